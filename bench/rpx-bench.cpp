@@ -0,0 +1,840 @@
+/**
+ * rpx-bench - HTTP load generator built on the rpx event loops
+ *
+ * Opens N keep-alive connections spread over M loops and reports throughput and latency
+ * percentiles. With a fixed rate (-R) requests are scheduled at their intended send time and
+ * latency is measured from it, so a stalled server is not hidden by the generator slowing
+ * down (coordinated omission).
+ *
+ * A script (-s) gives a weighted mix of requests, one per line:
+ *
+ *   # weight method path [body]
+ *   8 GET /ping
+ *   2 POST /api/echo hello
+ *
+ * With -2 the requests go as HTTP/2 streams over cleartext (h2c with prior knowledge) and -p is
+ * the streams in flight per connection, so a few multiplexed connections can be compared with
+ * many HTTP/1.1 ones at the same concurrency.
+ */
+#include <ctype.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CountDownLatch.hpp"
+#include "EventLoopThreadPool.hpp"
+#include "Metrics.hpp"
+#include "HttpClient.hpp"
+#include "Http2Connection.hpp"
+
+struct Options
+{
+  std::string host;
+  uint16_t port = 80;
+  std::string path = "/";
+  int connections = 10;
+  int threads = 2;
+  double duration = 10;
+  double rate = 0;   // requests per second in total, 0 for as fast as possible
+  int depth = 1;     // pipelined requests, or streams with HTTP/2, per connection
+  bool http2 = false;
+  std::string script;
+  std::vector<std::string> headers;
+};
+
+struct Request
+{
+  std::string data;      // the HTTP/1.1 request
+  HpackHeaders fields;   // the HTTP/2 header fields, pseudo-headers first
+  std::string body;
+  unsigned weight;
+};
+
+class Worker;
+
+/**
+ * class Connection - one client connection and its outstanding requests
+ */
+class Connection : noncopyable
+{
+public:
+  Connection(Worker* worker, unsigned seed)
+    : _worker(worker)
+    , _next(0)
+    , _rng(seed)
+  {}
+  virtual ~Connection() {}
+
+  virtual void start() = 0;
+  virtual void close() = 0;
+
+  /**
+   * schedule() - queue the requests due at @now, fixed rate mode only
+   */
+  void schedule(uint64_t now, uint64_t interval)
+  {
+    while (_next <= now) {
+      _backlog.push_back(_next);
+      _next += interval;
+    }
+    pump(now);
+  }
+
+  void setFirstSend(uint64_t t)
+  {
+    _next = t;
+  }
+
+protected:
+  Worker* _worker;
+  std::deque<uint64_t> _backlog;   // intended send times of the requests not sent yet
+  uint64_t _next;                  // intended send time of the next request
+  std::mt19937 _rng;
+
+  virtual void pump(uint64_t now) = 0;
+
+  /**
+   * nextStart() - when the next request counts from, false if none is due yet
+   */
+  bool nextStart(uint64_t now, uint64_t& start);
+
+  void record(uint64_t start, uint64_t now, unsigned status);
+};
+
+/**
+ * class Http1Connection - requests pipelined on an HTTP/1.1 connection
+ */
+class Http1Connection : public Connection
+{
+  typedef HttpContext<HttpResponse>::HttpContextPtr HttpContextPtr;
+
+public:
+  Http1Connection(Worker* worker, EventLoop* loop, const InetAddress& addr, unsigned seed);
+
+  void start() override
+  {
+    _client.start();
+  }
+
+  void close() override
+  {
+    _client.forceClose();
+  }
+
+private:
+  HttpClient _client;
+  HttpContextPtr _ctx;
+  std::deque<uint64_t> _inflight;   // start times of the requests sent
+
+  void pump(uint64_t now) override;
+  void onResponse(const HttpContextPtr& ctx);
+  void onClose(const HttpContextPtr& ctx);
+};
+
+/**
+ * class H2cConnection - requests as concurrent streams of an HTTP/2 connection
+ *
+ * Only what a load generator needs of HTTP/2: the windows we give are large enough to never be
+ * the bottleneck and the server's are not checked, the requests being small.
+ */
+class H2cConnection : public Connection
+{
+  typedef Http2Connection H2;
+
+public:
+  H2cConnection(Worker* worker, EventLoop* loop, const InetAddress& addr, unsigned seed);
+
+  void start() override
+  {
+    _client.start();
+  }
+
+  void close() override
+  {
+    _client.forceClose();
+  }
+
+private:
+  static constexpr size_t kFrameHeaderSize = 9;
+  static constexpr uint32_t kWindow = 1 << 30;
+
+  struct Stream
+  {
+    uint64_t start;
+    unsigned status;
+  };
+
+  TcpClient _client;
+  TcpConnectionPtr _conn;
+  std::unique_ptr<HpackEncoder> _encoder;   // per connection, like their tables
+  std::unique_ptr<HpackDecoder> _decoder;
+  std::unordered_map<uint32_t, Stream> _streams;
+  uint32_t _nextId;
+  uint32_t _maxStreams;   // as the server's SETTINGS_MAX_CONCURRENT_STREAMS
+  bool _goingAway;
+  std::string _headerBlock;   // a header block waiting for its CONTINUATION frames
+  uint32_t _headerStream;
+  bool _headerEndStream;
+  size_t _consumed;   // DATA bytes not given back to the connection window yet
+  std::string _out;
+
+  void pump(uint64_t now) override;
+  void onConnection(const TcpConnectionPtr& conn);
+  void onMessage(StreamBuffer* buffer);
+  void onClose(const TcpConnectionPtr& conn);
+  bool onFrame(uint8_t type, uint8_t flags, uint32_t id, const char* p, size_t len);
+  bool onHeaders(uint32_t id, bool endStream);
+  void complete(uint32_t id);
+  void lose(uint32_t id);
+  void flush();
+  void writeFrame(uint8_t type, uint8_t flags, uint32_t id, const char* p, size_t len);
+
+  static uint32_t getUint32(const char* p)
+  {
+    return static_cast<uint32_t>(static_cast<uint8_t>(p[0])) << 24 |
+           static_cast<uint8_t>(p[1]) << 16 | static_cast<uint8_t>(p[2]) << 8 |
+           static_cast<uint8_t>(p[3]);
+  }
+
+  static void putUint32(char* p, uint32_t v)
+  {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+  }
+};
+
+/**
+ * class Worker - the connections of one loop and their results
+ *
+ * Only touched from its loop, the results are read once the loop is done with them.
+ */
+class Worker : noncopyable
+{
+public:
+  Worker(EventLoop* loop, const Options& opts, const std::vector<Request>& requests)
+    : _loop(loop)
+    , _opts(opts)
+    , _requests(requests)
+    , _totalWeight(0)
+    , _stopped(false)
+    , completed(0)
+    , errors(0)
+    , badStatus(0)
+    , bytesIn(0)
+  {
+    for (const Request& r : requests)
+      _totalWeight += r.weight;
+  }
+
+  EventLoop* getLoop() const
+  {
+    return _loop;
+  }
+
+  const Options& options() const
+  {
+    return _opts;
+  }
+
+  bool stopped() const
+  {
+    return _stopped;
+  }
+
+  /**
+   * start() - connect @n connections, in the loop thread
+   */
+  void start(const InetAddress& addr, int n, unsigned seed)
+  {
+    uint64_t now = LoopMetrics::nowNs();
+    uint64_t interval = _opts.rate > 0 ? _opts.connections / _opts.rate * 1e9 : 0;
+    for (int i = 0; i < n; i++) {
+      if (_opts.http2)
+        _conns.emplace_back(new H2cConnection(this, _loop, addr, seed + i));
+      else
+        _conns.emplace_back(new Http1Connection(this, _loop, addr, seed + i));
+      // spread the first sends over an interval, so the connections don't fire in lockstep
+      if (interval)
+        _conns.back()->setFirstSend(now + interval * i / n);
+      _conns.back()->start();
+    }
+    if (interval) {
+      _interval = interval;
+      _ticker = _loop->runEvery(0.001, [this] {
+        uint64_t now = LoopMetrics::nowNs();
+        for (auto& conn : _conns)
+          conn->schedule(now, _interval);
+      });
+    }
+  }
+
+  /**
+   * stop() - stop counting and close the connections, @done is called once they are gone
+   */
+  void stop(std::function<void()> done)
+  {
+    _stopped = true;
+    _loop->cancel(_ticker);
+    bytesIn = _loop->metrics().bytesIn.value();
+    for (auto& conn : _conns)
+      conn->close();
+    // the closes complete over the next iterations, don't destroy the clients under them
+    _loop->runAfter(0.1, [this, done] {
+      _conns.clear();
+      done();
+    });
+  }
+
+  const Request& pick(std::mt19937& rng) const
+  {
+    if (_requests.size() == 1)
+      return _requests[0];
+    unsigned n = rng() % _totalWeight;
+    for (const Request& r : _requests) {
+      if (n < r.weight)
+        return r;
+      n -= r.weight;
+    }
+    return _requests.back();
+  }
+
+private:
+  EventLoop* _loop;
+  const Options& _opts;
+  const std::vector<Request>& _requests;
+  unsigned _totalWeight;
+  std::vector<std::unique_ptr<Connection>> _conns;
+  TimerId _ticker = 0;
+  uint64_t _interval = 0;
+  bool _stopped;
+
+public:
+  Histogram latency;
+  uint64_t completed;
+  uint64_t errors;      // requests lost with their connection
+  uint64_t badStatus;   // responses other than 2xx and 3xx
+  uint64_t bytesIn;
+};
+
+bool Connection::nextStart(uint64_t now, uint64_t& start)
+{
+  start = now;
+  if (_worker->options().rate <= 0)
+    return true;
+  if (_backlog.empty())
+    return false;
+  start = _backlog.front();
+  _backlog.pop_front();
+  return true;
+}
+
+void Connection::record(uint64_t start, uint64_t now, unsigned status)
+{
+  _worker->latency.record(now - start);
+  _worker->completed++;
+  if (status < 200 || status >= 400)
+    _worker->badStatus++;
+}
+
+Http1Connection::Http1Connection(Worker* worker, EventLoop* loop, const InetAddress& addr,
+                                 unsigned seed)
+  : Connection(worker, seed)
+  , _client(loop, addr)
+{
+  _client.enableReconnect();
+  _client.setConnectCallback([this](const HttpContextPtr& ctx) {
+    _ctx = ctx;
+    pump(LoopMetrics::nowNs());
+  });
+  _client.setResponseCallback([this](const HttpContextPtr& ctx) { onResponse(ctx); });
+  _client.setCloseCallback([this](const HttpContextPtr& ctx) { onClose(ctx); });
+}
+
+void Http1Connection::pump(uint64_t now)
+{
+  if (!_ctx || _worker->stopped())
+    return;
+  uint64_t start;
+  while (static_cast<int>(_inflight.size()) < _worker->options().depth && nextStart(now, start)) {
+    _inflight.push_back(start);
+    _ctx->send(_worker->pick(_rng).data);
+  }
+}
+
+void Http1Connection::onResponse(const HttpContextPtr& ctx)
+{
+  if (_worker->stopped() || _inflight.empty())
+    return;
+  uint64_t now = LoopMetrics::nowNs();
+  std::shared_ptr<HttpResponse> resp = ctx->getMessage();
+  record(_inflight.front(), now, resp->status_code);
+  _inflight.pop_front();
+  auto it = resp->headers.find("Connection");
+  if (it == resp->headers.end())
+    it = resp->headers.find("connection");
+  if (it != resp->headers.end() && strcasecmp(it->second.c_str(), "close") == 0) {
+    // close the connection only, the client reconnects
+    _ctx->getConn()->forceClose();
+    _ctx.reset();
+    return;
+  }
+  pump(now);
+}
+
+void Http1Connection::onClose(const HttpContextPtr& ctx)
+{
+  // a connection we closed after "Connection: close" has nothing in flight
+  if (ctx != _ctx || _worker->stopped())
+    return;
+  _ctx.reset();
+  // the requests sent are lost, the backlog waits for the reconnection
+  _worker->errors += _inflight.size();
+  _inflight.clear();
+}
+
+H2cConnection::H2cConnection(Worker* worker, EventLoop* loop, const InetAddress& addr,
+                             unsigned seed)
+  : Connection(worker, seed)
+  , _client(loop, addr)
+  , _nextId(1)
+  , _maxStreams(100)
+  , _goingAway(false)
+  , _headerStream(0)
+  , _headerEndStream(false)
+  , _consumed(0)
+{
+  _client.enableReconnect();
+  _client.setConnectCallback([this](const TcpConnectionPtr& conn) { onConnection(conn); });
+  _client.setMessageCallback(
+    [this](const TcpConnectionPtr&, StreamBuffer* buffer) { onMessage(buffer); });
+  _client.setCloseCallback([this](const TcpConnectionPtr& conn) { onClose(conn); });
+}
+
+void H2cConnection::onConnection(const TcpConnectionPtr& conn)
+{
+  _conn = conn;
+  _encoder.reset(new HpackEncoder);
+  _decoder.reset(new HpackDecoder);
+  _nextId = 1;
+  _maxStreams = 100;   // until the server's SETTINGS say otherwise, RFC 7540 6.5.2
+  _goingAway = false;
+  _headerStream = 0;
+  _consumed = 0;
+
+  _out.assign(H2::kPreface, H2::kPrefaceSize);
+  char settings[12] = {0, H2::SETTINGS_ENABLE_PUSH, 0, 0, 0, 0,
+                       0, H2::SETTINGS_INITIAL_WINDOW_SIZE};
+  putUint32(settings + 8, kWindow);
+  writeFrame(H2::SETTINGS, 0, 0, settings, sizeof(settings));
+  char increment[4];
+  putUint32(increment, kWindow - 65535);
+  writeFrame(H2::WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+  pump(LoopMetrics::nowNs());
+  flush();
+}
+
+void H2cConnection::pump(uint64_t now)
+{
+  if (!_conn || _goingAway || _worker->stopped())
+    return;
+  uint32_t limit = std::min<uint32_t>(_worker->options().depth, _maxStreams);
+  uint64_t start;
+  while (_streams.size() < limit && _nextId <= 0x7fffffff && nextStart(now, start)) {
+    const Request& req = _worker->pick(_rng);
+    uint32_t id = _nextId;
+    _nextId += 2;
+    _streams[id] = {start, 0};
+
+    std::string block;
+    _encoder->encode(req.fields, block);
+    bool hasBody = !req.body.empty();
+    writeFrame(H2::HEADERS, H2::FLAG_END_HEADERS | (hasBody ? 0 : H2::FLAG_END_STREAM), id,
+               block.data(), block.size());
+    // within the default frame size and window, a script line is never that long
+    if (hasBody)
+      writeFrame(H2::DATA, H2::FLAG_END_STREAM, id, req.body.data(), req.body.size());
+  }
+  flush();
+  // the ids ran out, start a new connection once these streams are done
+  if (_nextId > 0x7fffffff && _streams.empty())
+    _conn->forceClose();
+}
+
+void H2cConnection::onMessage(StreamBuffer* buffer)
+{
+  const char* p = buffer->data();
+  size_t n = buffer->size();
+  size_t used = 0;
+  while (n - used >= kFrameHeaderSize) {
+    const char* h = p + used;
+    size_t len = static_cast<uint8_t>(h[0]) << 16 | static_cast<uint8_t>(h[1]) << 8 |
+                 static_cast<uint8_t>(h[2]);
+    if (n - used < kFrameHeaderSize + len)
+      break;
+    used += kFrameHeaderSize + len;
+    if (!onFrame(h[3], h[4], getUint32(h + 5) & 0x7fffffff, h + kFrameHeaderSize, len)) {
+      _conn->forceClose();
+      return;
+    }
+  }
+  buffer->popFront(used);
+  if (_consumed >= kWindow / 2) {
+    char increment[4];
+    putUint32(increment, _consumed);
+    writeFrame(H2::WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+    _consumed = 0;
+  }
+  pump(LoopMetrics::nowNs());
+  flush();
+  if (_goingAway && _streams.empty())
+    _conn->forceClose();
+}
+
+bool H2cConnection::onFrame(uint8_t type, uint8_t flags, uint32_t id, const char* p, size_t len)
+{
+  if (_headerStream && (type != H2::CONTINUATION || id != _headerStream))
+    return false;
+  switch (type) {
+    case H2::DATA:
+      _consumed += len;
+      if (flags & H2::FLAG_END_STREAM)
+        complete(id);
+      return true;
+    case H2::HEADERS: {
+      size_t skip = 0, pad = 0;
+      if (flags & H2::FLAG_PADDED) {
+        if (len < 1)
+          return false;
+        pad = static_cast<uint8_t>(p[0]);
+        skip = 1;
+      }
+      if (flags & H2::FLAG_PRIORITY)
+        skip += 5;
+      if (skip + pad > len)
+        return false;
+      _headerBlock.assign(p + skip, len - skip - pad);
+      _headerEndStream = flags & H2::FLAG_END_STREAM;
+      if (flags & H2::FLAG_END_HEADERS)
+        return onHeaders(id, _headerEndStream);
+      _headerStream = id;
+      return true;
+    }
+    case H2::CONTINUATION:
+      if (!_headerStream)
+        return false;
+      _headerBlock.append(p, len);
+      if (!(flags & H2::FLAG_END_HEADERS))
+        return true;
+      _headerStream = 0;
+      return onHeaders(id, _headerEndStream);
+    case H2::RST_STREAM:
+      lose(id);
+      return true;
+    case H2::SETTINGS:
+      if (flags & H2::FLAG_ACK)
+        return true;
+      for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t setting = static_cast<uint8_t>(p[i]) << 8 | static_cast<uint8_t>(p[i + 1]);
+        uint32_t value = getUint32(p + i + 2);
+        if (setting == H2::SETTINGS_MAX_CONCURRENT_STREAMS)
+          _maxStreams = value;
+        else if (setting == H2::SETTINGS_HEADER_TABLE_SIZE)
+          _encoder->setMaxTableSize(std::min<uint32_t>(value, 4096));
+      }
+      writeFrame(H2::SETTINGS, H2::FLAG_ACK, 0, nullptr, 0);
+      return true;
+    case H2::PING:
+      if (!(flags & H2::FLAG_ACK))
+        writeFrame(H2::PING, H2::FLAG_ACK, 0, p, len);
+      return true;
+    case H2::GOAWAY: {
+      if (len < 8)
+        return false;
+      // the streams above the last one are not processed, those below still complete
+      uint32_t last = getUint32(p) & 0x7fffffff;
+      std::vector<uint32_t> lost;
+      for (const auto& [sid, stream] : _streams)
+        if (sid > last)
+          lost.push_back(sid);
+      for (uint32_t sid : lost)
+        lose(sid);
+      _goingAway = true;
+      return true;
+    }
+    default:
+      // PRIORITY, WINDOW_UPDATE and unknown frames, push is disabled
+      return true;
+  }
+}
+
+bool H2cConnection::onHeaders(uint32_t id, bool endStream)
+{
+  HpackHeaders headers;
+  // every block is decoded, the table is shared by the streams
+  if (!_decoder->decode(reinterpret_cast<const uint8_t*>(_headerBlock.data()),
+                        _headerBlock.size(), headers))
+    return false;
+  auto it = _streams.find(id);
+  if (it != _streams.end() && !headers.empty() && headers[0].first == ":status") {
+    unsigned status = atoi(headers[0].second.c_str());
+    // an interim response is followed by the real one
+    if (status >= 200)
+      it->second.status = status;
+  }
+  if (endStream)
+    complete(id);
+  return true;
+}
+
+void H2cConnection::complete(uint32_t id)
+{
+  auto it = _streams.find(id);
+  if (it == _streams.end())
+    return;
+  if (!_worker->stopped())
+    record(it->second.start, LoopMetrics::nowNs(), it->second.status);
+  _streams.erase(it);
+}
+
+void H2cConnection::lose(uint32_t id)
+{
+  if (_streams.erase(id) && !_worker->stopped())
+    _worker->errors++;
+}
+
+void H2cConnection::onClose(const TcpConnectionPtr& conn)
+{
+  if (conn != _conn)
+    return;
+  _conn.reset();
+  _out.clear();
+  if (!_worker->stopped())
+    _worker->errors += _streams.size();
+  _streams.clear();
+}
+
+void H2cConnection::flush()
+{
+  if (_conn && !_out.empty())
+    _conn->write(_out);
+  _out.clear();
+}
+
+void H2cConnection::writeFrame(uint8_t type, uint8_t flags, uint32_t id, const char* p,
+                               size_t len)
+{
+  char header[kFrameHeaderSize] = {static_cast<char>(len >> 16),
+                                   static_cast<char>(len >> 8),
+                                   static_cast<char>(len),
+                                   static_cast<char>(type),
+                                   static_cast<char>(flags)};
+  putUint32(header + 5, id);
+  _out.append(header, sizeof(header));
+  if (len)
+    _out.append(p, len);
+}
+
+static double percentile(const std::vector<uint64_t>& buckets, uint64_t count, double p)
+{
+  uint64_t target = std::max<uint64_t>(1, ceil(count * p));
+  uint64_t cumulative = 0;
+  for (int i = 0; i < Histogram::kBuckets; i++) {
+    cumulative += buckets[i];
+    if (cumulative >= target)
+      return Histogram::upperBound(i) / 1e6;
+  }
+  return 0;
+}
+
+static Request buildRequest(const Options& opts, const std::string& method,
+                            const std::string& path, const std::string& body, unsigned weight)
+{
+  std::string authority = opts.host + ":" + std::to_string(opts.port);
+  Request r{method + " " + path + " HTTP/1.1\r\n", {}, body, weight};
+  r.data += "Host: " + authority + "\r\n";
+  r.fields = {{":method", method}, {":scheme", "http"}, {":authority", authority},
+              {":path", path}};
+  for (const std::string& h : opts.headers) {
+    r.data += h + "\r\n";
+    // HTTP/2 field names are lowercase, the value starts after the optional whitespace
+    size_t colon = h.find(':');
+    std::string name = h.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    size_t value = colon == std::string::npos ? h.size() : h.find_first_not_of(" \t", colon + 1);
+    r.fields.emplace_back(name, value == std::string::npos ? "" : h.substr(value));
+  }
+  if (!body.empty() || method == "POST" || method == "PUT") {
+    r.data += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    r.fields.emplace_back("content-length", std::to_string(body.size()));
+  }
+  r.data += "\r\n" + body;
+  return r;
+}
+
+static bool loadScript(const Options& opts, std::vector<Request>& requests)
+{
+  std::ifstream in(opts.script);
+  if (!in)
+    return false;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream ss(line);
+    unsigned weight;
+    std::string method, path, body;
+    if (line.empty() || line[0] == '#')
+      continue;
+    if (!(ss >> weight >> method >> path) || weight == 0) {
+      fprintf(stderr, "bad script line: %s\n", line.c_str());
+      return false;
+    }
+    std::getline(ss >> std::ws, body);
+    requests.push_back(buildRequest(opts, method, path, body, weight));
+  }
+  return !requests.empty();
+}
+
+static bool parseUrl(const char* url, Options& opts)
+{
+  std::string s(url);
+  if (s.compare(0, 7, "http://") != 0)
+    return false;
+  s = s.substr(7);
+  size_t slash = s.find('/');
+  std::string hostPort = s.substr(0, slash);
+  opts.path = slash == std::string::npos ? "/" : s.substr(slash);
+  size_t colon = hostPort.rfind(':');
+  opts.host = hostPort.substr(0, colon);
+  if (colon != std::string::npos)
+    opts.port = atoi(hostPort.c_str() + colon + 1);
+  return !opts.host.empty() && opts.port != 0;
+}
+
+static void usage(const char* prog)
+{
+  fprintf(stderr,
+          "usage: %s [options] http://host:port/path\n"
+          "  -c N      connections (10)\n"
+          "  -t N      threads (2)\n"
+          "  -d SECS   duration (10)\n"
+          "  -R RATE   total requests per second, 0 for max (0)\n"
+          "  -p N      pipelined requests, or streams with -2, per connection (1)\n"
+          "  -2        HTTP/2 over cleartext with prior knowledge (h2c)\n"
+          "  -s FILE   request mix script\n"
+          "  -H HEADER add a request header\n",
+          prog);
+}
+
+int main(int argc, char* argv[])
+{
+  Options opts;
+  int c;
+  while ((c = getopt(argc, argv, "c:t:d:R:p:s:H:2h")) != -1) {
+    switch (c) {
+      case 'c': opts.connections = atoi(optarg); break;
+      case 't': opts.threads = atoi(optarg); break;
+      case 'd': opts.duration = atof(optarg); break;
+      case 'R': opts.rate = atof(optarg); break;
+      case 'p': opts.depth = atoi(optarg); break;
+      case 's': opts.script = optarg; break;
+      case 'H': opts.headers.push_back(optarg); break;
+      case '2': opts.http2 = true; break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (optind != argc - 1 || !parseUrl(argv[optind], opts) || opts.connections < 1 ||
+      opts.threads < 1 || opts.depth < 1 || opts.duration <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  opts.threads = std::min(opts.threads, opts.connections);
+
+  std::vector<Request> requests;
+  if (opts.script.empty()) {
+    requests.push_back(buildRequest(opts, "GET", opts.path, "", 1));
+  } else if (!loadScript(opts, requests)) {
+    fprintf(stderr, "cannot load script %s\n", opts.script.c_str());
+    return 1;
+  }
+
+  InetAddress addr;
+  if (!addr.parseHost(opts.host.c_str(), opts.port)) {
+    fprintf(stderr, "cannot resolve %s\n", opts.host.c_str());
+    return 1;
+  }
+
+  printf("Running %gs test @ http://%s:%u%s\n",
+         opts.duration,
+         opts.host.c_str(),
+         opts.port,
+         opts.script.empty() ? opts.path.c_str() : (" with " + opts.script).c_str());
+  printf("  %d threads, %d %s connections, %s %d", opts.threads, opts.connections,
+         opts.http2 ? "h2c" : "HTTP/1.1", opts.http2 ? "streams" : "pipeline depth",
+         opts.depth);
+  if (opts.rate > 0)
+    printf(", %g req/s", opts.rate);
+  printf("\n");
+
+  EventLoop baseLoop;
+  EventLoopThreadPool pool(&baseLoop, opts.threads);
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (int i = 0; i < opts.threads; i++) {
+    Worker* worker = new Worker(pool.getNextLoop(), opts, requests);
+    workers.emplace_back(worker);
+    int n = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+    worker->getLoop()->runInLoop([worker, &addr, n, i] { worker->start(addr, n, i * 7919); });
+  }
+
+  uint64_t begin = LoopMetrics::nowNs();
+  uint64_t elapsed = 0;
+  CountDownLatch stopped(opts.threads);
+  baseLoop.runAfter(opts.duration, [&] {
+    elapsed = LoopMetrics::nowNs() - begin;
+    for (auto& worker : workers)
+      worker->getLoop()->runInLoop(
+        [&, w = worker.get()] { w->stop([&] { stopped.countDown(); }); });
+    baseLoop.queueInLoop([&] {
+      stopped.wait();
+      baseLoop.quit();
+    });
+  });
+  baseLoop.loop();
+
+  std::vector<uint64_t> buckets(Histogram::kBuckets);
+  uint64_t completed = 0, errors = 0, badStatus = 0, bytesIn = 0, sum = 0;
+  for (auto& w : workers) {
+    for (int i = 0; i < Histogram::kBuckets; i++)
+      buckets[i] += w->latency.bucket(i);
+    sum += w->latency.sum();
+    completed += w->completed;
+    errors += w->errors;
+    badStatus += w->badStatus;
+    bytesIn += w->bytesIn;
+  }
+
+  double secs = elapsed / 1e9;
+  printf("  Latency (ms)   mean %.3f  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+         completed ? sum / 1e6 / completed : 0,
+         percentile(buckets, completed, 0.5),
+         percentile(buckets, completed, 0.9),
+         percentile(buckets, completed, 0.99),
+         percentile(buckets, completed, 0.999),
+         percentile(buckets, completed, 1));
+  printf("  %lu requests in %.2fs, %.2fMB read\n", completed, secs, bytesIn / 1048576.0);
+  if (errors || badStatus)
+    printf("  Lost requests: %lu, non-2xx or 3xx responses: %lu\n", errors, badStatus);
+  printf("Requests/sec: %.2f\n", completed / secs);
+  printf("Transfer/sec: %.2fMB\n", bytesIn / 1048576.0 / secs);
+  return 0;
+}
@@ -0,0 +1,461 @@
+/**
+ * rpx-replay - replay a traffic capture against an rpx instance
+ *
+ * Every captured connection is opened at its original time, and its bytes are sent with their
+ * original timing, so the connection concurrency of the capture is reproduced. -x speeds the
+ * replay up. The captured streams are parsed first to know how many requests every chunk
+ * completes; the latency of a request is from sending its last chunk to its response.
+ *
+ * -o saves the latencies, -b compares them with a saved baseline run:
+ *
+ *   rpx-replay -o before.txt rpx.cap 127.0.0.1:8080
+ *   rpx-replay -b before.txt rpx.cap 127.0.0.1:8080
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "CountDownLatch.hpp"
+#include "EventLoopThreadPool.hpp"
+#include "Metrics.hpp"
+#include "TrafficCapture.hpp"
+#include "HttpClient.hpp"
+
+static constexpr double kGraceSeconds = 10;
+
+struct Chunk
+{
+  uint64_t time;   // ns since the capture started
+  std::string data;
+  int requests;    // requests completed by this chunk
+};
+
+struct Stream
+{
+  uint64_t conn;
+  uint64_t open = 0;
+  uint64_t close = 0;   // 0 if still open at the end of the capture
+  bool truncated = false;
+  std::vector<Chunk> chunks;
+  int requests = 0;
+};
+
+class Worker;
+
+/**
+ * class Session - the replay of one stream
+ */
+class Session : noncopyable
+{
+  typedef HttpContext<HttpResponse>::HttpContextPtr HttpContextPtr;
+
+public:
+  Session(Worker* worker, const Stream& stream, const InetAddress& addr);
+
+  void start();
+
+  /**
+   * latencies() - in ns, one per request in order, -1 for the requests without a response
+   */
+  const std::vector<int64_t>& latencies() const
+  {
+    return _latencies;
+  }
+
+  void close()
+  {
+    _client.forceClose();
+  }
+
+private:
+  Worker* _worker;
+  const Stream& _stream;
+  HttpClient _client;
+  HttpContextPtr _ctx;
+  size_t _next;                     // next chunk to send
+  std::deque<size_t> _unsent;       // chunks due before the connection was up
+  std::deque<uint64_t> _inflight;   // send times of the requests waiting for a response
+  std::vector<int64_t> _latencies;
+  bool _closing;
+  bool _done;
+
+  void scheduleNext();
+  void send(size_t chunk);
+  void onResponse();
+  void onClose(const HttpContextPtr& ctx);
+  void finish();
+};
+
+/**
+ * class Worker - the sessions of one loop
+ */
+class Worker : noncopyable
+{
+public:
+  Worker(EventLoop* loop, uint64_t start, double speed, std::function<void()> sessionDone)
+    : _loop(loop)
+    , _start(start)
+    , _speed(speed)
+    , _stopped(false)
+    , _sessionDone(std::move(sessionDone))
+  {}
+
+  EventLoop* getLoop() const
+  {
+    return _loop;
+  }
+
+  bool stopped() const
+  {
+    return _stopped;
+  }
+
+  /**
+   * runAt() - run @cb at @time of the capture, scaled by the replay speed
+   */
+  void runAt(uint64_t time, std::function<void()> cb)
+  {
+    int64_t delay = _start + static_cast<uint64_t>(time / _speed) - LoopMetrics::nowNs();
+    _loop->runAfter(std::max<int64_t>(delay, 0) / 1e9, [this, cb = std::move(cb)] {
+      if (!_stopped)
+        cb();
+    });
+  }
+
+  void add(const Stream& stream, const InetAddress& addr)
+  {
+    Session* session = new Session(this, stream, addr);
+    _sessions.emplace_back(session);
+    runAt(stream.open, [session] { session->start(); });
+  }
+
+  void sessionDone()
+  {
+    _sessionDone();
+  }
+
+  void stop(std::function<void()> done)
+  {
+    _stopped = true;
+    for (auto& session : _sessions)
+      session->close();
+    // the closes complete over the next iterations, the results are read afterwards
+    _loop->runAfter(0.1, std::move(done));
+  }
+
+  const std::vector<std::unique_ptr<Session>>& sessions() const
+  {
+    return _sessions;
+  }
+
+private:
+  EventLoop* _loop;
+  uint64_t _start;
+  double _speed;
+  bool _stopped;
+  std::function<void()> _sessionDone;
+  std::vector<std::unique_ptr<Session>> _sessions;
+};
+
+Session::Session(Worker* worker, const Stream& stream, const InetAddress& addr)
+  : _worker(worker)
+  , _stream(stream)
+  , _client(worker->getLoop(), addr)
+  , _next(0)
+  , _closing(false)
+  , _done(false)
+{
+  _client.setConnectCallback([this](const HttpContextPtr& ctx) {
+    _ctx = ctx;
+    while (!_unsent.empty()) {
+      send(_unsent.front());
+      _unsent.pop_front();
+    }
+  });
+  _client.setResponseCallback([this](const HttpContextPtr&) { onResponse(); });
+  _client.setCloseCallback([this](const HttpContextPtr& ctx) { onClose(ctx); });
+}
+
+void Session::start()
+{
+  _client.start();
+  scheduleNext();
+}
+
+void Session::scheduleNext()
+{
+  if (_next < _stream.chunks.size()) {
+    _worker->runAt(_stream.chunks[_next].time, [this] {
+      send(_next++);
+      scheduleNext();
+    });
+  } else if (_stream.close) {
+    _worker->runAt(_stream.close, [this] {
+      _closing = true;
+      if (_inflight.empty())
+        finish();
+    });
+  } else {
+    _closing = true;
+  }
+}
+
+void Session::send(size_t chunk)
+{
+  if (_done)
+    return;
+  if (!_ctx) {
+    _unsent.push_back(chunk);
+    return;
+  }
+  const Chunk& c = _stream.chunks[chunk];
+  _ctx->send(c.data);
+  uint64_t now = LoopMetrics::nowNs();
+  for (int i = 0; i < c.requests; i++)
+    _inflight.push_back(now);
+}
+
+void Session::onResponse()
+{
+  if (_inflight.empty())
+    return;
+  _latencies.push_back(LoopMetrics::nowNs() - _inflight.front());
+  _inflight.pop_front();
+  if (_closing && _inflight.empty() && _next == _stream.chunks.size())
+    finish();
+}
+
+void Session::onClose(const HttpContextPtr& ctx)
+{
+  if (ctx == _ctx)
+    _ctx.reset();
+  finish();
+}
+
+void Session::finish()
+{
+  if (_done)
+    return;
+  _done = true;
+  _client.forceClose();
+  while (static_cast<int>(_latencies.size()) < _stream.requests)
+    _latencies.push_back(-1);
+  _worker->sessionDone();
+}
+
+/**
+ * loadStreams() - group the records by connection and count the requests of every chunk
+ */
+static bool loadStreams(const char* path, std::vector<Stream>& streams, uint64_t& end)
+{
+  std::vector<TrafficCapture::Record> records;
+  if (!TrafficCapture::load(path, records))
+    return false;
+  std::map<uint64_t, Stream> byConn;
+  end = 0;
+  for (auto& r : records) {
+    Stream& s = byConn[r.conn];
+    s.conn = r.conn;
+    end = std::max(end, r.time);
+    switch (r.type) {
+      case TrafficCapture::OPEN: s.open = r.time; break;
+      case TrafficCapture::DATA: s.chunks.push_back({r.time, std::move(r.data), 0}); break;
+      case TrafficCapture::CLOSE: s.close = r.time; break;
+      case TrafficCapture::TRUNCATED: s.truncated = true; break;
+    }
+  }
+  for (auto& kv : byConn) {
+    Stream& s = kv.second;
+    HttpParser<HttpRequest> parser;
+    int completed = 0;
+    parser.setMessageCallback([&](const HttpParser<HttpRequest>&) { completed++; });
+    for (Chunk& c : s.chunks) {
+      int before = completed;
+      if (parser.advance(c.data) != HPE_OK)
+        break;
+      c.requests = completed - before;
+    }
+    s.requests = completed;
+    streams.push_back(std::move(s));
+  }
+  return true;
+}
+
+static double percentile(std::vector<int64_t> v, double p)
+{
+  if (v.empty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  size_t i = std::min(v.size() - 1, static_cast<size_t>(ceil(v.size() * p)) - (p > 0));
+  return v[i] / 1e6;
+}
+
+// results: "conn request latency_ns", -1 for no response
+typedef std::map<std::pair<uint64_t, int>, int64_t> Results;
+
+static void summarize(const char* title, const Results& results)
+{
+  std::vector<int64_t> ok;
+  size_t failed = 0;
+  for (auto& kv : results) {
+    if (kv.second >= 0)
+      ok.push_back(kv.second);
+    else
+      failed++;
+  }
+  printf("%-10s %8zu requests %6zu failed   p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f ms\n",
+         title,
+         results.size(),
+         failed,
+         percentile(ok, 0.5),
+         percentile(ok, 0.9),
+         percentile(ok, 0.99),
+         percentile(ok, 1));
+}
+
+static void compare(const Results& baseline, const Results& current)
+{
+  summarize("baseline", baseline);
+  summarize("current", current);
+  std::vector<int64_t> deltas;
+  for (auto& kv : current) {
+    auto it = baseline.find(kv.first);
+    if (it != baseline.end() && it->second >= 0 && kv.second >= 0)
+      deltas.push_back(kv.second - it->second);
+  }
+  printf("per request delta over %zu matched requests: p10 %+.3f  p50 %+.3f  p90 %+.3f ms\n",
+         deltas.size(),
+         percentile(deltas, 0.1),
+         percentile(deltas, 0.5),
+         percentile(deltas, 0.9));
+}
+
+static void usage(const char* prog)
+{
+  fprintf(stderr,
+          "usage: %s [options] capture host:port\n"
+          "  -t N      threads (2)\n"
+          "  -x SPEED  replay speed, 2 for twice as fast (1)\n"
+          "  -o FILE   save the latencies\n"
+          "  -b FILE   compare with the latencies of a baseline run\n",
+          prog);
+}
+
+int main(int argc, char* argv[])
+{
+  int threads = 2;
+  double speed = 1;
+  const char* output = nullptr;
+  const char* baselinePath = nullptr;
+  int c;
+  while ((c = getopt(argc, argv, "t:x:o:b:h")) != -1) {
+    switch (c) {
+      case 't': threads = atoi(optarg); break;
+      case 'x': speed = atof(optarg); break;
+      case 'o': output = optarg; break;
+      case 'b': baselinePath = optarg; break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (optind != argc - 2 || threads < 1 || speed <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  std::string target = argv[optind + 1];
+  size_t colon = target.rfind(':');
+  InetAddress addr;
+  if (colon == std::string::npos ||
+      !addr.parseHost(target.substr(0, colon).c_str(), atoi(target.c_str() + colon + 1))) {
+    fprintf(stderr, "bad target %s\n", target.c_str());
+    return 1;
+  }
+
+  std::vector<Stream> streams;
+  uint64_t end;
+  if (!loadStreams(argv[optind], streams, end)) {
+    fprintf(stderr, "cannot load capture %s\n", argv[optind]);
+    return 1;
+  }
+  size_t truncated = std::count_if(streams.begin(), streams.end(), [](auto& s) {
+    return s.truncated;
+  });
+  printf("Replaying %zu connections (%zu truncated) over %.2fs at %gx\n",
+         streams.size(),
+         truncated,
+         end / 1e9,
+         speed);
+
+  EventLoop baseLoop;
+  EventLoopThreadPool pool(&baseLoop, threads);
+  size_t remaining = streams.size();
+  auto sessionDone = [&] {
+    baseLoop.runInLoop([&] {
+      if (--remaining == 0)
+        baseLoop.quit();
+    });
+  };
+  uint64_t start = LoopMetrics::nowNs() + 100 * 1000 * 1000;
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (int i = 0; i < threads; i++)
+    workers.emplace_back(new Worker(pool.getNextLoop(), start, speed, sessionDone));
+  for (size_t i = 0; i < streams.size(); i++) {
+    Worker* w = workers[i % threads].get();
+    w->getLoop()->runInLoop([w, &s = streams[i], &addr] { w->add(s, addr); });
+  }
+  if (!streams.empty()) {
+    // streams still open at the end of the capture, or never answered
+    baseLoop.runAfter(end / speed / 1e9 + 0.1 + kGraceSeconds, [&] { baseLoop.quit(); });
+    baseLoop.loop();
+  }
+
+  CountDownLatch stopped(threads);
+  for (auto& w : workers)
+    w->getLoop()->runInLoop([&, w = w.get()] { w->stop([&] { stopped.countDown(); }); });
+  stopped.wait();
+
+  Results results;
+  for (int i = 0; i < threads; i++) {
+    const auto& sessions = workers[i]->sessions();
+    for (size_t j = 0; j < sessions.size(); j++) {
+      const Stream& s = streams[j * threads + i];
+      const auto& lat = sessions[j]->latencies();
+      for (int k = 0; k < s.requests; k++)
+        results[{s.conn, k}] = k < static_cast<int>(lat.size()) ? lat[k] : -1;
+    }
+  }
+
+  if (output) {
+    FILE* f = fopen(output, "w");
+    if (!f) {
+      perror(output);
+      return 1;
+    }
+    for (auto& kv : results)
+      fprintf(f, "%lu %d %ld\n", kv.first.first, kv.first.second, kv.second);
+    fclose(f);
+  }
+  if (baselinePath) {
+    std::ifstream in(baselinePath);
+    if (!in) {
+      fprintf(stderr, "cannot read baseline %s\n", baselinePath);
+      return 1;
+    }
+    Results baseline;
+    uint64_t conn;
+    int request;
+    int64_t latency;
+    while (in >> conn >> request >> latency)
+      baseline[{conn, request}] = latency;
+    compare(baseline, results);
+  } else {
+    summarize("replay", results);
+  }
+  return 0;
+}
@@ -18,9 +18,11 @@ public:
     , socket(addr.family())
     , serverChannel(loop, socket.fd())
     , _idleFd(::open("/dev/null", O_RDONLY | O_CLOEXEC))
+    , _listening(false)
+    , _paused(false)
   {
     socket.setReuseAddr(true);
-    socket.setReuseAddr(reusePort);
+    socket.setReusePort(reusePort);
     socket.bind(addr);
     serverChannel.setReadCallback([&] { handleRead(); });
   }
@@ -36,11 +38,66 @@ public:
     _newConnectionCallback = std::move(cb);
   }
 
+  /**
+   * listen() - start listening, may be called from any thread
+   *
+   * The socket listens at once, so the sockets of a SO_REUSEPORT group join it in the order
+   * they are listened on. Connections are accepted once the loop picks them up.
+   */
   void listen()
   {
-    assert(_loop->isInEventLoop());
     socket.listen();
-    serverChannel.setReadInterest();
+    _loop->runInLoop([this] {
+      _listening = true;
+      if (!_paused)
+        serverChannel.setReadInterest();
+    });
+  }
+
+  /**
+   * setIncomingCpu() - see Socket::setIncomingCpu()
+   */
+  void setIncomingCpu(int cpu)
+  {
+    socket.setIncomingCpu(cpu);
+  }
+
+  /**
+   * setReusePortCpus() - see Socket::setReusePortCpus()
+   */
+  bool setReusePortCpus(const std::vector<int>& cpus)
+  {
+    return socket.setReusePortCpus(cpus);
+  }
+
+  /**
+   * pause() - stop accepting, new connections wait in the listen backlog
+   *
+   * May be called from the new connection callback, no more connections are accepted then.
+   */
+  void pause()
+  {
+    assert(_loop->isInEventLoop());
+    if (_paused)
+      return;
+    _paused = true;
+    if (_listening)
+      serverChannel.unsetReadInterest();
+  }
+
+  void resume()
+  {
+    assert(_loop->isInEventLoop());
+    if (!_paused)
+      return;
+    _paused = false;
+    if (_listening)
+      serverChannel.setReadInterest();
+  }
+
+  bool paused() const
+  {
+    return _paused;
   }
 
 private:
@@ -49,13 +106,15 @@ private:
   Channel serverChannel;
   NewConnectionCallback _newConnectionCallback;
   int _idleFd;
+  bool _listening;
+  bool _paused;
 
   void handleRead()
   {
     assert(_loop->isInEventLoop());
 
     InetAddress peerAddr;
-    while (true) {
+    while (!_paused) {
       int connfd = ::accept(socket.fd(), peerAddr);
       if (connfd < 0) {
         if (errno == EMFILE) {
@@ -0,0 +1,125 @@
+#ifndef __CLOCK_HPP__
+#define __CLOCK_HPP__
+
+#include <time.h>
+#include <string>
+#include "Utils.hpp"
+#include "Time.hpp"
+
+/**
+ * class LoopClock - the clock of an EventLoop, read once per loop iteration
+ *
+ * Everything handled in one iteration sees the same cached monotonic time instead of reading
+ * the clock again and again. The wall time and the HTTP Date string are derived from it, and
+ * only recomputed when a second has passed.
+ *
+ * Code that doesn't know its loop (e.g. the logger) reaches the clock of the current thread
+ * through threadNow() and threadWallNow(), which read a fresh clock outside loop threads.
+ */
+class LoopClock : noncopyable
+{
+public:
+  LoopClock()
+    : _coarse(false)
+    , _now(0)
+    , _wallOffset(0)
+    , _nextSecond(0)
+  {
+    update();
+  }
+
+  /**
+   * setCoarse() - read CLOCK_MONOTONIC_COARSE
+   *
+   * Cheaper to read, but only of the kernel tick resolution (1-4ms).
+   */
+  void setCoarse(bool on)
+  {
+    _coarse = on;
+    update();
+  }
+
+  /**
+   * update() - read the clock, called by the loop once per iteration
+   */
+  void update()
+  {
+    struct timespec ts;
+    clock_gettime(_coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &ts);
+    _now = static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    if (_now >= _nextSecond)
+      refreshWall();
+  }
+
+  Time now() const
+  {
+    return Time(_now);
+  }
+
+  Time wallNow() const
+  {
+    return Time(_now + _wallOffset);
+  }
+
+  /**
+   * httpDate() - the wall time as an HTTP Date header value (RFC 7231 7.1.1.1)
+   */
+  const std::string& httpDate() const
+  {
+    return _httpDate;
+  }
+
+  /**
+   * bind() - make this the clock of the calling thread
+   */
+  void bind()
+  {
+    current() = this;
+  }
+
+  void unbind()
+  {
+    if (current() == this)
+      current() = nullptr;
+  }
+
+  static Time threadNow()
+  {
+    LoopClock* clock = current();
+    return clock ? clock->now() : Time::now();
+  }
+
+  static Time threadWallNow()
+  {
+    LoopClock* clock = current();
+    return clock ? clock->wallNow() : Time::wallNow();
+  }
+
+private:
+  bool _coarse;
+  int64_t _now;          // us, monotonic
+  int64_t _wallOffset;   // us, wall time - monotonic time
+  int64_t _nextSecond;   // monotonic time of the next wall second
+  std::string _httpDate;
+
+  static LoopClock*& current()
+  {
+    static thread_local LoopClock* clock = nullptr;
+    return clock;
+  }
+
+  void refreshWall()
+  {
+    int64_t wall = Time::wallNow();
+    _wallOffset = wall - _now;
+    _nextSecond = _now + (1000000 - wall % 1000000);
+    time_t sec = wall / 1000000;
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    _httpDate = buf;
+  }
+};
+
+#endif
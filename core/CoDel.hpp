@@ -0,0 +1,64 @@
+#ifndef __CODEL_HPP__
+#define __CODEL_HPP__
+
+#include <stdint.h>
+#include "Utils.hpp"
+
+/**
+ * class CoDel - tell a standing queue from a burst by its sojourn times
+ *
+ * After the CoDel AQM (RFC 8289): a queue is only overloaded once the sojourn time has stayed
+ * above @target for a whole @interval. A burst drains within the interval and is let through,
+ * while a single sample below the target ends the overload at once.
+ *
+ * Only used from one thread.
+ */
+class CoDel : noncopyable
+{
+public:
+  CoDel()
+    : _target(0)
+    , _interval(0)
+    , _firstAbove(0)
+    , _overloaded(false)
+  {}
+
+  /**
+   * setTarget() - in ns, a @target of 0 disables the detection
+   */
+  void setTarget(uint64_t target, uint64_t interval)
+  {
+    _target = target;
+    _interval = interval;
+    _firstAbove = 0;
+    _overloaded = false;
+  }
+
+  /**
+   * observe() - @sojourn ns was spent in the queue by something dequeued at @now
+   */
+  void observe(uint64_t now, uint64_t sojourn)
+  {
+    if (!_target || sojourn < _target) {
+      _firstAbove = 0;
+      _overloaded = false;
+    } else if (!_firstAbove) {
+      _firstAbove = now + _interval;
+    } else if (now >= _firstAbove) {
+      _overloaded = true;
+    }
+  }
+
+  bool overloaded() const
+  {
+    return _overloaded;
+  }
+
+private:
+  uint64_t _target;
+  uint64_t _interval;
+  uint64_t _firstAbove;   // when the sojourn will have been above target for an interval
+  bool _overloaded;
+};
+
+#endif
@@ -10,12 +10,15 @@ class Connector : noncopyable, public std::enable_shared_from_this<Connector>
 
 public:
   typedef std::function<void(int sockfd)> NewConnectionCallback;
+  typedef std::function<void()> ConnectFailedCallback;
 
   Connector(EventLoop* loop, const InetAddress& peerAddr)
     : _loop(loop)
     , _peerAddr(peerAddr)
     , _running(false)
     , _retryDelayMs(kInitRetryDelayMs)
+    , _maxRetries(-1)
+    , _retries(0)
     , _state(DISCONNECTED)
   {}
 
@@ -30,6 +33,26 @@ public:
     _newConnectionCallback = std::move(cb);
   }
 
+  /**
+   * setConnectFailedCallback() - called when the connector gives up
+   *
+   * That is, the retries are exhausted or the error is not retryable.
+   */
+  void setConnectFailedCallback(ConnectFailedCallback cb)
+  {
+    _connectFailedCallback = std::move(cb);
+  }
+
+  /**
+   * setMaxRetries() - bound the number of reconnect attempts
+   *
+   * A negative value (the default) means retrying forever.
+   */
+  void setMaxRetries(int maxRetries)
+  {
+    _maxRetries = maxRetries;
+  }
+
   /**
    * start() - start the connector
    *
@@ -78,7 +101,10 @@ private:
   std::unique_ptr<Channel> _channel;
   bool _running;
   NewConnectionCallback _newConnectionCallback;
+  ConnectFailedCallback _connectFailedCallback;
   int _retryDelayMs;
+  int _maxRetries;
+  int _retries;
   States _state;
 
   /**
@@ -90,6 +116,7 @@ private:
   {
     assert(_loop->isInEventLoop());
     _retryDelayMs = kInitRetryDelayMs;
+    _retries = 0;
     _running = true;
     connect();
   }
@@ -124,6 +151,7 @@ private:
         default:
           perror("connect");
           ::close(sockfd);
+          giveUp();
           return;
       }
     }
@@ -177,6 +205,10 @@ private:
   void retry(int sockfd)
   {
     ::close(sockfd);
+    if (_maxRetries >= 0 && _retries++ >= _maxRetries) {
+      giveUp();
+      return;
+    }
     if (_running) {
       _loop->runAfter(_retryDelayMs / 1000.0, [that = shared_from_this()] {
         if (that->_running)
@@ -185,6 +217,15 @@ private:
       _retryDelayMs = std::min(_retryDelayMs * 2, kMaxRetryDelayMs);
     }
   }
+
+  void giveUp()
+  {
+    _state = DISCONNECTED;
+    // we may be in the middle of handling the channel's events
+    _loop->queueInLoop([that = shared_from_this()] { that->_channel.reset(); });
+    if (_running && _connectFailedCallback)
+      _connectFailedCallback();
+  }
 };
 
 #endif
@@ -0,0 +1,296 @@
+#ifndef __COROUTINE_HPP__
+#define __COROUTINE_HPP__
+
+#include <assert.h>
+#include <stdlib.h>
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "Utils.hpp"
+#include "EventLoop.hpp"
+
+/**
+ * class FrameAllocator - recycles coroutine frames, one per thread and so one per loop
+ *
+ * Frames are rounded up to size classes of kGranularity bytes, and a freed frame goes to
+ * the free list of its class, to be reused by the next coroutine of about the same size. A
+ * handler running the same coroutines request after request thus stops allocating once warm.
+ * Frames above kMaxFrame go to the heap.
+ *
+ * A coroutine of a loop is resumed in the loop, so its frame is freed by the thread that
+ * allocated it.
+ */
+class FrameAllocator : noncopyable
+{
+public:
+  static constexpr size_t kGranularity = 64;
+  static constexpr size_t kMaxFrame = 16384;
+  static constexpr size_t kMaxFree = 256;   // frames kept per class
+
+  ~FrameAllocator()
+  {
+    for (size_t i = 0; i < kClasses; i++)
+      while (_free[i]) {
+        FreeFrame* frame = _free[i];
+        _free[i] = frame->next;
+        ::operator delete(frame);
+      }
+  }
+
+  static void* allocate(size_t size)
+  {
+    if (size > kMaxFrame)
+      return ::operator new(size);
+    FrameAllocator& self = local();
+    size_t cls = classOf(size);
+    if (FreeFrame* frame = self._free[cls]) {
+      self._free[cls] = frame->next;
+      self._count[cls]--;
+      return frame;
+    }
+    return ::operator new((cls + 1) * kGranularity);
+  }
+
+  static void deallocate(void* p, size_t size)
+  {
+    if (size > kMaxFrame) {
+      ::operator delete(p);
+      return;
+    }
+    FrameAllocator& self = local();
+    size_t cls = classOf(size);
+    if (self._count[cls] >= kMaxFree) {
+      ::operator delete(p);
+      return;
+    }
+    FreeFrame* frame = static_cast<FreeFrame*>(p);
+    frame->next = self._free[cls];
+    self._free[cls] = frame;
+    self._count[cls]++;
+  }
+
+private:
+  static constexpr size_t kClasses = kMaxFrame / kGranularity;
+
+  struct FreeFrame
+  {
+    FreeFrame* next;
+  };
+  FreeFrame* _free[kClasses] = {};
+  size_t _count[kClasses] = {};
+
+  static FrameAllocator& local()
+  {
+    static thread_local FrameAllocator allocator;
+    return allocator;
+  }
+
+  static size_t classOf(size_t size)
+  {
+    return size ? (size - 1) / kGranularity : 0;
+  }
+};
+
+template<class T = void>
+class CoTask;
+
+namespace coroutine_detail {
+
+/**
+ * struct PromiseBase - what the promises of all CoTask have in common
+ */
+struct PromiseBase
+{
+  std::coroutine_handle<> continuation;   // awaiting this task, if any
+  std::exception_ptr error;
+  bool detached = false;
+
+  static void* operator new(size_t size)
+  {
+    return FrameAllocator::allocate(size);
+  }
+  static void operator delete(void* p, size_t size)
+  {
+    FrameAllocator::deallocate(p, size);
+  }
+
+  std::suspend_always initial_suspend() noexcept
+  {
+    return {};
+  }
+
+  struct FinalAwaiter
+  {
+    bool await_ready() noexcept
+    {
+      return false;
+    }
+    template<class Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+    {
+      PromiseBase& promise = h.promise();
+      if (promise.continuation)
+        return promise.continuation;
+      if (promise.detached) {
+        // nobody is left to rethrow it to
+        if (promise.error)
+          std::terminate();
+        h.destroy();
+      }
+      return std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+  FinalAwaiter final_suspend() noexcept
+  {
+    return {};
+  }
+
+  void unhandled_exception()
+  {
+    error = std::current_exception();
+  }
+};
+
+template<class T>
+struct Promise : PromiseBase
+{
+  std::optional<T> value;
+
+  CoTask<T> get_return_object();
+
+  template<class U>
+  void return_value(U&& v)
+  {
+    value.emplace(std::forward<U>(v));
+  }
+
+  T result()
+  {
+    if (error)
+      std::rethrow_exception(error);
+    return std::move(*value);
+  }
+};
+
+template<>
+struct Promise<void> : PromiseBase
+{
+  CoTask<void> get_return_object();
+
+  void return_void() {}
+
+  void result()
+  {
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+
+}   // namespace coroutine_detail
+
+/**
+ * class CoTask - a coroutine run on an EventLoop, written linearly instead of as callbacks
+ *
+ * A task is lazy: it starts when awaited by another task, or when detached. An awaited task
+ * hands its result, or what it threw, to its awaiter, and resumes it right away without
+ * going through the loop.
+ *
+ * The awaitables of the loop (coSleep(), TcpConnection::read(), ...) resume the task in the
+ * loop that suspended it. A suspended task must not be destroyed, it is to run to its end,
+ * so it must hold what it uses (e.g. the TcpConnectionPtr) by value.
+ *
+ * Frames come from the FrameAllocator of the thread.
+ */
+template<class T>
+class CoTask : noncopyable
+{
+public:
+  typedef coroutine_detail::Promise<T> promise_type;
+
+  CoTask(CoTask&& other)
+    : _handle(std::exchange(other._handle, nullptr))
+  {}
+  ~CoTask()
+  {
+    if (_handle)
+      _handle.destroy();
+  }
+
+  /**
+   * detach() - start the task, which frees itself once done
+   *
+   * It must not throw, the process is terminated if it does.
+   */
+  void detach()
+  {
+    auto h = std::exchange(_handle, nullptr);
+    h.promise().detached = true;
+    h.resume();
+  }
+
+  bool await_ready() const noexcept
+  {
+    return false;
+  }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+  {
+    _handle.promise().continuation = awaiting;
+    return _handle;
+  }
+
+  T await_resume()
+  {
+    return _handle.promise().result();
+  }
+
+private:
+  friend promise_type;
+
+  std::coroutine_handle<promise_type> _handle;
+
+  explicit CoTask(std::coroutine_handle<promise_type> handle)
+    : _handle(handle)
+  {}
+};
+
+template<class T>
+inline CoTask<T> coroutine_detail::Promise<T>::get_return_object()
+{
+  return CoTask<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline CoTask<void> coroutine_detail::Promise<void>::get_return_object()
+{
+  return CoTask<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+/**
+ * coSleep() - awaitable resuming after @seconds, in the loop of the calling thread
+ */
+inline auto coSleep(double seconds)
+{
+  struct Awaiter
+  {
+    EventLoop* loop;
+    double seconds;
+
+    bool await_ready() const noexcept
+    {
+      return false;
+    }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+      loop->runAfter(seconds, [h] { h.resume(); });
+    }
+    void await_resume() const noexcept {}
+  };
+  assert(EventLoop::current());
+  return Awaiter{EventLoop::current(), seconds};
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sched.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/timerfd.h>
@@ -21,6 +22,9 @@
 #include <zlog.h>
 #include "Utils.hpp"
 #include "Time.hpp"
+#include "Clock.hpp"
+#include "Metrics.hpp"
+#include "CoDel.hpp"
 #include "ThreadPool.hpp"
 
 #define CHAN_UNSET -1
@@ -236,6 +240,14 @@ public:
 
 typedef std::function<void()> TimerCallback;
 
+/**
+ * TimerId - handle returned by EventLoop::runAt() and friends
+ *
+ * It is the sequence number of the timer, so a stale id never cancels a newer timer that
+ * happens to reuse the same memory. 0 is never a valid id.
+ */
+typedef int64_t TimerId;
+
 class TimerQueue
 {
   friend EventLoop;
@@ -293,17 +305,24 @@ public:
     _timerfdChannel.setReadCallback([&] { handleRead(); });
     _timerfdChannel.setReadInterest();
   }
-  ~TimerQueue() {}
+  ~TimerQueue()
+  {
+    _timerfdChannel.unsetAllInterest();
+    _timerfdChannel.remove();
+    ::close(_timerfd);
+    for (auto& kv : _activeTimers)
+      delete kv.second;
+  }
 
-  Timer* addTimer(TimerCallback cb, Time when, double interval);
+  TimerId addTimer(TimerCallback cb, Time when, double interval);
 
   void addTimerInLoop(Timer* timer);
 
   bool insert(Timer* timer);
 
-  void cancel(Timer* timerId);
+  void cancel(TimerId timerId);
 
-  void cancelInLoop(Timer* timerId);
+  void cancelInLoop(TimerId timerId);
 
   typedef std::unordered_set<Timer*> TimerSet;
 
@@ -312,9 +331,9 @@ private:
   int _timerfd;
   Channel _timerfdChannel;
   std::map<Time, TimerSet> _timers;
-  TimerSet _activeTimers;
+  std::unordered_map<TimerId, Timer*> _activeTimers;
   bool _callingExpiredTimers;
-  TimerSet _cancelingTimers;
+  std::unordered_set<TimerId> _cancelingTimers;
 
   void handleRead();
 
@@ -356,6 +375,153 @@ private:
 
 std::atomic<int64_t> TimerQueue::Timer::_id;
 
+/**
+ * class TimingWheel - coarse deadlines of many objects, e.g. connection timeouts
+ *
+ * A hashed wheel of kSlots lists, one per tick. Scheduling and cancelling are O(1) list
+ * operations, and a deadline that only moves later does not touch the list at all: when its
+ * slot comes around, an entry that is not due yet is simply hashed into its new slot. So the
+ * cost of keeping a deadline up to date on every read is one store.
+ *
+ * The wheel only ticks while it holds entries. Deadlines fire up to one tick late.
+ */
+class TimingWheel : noncopyable
+{
+public:
+  static constexpr int kSlots = 512;
+  static constexpr int64_t kTickUs = 100000;
+
+  /**
+   * class Entry - a deadline in a TimingWheel, embedded in its owner
+   *
+   * Destroying an entry cancels it.
+   */
+  class Entry : noncopyable
+  {
+    friend class TimingWheel;
+
+  public:
+    Entry()
+      : _wheel(nullptr)
+      , _deadline(0)
+      , _tick(0)
+      , _prev(this)
+      , _next(this)
+    {}
+    ~Entry()
+    {
+      cancel();
+    }
+
+    /**
+     * setCallback() - called in the loop thread once the deadline has passed
+     *
+     * The entry is no longer scheduled when @cb runs, so @cb may schedule it again or
+     * destroy it.
+     */
+    void setCallback(std::function<void()> cb)
+    {
+      _cb = std::move(cb);
+    }
+
+    void cancel()
+    {
+      if (_wheel)
+        _wheel->cancel(this);
+    }
+
+    bool scheduled() const
+    {
+      return _wheel != nullptr;
+    }
+
+  private:
+    TimingWheel* _wheel;
+    Time _deadline;
+    int64_t _tick;   // the entry is looked at no later than this tick
+    Entry* _prev;
+    Entry* _next;
+    std::function<void()> _cb;
+
+    void unlink()
+    {
+      _prev->_next = _next;
+      _next->_prev = _prev;
+      _prev = _next = this;
+    }
+
+    void linkBefore(Entry* pos)
+    {
+      _prev = pos->_prev;
+      _next = pos;
+      _prev->_next = this;
+      pos->_prev = this;
+    }
+
+    bool empty() const
+    {
+      return _next == this;
+    }
+  };
+
+  TimingWheel(EventLoop* loop)
+    : _loop(loop)
+    , _slots(kSlots)
+    , _size(0)
+    , _currentTick(0)
+    , _ticker(0)
+  {}
+  ~TimingWheel()
+  {
+    // the owners of the entries may outlive the loop
+    for (auto& slot : _slots)
+      while (!slot.empty()) {
+        Entry* e = slot._next;
+        e->unlink();
+        e->_wheel = nullptr;
+      }
+  }
+
+  /**
+   * schedule() - call the callback of @e once @deadline (monotonic) has passed
+   */
+  void schedule(Entry* e, Time deadline);
+
+  void cancel(Entry* e)
+  {
+    assert(e->_wheel == this);
+    e->unlink();
+    e->_wheel = nullptr;
+    _size--;
+  }
+
+  size_t size() const
+  {
+    return _size;
+  }
+
+private:
+  EventLoop* _loop;
+  std::vector<Entry> _slots;   // sentinels of circular lists
+  size_t _size;
+  int64_t _currentTick;
+  TimerId _ticker;   // 0 while the wheel is idle
+
+  void link(Entry* e)
+  {
+    e->_tick = std::max(tickOf(e->_deadline), _currentTick + 1);
+    e->linkBefore(&_slots[e->_tick % kSlots]);
+  }
+
+  // the first tick at or after @t
+  static int64_t tickOf(Time t)
+  {
+    return (static_cast<int64_t>(t) + kTickUs - 1) / kTickUs;
+  }
+
+  void tick();
+};
+
 class EventLoop : noncopyable
 {
 public:
@@ -456,40 +622,159 @@ public:
     , _ownerThreadId(std::this_thread::get_id())
     , _wakeupFd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
     , _wakeupChannel(this, _wakeupFd)
+    , _pendingSince(0)
+    , _handlingEvents(false)
     , _timerQueue(this)
+    , _timingWheel(this)
   {
+    _clock.bind();
+    currentLoop() = this;
     _wakeupChannel.setReadCallback([&] { this->wakeupRead(); });
     _wakeupChannel.setReadInterest();
+    MetricsRegistry::instance().add(&_metrics);
   }
   ~EventLoop()
   {
+    MetricsRegistry::instance().remove(&_metrics);
+    _clock.unbind();
+    if (currentLoop() == this)
+      currentLoop() = nullptr;
     _wakeupChannel.unsetAllInterest();
     _wakeupChannel.remove();
     ::close(_wakeupFd);
   }
 
+  /**
+   * metrics() - metrics of this loop, only to be updated in the loop thread
+   */
+  LoopMetrics& metrics()
+  {
+    return _metrics;
+  }
+
+  /**
+   * current() - the loop of the calling thread, nullptr outside loop threads
+   */
+  static EventLoop* current()
+  {
+    return currentLoop();
+  }
+
   bool isInEventLoop()
   {
     return _ownerThreadId == std::this_thread::get_id();
   }
 
+  /**
+   * now() - monotonic time of the current loop iteration
+   *
+   * Read once after every poll, so it lags behind by the time spent handling the events.
+   */
+  Time now() const
+  {
+    return _clock.now();
+  }
+
+  /**
+   * clock() - the clock of this loop, also caching the wall time and the HTTP Date
+   *
+   * Only to be read in the loop thread.
+   */
+  const LoopClock& clock() const
+  {
+    return _clock;
+  }
+
+  /**
+   * setShedTarget() - consider the loop overloaded once its lag stays above @target seconds
+   *                   for @interval seconds, 0 to never
+   *
+   * The lag is the longer of the time an iteration took, which is how long the events
+   * arriving meanwhile wait, and the time the oldest queued task waited. See class CoDel.
+   */
+  void setShedTarget(double target, double interval)
+  {
+    runInLoop([this, target, interval] {
+      _codel.setTarget(static_cast<uint64_t>(target * 1e9), static_cast<uint64_t>(interval * 1e9));
+    });
+  }
+
+  /**
+   * overloaded() - whether new work should be shed, only to be called in the loop thread
+   */
+  bool overloaded() const
+  {
+    return _codel.overloaded();
+  }
+
+  /**
+   * setCpuAffinity() - pin the loop thread to @cpu
+   *
+   * The kernel allocates memory on the NUMA node of the cpu that first touches it, so what
+   * the loop creates afterwards, e.g. its connections and their buffers, stays local.
+   */
+  void setCpuAffinity(int cpu)
+  {
+    runInLoop([cpu] {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        perror("sched_setaffinity");
+    });
+  }
+
+  /**
+   * timingWheel() - coarse deadlines of this loop, only to be used in the loop thread
+   */
+  TimingWheel& timingWheel()
+  {
+    return _timingWheel;
+  }
+
+  /**
+   * setCoarseClock() - read the coarse monotonic clock, of the kernel tick resolution
+   *
+   * Timers still expire on the precise clock. Call it before loop().
+   */
+  void setCoarseClock(bool on)
+  {
+    _clock.setCoarse(on);
+  }
+
   void loop()
   {
+    _clock.update();
     while (running) {
       _activeChannels.clear();
       _poller.poll(&_activeChannels);
+      _clock.update();
+      uint64_t start = LoopMetrics::nowNs();
+      _handlingEvents = true;
       for (auto ch : _activeChannels)
         ch->handleEvent();
+      _handlingEvents = false;
       std::vector<Task> tasks;
-      _callingPendingTasks = true;
+      uint64_t queuedSince;
       {
         std::lock_guard lock(_mutex);
         tasks.swap(_pendingTask);
+        queuedSince = _pendingSince;
+      }
+      uint64_t taskDelay = 0;
+      if (!tasks.empty()) {
+        taskDelay = LoopMetrics::nowNs() - queuedSince;
+        _metrics.taskQueueDelay.record(taskDelay);
       }
       for (auto task : tasks)
         task();
-      _callingPendingTasks = true;
+      // whatever became ready while we were busy has waited that long
+      uint64_t end = LoopMetrics::nowNs();
+      _metrics.loopLag.record(end - start);
+      _codel.observe(end, std::max(end - start, taskDelay));
     }
+    // a quit() before loop() is still honoured, but the loop can be run again once it returned
+    running = true;
   }
 
   __attribute__((no_sanitize_thread)) void quit()
@@ -515,10 +800,13 @@ public:
   {
     {
       std::lock_guard lock(_mutex);
+      if (_pendingTask.empty())
+        _pendingSince = LoopMetrics::nowNs();
       _pendingTask.push_back(std::move(cb));
     }
 
-    if (!isInEventLoop() || _callingPendingTasks) {
+    // tasks queued while handling events run right after them, otherwise poll must return
+    if (!isInEventLoop() || !_handlingEvents) {
       wakeupWakeup();   // raise a new event
     }
   }
@@ -533,24 +821,29 @@ public:
     }
   }
 
-  void* runAt(Time time, TimerCallback cb)
+  TimerId runAt(Time time, TimerCallback cb)
   {
     return _timerQueue.addTimer(std::move(cb), time, 0.0);
   }
 
-  void* runAfter(double delayS, TimerCallback cb)
+  TimerId runAfter(double delayS, TimerCallback cb)
   {
-    return runAt(Time::now().offsetBy(delayS), std::move(cb));
+    return runAt(baseTime().offsetBy(delayS), std::move(cb));
   }
 
-  void* runEvery(double intervalS, TimerCallback cb)
+  TimerId runEvery(double intervalS, TimerCallback cb)
   {
-    return _timerQueue.addTimer(std::move(cb), Time::now(), intervalS);
+    return _timerQueue.addTimer(std::move(cb), baseTime(), intervalS);
   }
 
-  void cancel(void* timerId)
+  /**
+   * cancel() - cancel a timer
+   *
+   * It is safe to cancel a timer which has already expired.
+   */
+  void cancel(TimerId timerId)
   {
-    return _timerQueue.cancel(static_cast<TimerQueue::Timer*>(timerId));
+    return _timerQueue.cancel(timerId);
   }
 
 private:
@@ -558,15 +851,33 @@ private:
   Poller _poller;
   bool running;
   const std::thread::id _ownerThreadId;
+  LoopClock _clock;
 
   int _wakeupFd;
   Channel _wakeupChannel;
 
   mutable std::mutex _mutex;
   std::vector<Task> _pendingTask;
-  bool _callingPendingTasks;
+  uint64_t _pendingSince;   // when the oldest pending task was queued
+  bool _handlingEvents;
 
   TimerQueue _timerQueue;
+  TimingWheel _timingWheel;
+  CoDel _codel;
+
+  LoopMetrics _metrics;
+
+  static EventLoop*& currentLoop()
+  {
+    static thread_local EventLoop* loop = nullptr;
+    return loop;
+  }
+
+  // timers armed in the loop count from the cached time, other threads read the clock
+  Time baseTime()
+  {
+    return isInEventLoop() ? _clock.now() : Time::now();
+  }
 
   void wakeupRead()
   {
@@ -596,11 +907,12 @@ inline void Channel::remove()
   _loop->removeChannel(this);
 }
 
-inline TimerQueue::Timer* TimerQueue::addTimer(TimerCallback cb, Time when, double interval)
+inline TimerId TimerQueue::addTimer(TimerCallback cb, Time when, double interval)
 {
   Timer* timer = new Timer(std::move(cb), when, interval);
-  _loop->runInLoop([&, timer] { addTimerInLoop(timer); });
-  return timer;
+  TimerId id = timer->sequence();
+  _loop->runInLoop([this, timer] { addTimerInLoop(timer); });
+  return id;
 }
 
 inline void TimerQueue::addTimerInLoop(Timer* timer)
@@ -620,28 +932,29 @@ inline bool TimerQueue::insert(Timer* timer)
   if (it == _timers.end() || when < it->first)
     earliestChanged = true;
   _timers[when].insert(timer);
-  _activeTimers.insert(timer);
+  _activeTimers.emplace(timer->sequence(), timer);
   return earliestChanged;
 }
 
-inline void TimerQueue::cancel(Timer* timerId)
+inline void TimerQueue::cancel(TimerId timerId)
 {
-  _loop->runInLoop([&] { cancelInLoop(timerId); });
+  _loop->runInLoop([this, timerId] { cancelInLoop(timerId); });
 }
 
-inline void TimerQueue::cancelInLoop(Timer* timer)
+inline void TimerQueue::cancelInLoop(TimerId timerId)
 {
   assert(_loop->isInEventLoop());
-  auto it = _activeTimers.find(timer);
+  auto it = _activeTimers.find(timerId);
   if (it != _activeTimers.end()) {
+    Timer* timer = it->second;
     auto when = timer->when();
-    size_t n = _timers[when].erase(timer);
+    _timers[when].erase(timer);
     if (_timers[when].empty())
       _timers.erase(when);
     delete timer;
     _activeTimers.erase(it);
   } else if (_callingExpiredTimers) {
-    _cancelingTimers.insert(timer);
+    _cancelingTimers.insert(timerId);
   }
 }
 
@@ -657,7 +970,7 @@ inline void TimerQueue::handleRead()
   while (it != end) {
     for (auto timer : it->second) {
       expired.push_back(timer);
-      _activeTimers.erase(timer);
+      _activeTimers.erase(timer->sequence());
     }
     it = _timers.erase(it);
   }
@@ -669,16 +982,68 @@ inline void TimerQueue::handleRead()
     timer->run();
   _callingExpiredTimers = false;
 
-  bool earliestChanged = false;
   for (const auto& timer : expired) {
-    if (timer->isRepeat() && !_cancelingTimers.count(timer)) {
+    if (timer->isRepeat() && !_cancelingTimers.count(timer->sequence())) {
       timer->restart(now);
-      earliestChanged |= insert(timer);
+      insert(timer);
     } else
       delete timer;
   }
-  if (earliestChanged)
+  // the timerfd is one-shot, so re-arm it for whatever is left
+  if (!_timers.empty())
     resetTimerfd(_timers.begin()->first);
 }
 
+inline void TimingWheel::schedule(Entry* e, Time deadline)
+{
+  assert(_loop->isInEventLoop());
+  e->_deadline = deadline;
+  if (e->_wheel == this) {
+    // a later deadline is picked up when the current slot comes around
+    if (tickOf(deadline) >= e->_tick)
+      return;
+    e->unlink();
+  } else {
+    e->_wheel = this;
+    _size++;
+  }
+  if (!_ticker) {
+    _currentTick = _loop->now() / kTickUs;
+    _ticker = _loop->runEvery(kTickUs / 1e6, [this] { tick(); });
+  }
+  link(e);
+}
+
+inline void TimingWheel::tick()
+{
+  Time now = _loop->now();
+  int64_t target = now / kTickUs;
+  // a stalled loop may have missed ticks, but one turn of the wheel sees every entry
+  _currentTick = std::max(_currentTick, target - kSlots);
+  Entry pending;
+  while (_currentTick < target) {
+    Entry& slot = _slots[++_currentTick % kSlots];
+    if (slot.empty())
+      continue;
+    // take the whole slot, the callbacks may schedule into it again
+    pending.linkBefore(&slot);
+    slot.unlink();
+    while (!pending.empty()) {
+      Entry* e = pending._next;
+      e->unlink();
+      if (e->_deadline <= now) {
+        e->_wheel = nullptr;
+        _size--;
+        e->_cb();
+      } else {
+        link(e);
+      }
+    }
+  }
+  if (!_size) {
+    _loop->cancel(_ticker);
+    _ticker = 0;
+  }
+}
+
 #endif
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <atomic>
 #include <functional>
 #include <iostream>
@@ -45,6 +46,51 @@ public:
     return loop;
   }
 
+  const std::vector<EventLoop*>& getLoops() const
+  {
+    return _loops;
+  }
+
+  /**
+   * setCpuAffinity() - pin the i-th loop to @cpus[i % @cpus.size()]
+   */
+  void setCpuAffinity(const std::vector<int>& cpus)
+  {
+    if (cpus.empty())
+      return;
+    for (size_t i = 0; i < _loops.size(); i++)
+      _loops[i]->setCpuAffinity(cpus[i % cpus.size()]);
+  }
+
+  /**
+   * parseCpuList() - parse a list of cpus like "0-3,8", as in /sys/devices/system/cpu/online
+   */
+  static bool parseCpuList(const char* list, std::vector<int>& cpus)
+  {
+    const char* p = list;
+    while (*p) {
+      char* end;
+      long first = strtol(p, &end, 10);
+      long last = first;
+      if (end == p || first < 0)
+        return false;
+      p = end;
+      if (*p == '-') {
+        last = strtol(p + 1, &end, 10);
+        if (end == p + 1 || last < first)
+          return false;
+        p = end;
+      }
+      for (long cpu = first; cpu <= last; cpu++)
+        cpus.push_back(static_cast<int>(cpu));
+      if (*p == ',')
+        p++;
+      else if (*p)
+        return false;
+    }
+    return !cpus.empty();
+  }
+
 private:
   EventLoop* _baseLoop;
   ThreadPool _pool;
@@ -0,0 +1,371 @@
+#ifndef __LOGGER_HPP__
+#define __LOGGER_HPP__
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include "Utils.hpp"
+#include "Time.hpp"
+#include "Clock.hpp"
+
+#define ALOG_LEVEL_DEBUG 0
+#define ALOG_LEVEL_INFO 1
+#define ALOG_LEVEL_WARN 2
+#define ALOG_LEVEL_ERROR 3
+
+// Records below this level are compiled out, their arguments are not even evaluated.
+#ifndef ALOG_LEVEL
+#  define ALOG_LEVEL ALOG_LEVEL_INFO
+#endif
+
+static inline void alog_check_format(const char*, ...) __attribute__((format(printf, 1, 2)));
+static inline void alog_check_format(const char*, ...) {}
+
+#define ALOG_AT(level, category, fmt, ...)                                                         \
+  do {                                                                                             \
+    if constexpr (level >= ALOG_LEVEL) {                                                           \
+      if (false)                                                                                   \
+        alog_check_format(fmt, ##__VA_ARGS__);                                                     \
+      AsyncLogger::log(level, category, fmt, ##__VA_ARGS__);                                       \
+    }                                                                                              \
+  } while (0)
+
+#define alog_debug(category, fmt, ...) ALOG_AT(ALOG_LEVEL_DEBUG, category, fmt, ##__VA_ARGS__)
+#define alog_info(category, fmt, ...) ALOG_AT(ALOG_LEVEL_INFO, category, fmt, ##__VA_ARGS__)
+#define alog_warn(category, fmt, ...) ALOG_AT(ALOG_LEVEL_WARN, category, fmt, ##__VA_ARGS__)
+#define alog_error(category, fmt, ...) ALOG_AT(ALOG_LEVEL_ERROR, category, fmt, ##__VA_ARGS__)
+
+/**
+ * class AsyncLogger - asynchronous logging backend for the hot paths
+ *
+ * Every thread appends to its own single-producer single-consumer ring, so logging takes no
+ * lock and makes no syscall. A record only holds the format string (which must be a literal),
+ * the raw arguments and a function to format them; the background flusher thread formats
+ * the records and writes them to the file in batches.
+ *
+ * When a ring is full the record is dropped and counted, the flusher reports the drops.
+ * Records are ordered per thread, but not across threads.
+ */
+class AsyncLogger : noncopyable
+{
+  typedef int (*FormatFunc)(char* buf, size_t size, const char* fmt, const char* args);
+
+  static constexpr size_t kSlotSize = 256;
+  static constexpr size_t kSlots = 4096;   // per thread, must be a power of 2
+  static constexpr int kFlushIntervalMs = 50;
+
+  struct Record
+  {
+    int64_t time;
+    const char* category;
+    const char* fmt;
+    FormatFunc format;   // nullptr if args holds the formatted message
+    int level;
+  };
+  static constexpr size_t kArgsSize = kSlotSize - sizeof(Record);
+
+  struct Slot
+  {
+    Record record;
+    char args[kArgsSize];
+  };
+
+  struct Ring : noncopyable
+  {
+    Slot slots[kSlots];
+    std::atomic<uint64_t> head{0};   // written by the flusher
+    std::atomic<uint64_t> tail{0};   // written by the owner thread
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> retired{false};
+  };
+
+  // retires the ring of a thread when the thread exits, the flusher will free it
+  struct RingHolder
+  {
+    Ring* ring = nullptr;
+    ~RingHolder()
+    {
+      if (ring)
+        ring->retired.store(true, std::memory_order_release);
+    }
+  };
+
+public:
+  static AsyncLogger& instance()
+  {
+    static AsyncLogger logger;
+    return logger;
+  }
+
+  /**
+   * start() - start the flusher, appending to @path (stderr if nullptr)
+   */
+  bool start(const char* path = nullptr)
+  {
+    assert(!_running.load());
+    if (path) {
+      _fd = ::open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+      if (_fd < 0)
+        return false;
+    } else {
+      _fd = STDERR_FILENO;
+    }
+    _running.store(true, std::memory_order_release);
+    _flusher = std::thread([this] { flusherLoop(); });
+    return true;
+  }
+
+  /**
+   * stop() - flush everything and stop the flusher
+   */
+  void stop()
+  {
+    if (!_running.exchange(false))
+      return;
+    _flusher.join();
+    flushOnce();
+    if (_fd != STDERR_FILENO)
+      ::close(_fd);
+    _fd = -1;
+  }
+
+  /**
+   * dropped() - records dropped so far because a ring was full
+   */
+  uint64_t dropped()
+  {
+    std::lock_guard lock(_mutex);
+    uint64_t n = _droppedRetired;
+    for (Ring* ring : _rings)
+      n += ring->dropped.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  template<typename... Args>
+  static void log(int level, const char* category, const char* fmt, const Args&... args)
+  {
+    AsyncLogger& logger = instance();
+    if (!logger._running.load(std::memory_order_relaxed))
+      return;
+    Ring* ring = logger.localRing();
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) == kSlots) {
+      ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+      return;
+    }
+    Slot& slot = ring->slots[tail & (kSlots - 1)];
+    slot.record.time = LoopClock::threadWallNow();
+    slot.record.category = category;
+    slot.record.fmt = fmt;
+    slot.record.level = level;
+    if ((0 + ... + encodedSize(args)) <= kArgsSize) {
+      char* p = slot.args;
+      (encode(p, args), ...);
+      (void)p;
+      slot.record.format = &formatArgs<Decoded<Args>...>;
+    } else {
+      // rare and huge, not worth deferring
+      snprintf(slot.args, kArgsSize, fmt, pass(args)...);
+      slot.record.format = nullptr;
+    }
+    ring->tail.store(tail + 1, std::memory_order_release);
+  }
+
+private:
+  std::atomic<bool> _running;
+  int _fd;
+  std::thread _flusher;
+  std::mutex _mutex;   // guards _rings, only taken once per thread and by the flusher
+  std::vector<Ring*> _rings;
+  uint64_t _droppedRetired;
+  uint64_t _droppedReported;
+
+  AsyncLogger()
+    : _running(false)
+    , _fd(-1)
+    , _droppedRetired(0)
+    , _droppedReported(0)
+  {}
+  ~AsyncLogger()
+  {
+    stop();
+  }
+
+  Ring* localRing()
+  {
+    static thread_local RingHolder holder;
+    if (!holder.ring) {
+      holder.ring = new Ring;
+      std::lock_guard lock(_mutex);
+      _rings.push_back(holder.ring);
+    }
+    return holder.ring;
+  }
+
+  // Argument encoding: strings are copied, everything else is stored as is.
+  template<typename T>
+  static constexpr bool isString = std::is_same_v<std::decay_t<T>, const char*> ||
+                                   std::is_same_v<std::decay_t<T>, char*>;
+
+  template<typename T>
+  using Decoded = std::conditional_t<isString<T>, const char*, std::decay_t<T>>;
+
+  static const char* str(const char* s)
+  {
+    return s ? s : "(null)";
+  }
+
+  template<typename T>
+  static size_t encodedSize(const T& arg)
+  {
+    if constexpr (isString<T>)
+      return strlen(str(arg)) + 1;
+    else
+      return sizeof(T);
+  }
+
+  template<typename T>
+  static void encode(char*& p, const T& arg)
+  {
+    if constexpr (isString<T>) {
+      const char* s = str(arg);
+      size_t len = strlen(s) + 1;
+      memcpy(p, s, len);
+      p += len;
+    } else {
+      static_assert(std::is_trivially_copyable_v<T>, "unsupported log argument");
+      memcpy(p, &arg, sizeof(T));
+      p += sizeof(T);
+    }
+  }
+
+  template<typename T>
+  static T decode(const char*& p)
+  {
+    if constexpr (std::is_same_v<T, const char*>) {
+      const char* s = p;
+      p += strlen(s) + 1;
+      return s;
+    } else {
+      T arg;
+      memcpy(&arg, p, sizeof(T));
+      p += sizeof(T);
+      return arg;
+    }
+  }
+
+  template<typename T>
+  static Decoded<T> pass(const T& arg)
+  {
+    return arg;
+  }
+
+  template<typename... Args>
+  static int formatArgs(char* buf, size_t size, const char* fmt, const char* p)
+  {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-security"
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+    if constexpr (sizeof...(Args) == 0) {
+      return snprintf(buf, size, "%s", fmt);
+    } else {
+      // braced initialization evaluates left to right
+      std::tuple<Args...> args{decode<Args>(p)...};
+      return std::apply([&](auto... a) { return snprintf(buf, size, fmt, a...); }, args);
+    }
+#pragma GCC diagnostic pop
+  }
+
+  void flusherLoop()
+  {
+    while (_running.load(std::memory_order_acquire)) {
+      if (!flushOnce())
+        std::this_thread::sleep_for(std::chrono::milliseconds(kFlushIntervalMs));
+    }
+  }
+
+  /**
+   * flushOnce() - drain all the rings, returns whether anything was written
+   */
+  bool flushOnce()
+  {
+    static const char* const levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+    std::string out;
+    uint64_t dropped;
+    {
+      std::lock_guard lock(_mutex);
+      for (size_t i = 0; i < _rings.size();) {
+        Ring* ring = _rings[i];
+        // check before draining, so nothing is appended after the last drain
+        bool retired = ring->retired.load(std::memory_order_acquire);
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+        for (; head != tail; head++) {
+          const Slot& slot = ring->slots[head & (kSlots - 1)];
+          appendRecord(out, slot, levels[slot.record.level]);
+        }
+        ring->head.store(head, std::memory_order_release);
+        if (retired) {
+          _droppedRetired += ring->dropped.load(std::memory_order_relaxed);
+          delete ring;
+          _rings.erase(_rings.begin() + i);
+        } else {
+          i++;
+        }
+      }
+      dropped = _droppedRetired;
+      for (Ring* ring : _rings)
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+    if (dropped != _droppedReported) {
+      out += "AsyncLogger: " + std::to_string(dropped - _droppedReported) +
+             " records dropped\n";
+      _droppedReported = dropped;
+    }
+    if (out.empty())
+      return false;
+    for (size_t off = 0; off < out.size();) {
+      ssize_t n = ::write(_fd, out.data() + off, out.size() - off);
+      if (n <= 0)
+        break;
+      off += n;
+    }
+    return true;
+  }
+
+  static void appendRecord(std::string& out, const Slot& slot, const char* level)
+  {
+    const Record& r = slot.record;
+    char line[1024];
+    time_t sec = r.time / 1000000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    size_t n = strftime(line, sizeof(line), "%F %T", &tm);
+    n += snprintf(line + n,
+                  sizeof(line) - n,
+                  ".%06d %-5s %s - ",
+                  static_cast<int>(r.time % 1000000),
+                  level,
+                  r.category);
+    if (r.format)
+      r.format(line + n, sizeof(line) - n, r.fmt, slot.args);
+    else
+      snprintf(line + n, sizeof(line) - n, "%s", slot.args);
+    out += line;
+    out += '\n';
+  }
+};
+
+#endif
@@ -0,0 +1,498 @@
+#ifndef __METRICS_HPP__
+#define __METRICS_HPP__
+
+#include <assert.h>
+#include <time.h>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Utils.hpp"
+
+/**
+ * class Counter - a counter only ever written by one thread
+ *
+ * With a single writer, a relaxed load and store is enough: no locked instruction on the hot
+ * path, while readers in other threads still see a consistent (if slightly stale) value.
+ */
+class Counter : noncopyable
+{
+public:
+  Counter()
+    : _value(0)
+  {}
+
+  void add(uint64_t n = 1)
+  {
+    _value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  uint64_t value() const
+  {
+    return _value.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> _value;
+};
+
+/**
+ * class Histogram - single writer HDR-style histogram of nanoseconds
+ *
+ * Log-linear buckets: every power of two is split into 2^kSubBits linear buckets, so the
+ * relative error is below 1/2^kSubBits (12.5%) over the whole range.
+ */
+class Histogram : noncopyable
+{
+public:
+  static constexpr int kSubBits = 3;
+  static constexpr int kSubBuckets = 1 << kSubBits;
+  static constexpr int kMaxBits = 40;   // ~18 minutes
+  static constexpr int kBuckets = (kMaxBits - kSubBits + 1) * kSubBuckets;
+
+  Histogram() {}
+
+  void record(uint64_t ns)
+  {
+    add(_buckets[index(ns)], 1);
+    add(_sum, ns);
+  }
+
+  uint64_t bucket(int i) const
+  {
+    return _buckets[i].load(std::memory_order_relaxed);
+  }
+
+  uint64_t sum() const
+  {
+    return _sum.load(std::memory_order_relaxed);
+  }
+
+  static int index(uint64_t v)
+  {
+    if (v < kSubBuckets)
+      return v;
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= kMaxBits)
+      return kBuckets - 1;
+    int shift = msb - kSubBits;
+    return (shift + 1) * kSubBuckets + ((v >> shift) & (kSubBuckets - 1));
+  }
+
+  /**
+   * upperBound() - the exclusive upper bound of bucket @i
+   */
+  static uint64_t upperBound(int i)
+  {
+    if (i < kSubBuckets)
+      return i + 1;
+    int shift = i / kSubBuckets - 1;
+    return static_cast<uint64_t>(kSubBuckets + i % kSubBuckets + 1) << shift;
+  }
+
+private:
+  std::atomic<uint64_t> _buckets[kBuckets] = {};
+  std::atomic<uint64_t> _sum{0};
+
+  static void add(std::atomic<uint64_t>& v, uint64_t n)
+  {
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+};
+
+/**
+ * struct LoopMetrics - the metrics of one EventLoop, only written from the loop thread
+ */
+struct LoopMetrics : noncopyable
+{
+  static constexpr int kMaxStatus = 600;
+
+  /**
+   * enum Phase - phases of an HTTP request, see HttpContext::Timing
+   */
+  enum Phase
+  {
+    PHASE_HANDOFF = 0,   // accepted -> set up in the io loop
+    PHASE_HEADERS,       // first byte -> headers complete
+    PHASE_BODY,          // headers complete -> message complete
+    PHASE_HANDLER,       // message complete -> handler returned
+    PHASE_FIRST_WRITE,   // message complete -> first byte of the response written
+    PHASE_FLUSH,         // first write -> last byte flushed
+    PHASE_TOTAL,         // first byte -> last byte flushed
+    kPhases,
+  };
+  static constexpr const char* kPhaseNames[kPhases] = {
+    "handoff", "headers", "body", "handler", "first_write", "flush", "total"};
+
+  /**
+   * enum Timeout - reasons a server connection is timed out, see HttpServer
+   */
+  enum Timeout
+  {
+    TIMEOUT_HEADER_READ = 0,
+    TIMEOUT_BODY_READ,
+    TIMEOUT_KEEPALIVE,
+    TIMEOUT_WRITE_STALL,
+    kTimeouts,
+  };
+  static constexpr const char* kTimeoutNames[kTimeouts] = {
+    "header_read", "body_read", "keepalive", "write_stall"};
+
+  Counter connectionsAccepted;
+  Counter connectionsClosed;
+  Counter connectionsRejected;
+  Counter acceptPauses;
+  Counter bytesIn;
+  Counter bytesOut;
+  Counter responses[kMaxStatus];
+  Histogram routerMatch;
+  Histogram upstreamLatency;
+  Histogram requestPhases[kPhases];
+  Counter timeouts[kTimeouts];
+  Histogram loopLag;
+  Histogram taskQueueDelay;
+  Counter requestsShed;
+  Counter requestsRateLimited;
+  Counter tlsHandshakes;
+  Counter tlsHandshakeFailures;
+  Counter tlsResumed;
+  Counter http2Connections;
+  Counter http2Streams;
+  Counter http2StreamsRefused;
+  Counter websocketConnections;
+  Counter websocketMessagesIn;
+  Counter websocketMessagesOut;
+  Counter eventStreams;
+  Counter broadcastsDropped;
+  Counter broadcastDisconnects;
+  Counter gzipResponses;
+  Counter gzipBytesIn;
+  Counter gzipBytesOut;
+
+  void recordStatus(int code)
+  {
+    if (code > 0 && code < kMaxStatus)
+      responses[code].add();
+  }
+
+  /**
+   * recordGzip() - a response was sent gzipped, its body of @in bytes taking @out
+   */
+  void recordGzip(uint64_t in, uint64_t out)
+  {
+    gzipResponses.add();
+    gzipBytesIn.add(in);
+    gzipBytesOut.add(out);
+  }
+
+  /**
+   * nowNs() - monotonic clock for measuring durations
+   */
+  static uint64_t nowNs()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+};
+
+/**
+ * class MetricsRegistry - all the LoopMetrics in the process
+ *
+ * Values are only summed up when scraped. Metrics of destroyed loops are folded into a
+ * snapshot, so the counters never go backwards.
+ */
+class MetricsRegistry : noncopyable
+{
+  struct HistogramSnapshot
+  {
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(Histogram::kBuckets);
+    uint64_t sum = 0;
+
+    void merge(const Histogram& h)
+    {
+      for (int i = 0; i < Histogram::kBuckets; i++)
+        buckets[i] += h.bucket(i);
+      sum += h.sum();
+    }
+  };
+
+  struct Snapshot
+  {
+    uint64_t connectionsAccepted = 0;
+    uint64_t connectionsClosed = 0;
+    uint64_t connectionsRejected = 0;
+    uint64_t acceptPauses = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    std::vector<uint64_t> responses = std::vector<uint64_t>(LoopMetrics::kMaxStatus);
+    HistogramSnapshot routerMatch;
+    HistogramSnapshot upstreamLatency;
+    HistogramSnapshot requestPhases[LoopMetrics::kPhases];
+    uint64_t timeouts[LoopMetrics::kTimeouts] = {};
+    HistogramSnapshot loopLag;
+    HistogramSnapshot taskQueueDelay;
+    uint64_t requestsShed = 0;
+    uint64_t requestsRateLimited = 0;
+    uint64_t tlsHandshakes = 0;
+    uint64_t tlsHandshakeFailures = 0;
+    uint64_t tlsResumed = 0;
+    uint64_t http2Connections = 0;
+    uint64_t http2Streams = 0;
+    uint64_t http2StreamsRefused = 0;
+    uint64_t websocketConnections = 0;
+    uint64_t websocketMessagesIn = 0;
+    uint64_t websocketMessagesOut = 0;
+    uint64_t eventStreams = 0;
+    uint64_t broadcastsDropped = 0;
+    uint64_t broadcastDisconnects = 0;
+    uint64_t gzipResponses = 0;
+    uint64_t gzipBytesIn = 0;
+    uint64_t gzipBytesOut = 0;
+
+    void merge(const LoopMetrics& m)
+    {
+      connectionsAccepted += m.connectionsAccepted.value();
+      connectionsClosed += m.connectionsClosed.value();
+      connectionsRejected += m.connectionsRejected.value();
+      acceptPauses += m.acceptPauses.value();
+      bytesIn += m.bytesIn.value();
+      bytesOut += m.bytesOut.value();
+      for (int i = 0; i < LoopMetrics::kMaxStatus; i++)
+        responses[i] += m.responses[i].value();
+      routerMatch.merge(m.routerMatch);
+      upstreamLatency.merge(m.upstreamLatency);
+      for (int i = 0; i < LoopMetrics::kPhases; i++)
+        requestPhases[i].merge(m.requestPhases[i]);
+      for (int i = 0; i < LoopMetrics::kTimeouts; i++)
+        timeouts[i] += m.timeouts[i].value();
+      loopLag.merge(m.loopLag);
+      taskQueueDelay.merge(m.taskQueueDelay);
+      requestsShed += m.requestsShed.value();
+      requestsRateLimited += m.requestsRateLimited.value();
+      tlsHandshakes += m.tlsHandshakes.value();
+      tlsHandshakeFailures += m.tlsHandshakeFailures.value();
+      tlsResumed += m.tlsResumed.value();
+      http2Connections += m.http2Connections.value();
+      http2Streams += m.http2Streams.value();
+      http2StreamsRefused += m.http2StreamsRefused.value();
+      websocketConnections += m.websocketConnections.value();
+      websocketMessagesIn += m.websocketMessagesIn.value();
+      websocketMessagesOut += m.websocketMessagesOut.value();
+      eventStreams += m.eventStreams.value();
+      broadcastsDropped += m.broadcastsDropped.value();
+      broadcastDisconnects += m.broadcastDisconnects.value();
+      gzipResponses += m.gzipResponses.value();
+      gzipBytesIn += m.gzipBytesIn.value();
+      gzipBytesOut += m.gzipBytesOut.value();
+    }
+  };
+
+public:
+  static MetricsRegistry& instance()
+  {
+    static MetricsRegistry registry;
+    return registry;
+  }
+
+  void add(LoopMetrics* m)
+  {
+    std::lock_guard lock(_mutex);
+    _loops.push_back(m);
+  }
+
+  void remove(LoopMetrics* m)
+  {
+    std::lock_guard lock(_mutex);
+    _retired.merge(*m);
+    _loops.erase(std::remove(_loops.begin(), _loops.end(), m), _loops.end());
+  }
+
+  /**
+   * render() - all metrics in the Prometheus text exposition format
+   */
+  std::string render()
+  {
+    Snapshot s;
+    size_t loops;
+    {
+      std::lock_guard lock(_mutex);
+      s = _retired;
+      for (LoopMetrics* m : _loops)
+        s.merge(*m);
+      loops = _loops.size();
+    }
+
+    std::string out;
+    gauge(out, "rpx_event_loops", "Number of running event loops.", loops);
+    counter(out,
+            "rpx_connections_accepted_total",
+            "Connections accepted.",
+            s.connectionsAccepted);
+    counter(out, "rpx_connections_closed_total", "Connections closed.", s.connectionsClosed);
+    counter(out,
+            "rpx_connections_rejected_total",
+            "Connections turned away over the connection limits.",
+            s.connectionsRejected);
+    counter(out,
+            "rpx_accept_pauses_total",
+            "Times accepting was paused at the connection limits.",
+            s.acceptPauses);
+    counter(out, "rpx_received_bytes_total", "Bytes read from sockets.", s.bytesIn);
+    counter(out, "rpx_sent_bytes_total", "Bytes written to sockets.", s.bytesOut);
+    out += "# HELP rpx_http_responses_total HTTP responses by status code.\n";
+    out += "# TYPE rpx_http_responses_total counter\n";
+    for (int code = 0; code < LoopMetrics::kMaxStatus; code++)
+      if (s.responses[code])
+        out += "rpx_http_responses_total{code=\"" + std::to_string(code) + "\"} " +
+               std::to_string(s.responses[code]) + "\n";
+    histogram(out, "rpx_router_match_seconds", "Time to match a route.", s.routerMatch);
+    histogram(out,
+              "rpx_upstream_latency_seconds",
+              "Time from connecting to an upstream to the first byte of its response.",
+              s.upstreamLatency);
+    header(out, "rpx_request_phase_seconds", "Time spent in each phase of a request.", "histogram");
+    for (int i = 0; i < LoopMetrics::kPhases; i++) {
+      std::string labels = std::string("phase=\"") + LoopMetrics::kPhaseNames[i] + "\"";
+      histogramSeries(out, "rpx_request_phase_seconds", labels, s.requestPhases[i]);
+    }
+    header(out, "rpx_connection_timeouts_total", "Connections closed by a timeout.", "counter");
+    for (int i = 0; i < LoopMetrics::kTimeouts; i++)
+      out += std::string("rpx_connection_timeouts_total{type=\"") +
+             LoopMetrics::kTimeoutNames[i] + "\"} " + std::to_string(s.timeouts[i]) + "\n";
+    histogram(out,
+              "rpx_loop_lag_seconds",
+              "Time an event loop iteration took, what new events may wait.",
+              s.loopLag);
+    histogram(out,
+              "rpx_task_queue_delay_seconds",
+              "Time the oldest task queued to an event loop waited.",
+              s.taskQueueDelay);
+    counter(out,
+            "rpx_requests_shed_total",
+            "Requests answered with 503 by an overloaded loop.",
+            s.requestsShed);
+    counter(out,
+            "rpx_requests_rate_limited_total",
+            "Requests answered with 429 by the rate limiter.",
+            s.requestsRateLimited);
+    counter(out, "rpx_tls_handshakes_total", "TLS handshakes completed.", s.tlsHandshakes);
+    counter(out,
+            "rpx_tls_handshake_failures_total",
+            "TLS handshakes failed.",
+            s.tlsHandshakeFailures);
+    counter(out,
+            "rpx_tls_resumed_total",
+            "TLS handshakes resuming a session.",
+            s.tlsResumed);
+    counter(out,
+            "rpx_http2_connections_total",
+            "Connections switched to HTTP/2.",
+            s.http2Connections);
+    counter(out, "rpx_http2_streams_total", "HTTP/2 streams opened.", s.http2Streams);
+    counter(out,
+            "rpx_http2_streams_refused_total",
+            "HTTP/2 streams refused over the concurrency limit.",
+            s.http2StreamsRefused);
+    counter(out,
+            "rpx_websocket_connections_total",
+            "Connections upgraded to WebSocket.",
+            s.websocketConnections);
+    counter(out,
+            "rpx_websocket_messages_in_total",
+            "WebSocket messages received.",
+            s.websocketMessagesIn);
+    counter(out,
+            "rpx_websocket_messages_out_total",
+            "WebSocket messages sent.",
+            s.websocketMessagesOut);
+    counter(out, "rpx_event_streams_total", "Server-sent event streams opened.", s.eventStreams);
+    counter(out,
+            "rpx_broadcasts_dropped_total",
+            "Broadcast messages not sent to a slow subscriber.",
+            s.broadcastsDropped);
+    counter(out,
+            "rpx_broadcast_disconnects_total",
+            "Slow broadcast subscribers disconnected.",
+            s.broadcastDisconnects);
+    counter(out, "rpx_gzip_responses_total", "Responses sent gzipped.", s.gzipResponses);
+    counter(out,
+            "rpx_gzip_in_bytes_total",
+            "Body bytes of gzipped responses, before compression.",
+            s.gzipBytesIn);
+    counter(out,
+            "rpx_gzip_out_bytes_total",
+            "Body bytes of gzipped responses, after compression.",
+            s.gzipBytesOut);
+    return out;
+  }
+
+private:
+  std::mutex _mutex;
+  std::vector<LoopMetrics*> _loops;
+  Snapshot _retired;
+
+  MetricsRegistry() {}
+
+  static void header(std::string& out, const char* name, const char* help, const char* type)
+  {
+    out += std::string("# HELP ") + name + " " + help + "\n";
+    out += std::string("# TYPE ") + name + " " + type + "\n";
+  }
+
+  static void gauge(std::string& out, const char* name, const char* help, uint64_t v)
+  {
+    header(out, name, help, "gauge");
+    out += std::string(name) + " " + std::to_string(v) + "\n";
+  }
+
+  static void counter(std::string& out, const char* name, const char* help, uint64_t v)
+  {
+    header(out, name, help, "counter");
+    out += std::string(name) + " " + std::to_string(v) + "\n";
+  }
+
+  /**
+   * histogram() - export @h with a bucket per power of two from 1us
+   *
+   * Bucket boundaries are powers of two, so the exported buckets are exact.
+   */
+  static void histogram(std::string& out, const char* name, const char* help,
+                        const HistogramSnapshot& h)
+  {
+    header(out, name, help, "histogram");
+    histogramSeries(out, name, "", h);
+  }
+
+  /**
+   * histogramSeries() - the samples of one histogram series, @labels may be empty
+   */
+  static void histogramSeries(std::string& out, const char* name, const std::string& labels,
+                              const HistogramSnapshot& h)
+  {
+    std::string prefix = labels.empty() ? "{" : "{" + labels + ",";
+    std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+    uint64_t cumulative = 0;
+    int i = 0;
+    for (int bit = 10; bit <= Histogram::kMaxBits; bit++) {
+      uint64_t bound = 1ULL << bit;
+      for (; i < Histogram::kBuckets && Histogram::upperBound(i) <= bound; i++)
+        cumulative += h.buckets[i];
+      char le[32];
+      snprintf(le, sizeof(le), "%g", bound / 1e9);
+      out += std::string(name) + "_bucket" + prefix + "le=\"" + le + "\"} " +
+             std::to_string(cumulative) + "\n";
+    }
+    for (; i < Histogram::kBuckets; i++)
+      cumulative += h.buckets[i];
+    out += std::string(name) + "_bucket" + prefix + "le=\"+Inf\"} " + std::to_string(cumulative) +
+           "\n";
+    char sum[32];
+    snprintf(sum, sizeof(sum), "%.9f", h.sum / 1e9);
+    out += std::string(name) + "_sum" + suffix + " " + sum + "\n";
+    out += std::string(name) + "_count" + suffix + " " + std::to_string(cumulative) + "\n";
+  }
+};
+
+#endif
@@ -8,9 +8,11 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <linux/filter.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <vector>
 #include <unistd.h>
 
 inline struct sockaddr* sockaddr_cast(struct sockaddr_in* addr)
@@ -277,7 +279,8 @@ inline int connect(int sockfd, const InetAddress& addr)
 
 inline int accept(int sockfd, InetAddress& addr)
 {
-  return ::accept(sockfd, addr.getSockAddr(), &addr.getAddrLen());
+  // a blocking socket would stall the whole loop on a peer that stops reading
+  return ::accept4(sockfd, addr.getSockAddr(), &addr.getAddrLen(), SOCK_NONBLOCK | SOCK_CLOEXEC);
 }
 
 inline void getPeerAddr(int sockfd, InetAddress& addr)
@@ -357,6 +360,36 @@ public:
     ::setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval);
   }
 
+  /**
+   * setIncomingCpu() - prefer this socket of its SO_REUSEPORT group for connections received
+   *                    on @cpu
+   */
+  void setIncomingCpu(int cpu)
+  {
+    ::setsockopt(_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof cpu);
+  }
+
+  /**
+   * setReusePortCpus() - hand the connections received on @cpus[i] to the i-th socket that
+   *                      listens in the SO_REUSEPORT group of this socket
+   *
+   * Connections received on other cpus are spread by cpu over all the sockets.
+   */
+  bool setReusePortCpus(const std::vector<int>& cpus)
+  {
+    const uint32_t cpuOffset = SKF_AD_OFF + SKF_AD_CPU;
+    std::vector<struct sock_filter> code;
+    code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, cpuOffset));
+    for (size_t i = 0; i < cpus.size(); i++) {
+      code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(cpus[i]), 0, 1));
+      code.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(i)));
+    }
+    code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(cpus.size())));
+    code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+    struct sock_fprog prog = {static_cast<unsigned short>(code.size()), code.data()};
+    return ::setsockopt(_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == 0;
+  }
+
   void setKeepAlive(bool on)
   {
     int optval = on ? 1 : 0;
@@ -53,7 +53,8 @@ public:
   {
     // n *= 2;   // reserve more space
     char* new_data = new char[n];
-    char* new_head = new_data + headCapacity();
+    // callers size @n for the data at the reserved head room, not at the current head
+    char* new_head = new_data + _headRoom;
     _tail = std::copy(_head, _tail, new_head);
     delete[] _data;
     _head = new_head;
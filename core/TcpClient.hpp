@@ -1,6 +1,8 @@
 #ifndef __TCPCLIENT_HPP__
 #define __TCPCLIENT_HPP__
 
+#include <coroutine>
+#include <utility>
 #include "Socket.hpp"
 #include "EventLoop.hpp"
 #include "Connector.hpp"
@@ -18,6 +20,7 @@ public:
     , _zc(zlog_get_category("TcpClient"))
   {
     _connector->setNewConnectionCallback([&](int sockfd) { newConnection(sockfd); });
+    _connector->setConnectFailedCallback([this] { handleConnectFailed(); });
   }
   ~TcpClient()
   {
@@ -42,6 +45,12 @@ public:
     return _loop;
   }
 
+  TcpConnectionPtr connection()
+  {
+    std::lock_guard lock(_mutex);
+    return _connection;
+  }
+
   void enableReconnect()
   {
     _reconnect = true;
@@ -56,6 +65,36 @@ public:
     _connector->start();
   }
 
+  /**
+   * connect() - awaitable starting to connect, see CoTask
+   *
+   * Resumes with the connection, or with nullptr once the connector gives up (see
+   * setMaxConnectRetries()). The connect callbacks are still called.
+   */
+  auto connect()
+  {
+    struct Awaiter
+    {
+      TcpClient* client;
+
+      bool await_ready() const noexcept
+      {
+        return false;
+      }
+      void await_suspend(std::coroutine_handle<> h)
+      {
+        client->_connectWaiter = h;
+        client->start();
+      }
+      TcpConnectionPtr await_resume()
+      {
+        return client->connection();
+      }
+    };
+    assert(_loop->isInEventLoop());
+    return Awaiter{this};
+  }
+
   /**
    * stopConnect(): Interrupt the connecting process
    */
@@ -87,10 +126,36 @@ public:
       _connection->forceClose();
   }
 
+  /**
+   * setMaxConnectRetries(): Give up connecting after @maxRetries failed attempts
+   */
+  void setMaxConnectRetries(int maxRetries)
+  {
+    _connector->setMaxRetries(maxRetries);
+  }
+
+  /**
+   * setTls() - speak TLS with @ctx on the connections, before start()
+   * @serverName: sent as SNI and checked against the certificate of the server
+   *
+   * The connect callback runs as soon as the TCP connection is up, what is written before the
+   * handshake is done is sent after it.
+   */
+  void setTls(std::shared_ptr<TlsContext> ctx, const std::string& serverName)
+  {
+    assert(ctx->mode() == TlsContext::CLIENT);
+    _tls = std::move(ctx);
+    _serverName = serverName;
+  }
+
   void setConnectCallback(TcpCallback cb)
   {
     _userConnectCallback = std::move(cb);
   }
+  void setConnectFailedCallback(Connector::ConnectFailedCallback cb)
+  {
+    _userConnectFailedCallback = std::move(cb);
+  }
   void setMessageCallback(TcpMessageCallback cb)
   {
     _userMessageCallback = std::move(cb);
@@ -112,12 +177,16 @@ private:
   bool _reconnect;
   std::mutex _mutex;
   TcpConnectionPtr _connection;
+  std::shared_ptr<TlsContext> _tls;
+  std::string _serverName;
 
   // default callbacks for created connections
   TcpCallback _userConnectCallback;
   TcpMessageCallback _userMessageCallback;
   TcpCallback _userWriteCompleteCallback;
   TcpCallback _userCloseCallback;
+  Connector::ConnectFailedCallback _userConnectFailedCallback;
+  std::coroutine_handle<> _connectWaiter;   // task in connect()
 
   zlog_category_t* _zc;
 
@@ -131,6 +200,8 @@ private:
     conn->setMessageCallback(_userMessageCallback);
     conn->setWriteCompleteCallback(_userWriteCompleteCallback);
     conn->setCloseCallback([&](const TcpConnectionPtr& conn) { handleClose(conn); });
+    if (_tls)
+      conn->startTls(_tls, _serverName);
     {
       std::lock_guard lock(_mutex);
       _connection = conn;
@@ -138,6 +209,16 @@ private:
     conn->connectEstablished();
     if (_userConnectCallback)
       _userConnectCallback(conn);
+    if (_connectWaiter)
+      std::exchange(_connectWaiter, nullptr).resume();
+  }
+
+  void handleConnectFailed()
+  {
+    if (_userConnectFailedCallback)
+      _userConnectFailedCallback();
+    if (_connectWaiter)
+      std::exchange(_connectWaiter, nullptr).resume();
   }
 
   // user close callback wrapper
@@ -152,10 +233,11 @@ private:
     }
 
     // queueInLoop here, or the connection may be destructed in the middle of a loop
-    _loop->queueInLoop([&, conn] {
+    // the client may be gone by then, e.g. freed by a task resumed by the close
+    _loop->queueInLoop([conn, cb = _userCloseCallback] {
       conn->connectDestroyed();
-      if (_userCloseCallback)
-        _userCloseCallback(conn);
+      if (cb)
+        cb(conn);
     });
 
     // FIXME: reconnect
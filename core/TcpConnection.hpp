@@ -2,17 +2,24 @@
 #define __TCPCONNECTION_HPP__
 
 #include <assert.h>
+#include <sys/uio.h>
 #include <any>
-#include <zlog.h>
+#include <coroutine>
+#include <deque>
+#include <utility>
 #include "Utils.hpp"
+#include "Logger.hpp"
 #include "Socket.hpp"
 #include "StreamBuffer.hpp"
 #include "EventLoop.hpp"
+#include "TlsContext.hpp"
 
 class TcpConnection;
 typedef std::shared_ptr<TcpConnection> TcpConnectionPtr;
 typedef std::function<void(const TcpConnectionPtr&)> TcpCallback;
 typedef std::function<void(const TcpConnectionPtr&, StreamBuffer*)> TcpMessageCallback;
+// immutable bytes written to many connections without a copy, see TcpConnection::write()
+typedef std::shared_ptr<const std::string> SharedBuffer;
 
 class TcpConnection : noncopyable, public std::enable_shared_from_this<TcpConnection>
 {
@@ -25,16 +32,27 @@ public:
     , _channel(new Channel(loop, sockfd))
     , _peerAddr(peerAddr)
     , _socket(sockfd)
+    , _state(CONNECTING)
     , _readBuffer(1024)
     , _writeBuffer(1024, 20)
-    , _state(CONNECTING)
-    , _zc(zlog_get_category("TcpConnection"))
+    , _queuedBytes(0)
+    , _reading(true)
+    , _highWaterMark(kDefaultHighWaterMark)
+    , _lowWaterMark(kDefaultLowWaterMark)
+    , _aboveHighWaterMark(false)
+    , _shutdownPending(false)
+    , _readPending(false)
+    , _acceptTime(0)
+    , _establishedTime(0)
+    , _lastWriteTime(0)
   {
     _channel->setReadCallback([&] { handleRead(); });
     _channel->setWriteCallback([&] { handleWrite(); });
     _channel->setCloseCallback([&] { handleClose(); });
     _channel->setErrorCallback([&] { handleError(); });
     _socket.setKeepAlive(true);
+    // responses go out in several small writes, don't let Nagle hold them for a delayed ACK
+    _socket.setTcpNoDelay(true);
   }
   ~TcpConnection()
   {
@@ -71,43 +89,86 @@ public:
     _errorCallback = std::move(cb);
   }
 
+  /**
+   * setHighWaterMarkCallback() - called once the write buffer grows to @mark bytes
+   *
+   * It will not be called again until the buffer has drained to the low water mark.
+   */
+  void setHighWaterMarkCallback(TcpCallback cb, size_t mark)
+  {
+    _highWaterMarkCallback = std::move(cb);
+    _highWaterMark = mark;
+  }
+
+  /**
+   * setLowWaterMarkCallback() - called once the write buffer drains to @mark bytes
+   *
+   * Only fires after the high water mark has been crossed.
+   */
+  void setLowWaterMarkCallback(TcpCallback cb, size_t mark)
+  {
+    _lowWaterMarkCallback = std::move(cb);
+    _lowWaterMark = mark;
+  }
+
+  /**
+   * acceptTime() - when the server accepted the connection (LoopMetrics::nowNs())
+   *
+   * 0 for client connections.
+   */
+  uint64_t acceptTime() const
+  {
+    return _acceptTime;
+  }
+
+  /**
+   * establishedTime() - when the connection was set up in its own loop
+   */
+  uint64_t establishedTime() const
+  {
+    return _establishedTime;
+  }
+
+  /**
+   * lastWriteTime() - when bytes were last written to the socket (EventLoop::now())
+   */
+  Time lastWriteTime() const
+  {
+    return _lastWriteTime;
+  }
+
+  /**
+   * writeBufferSize() - what was written but is not sent yet, shared buffers included
+   */
+  size_t writeBufferSize() const
+  {
+    return _writeBuffer.size() + _queuedBytes;
+  }
+
+  /**
+   * tls() - the TLS session of the connection, null for cleartext
+   */
+  const TlsSession* tls() const
+  {
+    return _tls.get();
+  }
+
   int write(const char* data, size_t len)
   {
-    assert(_loop->isInEventLoop());
-    ssize_t written;
-    size_t remaining = len;
-    if (!_channel->hasWriteInterest() && _writeBuffer.empty()) {
-      written = ::write(_channel->fd(), data, len);
-      if (written < 0) {
-        if (errno != EWOULDBLOCK) {
-          char _errbuf[100];
-          zlog_error(_zc, "write: %s", strerror_r(errno, _errbuf, sizeof(_errbuf)));
-          return written;
-        }
-        written = 0;
+    ssize_t written = writeDirect(data, len);
+    if (written < 0)
+      return written;
+    if (static_cast<size_t>(written) < len) {
+      // after a shared buffer, the bytes go to a copy of their own at the end of the queue
+      if (_writeQueue.empty()) {
+        _writeBuffer.append(data + written, len - written);
       } else {
-        remaining -= written;
-        if (remaining == 0) {
-          if (_writeCompleteCallback)
-            _loop->queueInLoop([&] {
-              if (_writeCompleteCallback)
-                _writeCompleteCallback(shared_from_this());
-            });
-          return len;
-        }
-      }
-    }
-
-    if (remaining > 0) {
-      _writeBuffer.append(data + written, remaining);
-      bool close;
-      {
-        std::lock_guard lock(_stateLock);
-        close = (_state == DISCONNECTING || _state == DISCONNECTED);
+        if (_writeQueue.back().shared)
+          _writeQueue.emplace_back(nullptr, 0);
+        _writeQueue.back().copy.append(data + written, len - written);
+        _queuedBytes += len - written;
       }
-      // CHECKME: is it atomic?
-      if (!close && !_channel->hasWriteInterest())
-        _channel->setWriteInterest();
+      pending();
     }
     return len;
   }
@@ -116,12 +177,78 @@ public:
     return write(data.data(), data.size());
   }
 
+  /**
+   * write() - write @buffer, queueing a reference to it rather than a copy of what is unsent
+   *
+   * What is queued is sent with one writev() along with the write buffer, so the same bytes,
+   * e.g. a message broadcast to many connections, are never copied per connection.
+   */
+  int write(SharedBuffer buffer)
+  {
+    ssize_t written = writeDirect(buffer->data(), buffer->size());
+    if (written < 0)
+      return written;
+    size_t len = buffer->size();
+    if (static_cast<size_t>(written) < len) {
+      _writeQueue.emplace_back(std::move(buffer), written);
+      _queuedBytes += len - written;
+      pending();
+    }
+    return len;
+  }
+
   /**
    * shutdown() - shutdown write end of the connection
+   *
+   * Pending data in the write buffer will be sent first.
    */
   void shutdown()
   {
-    _loop->runInLoop([&] { _socket.shutdownWrite(); });
+    _loop->runInLoop([that = shared_from_this()] {
+      if (!that->writeBufferSize())
+        that->shutdownWrite();
+      else
+        that->_shutdownPending = true;
+    });
+  }
+
+  /**
+   * pauseRead() - stop reading from the socket
+   *
+   * Incoming data stays in the kernel, so the peer will be throttled by TCP flow control.
+   */
+  void pauseRead()
+  {
+    _loop->runInLoop([that = shared_from_this()] {
+      if (that->_reading && that->connected()) {
+        that->_reading = false;
+        that->_channel->unsetReadInterest();
+      }
+    });
+  }
+
+  /**
+   * resumeRead() - start reading from the socket again
+   */
+  void resumeRead()
+  {
+    _loop->runInLoop([that = shared_from_this()] {
+      if (!that->_reading && that->connected()) {
+        that->_reading = true;
+        that->_channel->setReadInterest();
+      }
+    });
+  }
+
+  bool isReading() const
+  {
+    return _reading;
+  }
+
+  bool connected()
+  {
+    std::lock_guard lock(_stateLock);
+    return _state == ESTABLISHED;
   }
 
   /**
@@ -135,6 +262,71 @@ public:
     }
   }
 
+  /**
+   * read() - awaitable resuming once bytes arrived since the last read(), see CoTask
+   *
+   * Resumes with the read buffer, to consume what it can of, or with nullptr once the
+   * connection is closed. The message callback is not called for the bytes a task is
+   * waiting for, and the bytes it consumed don't count as arrived. Only one task may read at
+   * once, in the loop of the connection.
+   */
+  auto read()
+  {
+    struct Awaiter
+    {
+      TcpConnection* conn;
+
+      bool await_ready()
+      {
+        return conn->_readPending || !conn->connected();
+      }
+      void await_suspend(std::coroutine_handle<> h)
+      {
+        conn->_readWaiter = h;
+      }
+      StreamBuffer* await_resume()
+      {
+        conn->_readPending = false;
+        return conn->connected() ? &conn->_readBuffer : nullptr;
+      }
+    };
+    assert(_loop->isInEventLoop());
+    return Awaiter{this};
+  }
+
+  /**
+   * writeAll() - awaitable writing @len bytes, resuming once they are all flushed
+   *
+   * Resumes with false if the connection is closed or failed first. Only one task may write
+   * at once, in the loop of the connection.
+   */
+  auto writeAll(const char* data, size_t len)
+  {
+    struct Awaiter
+    {
+      TcpConnection* conn;
+      const char* data;
+      size_t len;
+      bool ok;
+
+      bool await_ready()
+      {
+        ok = conn->write(data, len) >= 0;
+        return !ok || !conn->writeBufferSize() || !conn->connected();
+      }
+      void await_suspend(std::coroutine_handle<> h)
+      {
+        conn->_writeWaiter = h;
+      }
+      bool await_resume()
+      {
+        return ok && conn->connected();
+      }
+    };
+    assert(_loop->isInEventLoop());
+    return Awaiter{this, data, len, false};
+  }
+
   std::any& getUserData()
   {
     return _userData;
@@ -173,13 +365,56 @@ private:
   TcpCallback _closeCallback;
   TcpCallback _writeCompleteCallback;
   TcpCallback _errorCallback;
+  TcpCallback _highWaterMarkCallback;
+  TcpCallback _lowWaterMarkCallback;
+
+  /**
+   * struct Segment - a shared buffer waiting in the write queue, or a copy of what was written
+   *                  after one
+   */
+  struct Segment
+  {
+    SharedBuffer shared;   // null for a copy
+    std::string copy;
+    size_t offset;         // already sent
+
+    Segment(SharedBuffer buffer, size_t sent)
+      : shared(std::move(buffer))
+      , offset(sent)
+    {}
+    const char* data() const
+    {
+      return (shared ? shared->data() : copy.data()) + offset;
+    }
+    size_t size() const
+    {
+      return (shared ? shared->size() : copy.size()) - offset;
+    }
+  };
 
   StreamBuffer _readBuffer;
   StreamBuffer _writeBuffer;
+  std::deque<Segment> _writeQueue;   // sent after _writeBuffer
+  size_t _queuedBytes;               // unsent in _writeQueue
 
   std::any _userData;
 
-  zlog_category_t* _zc;
+  bool _reading;
+  size_t _highWaterMark;
+  size_t _lowWaterMark;
+  bool _aboveHighWaterMark;
+  bool _shutdownPending;
+  bool _readPending;                      // unseen bytes arrived since the last read()
+  std::coroutine_handle<> _readWaiter;    // task in read()
+  std::coroutine_handle<> _writeWaiter;   // task in writeAll()
+  std::unique_ptr<TlsSession> _tls;
+  uint64_t _acceptTime;
+  uint64_t _establishedTime;
+  Time _lastWriteTime;
+
+  static constexpr size_t kDefaultHighWaterMark = 4 * 1024 * 1024;
+  static constexpr size_t kDefaultLowWaterMark = 1024 * 1024;
+  static constexpr int kMaxIovecs = 64;
 
   bool compareExchange(StateE compare, StateE exchange)
   {
@@ -201,6 +436,18 @@ private:
     return false;
   }
 
+  /**
+   * startTls() - speak TLS over the connection, before connectEstablished()
+   *
+   * The handshake starts once established. Until it is done nothing reaches the message
+   * callback, and what is written waits in the write buffer.
+   */
+  void startTls(std::shared_ptr<TlsContext> ctx, const std::string& serverName = "")
+  {
+    _tls.reset(new TlsSession(std::move(ctx), _channel->fd(), serverName,
+                              serverName + "@" + _peerAddr.toIpPort()));
+  }
+
   void connectEstablished()
   {
     assert(_loop->isInEventLoop());
@@ -209,9 +456,14 @@ private:
       assert(_state == CONNECTING);
       _state = ESTABLISHED;
     }
+    _establishedTime = LoopMetrics::nowNs();
+    _lastWriteTime = _loop->now();
     // hold a weak ref to this, in case any callback would close the connection
     _channel->tie(shared_from_this());
     _channel->setReadInterest();
+    // a client speaks first
+    if (_tls)
+      continueHandshake();
   }
 
   /**
@@ -234,7 +486,10 @@ private:
   void handleRead()
   {
     assert(_loop->isInEventLoop());
-    int rv = _readBuffer.readFd(_channel->fd());
+    // application data may come along with the end of the handshake
+    if (_tls && !_tls->established() && !continueHandshake())
+      return;
+    ssize_t rv = _tls ? _tls->read(&_readBuffer) : _readBuffer.readFd(_channel->fd());
     if (rv < 0) {
       if (errno == EAGAIN)
         return;
@@ -243,29 +498,53 @@ private:
       // the peer has nothing more to send us
       // we can safely close the connection
       handleClose();
-    } else if (_messageCallback) {
-      _messageCallback(shared_from_this(), &_readBuffer);
+    } else {
+      _loop->metrics().bytesIn.add(rv);
+      if (_readWaiter) {
+        _readPending = true;
+        std::exchange(_readWaiter, nullptr).resume();
+      } else {
+        if (_messageCallback)
+          _messageCallback(shared_from_this(), &_readBuffer);
+        // what the callback consumed is no news to a later read()
+        _readPending = !_readBuffer.empty();
+      }
     }
   }
 
   void handleWrite()
   {
     assert(_loop->isInEventLoop());
+    if (_tls && !_tls->established()) {
+      continueHandshake();
+      return;
+    }
     if (_channel->hasWriteEvent()) {
-      ssize_t n = ::write(_channel->fd(), _writeBuffer.data(), _writeBuffer.size());
+      ssize_t n = sendPending();
       if (n < 0) {
         if (errno == EAGAIN)
           return;
         handleError();
       } else {
-        _writeBuffer.popFront(n);
-        if (_writeBuffer.empty()) {
+        _loop->metrics().bytesOut.add(n);
+        _lastWriteTime = _loop->now();
+        popPending(n);
+        if (_aboveHighWaterMark && writeBufferSize() <= _lowWaterMark) {
+          _aboveHighWaterMark = false;
+          if (_lowWaterMarkCallback)
+            _lowWaterMarkCallback(shared_from_this());
+        }
+        if (!writeBufferSize()) {
           _channel->unsetWriteInterest();
+          if (_shutdownPending)
+            shutdownWrite();
           if (_writeCompleteCallback)
             _loop->queueInLoop([&] {
               if (_writeCompleteCallback)
                 _writeCompleteCallback(shared_from_this());
             });
+          if (_writeWaiter)
+            std::exchange(_writeWaiter, nullptr).resume();
         }
       }
     }
@@ -289,12 +568,168 @@ private:
     _messageCallback = nullptr;
     _writeCompleteCallback = nullptr;
     _errorCallback = nullptr;
+    _highWaterMarkCallback = nullptr;
+    _lowWaterMarkCallback = nullptr;
     if (_closeCallback) {
       // cannot inline, because we will change _closeCallback afterward
       TcpConnectionPtr conn = shared_from_this();
       _closeCallback(conn);
       _closeCallback = nullptr;
     }
+    // the tasks see the connection closed, once its owner is done with it
+    if (_readWaiter)
+      std::exchange(_readWaiter, nullptr).resume();
+    if (_writeWaiter)
+      std::exchange(_writeWaiter, nullptr).resume();
+  }
+
+  /**
+   * continueHandshake() - false while the TLS handshake goes on, or once it failed
+   */
+  bool continueHandshake()
+  {
+    int rv = _tls->handshake();
+    if (rv < 0) {
+      _loop->metrics().tlsHandshakeFailures.add();
+      handleClose();
+      return false;
+    }
+    if (rv == 0) {
+      if (_tls->wantWrite() != _channel->hasWriteInterest()) {
+        if (_tls->wantWrite())
+          _channel->setWriteInterest();
+        else
+          _channel->unsetWriteInterest();
+      }
+      return false;
+    }
+    _loop->metrics().tlsHandshakes.add();
+    if (_tls->resumed())
+      _loop->metrics().tlsResumed.add();
+    // flush what was written meanwhile
+    if (!writeBufferSize() && _channel->hasWriteInterest())
+      _channel->unsetWriteInterest();
+    else if (writeBufferSize() && !_channel->hasWriteInterest())
+      _channel->setWriteInterest();
+    return true;
+  }
+
+  ssize_t send(const char* data, size_t len)
+  {
+    return _tls ? _tls->write(data, len) : ::write(_channel->fd(), data, len);
+  }
+
+  /**
+   * writeDirect() - send what can be of @data if nothing waits before it
+   *
+   * Returns what was sent, the rest is for the caller to queue, or -1 on an error.
+   */
+  ssize_t writeDirect(const char* data, size_t len)
+  {
+    assert(_loop->isInEventLoop());
+    // what is written during the TLS handshake waits in the buffer
+    bool handshaking = _tls && !_tls->established();
+    if (_channel->hasWriteInterest() || writeBufferSize() || handshaking)
+      return 0;
+    ssize_t written = send(data, len);
+    if (written < 0) {
+      if (errno != EWOULDBLOCK) {
+        char _errbuf[100];
+        alog_error("TcpConnection", "write: %s", strerror_r(errno, _errbuf, sizeof(_errbuf)));
+        return written;
+      }
+      return 0;
+    }
+    _loop->metrics().bytesOut.add(written);
+    _lastWriteTime = _loop->now();
+    if (static_cast<size_t>(written) == len && _writeCompleteCallback)
+      _loop->queueInLoop([&] {
+        if (_writeCompleteCallback)
+          _writeCompleteCallback(shared_from_this());
+      });
+    return written;
+  }
+
+  /**
+   * pending() - bytes were queued, have them sent once the socket is writable
+   */
+  void pending()
+  {
+    if (!_aboveHighWaterMark && writeBufferSize() >= _highWaterMark) {
+      _aboveHighWaterMark = true;
+      if (_highWaterMarkCallback)
+        _loop->queueInLoop([that = shared_from_this()] {
+          if (that->_highWaterMarkCallback)
+            that->_highWaterMarkCallback(that);
+        });
+    }
+    bool close;
+    {
+      std::lock_guard lock(_stateLock);
+      close = (_state == DISCONNECTING || _state == DISCONNECTED);
+    }
+    bool handshaking = _tls && !_tls->established();
+    // CHECKME: is it atomic?
+    if (!close && !_channel->hasWriteInterest() && !handshaking)
+      _channel->setWriteInterest();
+  }
+
+  /**
+   * sendPending() - send the write buffer and what follows in the write queue
+   *
+   * In one writev() for cleartext. TLS has none, it sends them in turn until the socket is full.
+   */
+  ssize_t sendPending()
+  {
+    if (_tls) {
+      ssize_t total = 0, n = 0;
+      auto sendPiece = [&](const char* data, size_t len) {
+        n = send(data, len);
+        if (n > 0)
+          total += n;
+        return n == static_cast<ssize_t>(len);
+      };
+      bool full = !_writeBuffer.empty() && !sendPiece(_writeBuffer.data(), _writeBuffer.size());
+      for (auto it = _writeQueue.begin(); !full && it != _writeQueue.end(); ++it)
+        full = !sendPiece(it->data(), it->size());
+      return total || n >= 0 ? total : n;
+    }
+    if (_writeQueue.empty())
+      return send(_writeBuffer.data(), _writeBuffer.size());
+    struct iovec vec[kMaxIovecs];
+    int n = 0;
+    if (!_writeBuffer.empty())
+      vec[n++] = {const_cast<char*>(_writeBuffer.data()), _writeBuffer.size()};
+    for (auto it = _writeQueue.begin(); it != _writeQueue.end() && n < kMaxIovecs; ++it)
+      vec[n++] = {const_cast<char*>(it->data()), it->size()};
+    return ::writev(_channel->fd(), vec, n);
+  }
+
+  /**
+   * popPending() - @n bytes of the write buffer and then of the write queue were sent
+   */
+  void popPending(size_t n)
+  {
+    size_t buffered = std::min(n, _writeBuffer.size());
+    if (buffered)
+      _writeBuffer.popFront(buffered);
+    n -= buffered;
+    while (n) {
+      Segment& segment = _writeQueue.front();
+      size_t len = std::min(n, segment.size());
+      segment.offset += len;
+      _queuedBytes -= len;
+      n -= len;
+      if (!segment.size())
+        _writeQueue.pop_front();
+    }
+  }
+
+  void shutdownWrite()
+  {
+    if (_tls)
+      _tls->shutdown();
+    _socket.shutdownWrite();
   }
 
   void handleError()
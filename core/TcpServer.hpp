@@ -1,10 +1,13 @@
 #ifndef __TCPSERVER_HPP__
 #define __TCPSERVER_HPP__
 
+#include <errno.h>
 #include <signal.h>
+#include <sys/socket.h>
+#include <algorithm>
 #include <iostream>
 #include <unordered_map>
-#include <zlog.h>
+#include "Logger.hpp"
 #include "Socket.hpp"
 #include "Acceptor.hpp"
 #include "EventLoop.hpp"
@@ -12,6 +15,105 @@
 #include "EventLoopThreadPool.hpp"
 #include "TcpConnection.hpp"
 
+/**
+ * class LingeringClose - close a turned away socket once the peer has seen what was sent
+ *
+ * Closing a socket with unread input resets the connection, and a client that sent its request
+ * already would mostly get the reset rather than the response. So the write side is shut down
+ * and the input thrown away until the peer closes or kTimeout passes, then the socket is
+ * closed, like lingering_close of nginx. At most kMaxPerLoop sockets linger in a loop, the
+ * others are drained once and closed.
+ */
+class LingeringClose : noncopyable
+{
+public:
+  static constexpr double kTimeout = 1.0;   // seconds
+  static constexpr int kMaxPerLoop = 1024;
+
+  /**
+   * start() - shut down the write side of @sockfd, accepted in @loop, and close it later
+   */
+  static void start(EventLoop* loop, int sockfd)
+  {
+    assert(loop->isInEventLoop());
+    ::shutdown(sockfd, SHUT_WR);
+    if (drain(sockfd) || lingering() >= kMaxPerLoop) {
+      ::close(sockfd);
+      return;
+    }
+    // deletes itself once closed
+    new LingeringClose(loop, sockfd);
+  }
+
+private:
+  static constexpr int kReadsPerEvent = 16;
+
+  EventLoop* _loop;
+  Channel _channel;
+  TimerId _timer;
+  bool _closed;
+
+  LingeringClose(EventLoop* loop, int sockfd)
+    : _loop(loop)
+    , _channel(loop, sockfd)
+    , _timer(0)
+    , _closed(false)
+  {
+    lingering()++;
+    _channel.setReadCallback([this] {
+      if (drain(_channel.fd()))
+        finish();
+    });
+    _channel.setCloseCallback([this] { finish(); });
+    _channel.setErrorCallback([this] { finish(); });
+    _channel.setReadInterest();
+    _timer = loop->runAfter(kTimeout, [this] {
+      _timer = 0;
+      finish();
+    });
+  }
+  ~LingeringClose() {}
+
+  void finish()
+  {
+    if (_closed)
+      return;
+    _closed = true;
+    if (_timer)
+      _loop->cancel(_timer);
+    _channel.unsetAllInterest();
+    _channel.remove();
+    ::close(_channel.fd());
+    lingering()--;
+    // the channel may be handling the event that ended it
+    _loop->queueInLoop([this] { delete this; });
+  }
+
+  /**
+   * drain() - throw away the input of @sockfd, true once the peer closed or the socket failed
+   */
+  static bool drain(int sockfd)
+  {
+    char buf[4096];
+    for (int i = 0; i < kReadsPerEvent; i++) {
+      ssize_t n = ::recv(sockfd, buf, sizeof(buf), 0);
+      if (n > 0)
+        continue;
+      if (n < 0 && errno == EINTR)
+        continue;
+      return n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+    // a busy peer, the loop reads on at the next event
+    return false;
+  }
+
+  static int& lingering()
+  {
+    static thread_local int count = 0;
+    return count;
+  }
+};
+
 class TcpServer
 {
 public:
@@ -19,10 +121,18 @@ public:
             const ThreadInitCallback& init = nullptr)
     : _baseLoop(baseLoop)
     , _addr(listenAddr)
+    , _reusePort(reusePort)
     , _acceptor(new Acceptor(baseLoop, listenAddr, reusePort))
-    , _zc(zlog_get_category("TcpServer"))
     , _pool(baseLoop, threadCount, init)
+    , _slots(new LoopSlot[_pool.getLoops().size()])
+    , _nextSlot(0)
+    , _liveConnections(0)
+    , _maxConnections(0)
+    , _maxConnectionsPerLoop(0)
+    , _listenerPerLoop(false)
   {
+    for (size_t i = 0; i < _pool.getLoops().size(); i++)
+      _slots[i].loop = _pool.getLoops()[i];
     // Ignore SIGPIPE
     static auto _ = signal(SIGPIPE, SIG_IGN);
 
@@ -37,6 +147,10 @@ public:
       _conn.reset();
       conn->getLoop()->runInLoop([conn] { conn->connectDestroyed(); });
     }
+    // a listener is torn down in its own loop
+    for (size_t i = 0; i < _pool.getLoops().size(); i++)
+      if (_slots[i].acceptor)
+        _slots[i].loop->runInLoop([acceptor = std::move(_slots[i].acceptor)] {});
   }
 
   EventLoop* getBaseLoop() const
@@ -44,11 +158,21 @@ public:
     return _baseLoop;
   }
 
+  const std::vector<EventLoop*>& getIoLoops() const
+  {
+    return _pool.getLoops();
+  }
+
   void start()
   {
     // make acceptor start listening
-    zlog_info(_zc, "listening on %s", _addr.toIpPort().c_str());
-    _baseLoop->runInLoop([&] { _acceptor->listen(); });
+    alog_info("TcpServer", "listening on %s", _addr.toIpPort().c_str());
+    if (_listenerPerLoop && !_reusePort)
+      alog_error("TcpServer", "a listener per loop needs SO_REUSEPORT, accepting in the base loop");
+    if (_listenerPerLoop && _reusePort)
+      startListeners();
+    else
+      _acceptor->listen();
   }
 
   void setConnectCallback(TcpCallback cb)
@@ -72,12 +196,97 @@ public:
     _userErrorCallback = std::move(cb);
   }
 
+  /**
+   * setConnectionLimits() - cap the connections served at once, 0 for no limit
+   * @total: connections of the whole server
+   * @perLoop: connections of one io loop, a full loop is skipped by the round robin
+   *
+   * Once full, the server stops accepting until a connection closes, new connections wait in
+   * the listen backlog. See setOverloadResponse() to turn them away instead.
+   */
+  void setConnectionLimits(size_t total, size_t perLoop)
+  {
+    _maxConnections = total;
+    _maxConnectionsPerLoop = perLoop;
+  }
+
+  /**
+   * setOverloadResponse() - keep accepting when full, write @response to the excess and close
+   *
+   * @response is sent as is with a single write, e.g. a prebuilt HTTP 503. Empty to stop
+   * accepting instead, the default.
+   */
+  void setOverloadResponse(std::string response)
+  {
+    _overloadResponse = std::move(response);
+  }
+
+  /**
+   * setCpuAffinity() - pin the io loops to @cpus, round robin, before start()
+   *
+   * The connections are then created in their io loop, so that they and their buffers are
+   * allocated on the NUMA node of its cpu.
+   */
+  void setCpuAffinity(const std::vector<int>& cpus)
+  {
+    _cpus = cpus;
+    _pool.setCpuAffinity(cpus);
+  }
+
+  /**
+   * setTls() - serve TLS with @ctx on every connection, before start()
+   */
+  void setTls(std::shared_ptr<TlsContext> ctx)
+  {
+    assert(ctx->mode() == TlsContext::SERVER);
+    _tls = std::move(ctx);
+  }
+
+  /**
+   * setListenerPerLoop() - accept in every io loop on its own socket, before start()
+   *
+   * The sockets form a SO_REUSEPORT group, so the server must be created with reusePort. The
+   * kernel spreads the connections over the loops, and the base loop is not involved at all.
+   * If the loops are pinned to distinct cpus, a connection goes to the loop on the cpu that
+   * received it (SO_INCOMING_CPU), which keeps it on the cpu handling its packets.
+   *
+   * The connection limits hold for each loop, the total may be exceeded by one connection
+   * per loop.
+   */
+  void setListenerPerLoop(bool on)
+  {
+    _listenerPerLoop = on;
+  }
+
 private:
+  /**
+   * struct LoopSlot - an io loop and the connections it serves
+   *
+   * Counted up in the loop accepting, down in the io loop.
+   */
+  struct LoopSlot
+  {
+    EventLoop* loop = nullptr;
+    std::atomic<size_t> connections{0};
+    std::shared_ptr<Acceptor> acceptor;   // with a listener per loop
+    std::atomic<bool> paused{false};      // acceptor paused by the limits
+  };
+
   EventLoop* _baseLoop;
   InetAddress _addr;
+  bool _reusePort;
   std::unique_ptr<Acceptor> _acceptor;
   EventLoopThreadPool _pool;
   std::unordered_map<int, TcpConnectionPtr> _connections;
+  std::unique_ptr<LoopSlot[]> _slots;
+  size_t _nextSlot;
+  std::atomic<size_t> _liveConnections;
+  size_t _maxConnections;
+  size_t _maxConnectionsPerLoop;
+  std::string _overloadResponse;
+  std::vector<int> _cpus;
+  bool _listenerPerLoop;
+  std::shared_ptr<TlsContext> _tls;
 
   // default callbacks for created connections
   TcpCallback _userConnectCallback;
@@ -86,24 +295,101 @@ private:
   TcpCallback _userCloseCallback;
   TcpCallback _userErrorCallback;
 
-  zlog_category_t* _zc;
-
   void handleNewConnection(int sockfd, const InetAddress& peerAddr)
   {
     assert(_baseLoop->isInEventLoop());
-    EventLoop* ioLoop = _pool.getNextLoop();
-    auto conn = std::make_shared<TcpConnection>(ioLoop, sockfd, peerAddr);
-    _connections.insert({sockfd, conn});
+    _baseLoop->metrics().connectionsAccepted.add();
+    LoopSlot* slot = nextSlot();
+    if (!slot) {
+      reject(_baseLoop, sockfd);
+      return;
+    }
+    slot->connections++;
+    _liveConnections++;
+    if (_overloadResponse.empty() && !hasRoom()) {
+      _acceptor->pause();
+      _baseLoop->metrics().acceptPauses.add();
+    }
+
+    // the connection is created in its io loop, to be allocated on the node of that loop
+    slot->loop->queueInLoop([this, slot, sockfd, peerAddr, acceptTime = LoopMetrics::nowNs()] {
+      establish(slot, sockfd, peerAddr, acceptTime);
+    });
+  }
+
+  /**
+   * handleLoopConnection() - new connection callback of the listener of @slot
+   */
+  void handleLoopConnection(LoopSlot* slot, int sockfd, const InetAddress& peerAddr)
+  {
+    EventLoop* loop = slot->loop;
+    assert(loop->isInEventLoop());
+    loop->metrics().connectionsAccepted.add();
+    if (!hasRoom(slot)) {
+      // the other loops took the last room of the server
+      reject(loop, sockfd);
+      if (_overloadResponse.empty())
+        pauseListener(slot);
+      return;
+    }
+    slot->connections++;
+    _liveConnections++;
+    if (_overloadResponse.empty() && !hasRoom(slot))
+      pauseListener(slot);
+    establish(slot, sockfd, peerAddr, LoopMetrics::nowNs());
+  }
+
+  /**
+   * establish() - set up a connection in the io loop of @slot
+   */
+  void establish(LoopSlot* slot, int sockfd, const InetAddress& peerAddr, uint64_t acceptTime)
+  {
+    assert(slot->loop->isInEventLoop());
+    auto conn = std::make_shared<TcpConnection>(slot->loop, sockfd, peerAddr);
+    conn->_acceptTime = acceptTime;
     conn->setMessageCallback(_userMessageCallback);
     conn->setWriteCompleteCallback(_userWriteCompleteCallback);
-    conn->setCloseCallback([&](const TcpConnectionPtr& conn) { handleClose(conn); });
+    conn->setCloseCallback(
+      [this, slot](const TcpConnectionPtr& conn) { handleClose(conn, slot); });
     conn->setErrorCallback(_userErrorCallback);
-    // we are in the base loop, so we cannot call connectEstablished directly
-    ioLoop->queueInLoop([&, conn] {
-      conn->connectEstablished();
-      if (_userConnectCallback)
-        _userConnectCallback(conn);
-    });
+    if (_tls)
+      conn->startTls(_tls);
+    // queued before the connection can close and queue its erase
+    _baseLoop->queueInLoop([this, conn] { _connections.insert({conn->fd(), conn}); });
+    conn->connectEstablished();
+    if (_userConnectCallback)
+      _userConnectCallback(conn);
+  }
+
+  /**
+   * startListeners() - listen on a socket in every io loop, in the order of the loops
+   */
+  void startListeners()
+  {
+    size_t n = _pool.getLoops().size();
+    std::vector<int> cpus;
+    for (size_t i = 0; i < n; i++) {
+      LoopSlot* slot = &_slots[i];
+      slot->acceptor = std::make_shared<Acceptor>(slot->loop, _addr, true);
+      slot->acceptor->setNewConnectionCallback(
+        [this, slot](int sockfd, const InetAddress& peerAddr) {
+          handleLoopConnection(slot, sockfd, peerAddr);
+        });
+      if (!_cpus.empty()) {
+        cpus.push_back(_cpus[i % _cpus.size()]);
+        slot->acceptor->setIncomingCpu(cpus.back());
+      }
+    }
+    for (size_t i = 0; i < n; i++)
+      _slots[i].acceptor->listen();
+
+    // steer by cpu only if every loop has a cpu of its own, the kernel hashes otherwise
+    std::vector<int> sorted(cpus);
+    std::sort(sorted.begin(), sorted.end());
+    if (cpus.size() == n && n > 1 &&
+        std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end() &&
+        !_slots[0].acceptor->setReusePortCpus(cpus))
+      alog_error("TcpServer", "failed to attach the reuseport program: %s", strerror(errno));
   }
 
   /**
@@ -111,10 +397,19 @@ private:
    *
    * Do the cleanup work for TcpServer.
    */
-  void handleClose(const TcpConnectionPtr& conn)
+  void handleClose(const TcpConnectionPtr& conn, LoopSlot* slot)
   {
     // We are in the io loop now
-    _baseLoop->queueInLoop([&, fd = conn->fd()] { _connections.erase(fd); });
+    conn->getLoop()->metrics().connectionsClosed.add();
+    slot->connections--;
+    _liveConnections--;
+    _baseLoop->queueInLoop([&, fd = conn->fd()] {
+      _connections.erase(fd);
+      if (_acceptor->paused() && hasRoom())
+        _acceptor->resume();
+    });
+    if (slot->acceptor)
+      resumeListeners();
 
     // Keep a ref to conn, so that it won't be destroyed before _userCloseCallback()
     conn->getLoop()->queueInLoop([&, conn] {
@@ -123,6 +418,94 @@ private:
         _userCloseCallback(conn);
     });
   }
+
+  /**
+   * nextSlot() - the next io loop in round robin with room for a connection, if any
+   */
+  LoopSlot* nextSlot()
+  {
+    size_t n = _pool.getLoops().size();
+    if (_maxConnections && _liveConnections >= _maxConnections)
+      return nullptr;
+    for (size_t i = 0; i < n; i++) {
+      LoopSlot* slot = &_slots[_nextSlot];
+      _nextSlot = (_nextSlot + 1) % n;
+      if (!_maxConnectionsPerLoop || slot->connections < _maxConnectionsPerLoop)
+        return slot;
+    }
+    return nullptr;
+  }
+
+  bool hasRoom() const
+  {
+    if (_maxConnections && _liveConnections >= _maxConnections)
+      return false;
+    if (!_maxConnectionsPerLoop)
+      return true;
+    for (size_t i = 0; i < _pool.getLoops().size(); i++)
+      if (_slots[i].connections < _maxConnectionsPerLoop)
+        return true;
+    return false;
+  }
+
+  bool hasRoom(const LoopSlot* slot) const
+  {
+    if (_maxConnections && _liveConnections >= _maxConnections)
+      return false;
+    return !_maxConnectionsPerLoop || slot->connections < _maxConnectionsPerLoop;
+  }
+
+  /**
+   * pauseListener() - stop accepting in the loop of @slot until a connection closes
+   */
+  void pauseListener(LoopSlot* slot)
+  {
+    slot->acceptor->pause();
+    slot->paused = true;
+    slot->loop->metrics().acceptPauses.add();
+    // a connection closing meanwhile in another loop may have missed the pause
+    if (hasRoom(slot)) {
+      slot->paused = false;
+      slot->acceptor->resume();
+    }
+  }
+
+  /**
+   * resumeListeners() - after a close, resume the paused listeners that have room again
+   *
+   * A full loop only gets room by a close of its own, a full server by any close.
+   */
+  void resumeListeners()
+  {
+    for (size_t i = 0; i < _pool.getLoops().size(); i++) {
+      LoopSlot* slot = &_slots[i];
+      if (!slot->paused || !hasRoom(slot))
+        continue;
+      slot->loop->runInLoop([this, slot] {
+        if (slot->paused && hasRoom(slot)) {
+          slot->paused = false;
+          slot->acceptor->resume();
+        }
+      });
+    }
+  }
+
+  /**
+   * reject() - turn away a connection over the limits, accepted in @loop
+   */
+  void reject(EventLoop* loop, int sockfd)
+  {
+    loop->metrics().connectionsRejected.add();
+    if (_overloadResponse.empty()) {
+      ::close(sockfd);
+      return;
+    }
+    // a fresh socket has room for a short response, don't bother with what is left
+    ssize_t n = ::write(sockfd, _overloadResponse.data(), _overloadResponse.size());
+    (void)n;
+    // the request may be waiting unread, closing now would reset the connection
+    LingeringClose::start(loop, sockfd);
+  }
 };
 
 #endif
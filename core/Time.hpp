@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
 
 class Time
 {
@@ -12,11 +13,26 @@ public:
   {}
   ~Time() {}
 
+  /**
+   * now() - monotonic time, for timers and durations
+   *
+   * In a loop thread, EventLoop::now() is cheaper and usually precise enough.
+   */
   static Time now()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return Time(static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+  }
+
+  /**
+   * wallNow() - wall clock time since the epoch, may jump
+   */
+  static Time wallNow()
   {
     struct timeval tv;
     gettimeofday(&tv, nullptr);
-    return Time(tv.tv_sec * 1000000 + tv.tv_usec);
+    return Time(static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec);
   }
 
   Time operator+(const Time& t) const
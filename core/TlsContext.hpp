@@ -0,0 +1,410 @@
+#ifndef __TLSCONTEXT_HPP__
+#define __TLSCONTEXT_HPP__
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Utils.hpp"
+#include "Logger.hpp"
+#include "StreamBuffer.hpp"
+
+/**
+ * class TlsContext - the OpenSSL setup shared by the TLS connections of a server or a client
+ *
+ * One context serves every loop, OpenSSL locks what it shares. Connections are offered kernel
+ * TLS (SSL_OP_ENABLE_KTLS): once the handshake is done OpenSSL sets the "tls" ULP on the
+ * socket and hands the keys to the kernel, if the kernel and the cipher allow it. The records
+ * are then encrypted by the kernel, so plain write() and sendfile() on the socket stay zero
+ * copy. Otherwise OpenSSL encrypts in user space.
+ *
+ * A server resumes sessions with tickets. Setting the ticket key lets the processes behind
+ * one address (or a restarted one) resume each other's sessions; without it every context
+ * makes a random key of its own. A client keeps the last session of each peer, to resume it
+ * on the next connection.
+ */
+class TlsContext : noncopyable
+{
+public:
+  enum Mode
+  {
+    SERVER,
+    CLIENT,
+  };
+
+  static constexpr size_t kTicketKeySize = 80;   // name, HMAC secret, AES key
+
+  explicit TlsContext(Mode mode)
+    : _mode(mode)
+    , _ctx(SSL_CTX_new(mode == SERVER ? TLS_server_method() : TLS_client_method()))
+  {
+    assert(_ctx);
+    SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                              SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // SSL_write() behaves like write(): partial writes, retried from a moved buffer
+    SSL_CTX_set_mode(_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                             SSL_MODE_RELEASE_BUFFERS);
+    if (mode == CLIENT) {
+      SSL_CTX_set_verify(_ctx, SSL_VERIFY_PEER, nullptr);
+      SSL_CTX_set_default_verify_paths(_ctx);
+      SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL);
+    }
+  }
+  ~TlsContext()
+  {
+    for (auto& [key, session] : _sessions)
+      SSL_SESSION_free(session);
+    SSL_CTX_free(_ctx);
+  }
+
+  Mode mode() const
+  {
+    return _mode;
+  }
+
+  /**
+   * loadCertificate() - the certificate chain and private key of a server, in PEM files
+   */
+  bool loadCertificate(const std::string& certFile, const std::string& keyFile)
+  {
+    if (SSL_CTX_use_certificate_chain_file(_ctx, certFile.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(_ctx, keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(_ctx) != 1) {
+      alog_error("TlsContext", "loading %s: %s", certFile.c_str(), errorString().c_str());
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * loadVerifyLocations() - trust the CAs of @caFile, e.g. a self-signed certificate
+   */
+  bool loadVerifyLocations(const std::string& caFile)
+  {
+    if (SSL_CTX_load_verify_locations(_ctx, caFile.c_str(), nullptr) != 1) {
+      alog_error("TlsContext", "loading %s: %s", caFile.c_str(), errorString().c_str());
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * setVerifyPeer() - whether a client checks the certificate of the server, the default
+   */
+  void setVerifyPeer(bool verify)
+  {
+    SSL_CTX_set_verify(_ctx, verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, nullptr);
+  }
+
+  /**
+   * setTicketKey() - the kTicketKeySize bytes of key shared by the servers, e.g. from
+   *                  openssl rand 80
+   */
+  bool setTicketKey(const std::string& key)
+  {
+    if (key.size() != kTicketKeySize ||
+        SSL_CTX_set_tlsext_ticket_keys(_ctx, const_cast<char*>(key.data()), key.size()) != 1) {
+      alog_error("TlsContext", "bad ticket key of %zu bytes", key.size());
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * setAlpnProtocols() - the protocols to negotiate, most preferred first, e.g. "h2"
+   *
+   * A server picks the first of its own the client offers, and goes on without ALPN if there
+   * is none. A client offers them all.
+   */
+  void setAlpnProtocols(const std::vector<std::string>& protocols)
+  {
+    _alpn.clear();
+    for (const auto& p : protocols) {
+      assert(!p.empty() && p.size() < 256);
+      _alpn.push_back(static_cast<char>(p.size()));
+      _alpn.append(p);
+    }
+    const unsigned char* wire = reinterpret_cast<const unsigned char*>(_alpn.data());
+    if (_mode == CLIENT)
+      SSL_CTX_set_alpn_protos(_ctx, wire, _alpn.size());
+    else
+      SSL_CTX_set_alpn_select_cb(_ctx, selectAlpn, this);
+  }
+
+  bool loadTicketKey(const std::string& path)
+  {
+    std::ifstream in(path, std::ios::binary);
+    std::string key{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return setTicketKey(key);
+  }
+
+  SSL_CTX* nativeHandle() const
+  {
+    return _ctx;
+  }
+
+  static std::string errorString()
+  {
+    char buf[256];
+    unsigned long err = ERR_get_error();
+    ERR_clear_error();
+    if (!err)
+      return strerror(errno);
+    ERR_error_string_n(err, buf, sizeof(buf));
+    return buf;
+  }
+
+private:
+  friend class TlsSession;
+
+  Mode _mode;
+  SSL_CTX* _ctx;
+  std::string _alpn;   // in wire format, lengths first
+  std::mutex _sessionMutex;   // guards _sessions
+  std::unordered_map<std::string, SSL_SESSION*> _sessions;   // of a client, by peer
+
+  static int selectAlpn(SSL*, const unsigned char** out, unsigned char* outLen,
+                        const unsigned char* in, unsigned int inLen, void* arg)
+  {
+    TlsContext* self = static_cast<TlsContext*>(arg);
+    unsigned char* selected;
+    int rv = SSL_select_next_proto(&selected, outLen,
+                                   reinterpret_cast<const unsigned char*>(self->_alpn.data()),
+                                   self->_alpn.size(), in, inLen);
+    if (rv != OPENSSL_NPN_NEGOTIATED)
+      return SSL_TLSEXT_ERR_NOACK;
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+  }
+
+  SSL_SESSION* takeSession(const std::string& peer)
+  {
+    std::lock_guard lock(_sessionMutex);
+    auto it = _sessions.find(peer);
+    if (it == _sessions.end())
+      return nullptr;
+    SSL_SESSION* session = it->second;
+    // a session ticket is only to be used once
+    _sessions.erase(it);
+    return session;
+  }
+
+  void saveSession(const std::string& peer, SSL_SESSION* session)
+  {
+    std::lock_guard lock(_sessionMutex);
+    SSL_SESSION*& slot = _sessions[peer];
+    if (slot)
+      SSL_SESSION_free(slot);
+    slot = session;
+  }
+};
+
+/**
+ * class TlsSession - the TLS state of one connection, driven by its TcpConnection
+ *
+ * Works on the nonblocking socket: the calls return -1 with EAGAIN when the socket is not
+ * ready, as read() and write() do.
+ */
+class TlsSession : noncopyable
+{
+public:
+  /**
+   * TlsSession() - TLS on @fd, as a server or a client depending on @ctx
+   * @serverName: of a client, sent as SNI and checked against the certificate if not empty
+   * @peer: of a client, keys the session kept to resume
+   */
+  TlsSession(std::shared_ptr<TlsContext> ctx, int fd, const std::string& serverName,
+             const std::string& peer)
+    : _ctx(std::move(ctx))
+    , _ssl(SSL_new(_ctx->_ctx))
+    , _fd(fd)
+    , _peer(peer)
+    , _established(false)
+    , _wantWrite(false)
+    , _ktlsSend(false)
+  {
+    SSL_set_fd(_ssl, fd);
+    if (_ctx->mode() == TlsContext::SERVER) {
+      SSL_set_accept_state(_ssl);
+      return;
+    }
+    SSL_set_connect_state(_ssl);
+    // an address is no SNI, it is checked against the IP names of the certificate
+    unsigned char ip[sizeof(struct in6_addr)];
+    if (inet_pton(AF_INET, serverName.c_str(), ip) == 1 ||
+        inet_pton(AF_INET6, serverName.c_str(), ip) == 1) {
+      X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(_ssl), serverName.c_str());
+    } else if (!serverName.empty()) {
+      SSL_set_tlsext_host_name(_ssl, serverName.c_str());
+      SSL_set1_host(_ssl, serverName.c_str());
+    }
+    if (SSL_SESSION* session = _ctx->takeSession(_peer)) {
+      SSL_set_session(_ssl, session);
+      SSL_SESSION_free(session);
+    }
+  }
+  ~TlsSession()
+  {
+    // a TLS 1.3 ticket comes after the handshake, so the session is kept at the end
+    if (_ctx->mode() == TlsContext::CLIENT && _established) {
+      SSL_SESSION* session = SSL_get1_session(_ssl);
+      if (session && SSL_SESSION_is_resumable(session))
+        _ctx->saveSession(_peer, session);
+      else if (session)
+        SSL_SESSION_free(session);
+    }
+    SSL_free(_ssl);
+  }
+
+  bool established() const
+  {
+    return _established;
+  }
+
+  /**
+   * wantWrite() - the handshake waits for the socket to be writable rather than readable
+   */
+  bool wantWrite() const
+  {
+    return _wantWrite;
+  }
+
+  bool resumed() const
+  {
+    return SSL_session_reused(_ssl);
+  }
+
+  /**
+   * alpnProtocol() - the protocol agreed on by ALPN, empty if none
+   */
+  std::string alpnProtocol() const
+  {
+    const unsigned char* p;
+    unsigned int len;
+    SSL_get0_alpn_selected(_ssl, &p, &len);
+    return p ? std::string(reinterpret_cast<const char*>(p), len) : std::string();
+  }
+
+  /**
+   * ktlsSend() - the kernel encrypts what is written to the socket
+   */
+  bool ktlsSend() const
+  {
+    return _ktlsSend;
+  }
+
+  bool ktlsRecv() const
+  {
+    return BIO_get_ktls_recv(SSL_get_rbio(_ssl));
+  }
+
+  /**
+   * handshake() - go on with the handshake, 1 once done, 0 to wait for the socket, -1 if failed
+   */
+  int handshake()
+  {
+    int rv = SSL_do_handshake(_ssl);
+    if (rv == 1) {
+      _established = true;
+      _wantWrite = false;
+      _ktlsSend = BIO_get_ktls_send(SSL_get_wbio(_ssl));
+      return 1;
+    }
+    int err = SSL_get_error(_ssl, rv);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+      _wantWrite = (err == SSL_ERROR_WANT_WRITE);
+      return 0;
+    }
+    alog_debug("TlsSession", "handshake failed: %s", TlsContext::errorString().c_str());
+    return -1;
+  }
+
+  /**
+   * read() - decrypt what the socket has into @buf
+   *
+   * Returns the bytes read, 0 at the end of the stream, -1 with errno set otherwise.
+   */
+  ssize_t read(StreamBuffer* buf)
+  {
+    char chunk[16384];
+    ssize_t total = 0;
+    for (;;) {
+      size_t n = 0;
+      int rv = SSL_read_ex(_ssl, chunk, sizeof(chunk), &n);
+      if (rv == 1) {
+        buf->append(chunk, n);
+        total += n;
+        continue;
+      }
+      int err = SSL_get_error(_ssl, rv);
+      if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        if (total)
+          return total;
+        errno = EAGAIN;
+        return -1;
+      }
+      if (total)
+        return total;
+      if (err == SSL_ERROR_ZERO_RETURN) {
+        // answer the close_notify, or the session would not be resumed
+        SSL_shutdown(_ssl);
+        ERR_clear_error();
+        return 0;
+      }
+      if (err != SSL_ERROR_SYSCALL)
+        errno = EIO;
+      ERR_clear_error();
+      return -1;
+    }
+  }
+
+  /**
+   * write() - encrypt and send @len bytes, the bytes sent or -1 with errno set
+   */
+  ssize_t write(const char* data, size_t len)
+  {
+    if (_ktlsSend)
+      return ::write(_fd, data, len);
+    size_t n = 0;
+    int rv = SSL_write_ex(_ssl, data, len, &n);
+    if (rv == 1)
+      return n;
+    int err = SSL_get_error(_ssl, rv);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+      errno = EAGAIN;
+    else if (err != SSL_ERROR_SYSCALL)
+      errno = EIO;
+    ERR_clear_error();
+    return -1;
+  }
+
+  /**
+   * shutdown() - send close_notify, before the write end of the socket is shut down
+   */
+  void shutdown()
+  {
+    if (_established)
+      SSL_shutdown(_ssl);
+    ERR_clear_error();
+  }
+
+private:
+  std::shared_ptr<TlsContext> _ctx;
+  SSL* _ssl;
+  int _fd;
+  std::string _peer;
+  bool _established;
+  bool _wantWrite;
+  bool _ktlsSend;
+};
+
+#endif
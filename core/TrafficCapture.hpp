@@ -0,0 +1,265 @@
+#ifndef __TRAFFICCAPTURE_HPP__
+#define __TRAFFICCAPTURE_HPP__
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Utils.hpp"
+#include "Metrics.hpp"
+
+/**
+ * class TrafficCapture - record the bytes received on a sample of the connections
+ *
+ * The file starts with an 8 byte magic, followed by records of LEB128 varints:
+ *
+ *   record := type conn time [len bytes]
+ *
+ * @time is in ns since the capture started, only DATA records carry bytes. Connections are
+ * sampled when opened. Once the byte rate limit is hit, the connection is marked TRUNCATED
+ * and not recorded any further, so a capture never holds half a request stream silently.
+ *
+ * Only sampled connections take the lock; the file is written by a background thread.
+ */
+class TrafficCapture : noncopyable
+{
+public:
+  static constexpr char kMagic[8] = {'R', 'P', 'X', 'C', 'A', 'P', '1', '\n'};
+  static constexpr size_t kMaxBuffered = 16 << 20;
+  static constexpr int kFlushIntervalMs = 100;
+
+  enum RecordType
+  {
+    OPEN = 1,
+    DATA,
+    CLOSE,
+    TRUNCATED,
+  };
+
+  struct Record
+  {
+    int type;
+    uint64_t conn;
+    uint64_t time;
+    std::string data;
+  };
+
+  TrafficCapture()
+    : _running(false)
+    , _fd(-1)
+    , _sampleRate(1)
+    , _bytesPerSec(0)
+    , _tokens(0)
+    , _lastRefill(0)
+    , _start(0)
+    , _nextId(1)
+    , _truncated(0)
+  {}
+  ~TrafficCapture()
+  {
+    stop();
+  }
+
+  /**
+   * start() - capture a @sampleRate fraction of the connections into @path
+   * @bytesPerSec: limit of the bytes recorded per second, 0 for no limit
+   */
+  bool start(const char* path, double sampleRate, size_t bytesPerSec)
+  {
+    _fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd < 0)
+      return false;
+    _sampleRate = sampleRate;
+    _bytesPerSec = bytesPerSec;
+    _start = LoopMetrics::nowNs();
+    _lastRefill = _start;
+    _tokens = bytesPerSec;
+    _buffer.assign(kMagic, sizeof(kMagic));
+    _running.store(true, std::memory_order_release);
+    _flusher = std::thread([this] {
+      while (_running.load(std::memory_order_acquire)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(kFlushIntervalMs));
+        flush();
+      }
+    });
+    return true;
+  }
+
+  void stop()
+  {
+    if (!_running.exchange(false))
+      return;
+    _flusher.join();
+    flush();
+    ::close(_fd);
+    _fd = -1;
+  }
+
+  /**
+   * open() - a connection is set up, returns its id or 0 if it is not sampled
+   */
+  uint64_t open()
+  {
+    static thread_local std::minstd_rand rng(std::random_device{}());
+    if (!_running.load(std::memory_order_relaxed))
+      return 0;
+    if (_sampleRate < 1 && std::uniform_real_distribution<double>()(rng) >= _sampleRate)
+      return 0;
+    uint64_t id = _nextId.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard lock(_mutex);
+    append(OPEN, id, nullptr, 0);
+    return id;
+  }
+
+  /**
+   * data() - @len bytes received on connection @id
+   *
+   * Returns false once the connection is truncated, the caller stops recording it.
+   */
+  bool data(uint64_t id, const char* data, size_t len)
+  {
+    std::lock_guard lock(_mutex);
+    if (!take(len) || _buffer.size() + len > kMaxBuffered) {
+      append(TRUNCATED, id, nullptr, 0);
+      _truncated++;
+      return false;
+    }
+    append(DATA, id, data, len);
+    return true;
+  }
+
+  void close(uint64_t id)
+  {
+    std::lock_guard lock(_mutex);
+    append(CLOSE, id, nullptr, 0);
+  }
+
+  /**
+   * truncated() - connections cut short by the rate limit so far
+   */
+  uint64_t truncated()
+  {
+    std::lock_guard lock(_mutex);
+    return _truncated;
+  }
+
+  /**
+   * load() - read all the records of a capture file
+   */
+  static bool load(const char* path, std::vector<Record>& records)
+  {
+    std::string file;
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+    char buf[65536];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+      file.append(buf, n);
+    ::close(fd);
+    if (file.size() < sizeof(kMagic) || memcmp(file.data(), kMagic, sizeof(kMagic)) != 0)
+      return false;
+
+    const char* p = file.data() + sizeof(kMagic);
+    const char* end = file.data() + file.size();
+    while (p < end) {
+      Record r;
+      uint64_t type, len = 0;
+      // a capture of a process that was killed may end with a partial record
+      if (!getVarint(p, end, type) || !getVarint(p, end, r.conn) || !getVarint(p, end, r.time))
+        break;
+      r.type = type;
+      if (type == DATA) {
+        if (!getVarint(p, end, len) || static_cast<uint64_t>(end - p) < len)
+          break;
+        r.data.assign(p, len);
+        p += len;
+      }
+      records.push_back(std::move(r));
+    }
+    return true;
+  }
+
+private:
+  std::atomic<bool> _running;
+  int _fd;
+  double _sampleRate;
+  size_t _bytesPerSec;
+  std::thread _flusher;
+
+  std::mutex _mutex;   // guards the members below
+  std::string _buffer;
+  double _tokens;
+  uint64_t _lastRefill;
+  uint64_t _start;
+  std::atomic<uint64_t> _nextId;
+  uint64_t _truncated;
+
+  bool take(size_t len)
+  {
+    if (!_bytesPerSec)
+      return true;
+    uint64_t now = LoopMetrics::nowNs();
+    _tokens = std::min<double>(_bytesPerSec, _tokens + (now - _lastRefill) / 1e9 * _bytesPerSec);
+    _lastRefill = now;
+    if (_tokens < len)
+      return false;
+    _tokens -= len;
+    return true;
+  }
+
+  void append(int type, uint64_t id, const char* data, size_t len)
+  {
+    putVarint(type);
+    putVarint(id);
+    putVarint(LoopMetrics::nowNs() - _start);
+    if (type == DATA) {
+      putVarint(len);
+      _buffer.append(data, len);
+    }
+  }
+
+  void putVarint(uint64_t v)
+  {
+    while (v >= 0x80) {
+      _buffer.push_back(static_cast<char>(v | 0x80));
+      v >>= 7;
+    }
+    _buffer.push_back(static_cast<char>(v));
+  }
+
+  static bool getVarint(const char*& p, const char* end, uint64_t& v)
+  {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+      uint8_t b = *p++;
+      v |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  void flush()
+  {
+    std::string out;
+    {
+      std::lock_guard lock(_mutex);
+      out.swap(_buffer);
+    }
+    for (size_t off = 0; off < out.size();) {
+      ssize_t n = ::write(_fd, out.data() + off, out.size() - off);
+      if (n <= 0)
+        break;
+      off += n;
+    }
+  }
+};
+
+#endif
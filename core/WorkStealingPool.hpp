@@ -0,0 +1,295 @@
+#ifndef __WORKSTEALINGPOOL_HPP__
+#define __WORKSTEALINGPOOL_HPP__
+
+#include <assert.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Utils.hpp"
+#include "EventLoop.hpp"
+
+/**
+ * class TaskFuture - the result of a task submitted to a WorkStealingPool
+ *
+ * Either waited for with get(), or handed to a continuation with then(). The continuation
+ * runs in the loop that submitted the task, so it may touch the state of that loop (e.g. send
+ * on a connection) without locking.
+ */
+template<class T>
+class TaskFuture
+{
+public:
+  typedef std::function<void(TaskFuture<T>&)> Continuation;
+
+  TaskFuture() = default;
+
+  bool valid() const
+  {
+    return static_cast<bool>(_state);
+  }
+
+  bool ready() const
+  {
+    std::lock_guard lock(_state->mutex);
+    return _state->done;
+  }
+
+  /**
+   * get() - wait for the task and take its result, rethrowing what it threw
+   *
+   * Not to be called in a loop thread before the task is done, that would stall the loop.
+   * Use then() there instead.
+   */
+  T get()
+  {
+    std::unique_lock lock(_state->mutex);
+    _state->doneCond.wait(lock, [this] { return _state->done; });
+    if (_state->error)
+      std::rethrow_exception(_state->error);
+    if constexpr (!std::is_void_v<T>)
+      return std::move(*_state->value);
+  }
+
+  /**
+   * then() - call @cont once the task is done, with this future ready to get()
+   *
+   * @cont runs in the loop that submitted the task via runInLoop(), or in the worker if the
+   * task was not submitted from a loop. Only one continuation may be set.
+   */
+  void then(Continuation cont)
+  {
+    std::unique_lock lock(_state->mutex);
+    assert(!_state->cont);
+    if (!_state->done) {
+      _state->cont = std::move(cont);
+      return;
+    }
+    lock.unlock();
+    dispatch(_state, std::move(cont));
+  }
+
+private:
+  friend class WorkStealingPool;
+
+  struct State
+  {
+    std::mutex mutex;
+    std::condition_variable doneCond;
+    bool done = false;
+    std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> value;
+    std::exception_ptr error;
+    EventLoop* loop = nullptr;   // where the continuation runs
+    Continuation cont;
+  };
+  std::shared_ptr<State> _state;
+
+  explicit TaskFuture(std::shared_ptr<State> state)
+    : _state(std::move(state))
+  {}
+
+  template<class F>
+  static void run(const std::shared_ptr<State>& state, F& func)
+  {
+    try {
+      if constexpr (std::is_void_v<T>) {
+        func();
+        state->value.emplace(true);
+      } else {
+        state->value.emplace(func());
+      }
+    } catch (...) {
+      state->error = std::current_exception();
+    }
+    Continuation cont;
+    {
+      std::lock_guard lock(state->mutex);
+      state->done = true;
+      cont = std::move(state->cont);
+    }
+    state->doneCond.notify_all();
+    if (cont)
+      dispatch(state, std::move(cont));
+  }
+
+  static void dispatch(const std::shared_ptr<State>& state, Continuation cont)
+  {
+    if (!state->loop) {
+      TaskFuture<T> future(state);
+      cont(future);
+      return;
+    }
+    state->loop->runInLoop([state, cont = std::move(cont)] {
+      TaskFuture<T> future(state);
+      cont(future);
+    });
+  }
+};
+
+/**
+ * class WorkStealingPool - threads to offload blocking or cpu heavy work from the loops
+ *
+ * Every worker has a deque of its own. Tasks submitted by a worker go to its own deque, the
+ * others are spread round robin. A worker takes the newest task of its deque, which is likely
+ * still in its cache, and once out of work steals the oldest task of another deque. So the
+ * workers mostly contend on nothing but their own lock, unlike ThreadPool and its one queue.
+ *
+ * Idle workers sleep until a task is submitted. Tasks still queued when the pool stops are
+ * run before the workers exit.
+ */
+class WorkStealingPool : noncopyable
+{
+public:
+  explicit WorkStealingPool(int numThreads)
+    : _running(true)
+    , _pending(0)
+    , _idle(0)
+    , _next(0)
+  {
+    assert(numThreads > 0);
+    for (int i = 0; i < numThreads; i++)
+      _workers.emplace_back(new Worker);
+    for (int i = 0; i < numThreads; i++)
+      _workers[i]->thread = std::thread(&WorkStealingPool::runInThread, this, i);
+  }
+  ~WorkStealingPool()
+  {
+    stop();
+  }
+
+  /**
+   * submit() - run @func in a worker
+   *
+   * The continuation of the returned future runs in the loop of the calling thread, if any.
+   */
+  template<class F>
+  auto submit(F func) -> TaskFuture<std::invoke_result_t<F>>
+  {
+    typedef TaskFuture<std::invoke_result_t<F>> Future;
+    auto state = std::make_shared<typename Future::State>();
+    state->loop = EventLoop::current();
+    post([state, func = std::move(func)]() mutable { Future::run(state, func); });
+    return Future(state);
+  }
+
+  /**
+   * post() - run @task in a worker, with no future to wait for
+   */
+  void post(std::function<void()> task)
+  {
+    Worker* worker = currentPool() == this ? _workers[currentIndex()].get()
+                                           : _workers[_next++ % _workers.size()].get();
+    {
+      std::lock_guard lock(worker->mutex);
+      // counted before a thief can take it and count it off
+      _pending++;
+      worker->tasks.push_back(std::move(task));
+    }
+    // an idle worker counts itself under the lock before it checks _pending
+    if (_idle > 0) {
+      std::lock_guard lock(_sleepMutex);
+      _wakeup.notify_one();
+    }
+  }
+
+  void stop()
+  {
+    {
+      std::lock_guard lock(_sleepMutex);
+      if (!_running)
+        return;
+      _running = false;
+    }
+    _wakeup.notify_all();
+    for (auto& worker : _workers)
+      worker->thread.join();
+  }
+
+  size_t size() const
+  {
+    return _workers.size();
+  }
+
+private:
+  struct Worker
+  {
+    std::mutex mutex;   // guards tasks
+    std::deque<std::function<void()>> tasks;
+    std::thread thread;
+  };
+
+  std::vector<std::unique_ptr<Worker>> _workers;
+  bool _running;   // guarded by _sleepMutex
+  std::atomic<size_t> _pending;
+  std::atomic<size_t> _idle;
+  std::atomic<size_t> _next;
+  std::mutex _sleepMutex;
+  std::condition_variable _wakeup;
+
+  static WorkStealingPool*& currentPool()
+  {
+    static thread_local WorkStealingPool* pool = nullptr;
+    return pool;
+  }
+
+  static size_t& currentIndex()
+  {
+    static thread_local size_t index = 0;
+    return index;
+  }
+
+  void runInThread(size_t index)
+  {
+    currentPool() = this;
+    currentIndex() = index;
+    std::function<void()> task;
+    for (;;) {
+      if (take(index, task)) {
+        task();
+        task = nullptr;
+        continue;
+      }
+      std::unique_lock lock(_sleepMutex);
+      _idle++;
+      _wakeup.wait(lock, [this] { return _pending > 0 || !_running; });
+      _idle--;
+      if (!_running && _pending == 0)
+        return;
+    }
+  }
+
+  bool take(size_t index, std::function<void()>& task)
+  {
+    {
+      Worker* self = _workers[index].get();
+      std::lock_guard lock(self->mutex);
+      if (!self->tasks.empty()) {
+        task = std::move(self->tasks.back());
+        self->tasks.pop_back();
+        _pending--;
+        return true;
+      }
+    }
+    for (size_t i = 1; i < _workers.size(); i++) {
+      Worker* victim = _workers[(index + i) % _workers.size()].get();
+      std::lock_guard lock(victim->mutex);
+      if (!victim->tasks.empty()) {
+        task = std::move(victim->tasks.front());
+        victim->tasks.pop_front();
+        _pending--;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef __BROADCAST_HPP__
+#define __BROADCAST_HPP__
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "EventLoop.hpp"
+#include "TcpConnection.hpp"
+#include "WebSocket.hpp"
+#include "EventStream.hpp"
+
+/**
+ * class Broadcast - a topic publishing every message to all its WebSocket and event stream
+ *                   subscribers, whatever loop they are on
+ *
+ * A message is framed once for WebSocket and once as an event into immutable buffers, which
+ * are posted once to each loop with subscribers. There the connection of every subscriber
+ * queues a reference to the same buffer (TcpConnection::write(SharedBuffer)), so however many
+ * subscribers there are, the payload is not copied per connection.
+ *
+ * A subscriber with more than maxBuffered bytes waiting to be written when a message comes is
+ * slow: by the policy, it misses the message, or it is disconnected.
+ *
+ * Every loop has a shard of its own subscribers (see addLoops()), subscribe() and unsubscribe()
+ * are called in the loop of the subscriber and take no lock. publish() may be called from any
+ * thread. Subscribers are held weakly, one that closes is forgotten at the next message.
+ */
+class Broadcast : noncopyable
+{
+public:
+  typedef WebSocket::WebSocketPtr WebSocketPtr;
+  typedef EventStream::EventStreamPtr EventStreamPtr;
+
+  enum SlowPolicy
+  {
+    DROP,         // skip the messages until the subscriber catches up
+    DISCONNECT,   // close its connection
+  };
+
+  Broadcast()
+    : _policy(DROP)
+    , _maxBuffered(kDefaultMaxBuffered)
+  {}
+  ~Broadcast() {}
+
+  /**
+   * setSlowPolicy() - what to do with a subscriber @maxBuffered bytes behind
+   */
+  void setSlowPolicy(SlowPolicy policy, size_t maxBuffered)
+  {
+    _policy = policy;
+    _maxBuffered = maxBuffered;
+  }
+
+  /**
+   * addLoops() - create a shard for each of @loops, before anyone subscribes
+   *
+   * The broadcast must outlive the loops.
+   */
+  void addLoops(const std::vector<EventLoop*>& loops)
+  {
+    for (EventLoop* loop : loops) {
+      _shards.emplace_back(new Shard(this, loop));
+      _shardOfLoop[loop] = _shards.back().get();
+    }
+  }
+
+  void subscribe(const WebSocketPtr& ws)
+  {
+    Shard* shard = shardOf(ws->getLoop());
+    if (shard->_webSockets.emplace(ws.get(), ws).second)
+      shard->_subscribers++;
+  }
+
+  void subscribe(const EventStreamPtr& es)
+  {
+    Shard* shard = shardOf(es->getLoop());
+    if (shard->_eventStreams.emplace(es.get(), es).second)
+      shard->_subscribers++;
+  }
+
+  void unsubscribe(const WebSocketPtr& ws)
+  {
+    Shard* shard = shardOf(ws->getLoop());
+    if (shard->_webSockets.erase(ws.get()))
+      shard->_subscribers--;
+  }
+
+  void unsubscribe(const EventStreamPtr& es)
+  {
+    Shard* shard = shardOf(es->getLoop());
+    if (shard->_eventStreams.erase(es.get()))
+      shard->_subscribers--;
+  }
+
+  /**
+   * publish() - send @data to every subscriber
+   *
+   * WebSockets get a text or a @binary message, event streams an event of type @event, or of
+   * the default type if empty. Binary messages are not sent to event streams.
+   */
+  void publish(const std::string& data, bool binary = false,
+               const std::string& event = std::string())
+  {
+    auto message = std::make_shared<Message>();
+    message->frame = WebSocket::prepare(data.data(), data.size(), binary);
+    if (!binary)
+      message->event = EventStream::prepare(data, event);
+    for (auto& shard : _shards)
+      if (shard->_subscribers.load(std::memory_order_relaxed))
+        shard->_loop->runInLoop([shard = shard.get(), message] { shard->deliver(*message); });
+  }
+
+  /**
+   * subscribers() - how many there are over the loops, including closed ones not forgotten yet
+   */
+  size_t subscribers() const
+  {
+    size_t n = 0;
+    for (auto& shard : _shards)
+      n += shard->_subscribers.load(std::memory_order_relaxed);
+    return n;
+  }
+
+private:
+  static constexpr size_t kDefaultMaxBuffered = 1024 * 1024;
+
+  /**
+   * struct Message - what is posted to the loops, shared by all of them
+   */
+  struct Message
+  {
+    SharedBuffer frame;   // WebSocket frame
+    SharedBuffer event;   // text/event-stream event, null for a binary message
+  };
+
+  class Shard : noncopyable
+  {
+  public:
+    Shard(Broadcast* broadcast, EventLoop* loop)
+      : _broadcast(broadcast)
+      , _loop(loop)
+      , _subscribers(0)
+    {}
+
+    Broadcast* _broadcast;
+    EventLoop* _loop;
+    std::unordered_map<WebSocket*, std::weak_ptr<WebSocket>> _webSockets;
+    std::unordered_map<EventStream*, std::weak_ptr<EventStream>> _eventStreams;
+    std::atomic<size_t> _subscribers;   // read by publish() in other threads
+
+    void deliver(const Message& message)
+    {
+      deliver(_webSockets, message.frame);
+      if (message.event)
+        deliver(_eventStreams, message.event);
+    }
+
+    /**
+     * deliver() - send @buffer to the open subscribers of @subscribers, forget the others
+     *
+     * Closing a connection only takes effect in the next loop iteration, so @subscribers is
+     * not changed by the callbacks while we go through it.
+     */
+    template<typename S>
+    void deliver(std::unordered_map<S*, std::weak_ptr<S>>& subscribers,
+                 const SharedBuffer& buffer)
+    {
+      for (auto it = subscribers.begin(); it != subscribers.end();) {
+        std::shared_ptr<S> subscriber = it->second.lock();
+        if (!subscriber || !subscriber->isOpen()) {
+          it = subscribers.erase(it);
+          _subscribers--;
+          continue;
+        }
+        ++it;
+        size_t maxBuffered = _broadcast->_maxBuffered;
+        if (maxBuffered && subscriber->bufferedBytes() > maxBuffered) {
+          if (_broadcast->_policy == DISCONNECT) {
+            _loop->metrics().broadcastDisconnects.add();
+            subscriber->getConn()->forceClose();
+          } else {
+            _loop->metrics().broadcastsDropped.add();
+          }
+          continue;
+        }
+        subscriber->sendPrepared(buffer);
+      }
+    }
+  };
+
+  SlowPolicy _policy;
+  size_t _maxBuffered;
+  std::vector<std::unique_ptr<Shard>> _shards;
+  std::unordered_map<EventLoop*, Shard*> _shardOfLoop;
+
+  Shard* shardOf(EventLoop* loop)
+  {
+    assert(loop->isInEventLoop());
+    auto it = _shardOfLoop.find(loop);
+    assert(it != _shardOfLoop.end());
+    return it->second;
+  }
+};
+
+#endif
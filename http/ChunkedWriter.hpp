@@ -0,0 +1,253 @@
+#ifndef __CHUNKEDWRITER_HPP__
+#define __CHUNKEDWRITER_HPP__
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "EventLoop.hpp"
+#include "HttpContext.hpp"
+#include "HttpDefinition.hpp"
+
+/**
+ * class ChunkedWriter - stream a response of unknown length, keeping the connection alive
+ *
+ *   auto writer = std::make_shared<ChunkedWriter>(ctx);
+ *   writer->start(200, {{"Content-Type", "text/plain"}});
+ *   writer->write(line);   // as often as there is something to say
+ *   writer->finish({{"X-Checksum", sum}});
+ *
+ * The body goes out with chunked transfer encoding. Writes are batched into a chunk until
+ * flushSize bytes are pending, or flushDelay seconds after the first of them, so many small
+ * writes cost few syscalls. The size line of a chunk is written into room kept before its
+ * data, and the headers, a chunk and its CRLF, or the last chunk and the trailers, go out in
+ * one write.
+ *
+ * An HTTP/1.0 client gets the body as it is, ended by closing the connection, and a HEAD
+ * request no body at all. Over HTTP/2 the stream frames the body itself, trailers are dropped.
+ * A writer destroyed before finish() closes the connection, so the client sees the response
+ * is cut short.
+ *
+ * Only used from the loop of its context.
+ */
+class ChunkedWriter : noncopyable, public std::enable_shared_from_this<ChunkedWriter>
+{
+public:
+  typedef HttpContext<HttpRequest>::HttpContextPtr HttpContextPtr;
+  typedef std::vector<std::pair<std::string, std::string>> Headers;
+
+  static constexpr size_t kDefaultFlushSize = 16 * 1024;
+  static constexpr double kDefaultFlushDelay = 0.01;
+
+  explicit ChunkedWriter(const HttpContextPtr& ctx)
+    : _ctx(ctx)
+    , _loop(ctx->getLoop())
+    , _flushSize(kDefaultFlushSize)
+    , _flushDelay(kDefaultFlushDelay)
+    , _chunked(true)
+    , _keepAlive(true)
+    , _skipBody(false)
+    , _started(false)
+    , _finished(false)
+    , _dataStart(kNoData)
+    , _flushTimer(0)
+  {}
+  ~ChunkedWriter()
+  {
+    if (_flushTimer)
+      _loop->cancel(_flushTimer);
+    if (_started && !_finished)
+      _ctx->forceClose();
+  }
+
+  /**
+   * setFlushPolicy() - send a chunk once @bytes are pending, or @seconds after the first of
+   *                    them was written
+   *
+   * @bytes 0 sends every write as a chunk, @seconds 0 keeps the bytes until there are enough
+   * of them, flush() or finish().
+   */
+  void setFlushPolicy(size_t bytes, double seconds)
+  {
+    _flushSize = bytes;
+    _flushDelay = seconds;
+  }
+
+  /**
+   * start() - begin the response with status @code and @headers
+   *
+   * Transfer-Encoding is added, and Connection if the client asked to close or speaks
+   * HTTP/1.0. The headers wait to go out with the first chunk, within the flush delay.
+   */
+  void start(int code, const Headers& headers = Headers())
+  {
+    std::shared_ptr<HttpRequest> req = _ctx->getMessage();
+    const std::string* connection = req->findHeader("Connection");
+    _chunked = req->major > 1 || (req->major == 1 && req->minor >= 1);
+    _keepAlive = _chunked && !(connection && strcasestr(connection->c_str(), "close"));
+    _skipBody = req->method == HTTP_HEAD;
+    _started = true;
+    _buffer.append("HTTP/1.1 ").append(std::to_string(code)).append(" ");
+    _buffer.append(HttpDefinition::getMessage(code)).append("\r\n");
+    _buffer.append("Date: ").append(_loop->clock().httpDate()).append("\r\n");
+    for (const auto& [name, value] : headers)
+      _buffer.append(name).append(": ").append(value).append("\r\n");
+    if (_chunked)
+      _buffer.append("Transfer-Encoding: chunked\r\n");
+    if (!_keepAlive)
+      _buffer.append("Connection: close\r\n");
+    _buffer.append("\r\n");
+    armFlushTimer();
+  }
+
+  /**
+   * write() - add @len bytes to the body. Returns -1 once the client is gone.
+   */
+  int write(const char* data, size_t len)
+  {
+    if (!_started || _finished || !_ctx->connected())
+      return -1;
+    if (_skipBody || !len)
+      return len;
+    if (_dataStart == kNoData) {
+      // room for the size line, filled in by flush()
+      _buffer.append(_chunked ? kSizeRoom : 0, '\0');
+      _dataStart = _buffer.size();
+    }
+    _buffer.append(data, len);
+    if (pendingBytes() >= _flushSize)
+      flush();
+    else
+      armFlushTimer();
+    return len;
+  }
+
+  int write(const std::string& data)
+  {
+    return write(data.data(), data.size());
+  }
+
+  /**
+   * flush() - send what is pending now, as one chunk
+   */
+  void flush()
+  {
+    if (!_started || _finished)
+      return;
+    size_t begin = closeChunk();
+    send(begin);
+  }
+
+  /**
+   * finish() - send what is pending, the last chunk and @trailers, ending the response
+   *
+   * The connection is kept alive for the next request, unless start() said otherwise.
+   */
+  void finish(const Headers& trailers = Headers())
+  {
+    if (!_started || _finished)
+      return;
+    size_t begin = closeChunk();
+    if (_chunked && !_skipBody) {
+      _buffer.append("0\r\n");
+      for (const auto& [name, value] : trailers)
+        _buffer.append(name).append(": ").append(value).append("\r\n");
+      _buffer.append("\r\n");
+    }
+    send(begin);
+    _finished = true;
+    if (!_keepAlive)
+      _ctx->shutdown();
+  }
+
+  /**
+   * pendingBytes() - body written but not sent yet, waiting for the flush policy
+   */
+  size_t pendingBytes() const
+  {
+    return _dataStart == kNoData ? 0 : _buffer.size() - _dataStart;
+  }
+
+  /**
+   * bufferedBytes() - what is pending, and what was sent but is not written to the socket yet
+   *
+   * To slow down the producer of a large body, with HttpContext::drained() for one.
+   */
+  size_t bufferedBytes() const
+  {
+    return _buffer.size() + _ctx->bufferedBytes();
+  }
+
+  bool finished() const
+  {
+    return _finished;
+  }
+
+private:
+  // the longest size line: 16 hex digits and CRLF
+  static constexpr size_t kSizeRoom = 18;
+  static constexpr size_t kNoData = std::string::npos;
+
+  HttpContextPtr _ctx;
+  EventLoop* _loop;
+  size_t _flushSize;
+  double _flushDelay;
+  bool _chunked;          // or the body ends with the connection, for HTTP/1.0
+  bool _keepAlive;
+  bool _skipBody;         // a response to HEAD
+  bool _started;
+  bool _finished;
+  std::string _buffer;    // what is not sent yet: headers, room for a size line, chunk data
+  size_t _dataStart;      // of the pending chunk data in _buffer, kNoData if none
+  TimerId _flushTimer;    // 0 if not armed
+
+  /**
+   * closeChunk() - frame the pending data as a chunk, returns where _buffer starts then
+   *
+   * The size line takes the end of its room, and what comes before the room, e.g. the
+   * headers, moves up to meet it, so the data itself is not moved.
+   */
+  size_t closeChunk()
+  {
+    if (_dataStart == kNoData || !_chunked)
+      return 0;
+    char line[kSizeRoom + 1];
+    int n = snprintf(line, sizeof(line), "%zx\r\n", pendingBytes());
+    size_t roomStart = _dataStart - kSizeRoom;
+    size_t begin = kSizeRoom - n;
+    memcpy(&_buffer[_dataStart - n], line, n);
+    if (roomStart)
+      memmove(&_buffer[begin], &_buffer[0], roomStart);
+    _buffer.append("\r\n");
+    return begin;
+  }
+
+  void send(size_t begin)
+  {
+    if (_flushTimer) {
+      _loop->cancel(_flushTimer);
+      _flushTimer = 0;
+    }
+    if (_buffer.size() > begin)
+      _ctx->send(_buffer.data() + begin, _buffer.size() - begin);
+    _buffer.clear();
+    _dataStart = kNoData;
+  }
+
+  void armFlushTimer()
+  {
+    if (_flushTimer || _flushDelay <= 0)
+      return;
+    _flushTimer = _loop->runAfter(_flushDelay, [weakSelf = weak_from_this()] {
+      if (auto self = weakSelf.lock()) {
+        self->_flushTimer = 0;
+        self->flush();
+      }
+    });
+  }
+};
+
+#endif
@@ -0,0 +1,343 @@
+#ifndef __COMPRESSION_HPP__
+#define __COMPRESSION_HPP__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Utils.hpp"
+#include "TcpConnection.hpp"
+#include "HttpParser.hpp"
+
+/**
+ * class DeflatePool - gzip streams set up once and reused, one pool per thread and so one per
+ *                     loop
+ *
+ * deflateInit2() allocates some 256KB of state, while deflateReset() of a used stream only
+ * clears it. A loop compressing response after response thus stops allocating once warm.
+ * Streams are kept per compression level, at most kMaxFree of each.
+ */
+class DeflatePool : noncopyable
+{
+public:
+  static constexpr int kMinLevel = 1;
+  static constexpr int kMaxLevel = 9;
+  static constexpr size_t kMaxFree = 16;   // streams kept per level
+
+  ~DeflatePool()
+  {
+    for (auto& free : _free)
+      for (z_stream* stream : free) {
+        deflateEnd(stream);
+        delete stream;
+      }
+  }
+
+  /**
+   * acquire() - a stream at @level ready for a new gzip member, null if zlib fails
+   */
+  static z_stream* acquire(int level)
+  {
+    std::vector<z_stream*>& free = local()._free[level - kMinLevel];
+    if (!free.empty()) {
+      z_stream* stream = free.back();
+      free.pop_back();
+      return stream;
+    }
+    z_stream* stream = new z_stream;
+    memset(stream, 0, sizeof(*stream));
+    // a 32KB window, with the gzip header and trailer around the deflate data
+    if (deflateInit2(stream, level, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      delete stream;
+      return nullptr;
+    }
+    return stream;
+  }
+
+  /**
+   * release() - hand back @stream, acquired at @level by this thread
+   */
+  static void release(z_stream* stream, int level)
+  {
+    std::vector<z_stream*>& free = local()._free[level - kMinLevel];
+    if (free.size() < kMaxFree && deflateReset(stream) == Z_OK) {
+      free.push_back(stream);
+      return;
+    }
+    deflateEnd(stream);
+    delete stream;
+  }
+
+private:
+  std::vector<z_stream*> _free[kMaxLevel - kMinLevel + 1];
+
+  static DeflatePool& local()
+  {
+    static thread_local DeflatePool pool;
+    return pool;
+  }
+};
+
+/**
+ * class GzipEncoder - compress a body into a gzip stream, a piece at a time
+ *
+ * Its stream comes from the pool of the thread, so it is created and destroyed in the same
+ * loop, by a handler or a coroutine of that loop.
+ */
+class GzipEncoder : noncopyable
+{
+public:
+  explicit GzipEncoder(int level)
+    : _level(level)
+    , _stream(DeflatePool::acquire(level))
+    , _bytesIn(0)
+    , _bytesOut(0)
+  {}
+  ~GzipEncoder()
+  {
+    if (_stream)
+      DeflatePool::release(_stream, _level);
+  }
+
+  /**
+   * compress() - append @len bytes of @data, compressed, to @out
+   * @flush: Z_NO_FLUSH lets zlib hold back what it likes for a better ratio, Z_SYNC_FLUSH
+   *         hands out everything so far, e.g. before the source goes quiet, Z_FINISH ends the
+   *         stream
+   *
+   * False if zlib fails, the encoder is of no use afterwards.
+   */
+  bool compress(const char* data, size_t len, std::string& out, int flush)
+  {
+    if (!_stream)
+      return false;
+    size_t start = out.size();
+    _stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    _stream->avail_in = len;
+    int rc;
+    do {
+      size_t used = out.size();
+      out.resize(used + deflateBound(_stream, _stream->avail_in) + 16);
+      _stream->next_out = reinterpret_cast<Bytef*>(&out[used]);
+      _stream->avail_out = out.size() - used;
+      rc = deflate(_stream, flush);
+      out.resize(out.size() - _stream->avail_out);
+      if (rc != Z_OK && rc != Z_BUF_ERROR && rc != Z_STREAM_END)
+        return false;
+    } while (_stream->avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+    _bytesIn += len;
+    _bytesOut += out.size() - start;
+    return true;
+  }
+
+  /**
+   * bytesIn() - what was given to compress() so far
+   */
+  uint64_t bytesIn() const
+  {
+    return _bytesIn;
+  }
+
+  /**
+   * bytesOut() - what compress() handed out so far
+   */
+  uint64_t bytesOut() const
+  {
+    return _bytesOut;
+  }
+
+private:
+  int _level;
+  z_stream* _stream;   // null if zlib failed to set it up
+  uint64_t _bytesIn;
+  uint64_t _bytesOut;
+};
+
+/**
+ * class Compression - which responses are worth compressing with gzip
+ *
+ * Bodies of a text-like media type (see setTypes()) and of at least minSize bytes, for clients
+ * accepting gzip. Images, video, fonts and archives are compressed already, and are left alone.
+ */
+class Compression
+{
+public:
+  static constexpr size_t kDefaultMinSize = 1024;
+  static constexpr int kDefaultLevel = 6;
+
+  Compression()
+    : _minSize(kDefaultMinSize)
+    , _level(kDefaultLevel)
+    , _types({"text/",
+              "application/javascript",
+              "application/json",
+              "application/xml",
+              "application/wasm",
+              "image/svg+xml"})
+  {}
+  ~Compression() {}
+
+  /**
+   * setMinSize() - leave bodies of less than @bytes as they are, the gzip framing would eat
+   *                most of the gain
+   */
+  void setMinSize(size_t bytes)
+  {
+    _minSize = bytes;
+  }
+
+  /**
+   * setLevel() - the zlib level, from 1 (fastest) to 9 (smallest)
+   */
+  void setLevel(int level)
+  {
+    _level = std::clamp(level, DeflatePool::kMinLevel, DeflatePool::kMaxLevel);
+  }
+
+  /**
+   * setTypes() - the media types to compress, one ending with '/' stands for all its subtypes
+   */
+  void setTypes(std::vector<std::string> types)
+  {
+    _types = std::move(types);
+  }
+
+  int level() const
+  {
+    return _level;
+  }
+
+  /**
+   * acceptsGzip() - whether the Accept-Encoding of @req takes gzip, by name or by "*"
+   */
+  static bool acceptsGzip(const HttpRequest& req)
+  {
+    const std::string* accept = req.findHeader("Accept-Encoding");
+    if (!accept)
+      return false;
+    double gzip = -1, any = -1;
+    size_t start = 0;
+    while (start < accept->size()) {
+      size_t end = std::min(accept->find(',', start), accept->size());
+      size_t semi = std::min(accept->find(';', start), end);
+      std::string coding = accept->substr(start, semi - start);
+      coding.erase(0, coding.find_first_not_of(" \t"));
+      coding.erase(coding.find_last_not_of(" \t") + 1);
+      double q = 1;
+      size_t qpos = accept->find("q=", semi);
+      if (qpos < end)
+        q = atof(accept->c_str() + qpos + 2);
+      if (strcasecmp(coding.c_str(), "gzip") == 0 || strcasecmp(coding.c_str(), "x-gzip") == 0)
+        gzip = q;
+      else if (coding == "*")
+        any = q;
+      start = end + 1;
+    }
+    // "gzip;q=0" refuses it, whatever "*" says
+    return gzip >= 0 ? gzip > 0 : any > 0;
+  }
+
+  /**
+   * compressible() - whether a body of @contentType and @length bytes, -1 if unknown, is
+   *                  worth compressing
+   */
+  bool compressible(const std::string& contentType, int64_t length) const
+  {
+    if (length >= 0 && static_cast<size_t>(length) < _minSize)
+      return false;
+    std::string type = contentType.substr(0, contentType.find(';'));
+    type.erase(type.find_last_not_of(" \t") + 1);
+    // events must reach the client as they are sent, not when zlib has enough of them
+    if (strcasecmp(type.c_str(), "text/event-stream") == 0)
+      return false;
+    for (const std::string& t : _types) {
+      if (t.back() == '/' ? strncasecmp(type.c_str(), t.c_str(), t.size()) == 0
+                          : strcasecmp(type.c_str(), t.c_str()) == 0)
+        return true;
+    }
+    return false;
+  }
+
+private:
+  size_t _minSize;
+  int _level;
+  std::vector<std::string> _types;
+};
+
+/**
+ * class GzipCache - the gzipped bodies of small hot files, one cache per thread and so one per
+ *                   loop
+ *
+ * Rather than compressing the same stylesheet for every request, the result is kept, keyed by
+ * path and checked against the modification time and size of the file, so an edited file is
+ * compressed again. The least recently used entries go once more than kMaxBytes are held.
+ */
+class GzipCache : noncopyable
+{
+public:
+  static constexpr size_t kMaxFileSize = 256 * 1024;   // larger files are compressed as sent
+  static constexpr size_t kMaxBytes = 8 * 1024 * 1024;
+
+  static GzipCache& local()
+  {
+    static thread_local GzipCache cache;
+    return cache;
+  }
+
+  /**
+   * find() - the gzipped @path if it was cached at modification time @mtime and @size
+   */
+  SharedBuffer find(const std::string& path, int64_t mtime, size_t size)
+  {
+    auto it = _index.find(path);
+    if (it == _index.end())
+      return nullptr;
+    if (it->second->mtime != mtime || it->second->size != size) {
+      erase(it);
+      return nullptr;
+    }
+    _lru.splice(_lru.begin(), _lru, it->second);
+    return it->second->gz;
+  }
+
+  void insert(const std::string& path, int64_t mtime, size_t size, SharedBuffer gz)
+  {
+    auto it = _index.find(path);
+    if (it != _index.end())
+      erase(it);
+    _bytes += gz->size();
+    _lru.push_front(Entry{path, mtime, size, std::move(gz)});
+    _index.emplace(path, _lru.begin());
+    while (_bytes > kMaxBytes)
+      erase(_index.find(_lru.back().path));
+  }
+
+private:
+  struct Entry
+  {
+    std::string path;
+    int64_t mtime;   // in nanoseconds
+    size_t size;
+    SharedBuffer gz;
+  };
+
+  std::list<Entry> _lru;   // most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> _index;
+  size_t _bytes = 0;
+
+  void erase(std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it)
+  {
+    _bytes -= it->second->gz->size();
+    _lru.erase(it->second);
+    _index.erase(it);
+  }
+};
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef __EVENTSTREAM_HPP__
+#define __EVENTSTREAM_HPP__
+
+#include <any>
+#include <functional>
+#include <memory>
+#include <string>
+#include "TcpConnection.hpp"
+#include "HttpContext.hpp"
+#include "HttpServer.hpp"
+
+/**
+ * class EventStream - the server end of a server-sent event stream (text/event-stream)
+ *
+ * Created by EventStreamHandler once the response headers are sent, it takes over the
+ * connection: the response body is the events, delimited by the connection closing. What the
+ * client sends afterwards is ignored.
+ *
+ * Only used from its loop, like the connection.
+ */
+class EventStream
+  : noncopyable
+  , public HttpUpgrade
+  , public std::enable_shared_from_this<EventStream>
+{
+public:
+  typedef std::shared_ptr<EventStream> EventStreamPtr;
+  typedef std::function<void(const EventStreamPtr&)> EventStreamCallback;
+
+  EventStream(const TcpConnectionPtr& conn, size_t maxBuffered)
+    : _conn(conn)
+    , _loop(conn->getLoop())
+    , _maxBuffered(maxBuffered)
+    , _closed(false)
+  {}
+  ~EventStream() {}
+
+  /**
+   * format() - append an event to @out, each line of @data in a data field
+   * @event: its type, empty for the default "message"
+   * @id: the last event id the client sends back when it reconnects, empty for none
+   */
+  static void format(std::string& out, const std::string& data, const std::string& event,
+                     const std::string& id)
+  {
+    if (!event.empty())
+      out.append("event: ").append(event).append("\n");
+    if (!id.empty())
+      out.append("id: ").append(id).append("\n");
+    size_t start = 0;
+    while (true) {
+      size_t end = data.find('\n', start);
+      size_t len = (end == std::string::npos ? data.size() : end) - start;
+      if (len && data[start + len - 1] == '\r')
+        len--;
+      out.append("data: ").append(data, start, len).append("\n");
+      if (end == std::string::npos)
+        break;
+      start = end + 1;
+    }
+    out.append("\n");
+  }
+
+  /**
+   * prepare() - format an event once to be sent to many streams, see sendPrepared()
+   */
+  static SharedBuffer prepare(const std::string& data, const std::string& event = std::string(),
+                              const std::string& id = std::string())
+  {
+    auto out = std::make_shared<std::string>();
+    format(*out, data, event, id);
+    return out;
+  }
+
+  /**
+   * send() - send an event, see format(). Returns -1 once the stream is closed.
+   */
+  int send(const std::string& data, const std::string& event = std::string(),
+           const std::string& id = std::string())
+  {
+    if (_closed)
+      return -1;
+    std::string out;
+    format(out, data, event, id);
+    int rc = _conn->write(out);
+    checkBuffered();
+    return rc;
+  }
+
+  /**
+   * sendPrepared() - send an event formatted by prepare(), without copying it
+   */
+  int sendPrepared(const SharedBuffer& event)
+  {
+    if (_closed)
+      return -1;
+    int rc = _conn->write(event);
+    checkBuffered();
+    return rc;
+  }
+
+  /**
+   * close() - end the stream once what was sent is flushed
+   */
+  void close()
+  {
+    if (!_closed)
+      _conn->shutdown();
+  }
+
+  bool isOpen() const
+  {
+    return !_closed;
+  }
+
+  /**
+   * bufferedBytes() - what was sent but is not written to the socket yet
+   */
+  size_t bufferedBytes() const
+  {
+    return _conn->writeBufferSize();
+  }
+
+  const TcpConnectionPtr& getConn() const
+  {
+    return _conn;
+  }
+
+  EventLoop* getLoop() const
+  {
+    return _loop;
+  }
+
+  std::any& getUserData()
+  {
+    return _userData;
+  }
+  void setUserData(const std::any& userData)
+  {
+    _userData = userData;
+  }
+
+  /**
+   * setCloseCallback() - called once the connection is gone
+   */
+  void setCloseCallback(EventStreamCallback cb)
+  {
+    _closeCallback = std::move(cb);
+  }
+
+  void onData(const char* data, size_t len) override {}
+
+  void onWriteComplete() override {}
+
+  void onClose() override
+  {
+    if (_closed)
+      return;
+    _closed = true;
+    EventStreamPtr self = shared_from_this();
+    if (_closeCallback)
+      _closeCallback(self);
+    // they may hold references to us
+    _closeCallback = nullptr;
+    _userData.reset();
+  }
+
+private:
+  TcpConnectionPtr _conn;
+  EventLoop* _loop;
+  size_t _maxBuffered;   // unsent bytes before the client is dropped, 0 for no limit
+  bool _closed;
+  std::any _userData;
+  EventStreamCallback _closeCallback;
+
+  void checkBuffered()
+  {
+    // a client that doesn't read would have us buffer without limit
+    if (_maxBuffered && _conn->writeBufferSize() > _maxBuffered)
+      _conn->forceClose();
+  }
+};
+
+/**
+ * class EventStreamHandler - a route answering with a server-sent event stream
+ *
+ *   EventStreamHandler events;
+ *   events.setOpenCallback([](const EventStreamPtr& es, const std::shared_ptr<HttpRequest>&) {
+ *     es->send("hello");
+ *   });
+ *   router.addSimpleRoute("/events", events);
+ *
+ * Only over HTTP/1.x, an HTTP/2 request gets a 505.
+ */
+class EventStreamHandler
+{
+  typedef class HttpContext<HttpRequest> HttpContext;
+  typedef typename HttpContext::HttpContextPtr HttpContextPtr;
+  typedef EventStream::EventStreamPtr EventStreamPtr;
+
+public:
+  typedef std::function<void(const EventStreamPtr&, const std::shared_ptr<HttpRequest>&)>
+    OpenCallback;
+
+  EventStreamHandler()
+    : _maxBuffered(kDefaultMaxBuffered)
+  {}
+  ~EventStreamHandler() {}
+
+  /**
+   * setMaxBuffered() - drop a client once @bytes wait to be written to it, 0 for no limit
+   */
+  void setMaxBuffered(size_t bytes)
+  {
+    _maxBuffered = bytes;
+  }
+
+  /**
+   * setOpenCallback() - a stream is opened, with its request, e.g. for its Last-Event-ID
+   */
+  void setOpenCallback(OpenCallback cb)
+  {
+    _openCallback = std::move(cb);
+  }
+
+  void setCloseCallback(EventStream::EventStreamCallback cb)
+  {
+    _closeCallback = std::move(cb);
+  }
+
+  void operator()(int prefixLen, HttpContextPtr ctx, HttpServer* server)
+  {
+    std::shared_ptr<HttpRequest> req = ctx->getMessage();
+    if (req->major != 1) {
+      ctx->sendError(HttpStatus::HTTP_VERSION_NOT_SUPPORTED);
+      return;
+    }
+    if (req->method != HTTP_GET) {
+      ctx->sendError(HttpStatus::METHOD_NOT_ALLOWED);
+      return;
+    }
+    ctx->send("HTTP/1.1 200 OK\r\nDate: " + ctx->getLoop()->clock().httpDate() +
+              "\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+              "Connection: close\r\n\r\n");
+
+    auto es = std::make_shared<EventStream>(ctx->getConn(), _maxBuffered);
+    es->setCloseCallback(_closeCallback);
+    ctx->getLoop()->metrics().eventStreams.add();
+    if (_openCallback)
+      _openCallback(es, req);
+    // the connection is the stream's from now on, no longer timed out as a request
+    ctx->upgrade(es);
+  }
+
+private:
+  static constexpr size_t kDefaultMaxBuffered = 4 * 1024 * 1024;
+
+  size_t _maxBuffered;
+  OpenCallback _openCallback;
+  EventStream::EventStreamCallback _closeCallback;
+};
+
+#endif
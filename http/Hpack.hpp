@@ -0,0 +1,640 @@
+#ifndef __HPACK_HPP__
+#define __HPACK_HPP__
+
+#include <stdint.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Utils.hpp"
+
+/**
+ * HPACK (RFC 7541), the header compression of HTTP/2
+ *
+ * Each direction of a connection has its own dynamic table, shared by all its streams, so the
+ * header blocks must be decoded (and encoded) in the order they go on the wire.
+ */
+typedef std::vector<std::pair<std::string, std::string>> HpackHeaders;
+
+namespace hpack_detail {
+
+struct StaticEntry
+{
+  const char* name;
+  const char* value;
+};
+
+// RFC 7541 Appendix A, index 1 first
+inline constexpr StaticEntry kStaticTable[] = {
+  {":authority", ""},
+  {":method", "GET"},
+  {":method", "POST"},
+  {":path", "/"},
+  {":path", "/index.html"},
+  {":scheme", "http"},
+  {":scheme", "https"},
+  {":status", "200"},
+  {":status", "204"},
+  {":status", "206"},
+  {":status", "304"},
+  {":status", "400"},
+  {":status", "404"},
+  {":status", "500"},
+  {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"},
+  {"accept-language", ""},
+  {"accept-ranges", ""},
+  {"accept", ""},
+  {"access-control-allow-origin", ""},
+  {"age", ""},
+  {"allow", ""},
+  {"authorization", ""},
+  {"cache-control", ""},
+  {"content-disposition", ""},
+  {"content-encoding", ""},
+  {"content-language", ""},
+  {"content-length", ""},
+  {"content-location", ""},
+  {"content-range", ""},
+  {"content-type", ""},
+  {"cookie", ""},
+  {"date", ""},
+  {"etag", ""},
+  {"expect", ""},
+  {"expires", ""},
+  {"from", ""},
+  {"host", ""},
+  {"if-match", ""},
+  {"if-modified-since", ""},
+  {"if-none-match", ""},
+  {"if-range", ""},
+  {"if-unmodified-since", ""},
+  {"last-modified", ""},
+  {"link", ""},
+  {"location", ""},
+  {"max-forwards", ""},
+  {"proxy-authenticate", ""},
+  {"proxy-authorization", ""},
+  {"range", ""},
+  {"referer", ""},
+  {"refresh", ""},
+  {"retry-after", ""},
+  {"server", ""},
+  {"set-cookie", ""},
+  {"strict-transport-security", ""},
+  {"transfer-encoding", ""},
+  {"user-agent", ""},
+  {"vary", ""},
+  {"via", ""},
+  {"www-authenticate", ""},
+};
+inline constexpr size_t kStaticSize = sizeof(kStaticTable) / sizeof(kStaticTable[0]);
+
+// RFC 7541 Appendix B, by symbol, 256 is EOS
+inline constexpr uint32_t kHuffmanCodes[257] = {
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+  0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+  0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+  0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+  0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+  0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+  0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+  0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+  0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+  0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+  0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+  0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+  0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+  0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+  0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+  0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+  0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+  0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+  0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+  0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+  0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+  0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+  0x3fffffff,
+};
+inline constexpr uint8_t kHuffmanLengths[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30,
+};
+
+/**
+ * class HuffmanDecoder - the code is canonical, so it is decoded by length: a code of length
+ *                        l is the symbol at its offset from the first code of that length
+ */
+class HuffmanDecoder : noncopyable
+{
+public:
+  static const HuffmanDecoder& instance()
+  {
+    static HuffmanDecoder decoder;
+    return decoder;
+  }
+
+  bool decode(const uint8_t* p, size_t len, std::string& out) const
+  {
+    uint32_t code = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len; i++) {
+      for (int b = 7; b >= 0; b--) {
+        code = (code << 1) | ((p[i] >> b) & 1);
+        bits++;
+        if (code - _first[bits] < _count[bits]) {
+          uint16_t sym = _symbols[_offset[bits] + code - _first[bits]];
+          if (sym == 256)
+            return false;
+          out.push_back(static_cast<char>(sym));
+          code = 0;
+          bits = 0;
+        } else if (bits == kMaxBits) {
+          return false;
+        }
+      }
+    }
+    // the padding is at most 7 bits of the EOS code, all ones
+    return bits < 8 && code == (1u << bits) - 1;
+  }
+
+private:
+  static constexpr int kMaxBits = 30;
+
+  uint32_t _first[kMaxBits + 1];
+  uint32_t _count[kMaxBits + 1];
+  uint16_t _offset[kMaxBits + 1];
+  uint16_t _symbols[257];
+
+  HuffmanDecoder()
+  {
+    for (uint16_t i = 0; i < 257; i++)
+      _symbols[i] = i;
+    std::sort(_symbols, _symbols + 257, [](uint16_t a, uint16_t b) {
+      return kHuffmanLengths[a] != kHuffmanLengths[b] ? kHuffmanLengths[a] < kHuffmanLengths[b]
+                                                      : kHuffmanCodes[a] < kHuffmanCodes[b];
+    });
+    for (int l = 0; l <= kMaxBits; l++) {
+      _first[l] = 0;
+      _count[l] = 0;
+      _offset[l] = 0;
+    }
+    for (int i = 256; i >= 0; i--) {
+      uint16_t sym = _symbols[i];
+      int l = kHuffmanLengths[sym];
+      _count[l]++;
+      _first[l] = kHuffmanCodes[sym];
+      _offset[l] = i;
+    }
+  }
+};
+
+inline size_t huffmanLength(const std::string& s)
+{
+  size_t bits = 0;
+  for (unsigned char c : s)
+    bits += kHuffmanLengths[c];
+  return (bits + 7) / 8;
+}
+
+inline void huffmanEncode(const std::string& s, std::string& out)
+{
+  uint64_t acc = 0;
+  int bits = 0;
+  for (unsigned char c : s) {
+    acc = (acc << kHuffmanLengths[c]) | kHuffmanCodes[c];
+    bits += kHuffmanLengths[c];
+    while (bits >= 8) {
+      bits -= 8;
+      out.push_back(static_cast<char>(acc >> bits));
+    }
+  }
+  if (bits)
+    out.push_back(static_cast<char>((acc << (8 - bits)) | (0xff >> bits)));
+}
+
+inline void encodeInteger(uint64_t value, int prefix, uint8_t flags, std::string& out)
+{
+  uint64_t max = (1u << prefix) - 1;
+  if (value < max) {
+    out.push_back(static_cast<char>(flags | value));
+    return;
+  }
+  out.push_back(static_cast<char>(flags | max));
+  value -= max;
+  while (value >= 128) {
+    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+inline bool decodeInteger(const uint8_t*& p, const uint8_t* end, int prefix, uint64_t& value)
+{
+  uint64_t max = (1u << prefix) - 1;
+  value = *p++ & max;
+  if (value < max)
+    return true;
+  for (int shift = 0; p < end && shift < 56; shift += 7) {
+    uint8_t b = *p++;
+    value += static_cast<uint64_t>(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+/**
+ * class DynamicTable - the entries added by a header block, newest first
+ */
+class DynamicTable : noncopyable
+{
+public:
+  static constexpr size_t kEntryOverhead = 32;
+
+  DynamicTable()
+    : _size(0)
+    , _maxSize(4096)
+    , _inserted(0)
+  {}
+
+  size_t size() const
+  {
+    return _size;
+  }
+  size_t maxSize() const
+  {
+    return _maxSize;
+  }
+  size_t count() const
+  {
+    return _entries.size();
+  }
+
+  /**
+   * get() - the entry at @index of the whole table, the dynamic entries following the static
+   */
+  bool get(uint64_t index, const std::string*& name, const std::string*& value) const
+  {
+    static const std::vector<std::pair<std::string, std::string>> statics = [] {
+      std::vector<std::pair<std::string, std::string>> v;
+      for (const StaticEntry& e : kStaticTable)
+        v.emplace_back(e.name, e.value);
+      return v;
+    }();
+    if (index == 0)
+      return false;
+    if (index <= kStaticSize) {
+      name = &statics[index - 1].first;
+      value = &statics[index - 1].second;
+      return true;
+    }
+    index -= kStaticSize + 1;
+    if (index >= _entries.size())
+      return false;
+    name = &_entries[index].name;
+    value = &_entries[index].value;
+    return true;
+  }
+
+  void add(const std::string& name, const std::string& value)
+  {
+    size_t size = name.size() + value.size() + kEntryOverhead;
+    // an entry larger than the table empties it
+    while (!_entries.empty() && _size + size > _maxSize)
+      evict();
+    if (size > _maxSize)
+      return;
+    _entries.push_front(Entry{name, value, _inserted++});
+    _size += size;
+  }
+
+  void setMaxSize(size_t maxSize)
+  {
+    _maxSize = maxSize;
+    while (_size > _maxSize)
+      evict();
+  }
+
+  /**
+   * inserted() - the entries ever added, the last one added is number inserted() - 1
+   *
+   * An entry keeps its number as others are added, for an encoder to find it again.
+   */
+  uint64_t inserted() const
+  {
+    return _inserted;
+  }
+  /**
+   * oldest() - the number of the oldest entry still in the table
+   */
+  uint64_t oldest() const
+  {
+    return _inserted - _entries.size();
+  }
+
+private:
+  struct Entry
+  {
+    std::string name;
+    std::string value;
+    uint64_t seq;
+  };
+  std::deque<Entry> _entries;
+  size_t _size;
+  size_t _maxSize;
+  uint64_t _inserted;
+
+  void evict()
+  {
+    const Entry& e = _entries.back();
+    _size -= e.name.size() + e.value.size() + kEntryOverhead;
+    _entries.pop_back();
+  }
+};
+
+}   // namespace hpack_detail
+
+/**
+ * class HpackDecoder - decodes the header blocks of one direction of a connection
+ */
+class HpackDecoder : noncopyable
+{
+public:
+  HpackDecoder()
+    : _maxTableSize(4096)
+    , _maxHeaderListSize(64 * 1024)
+  {}
+
+  /**
+   * setMaxTableSize() - the table size we allow the peer, as in our SETTINGS_HEADER_TABLE_SIZE
+   */
+  void setMaxTableSize(size_t size)
+  {
+    _maxTableSize = size;
+    if (_table.maxSize() > size)
+      _table.setMaxSize(size);
+  }
+
+  /**
+   * setMaxHeaderListSize() - fail blocks above @size bytes, as RFC 7540 counts them
+   */
+  void setMaxHeaderListSize(size_t size)
+  {
+    _maxHeaderListSize = size;
+  }
+
+  /**
+   * decode() - append the headers of the block to @headers, false if it is malformed
+   *
+   * A failed block leaves the table out of sync, so the connection is lost.
+   */
+  bool decode(const uint8_t* p, size_t len, HpackHeaders& headers)
+  {
+    const uint8_t* end = p + len;
+    size_t listSize = 0;
+    bool first = true;
+    while (p < end) {
+      uint8_t b = *p;
+      uint64_t index;
+      if (b & 0x80) {
+        // indexed
+        const std::string *name, *value;
+        if (!hpack_detail::decodeInteger(p, end, 7, index) || !_table.get(index, name, value))
+          return false;
+        headers.emplace_back(*name, *value);
+      } else if ((b & 0xe0) == 0x20) {
+        // size updates only come first
+        if (!first || !hpack_detail::decodeInteger(p, end, 5, index) || index > _maxTableSize)
+          return false;
+        _table.setMaxSize(index);
+        continue;
+      } else {
+        bool indexing = (b & 0xc0) == 0x40;
+        if (!hpack_detail::decodeInteger(p, end, indexing ? 6 : 4, index))
+          return false;
+        std::string name, value;
+        if (index) {
+          const std::string *n, *v;
+          if (!_table.get(index, n, v))
+            return false;
+          name = *n;
+        } else if (!decodeString(p, end, name)) {
+          return false;
+        }
+        if (!decodeString(p, end, value))
+          return false;
+        if (indexing)
+          _table.add(name, value);
+        headers.emplace_back(std::move(name), std::move(value));
+      }
+      first = false;
+      listSize += headers.back().first.size() + headers.back().second.size() + 32;
+      if (listSize > _maxHeaderListSize)
+        return false;
+    }
+    return true;
+  }
+
+private:
+  hpack_detail::DynamicTable _table;
+  size_t _maxTableSize;
+  size_t _maxHeaderListSize;
+
+  static bool decodeString(const uint8_t*& p, const uint8_t* end, std::string& out)
+  {
+    if (p >= end)
+      return false;
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if (!hpack_detail::decodeInteger(p, end, 7, len) || len > static_cast<size_t>(end - p))
+      return false;
+    if (huffman) {
+      if (!hpack_detail::HuffmanDecoder::instance().decode(p, len, out))
+        return false;
+    } else {
+      out.assign(reinterpret_cast<const char*>(p), len);
+    }
+    p += len;
+    return true;
+  }
+};
+
+/**
+ * class HpackEncoder - encodes the header blocks of one direction of a connection
+ *
+ * Headers that repeat across responses (server, content-type, ...) are added to the dynamic
+ * table and sent as a single index afterwards. Values that rarely repeat are sent literally
+ * without indexing, not to evict the useful entries. Strings are Huffman coded when shorter.
+ */
+class HpackEncoder : noncopyable
+{
+public:
+  static constexpr size_t kDefaultTableSize = 4096;
+
+  HpackEncoder()
+    : _tableSizeUpdate(false)
+  {
+    for (size_t i = hpack_detail::kStaticSize; i > 0; i--) {
+      const hpack_detail::StaticEntry& e = hpack_detail::kStaticTable[i - 1];
+      _staticFields[key(e.name, e.value)] = i;
+      _staticNames[e.name] = i;
+    }
+  }
+
+  /**
+   * setMaxTableSize() - the peer allows a table of @size, as in its SETTINGS_HEADER_TABLE_SIZE
+   *
+   * We use at most kDefaultTableSize of it.
+   */
+  void setMaxTableSize(size_t size)
+  {
+    size = std::min(size, kDefaultTableSize);
+    if (size == _table.maxSize())
+      return;
+    _table.setMaxSize(size);
+    _tableSizeUpdate = true;
+  }
+
+  void encode(const HpackHeaders& headers, std::string& out)
+  {
+    if (_tableSizeUpdate) {
+      hpack_detail::encodeInteger(_table.maxSize(), 5, 0x20, out);
+      _tableSizeUpdate = false;
+    }
+    for (const auto& [name, value] : headers)
+      encode(name, value, out);
+  }
+
+private:
+  hpack_detail::DynamicTable _table;
+  bool _tableSizeUpdate;
+  std::unordered_map<std::string, size_t> _staticFields;   // name and value to index
+  std::unordered_map<std::string, size_t> _staticNames;
+  std::unordered_map<std::string, uint64_t> _dynamicFields;   // to the sequence of the entry
+  std::unordered_map<std::string, uint64_t> _dynamicNames;
+
+  static std::string key(const std::string& name, const std::string& value)
+  {
+    std::string k;
+    k.reserve(name.size() + value.size() + 1);
+    k.append(name).push_back('\0');
+    k.append(value);
+    return k;
+  }
+
+  /**
+   * dynamicIndex() - the index of the entry of sequence @seq, 0 if it is evicted
+   */
+  uint64_t dynamicIndex(uint64_t seq) const
+  {
+    if (seq < _table.oldest())
+      return 0;
+    return hpack_detail::kStaticSize + (_table.inserted() - seq);
+  }
+
+  static bool indexable(const std::string& name)
+  {
+    return name != "content-length" && name != "set-cookie" && name != "etag" &&
+           name != "last-modified" && name != "location" && name != "authorization";
+  }
+
+  void encode(const std::string& name, const std::string& value, std::string& out)
+  {
+    std::string k = key(name, value);
+    auto s = _staticFields.find(k);
+    if (s != _staticFields.end()) {
+      hpack_detail::encodeInteger(s->second, 7, 0x80, out);
+      return;
+    }
+    auto d = _dynamicFields.find(k);
+    if (d != _dynamicFields.end()) {
+      if (uint64_t index = dynamicIndex(d->second)) {
+        hpack_detail::encodeInteger(index, 7, 0x80, out);
+        return;
+      }
+      _dynamicFields.erase(d);
+    }
+
+    uint64_t nameIndex = 0;
+    auto sn = _staticNames.find(name);
+    if (sn != _staticNames.end()) {
+      nameIndex = sn->second;
+    } else {
+      auto dn = _dynamicNames.find(name);
+      if (dn != _dynamicNames.end() && !(nameIndex = dynamicIndex(dn->second)))
+        _dynamicNames.erase(dn);
+    }
+
+    bool indexing = indexable(name) &&
+                    name.size() + value.size() + hpack_detail::DynamicTable::kEntryOverhead <=
+                      _table.maxSize() / 2;
+    if (indexing)
+      hpack_detail::encodeInteger(nameIndex, 6, 0x40, out);
+    else
+      hpack_detail::encodeInteger(nameIndex, 4, 0x00, out);
+    if (!nameIndex)
+      encodeString(name, out);
+    encodeString(value, out);
+    if (indexing) {
+      _table.add(name, value);
+      uint64_t seq = _table.inserted() - 1;
+      _dynamicFields[k] = seq;
+      _dynamicNames[name] = seq;
+      if (_dynamicFields.size() > 4 * _table.count() + 16)
+        prune();
+    }
+  }
+
+  /**
+   * prune() - forget the evicted entries
+   */
+  void prune()
+  {
+    for (auto it = _dynamicFields.begin(); it != _dynamicFields.end();)
+      it = it->second < _table.oldest() ? _dynamicFields.erase(it) : std::next(it);
+    for (auto it = _dynamicNames.begin(); it != _dynamicNames.end();)
+      it = it->second < _table.oldest() ? _dynamicNames.erase(it) : std::next(it);
+  }
+
+  static void encodeString(const std::string& s, std::string& out)
+  {
+    size_t huffman = hpack_detail::huffmanLength(s);
+    if (huffman < s.size()) {
+      hpack_detail::encodeInteger(huffman, 7, 0x80, out);
+      hpack_detail::huffmanEncode(s, out);
+    } else {
+      hpack_detail::encodeInteger(s.size(), 7, 0x00, out);
+      out.append(s);
+    }
+  }
+};
+
+#endif
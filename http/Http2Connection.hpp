@@ -0,0 +1,1278 @@
+#ifndef __HTTP2CONNECTION_HPP__
+#define __HTTP2CONNECTION_HPP__
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "TcpConnection.hpp"
+#include "HttpContext.hpp"
+#include "Hpack.hpp"
+
+class Http2Connection;
+
+/**
+ * class Http2Stream - one request of an HTTP/2 connection, and the sink of its context
+ *
+ * The handler answers in HTTP/1.1 as usual. A response parser turns what it writes into the
+ * headers of a HEADERS frame and the body of DATA frames, the body waiting here until flow
+ * control and the scheduler of the connection let it go.
+ */
+class Http2Stream : noncopyable, public HttpStreamSink
+{
+public:
+  typedef HttpContext<HttpRequest>::HttpContextPtr HttpContextPtr;
+
+  Http2Stream(Http2Connection* owner, uint32_t id, int64_t sendWindow, int32_t recvWindow);
+  ~Http2Stream() {}
+
+  uint32_t id() const
+  {
+    return _id;
+  }
+
+  int write(const char* data, size_t len) override;
+  void shutdown() override;
+  void forceClose() override;
+
+  /**
+   * bufferedBytes() - the body not framed yet, what is framed belongs to the connection
+   */
+  size_t bufferedBytes() const override
+  {
+    return _data.size();
+  }
+
+  bool closed() const override
+  {
+    return !_owner;
+  }
+
+private:
+  friend class Http2Connection;
+
+  Http2Connection* _owner;   // null once the stream is closed
+  uint32_t _id;
+  HttpContextPtr _ctx;
+  std::shared_ptr<HttpRequest> _request;
+  HttpParser<HttpResponse> _response;
+  HpackHeaders _responseHeaders;
+  StreamBuffer _data;        // body to frame
+  int64_t _sendWindow;
+  int32_t _recvWindow;
+  uint32_t _parent;          // stream depended on, 0 for the root
+  uint16_t _weight;
+  uint64_t _pass;            // of the stride scheduler, the stream with the lowest goes next
+  bool _headersReady;        // the response headers are parsed and wait for their frame
+  bool _headersSent;
+  bool _ended;               // the whole response is parsed
+  bool _endSent;             // END_STREAM is framed
+  bool _remoteClosed;        // END_STREAM received
+  bool _drainPending;        // the context waits to hear the body is framed
+  bool _bodyRefused;         // answered 413, the rest of the request is dropped
+
+  void onResponseHeaders();
+  void onResponseBody(const char* data, size_t len);
+  void onResponseComplete();
+};
+
+/**
+ * class Http2Connection - the HTTP/2 (RFC 7540) side of a server connection
+ *
+ * Fed with what the connection reads once it speaks HTTP/2: after the client preface (h2c
+ * with prior knowledge, or "h2" picked by ALPN), or after an "Upgrade: h2c" request. Every
+ * stream gets a context of its own, pointing at the shared connection, which is handed to
+ * the request callback once its request is complete, just as an HTTP/1.1 request is.
+ *
+ * Frames going out are batched in one buffer and written in one go per turn of the loop.
+ * HEADERS go first. DATA is scheduled by stride: each frame a stream sends moves it ahead by
+ * the inverse of its weight, and the stream furthest behind goes next, so streams share the
+ * connection by weight. A stream waits while the stream it depends on has data to send. No
+ * more than kMaxBuffered bytes wait in the connection, the rest stays in the streams, so a
+ * stream made urgent by a new request doesn't queue behind what is buffered.
+ *
+ * The priority tree only holds open streams, a stream depending on one that is closed or
+ * not open yet depends on the root.
+ *
+ * A request body waits in its stream until END_STREAM, when the handler gets it whole. The
+ * window of a stream is never topped up for the body, so it caps what the stream buffers at
+ * one byte over setMaxRequestBody(), and a body over it is answered with 413. The window of
+ * the connection is handed back as it is used, the streams bound what it lets in.
+ */
+class Http2Connection : noncopyable, public std::enable_shared_from_this<Http2Connection>
+{
+public:
+  typedef class HttpContext<HttpRequest> HttpContext;
+  typedef typename HttpContext::HttpContextPtr HttpContextPtr;
+  typedef std::function<void(const HttpContextPtr&)> StreamCallback;
+
+  static constexpr const char kPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+  static constexpr size_t kPrefaceSize = sizeof(kPreface) - 1;
+
+  static constexpr uint32_t kMaxConcurrentStreams = 128;
+  static constexpr int32_t kWindow = 1 << 20;                // what the connection may receive
+  static constexpr size_t kDefaultMaxRequestBody = 1 << 20;
+  static constexpr size_t kMaxBuffered = 256 * 1024;         // framed, not written to the socket
+  static constexpr size_t kMaxHeaderListSize = 64 * 1024;
+
+  enum FrameType
+  {
+    DATA = 0,
+    HEADERS = 1,
+    PRIORITY = 2,
+    RST_STREAM = 3,
+    SETTINGS = 4,
+    PUSH_PROMISE = 5,
+    PING = 6,
+    GOAWAY = 7,
+    WINDOW_UPDATE = 8,
+    CONTINUATION = 9,
+  };
+
+  enum Flag
+  {
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20,
+  };
+
+  enum Error
+  {
+    NO_ERROR = 0x0,
+    PROTOCOL_ERROR = 0x1,
+    INTERNAL_ERROR = 0x2,
+    FLOW_CONTROL_ERROR = 0x3,
+    STREAM_CLOSED = 0x5,
+    FRAME_SIZE_ERROR = 0x6,
+    REFUSED_STREAM = 0x7,
+    CANCEL = 0x8,
+    COMPRESSION_ERROR = 0x9,
+  };
+
+  enum Setting
+  {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+  };
+
+  explicit Http2Connection(const TcpConnectionPtr& conn)
+    : _conn(conn)
+    , _prefaceReceived(false)
+    , _failed(false)
+    , _closed(false)
+    , _goingAway(false)
+    , _lastStreamId(0)
+    , _requests(0)
+    , _peerInitialWindow(65535)
+    , _peerMaxFrameSize(16384)
+    , _sendWindow(65535)
+    , _recvWindow(65535)
+    , _maxRequestBody(kDefaultMaxRequestBody)
+    , _continuationStream(0)
+    , _continuationFlags(0)
+    , _virtualTime(0)
+    , _pumping(false)
+    , _pumpAgain(false)
+    , _pumpQueued(false)
+    , _readTime(0)
+  {
+    _decoder.setMaxHeaderListSize(kMaxHeaderListSize);
+  }
+  ~Http2Connection() {}
+
+  /**
+   * setRequestCallback() - called with the context of a stream once its request is complete
+   */
+  void setRequestCallback(StreamCallback cb)
+  {
+    _requestCallback = std::move(cb);
+  }
+
+  /**
+   * setMaxRequestBody() - answer the requests with a body over @bytes with 413, before start()
+   */
+  void setMaxRequestBody(size_t bytes)
+  {
+    // one byte of window over it tells a body over it
+    _maxRequestBody = std::min<size_t>(bytes, 0x7ffffffe);
+  }
+
+  /**
+   * setStreamCloseCallback() - called with the context of a stream once it is closed
+   *
+   * The context's own close callback is called afterwards.
+   */
+  void setStreamCloseCallback(StreamCallback cb)
+  {
+    _streamCloseCallback = std::move(cb);
+  }
+
+  /**
+   * isPreface() - whether the @len bytes read so far start the client preface
+   *
+   * A partial match is only a maybe: read more until there are kPrefaceSize bytes.
+   */
+  static bool isPreface(const char* data, size_t len)
+  {
+    return memcmp(data, kPreface, std::min(len, kPrefaceSize)) == 0;
+  }
+
+  /**
+   * start() - send our settings, the first thing a server says
+   */
+  void start()
+  {
+    _conn->getLoop()->metrics().http2Connections.add();
+    std::string settings;
+    appendSetting(settings, SETTINGS_MAX_CONCURRENT_STREAMS, kMaxConcurrentStreams);
+    appendSetting(settings, SETTINGS_INITIAL_WINDOW_SIZE, streamWindow());
+    appendSetting(settings, SETTINGS_MAX_HEADER_LIST_SIZE, kMaxHeaderListSize);
+    appendSetting(settings, SETTINGS_ENABLE_PUSH, 0);
+    writeFrame(SETTINGS, 0, 0, settings.data(), settings.size());
+    writeWindowUpdate(0, kWindow - _recvWindow);
+    _recvWindow = kWindow;
+    flush();
+  }
+
+  /**
+   * upgrade() - take over from an HTTP/1.1 request that asked for "Upgrade: h2c"
+   * @settings: the HTTP2-Settings header of @request
+   * @timing: of @request so far
+   *
+   * The request becomes stream 1, already half closed, and is handed to the request callback.
+   * The 101 response must be sent before, the client preface is still to come. Returns false
+   * if @settings is malformed.
+   */
+  bool upgrade(const std::string& settings, std::shared_ptr<HttpRequest> request,
+               const HttpContext::Timing& timing)
+  {
+    std::string payload;
+    if (!decodeBase64Url(settings, payload) || applySettings(payload.data(), payload.size()))
+      return false;
+    start();
+    // what asked for the upgrade is not part of the request
+    for (auto it = request->headers.begin(); it != request->headers.end();) {
+      if (strcasecmp(it->first.c_str(), "connection") == 0 ||
+          strcasecmp(it->first.c_str(), "upgrade") == 0 ||
+          strcasecmp(it->first.c_str(), "http2-settings") == 0)
+        it = request->headers.erase(it);
+      else
+        ++it;
+    }
+    request->major = 2;
+    request->minor = 0;
+    std::shared_ptr<Http2Stream> stream = openStream(1);
+    stream->_request = std::move(request);
+    stream->_ctx->parser.setMessage(stream->_request);
+    stream->_remoteClosed = true;
+    stream->_ctx->_timing = timing;
+    _lastStreamId = 1;
+    dispatch(stream.get());
+    pump();
+    return true;
+  }
+
+  /**
+   * feed() - process the @len bytes read at @readTime, LoopMetrics::nowNs()
+   */
+  void feed(const char* data, size_t len, uint64_t readTime)
+  {
+    if (_failed || _closed)
+      return;
+    auto self = shared_from_this();
+    _readTime = readTime;
+    if (_in.empty()) {
+      size_t used = process(data, len);
+      if (!_failed)
+        _in.assign(data + used, len - used);
+    } else {
+      _in.append(data, len);
+      size_t used = process(_in.data(), _in.size());
+      if (!_failed)
+        _in.erase(0, used);
+    }
+    pump();
+  }
+
+  /**
+   * onWriteComplete() - the connection flushed what we gave it, frame some more
+   */
+  void onWriteComplete()
+  {
+    if (!_closed)
+      pump();
+  }
+
+  /**
+   * onClose() - the connection is gone, and so are its streams
+   */
+  void onClose()
+  {
+    if (_closed)
+      return;
+    _closed = true;
+    auto self = shared_from_this();
+    while (!_streams.empty())
+      closeStream(_streams.begin()->second);
+  }
+
+  /**
+   * goAway() - refuse new streams, the open ones are still served
+   */
+  void goAway(Error error = NO_ERROR)
+  {
+    if (_closed)
+      return;
+    _goingAway = true;
+    char payload[8];
+    putUint32(payload, _lastStreamId);
+    putUint32(payload + 4, error);
+    writeFrame(GOAWAY, 0, 0, payload, sizeof(payload));
+    flush();
+  }
+
+  size_t activeStreams() const
+  {
+    return _streams.size();
+  }
+
+private:
+  friend class Http2Stream;
+
+  TcpConnectionPtr _conn;
+  StreamCallback _requestCallback;
+  StreamCallback _streamCloseCallback;
+  HpackDecoder _decoder;
+  HpackEncoder _encoder;
+  std::map<uint32_t, std::shared_ptr<Http2Stream>> _streams;   // open ones
+  std::string _in;    // a partial frame
+  std::string _out;   // frames to write
+  bool _prefaceReceived;
+  bool _failed;       // a connection error was sent, the rest of the input is dropped
+  bool _closed;
+  bool _goingAway;
+  uint32_t _lastStreamId;
+  uint64_t _requests;
+  int64_t _peerInitialWindow;
+  uint32_t _peerMaxFrameSize;
+  int64_t _sendWindow;
+  int32_t _recvWindow;
+  size_t _maxRequestBody;
+  uint32_t _continuationStream;   // whose header block continues, 0 if none
+  uint8_t _continuationFlags;     // of the HEADERS frame it started with
+  std::string _headerBlock;
+  uint64_t _virtualTime;          // pass of the stream scheduled last
+  bool _pumping;
+  bool _pumpAgain;
+  bool _pumpQueued;
+  uint64_t _readTime;
+
+  static constexpr size_t kFrameHeaderSize = 9;
+  static constexpr uint32_t kMaxFrameSize = 16384;   // we receive, the default
+  static constexpr uint64_t kStride = 1 << 16;
+  static constexpr uint16_t kDefaultWeight = 16;
+
+  static uint32_t getUint32(const char* p)
+  {
+    const uint8_t* u = reinterpret_cast<const uint8_t*>(p);
+    return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | u[3];
+  }
+
+  static void putUint32(char* p, uint32_t v)
+  {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+  }
+
+  static void appendSetting(std::string& out, uint16_t id, uint32_t value)
+  {
+    char buf[6] = {static_cast<char>(id >> 8), static_cast<char>(id)};
+    putUint32(buf + 2, value);
+    out.append(buf, sizeof(buf));
+  }
+
+  static bool decodeBase64Url(const std::string& in, std::string& out)
+  {
+    uint32_t bits = 0;
+    int count = 0;
+    for (char c : in) {
+      int v;
+      if (c >= 'A' && c <= 'Z')
+        v = c - 'A';
+      else if (c >= 'a' && c <= 'z')
+        v = c - 'a' + 26;
+      else if (c >= '0' && c <= '9')
+        v = c - '0' + 52;
+      else if (c == '-' || c == '+')
+        v = 62;
+      else if (c == '_' || c == '/')
+        v = 63;
+      else if (c == '=')
+        break;
+      else
+        return false;
+      bits = (bits << 6) | v;
+      count += 6;
+      if (count >= 8) {
+        count -= 8;
+        out.push_back(static_cast<char>(bits >> count));
+      }
+    }
+    return true;
+  }
+
+  void writeFrameHeader(size_t len, uint8_t type, uint8_t flags, uint32_t id)
+  {
+    char header[kFrameHeaderSize] = {static_cast<char>(len >> 16),
+                                     static_cast<char>(len >> 8),
+                                     static_cast<char>(len),
+                                     static_cast<char>(type),
+                                     static_cast<char>(flags)};
+    putUint32(header + 5, id & 0x7fffffff);
+    _out.append(header, sizeof(header));
+  }
+
+  void writeFrame(uint8_t type, uint8_t flags, uint32_t id, const char* payload, size_t len)
+  {
+    writeFrameHeader(len, type, flags, id);
+    _out.append(payload, len);
+  }
+
+  void writeWindowUpdate(uint32_t id, uint32_t increment)
+  {
+    char payload[4];
+    putUint32(payload, increment);
+    writeFrame(WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+  }
+
+  void writeRstStream(uint32_t id, Error error)
+  {
+    char payload[4];
+    putUint32(payload, error);
+    writeFrame(RST_STREAM, 0, id, payload, sizeof(payload));
+  }
+
+  void flush()
+  {
+    if (_out.empty() || _closed)
+      return;
+    _conn->write(_out);
+    _out.clear();
+  }
+
+  /**
+   * connectionError() - tell the client why and close, after what is buffered
+   */
+  void connectionError(Error error)
+  {
+    alog_debug("Http2Connection", "%s: connection error %d",
+               _conn->getPeerAddr().toIpPort().c_str(), error);
+    goAway(error);
+    _failed = true;
+    _in.clear();
+    _conn->shutdown();
+  }
+
+  /**
+   * process() - handle the complete frames of @data, the bytes used
+   */
+  size_t process(const char* data, size_t len)
+  {
+    size_t used = 0;
+    if (!_prefaceReceived) {
+      if (!isPreface(data, len)) {
+        connectionError(PROTOCOL_ERROR);
+        return 0;
+      }
+      if (len < kPrefaceSize)
+        return 0;
+      _prefaceReceived = true;
+      used = kPrefaceSize;
+    }
+    while (!_failed && len - used >= kFrameHeaderSize) {
+      const uint8_t* h = reinterpret_cast<const uint8_t*>(data + used);
+      size_t length = (size_t(h[0]) << 16) | (size_t(h[1]) << 8) | h[2];
+      if (length > kMaxFrameSize) {
+        connectionError(FRAME_SIZE_ERROR);
+        break;
+      }
+      if (len - used < kFrameHeaderSize + length)
+        break;
+      uint32_t id = getUint32(data + used + 5) & 0x7fffffff;
+      Error error = handleFrame(h[3], h[4], id, data + used + kFrameHeaderSize, length);
+      used += kFrameHeaderSize + length;
+      if (error != NO_ERROR)
+        connectionError(error);
+    }
+    return used;
+  }
+
+  Error handleFrame(uint8_t type, uint8_t flags, uint32_t id, const char* p, size_t len)
+  {
+    // nothing may come between the frames of a header block
+    if (_continuationStream && (type != CONTINUATION || id != _continuationStream))
+      return PROTOCOL_ERROR;
+    switch (type) {
+      case DATA:
+        return handleData(flags, id, p, len);
+      case HEADERS:
+        return handleHeaders(flags, id, p, len);
+      case PRIORITY:
+        if (!id)
+          return PROTOCOL_ERROR;
+        if (len != 5)
+          return FRAME_SIZE_ERROR;
+        if (auto it = _streams.find(id); it != _streams.end())
+          setPriority(it->second.get(), p);
+        return NO_ERROR;
+      case RST_STREAM:
+        if (!id || id > _lastStreamId)
+          return PROTOCOL_ERROR;
+        if (len != 4)
+          return FRAME_SIZE_ERROR;
+        if (auto it = _streams.find(id); it != _streams.end())
+          closeStream(it->second);
+        return NO_ERROR;
+      case SETTINGS:
+        return handleSettings(flags, id, p, len);
+      case PUSH_PROMISE:
+        // we told the client not to push, and it may not anyway
+        return PROTOCOL_ERROR;
+      case PING:
+        if (id)
+          return PROTOCOL_ERROR;
+        if (len != 8)
+          return FRAME_SIZE_ERROR;
+        if (!(flags & FLAG_ACK))
+          writeFrame(PING, FLAG_ACK, 0, p, len);
+        return NO_ERROR;
+      case GOAWAY:
+        if (id)
+          return PROTOCOL_ERROR;
+        // the client opens no more streams, we serve the ones it has
+        _goingAway = true;
+        return NO_ERROR;
+      case WINDOW_UPDATE:
+        return handleWindowUpdate(id, p, len);
+      case CONTINUATION:
+        if (!_continuationStream)
+          return PROTOCOL_ERROR;
+        _headerBlock.append(p, len);
+        if (_headerBlock.size() > kMaxHeaderListSize)
+          return PROTOCOL_ERROR;
+        if (!(flags & FLAG_END_HEADERS))
+          return NO_ERROR;
+        id = std::exchange(_continuationStream, 0);
+        return endHeaders(id, _continuationFlags);
+      default:
+        // unknown types are ignored
+        return NO_ERROR;
+    }
+  }
+
+  /**
+   * streamWindow() - the receive window each stream starts with, and never gets more of
+   */
+  int32_t streamWindow() const
+  {
+    return _maxRequestBody + 1;
+  }
+
+  /**
+   * consumeWindow() - account @len received bytes against @window, false if over it
+   */
+  static bool consumeWindow(int32_t& window, size_t len)
+  {
+    if (static_cast<int64_t>(len) > window)
+      return false;
+    window -= len;
+    return true;
+  }
+
+  Error handleData(uint8_t flags, uint32_t id, const char* p, size_t len)
+  {
+    if (!id)
+      return PROTOCOL_ERROR;
+    // padding counts against the windows too
+    if (!consumeWindow(_recvWindow, len))
+      return FLOW_CONTROL_ERROR;
+    if (_recvWindow < kWindow / 2) {
+      writeWindowUpdate(0, kWindow - _recvWindow);
+      _recvWindow = kWindow;
+    }
+    auto it = _streams.find(id);
+    if (it == _streams.end()) {
+      // frames of a stream we closed may still be on their way
+      return id > _lastStreamId ? PROTOCOL_ERROR : NO_ERROR;
+    }
+    if (it->second->_remoteClosed) {
+      resetStream(it->second, STREAM_CLOSED);
+      return NO_ERROR;
+    }
+    std::shared_ptr<Http2Stream> stream = it->second;
+    // the last frame of a stream is held to its window as well
+    if (!consumeWindow(stream->_recvWindow, len)) {
+      resetStream(stream, FLOW_CONTROL_ERROR);
+      return NO_ERROR;
+    }
+    size_t frameLen = len;
+    if (!stripPadding(flags, p, len))
+      return PROTOCOL_ERROR;
+    if (flags & FLAG_END_STREAM) {
+      stream->_remoteClosed = true;
+    } else if (frameLen > len) {
+      // the padding is dropped, as good as consumed
+      stream->_recvWindow += frameLen - len;
+      writeWindowUpdate(id, frameLen - len);
+    }
+    if (stream->_bodyRefused)
+      return NO_ERROR;
+    if (stream->_request->body.size() + len > _maxRequestBody) {
+      refuseBody(stream);
+      return NO_ERROR;
+    }
+    stream->_request->body.append(p, len);
+    if (stream->_remoteClosed)
+      dispatch(stream.get());
+    return NO_ERROR;
+  }
+
+  /**
+   * refuseBody() - answer 413 to the request of @stream, its body being over the maximum
+   */
+  void refuseBody(const std::shared_ptr<Http2Stream>& stream)
+  {
+    stream->_bodyRefused = true;
+    std::string().swap(stream->_request->body);
+    stream->_ctx->sendError(HttpStatus::REQUEST_ENTITY_TOO_LARGE);
+  }
+
+  static bool stripPadding(uint8_t flags, const char*& p, size_t& len)
+  {
+    if (!(flags & FLAG_PADDED))
+      return true;
+    if (len < 1)
+      return false;
+    size_t pad = static_cast<uint8_t>(p[0]);
+    if (pad >= len)
+      return false;
+    p++;
+    len -= 1 + pad;
+    return true;
+  }
+
+  Error handleHeaders(uint8_t flags, uint32_t id, const char* p, size_t len)
+  {
+    if (!id || !(id & 1))
+      return PROTOCOL_ERROR;
+    if (!stripPadding(flags, p, len))
+      return PROTOCOL_ERROR;
+    const char* priority = nullptr;
+    if (flags & FLAG_PRIORITY) {
+      if (len < 5)
+        return FRAME_SIZE_ERROR;
+      if ((getUint32(p) & 0x7fffffff) == id)
+        return PROTOCOL_ERROR;
+      priority = p;
+      p += 5;
+      len -= 5;
+    }
+    auto it = _streams.find(id);
+    if (it == _streams.end()) {
+      // a new stream, unless it is an old one
+      if (id <= _lastStreamId)
+        return STREAM_CLOSED;
+      _lastStreamId = id;
+      if (!_goingAway && _streams.size() < kMaxConcurrentStreams) {
+        std::shared_ptr<Http2Stream> stream = openStream(id);
+        if (priority)
+          setPriority(stream.get(), priority);
+      } else if (!_goingAway) {
+        _conn->getLoop()->metrics().http2StreamsRefused.add();
+      }
+    } else if (it->second->_remoteClosed || !(flags & FLAG_END_STREAM)) {
+      // trailers end the stream, and only come once
+      return PROTOCOL_ERROR;
+    }
+    _headerBlock.assign(p, len);
+    if (!(flags & FLAG_END_HEADERS)) {
+      _continuationStream = id;
+      _continuationFlags = flags;
+      return NO_ERROR;
+    }
+    return endHeaders(id, flags);
+  }
+
+  /**
+   * endHeaders() - the header block of stream @id is complete
+   *
+   * It is decoded even for a stream we refused, to keep the HPACK table in sync.
+   */
+  Error endHeaders(uint32_t id, uint8_t flags)
+  {
+    HpackHeaders headers;
+    bool decoded =
+      _decoder.decode(reinterpret_cast<const uint8_t*>(_headerBlock.data()), _headerBlock.size(),
+                      headers);
+    _headerBlock.clear();
+    if (!decoded)
+      return COMPRESSION_ERROR;
+    auto it = _streams.find(id);
+    if (it == _streams.end()) {
+      writeRstStream(id, REFUSED_STREAM);
+      return NO_ERROR;
+    }
+    std::shared_ptr<Http2Stream> stream = it->second;
+    // trailers are dropped, a request has nowhere to put them
+    if (stream->_request->method != HTTP_PRI) {
+      stream->_remoteClosed = true;
+      if (!stream->_bodyRefused)
+        dispatch(stream.get());
+      return NO_ERROR;
+    }
+    if (!buildRequest(headers, *stream->_request)) {
+      resetStream(stream, PROTOCOL_ERROR);
+      return NO_ERROR;
+    }
+    stream->_ctx->_timing.headersComplete = LoopMetrics::nowNs();
+    // no need to wait for a body announced over the maximum
+    const std::string* length = stream->_request->findHeader("content-length");
+    if (!(flags & FLAG_END_STREAM) && length &&
+        strtoull(length->c_str(), nullptr, 10) > _maxRequestBody) {
+      refuseBody(stream);
+      return NO_ERROR;
+    }
+    if (flags & FLAG_END_STREAM) {
+      stream->_remoteClosed = true;
+      dispatch(stream.get());
+    }
+    return NO_ERROR;
+  }
+
+  static bool methodOf(const std::string& name, llhttp_method_t& method)
+  {
+    static const std::unordered_map<std::string, llhttp_method_t> methods = [] {
+      std::unordered_map<std::string, llhttp_method_t> m;
+      for (int i = HTTP_DELETE; i <= HTTP_FLUSH; i++) {
+        llhttp_method_t method = static_cast<llhttp_method_t>(i);
+        m.emplace(llhttp_method_name(method), method);
+      }
+      return m;
+    }();
+    auto it = methods.find(name);
+    if (it == methods.end() || it->second == HTTP_PRI)
+      return false;
+    method = it->second;
+    return true;
+  }
+
+  /**
+   * buildRequest() - @req as if it came in HTTP/1.1, false if the headers are malformed
+   */
+  static bool buildRequest(const HpackHeaders& headers, HttpRequest& req)
+  {
+    bool hasMethod = false, hasPath = false, regular = false;
+    std::string authority;
+    for (const auto& [name, value] : headers) {
+      if (name.empty())
+        return false;
+      if (name[0] == ':') {
+        // pseudo headers come first
+        if (regular)
+          return false;
+        if (name == ":method") {
+          if (hasMethod || !methodOf(value, req.method))
+            return false;
+          hasMethod = true;
+        } else if (name == ":path") {
+          if (hasPath || value.empty())
+            return false;
+          req.path = value;
+          hasPath = true;
+        } else if (name == ":authority") {
+          authority = value;
+        } else if (name != ":scheme") {
+          return false;
+        }
+        continue;
+      }
+      regular = true;
+      for (char c : name)
+        if (isupper(static_cast<unsigned char>(c)))
+          return false;
+      if (name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+          name == "transfer-encoding" || name == "upgrade")
+        return false;
+      if (name == "te" && value != "trailers")
+        return false;
+      auto [it, inserted] = req.headers.emplace(name, value);
+      if (!inserted)
+        it->second.append(name == "cookie" ? "; " : ", ").append(value);
+    }
+    if (!hasMethod || (!hasPath && req.method != HTTP_CONNECT))
+      return false;
+    // under the name HTTP/1.1 handlers know it by
+    if (!authority.empty()) {
+      req.headers.erase("host");
+      req.headers.insert_or_assign("Host", authority);
+    }
+    req.major = 2;
+    req.minor = 0;
+    return true;
+  }
+
+  Error handleSettings(uint8_t flags, uint32_t id, const char* p, size_t len)
+  {
+    if (id)
+      return PROTOCOL_ERROR;
+    if (flags & FLAG_ACK)
+      return len ? FRAME_SIZE_ERROR : NO_ERROR;
+    if (len % 6)
+      return FRAME_SIZE_ERROR;
+    if (Error error = applySettings(p, len))
+      return error;
+    writeFrame(SETTINGS, FLAG_ACK, 0, nullptr, 0);
+    return NO_ERROR;
+  }
+
+  Error applySettings(const char* p, size_t len)
+  {
+    if (len % 6)
+      return FRAME_SIZE_ERROR;
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+      uint16_t setting = (uint16_t(uint8_t(p[i])) << 8) | uint8_t(p[i + 1]);
+      uint32_t value = getUint32(p + i + 2);
+      switch (setting) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+          _encoder.setMaxTableSize(value);
+          break;
+        case SETTINGS_ENABLE_PUSH:
+          if (value > 1)
+            return PROTOCOL_ERROR;
+          break;
+        case SETTINGS_INITIAL_WINDOW_SIZE: {
+          if (value > 0x7fffffff)
+            return FLOW_CONTROL_ERROR;
+          int64_t delta = static_cast<int64_t>(value) - _peerInitialWindow;
+          for (auto& [sid, stream] : _streams) {
+            stream->_sendWindow += delta;
+            if (stream->_sendWindow > 0x7fffffff)
+              return FLOW_CONTROL_ERROR;
+          }
+          _peerInitialWindow = value;
+          break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+          if (value < 16384 || value > 16777215)
+            return PROTOCOL_ERROR;
+          _peerMaxFrameSize = value;
+          break;
+        default:
+          break;
+      }
+    }
+    return NO_ERROR;
+  }
+
+  Error handleWindowUpdate(uint32_t id, const char* p, size_t len)
+  {
+    if (len != 4)
+      return FRAME_SIZE_ERROR;
+    uint32_t increment = getUint32(p) & 0x7fffffff;
+    if (!id) {
+      if (!increment)
+        return PROTOCOL_ERROR;
+      _sendWindow += increment;
+      return _sendWindow > 0x7fffffff ? FLOW_CONTROL_ERROR : NO_ERROR;
+    }
+    auto it = _streams.find(id);
+    if (it == _streams.end())
+      return id > _lastStreamId ? PROTOCOL_ERROR : NO_ERROR;
+    std::shared_ptr<Http2Stream> stream = it->second;
+    if (!increment) {
+      resetStream(stream, PROTOCOL_ERROR);
+      return NO_ERROR;
+    }
+    stream->_sendWindow += increment;
+    if (stream->_sendWindow > 0x7fffffff)
+      resetStream(stream, FLOW_CONTROL_ERROR);
+    return NO_ERROR;
+  }
+
+  Http2Stream* findStream(uint32_t id) const
+  {
+    auto it = _streams.find(id);
+    return it == _streams.end() ? nullptr : it->second.get();
+  }
+
+  /**
+   * dependsOn() - whether @stream depends on @ancestor, directly or not
+   */
+  bool dependsOn(const Http2Stream* stream, uint32_t ancestor) const
+  {
+    // the depth is bounded, in case the tree is broken
+    for (size_t depth = 0; stream && depth <= _streams.size(); depth++) {
+      if (stream->_parent == ancestor)
+        return true;
+      stream = findStream(stream->_parent);
+    }
+    return false;
+  }
+
+  /**
+   * setPriority() - apply the 5 bytes of priority at @p to @stream
+   */
+  void setPriority(Http2Stream* stream, const char* p)
+  {
+    uint32_t dependency = getUint32(p);
+    bool exclusive = dependency & 0x80000000;
+    dependency &= 0x7fffffff;
+    if (dependency == stream->_id)
+      return;
+    Http2Stream* parent = findStream(dependency);
+    if (!parent)
+      dependency = 0;
+    else if (dependsOn(parent, stream->_id))
+      // a stream depending on its own descendant: the descendant moves up first
+      parent->_parent = stream->_parent;
+    if (exclusive)
+      for (auto& [id, s] : _streams)
+        if (s->_parent == dependency && s.get() != stream)
+          s->_parent = stream->_id;
+    stream->_parent = dependency;
+    stream->_weight = static_cast<uint8_t>(p[4]) + 1;
+  }
+
+  std::shared_ptr<Http2Stream> openStream(uint32_t id)
+  {
+    auto stream = std::make_shared<Http2Stream>(this, id, _peerInitialWindow, streamWindow());
+    stream->_request = std::make_shared<HttpRequest>();
+    // not a method a request can have, until the headers say otherwise
+    stream->_request->method = HTTP_PRI;
+    stream->_pass = _virtualTime;
+    HttpContextPtr ctx = HttpContext::create(_conn);
+    ctx->_sink = stream;
+    ctx->parser.setMessage(stream->_request);
+    ctx->_readTime = _readTime;
+    // the connection was handed off for its first request only
+    if (_requests++) {
+      ctx->_timing.accept = 0;
+      ctx->_timing.established = 0;
+    }
+    ctx->_timing.firstByte = _readTime;
+    stream->_ctx = std::move(ctx);
+    _streams.emplace(id, stream);
+    _conn->getLoop()->metrics().http2Streams.add();
+    return stream;
+  }
+
+  /**
+   * dispatch() - the request of @stream is complete, hand it over
+   */
+  void dispatch(Http2Stream* stream)
+  {
+    HttpContextPtr ctx = stream->_ctx;
+    ctx->_timing.messageComplete = LoopMetrics::nowNs();
+    stream->_response.setSkipBody(stream->_request->method == HTTP_HEAD);
+    if (_requestCallback)
+      _requestCallback(ctx);
+  }
+
+  /**
+   * resetStream() - send RST_STREAM and forget the stream
+   */
+  void resetStream(const std::shared_ptr<Http2Stream>& stream, Error error)
+  {
+    writeRstStream(stream->_id, error);
+    closeStream(stream);
+    schedulePump();
+  }
+
+  void closeStream(std::shared_ptr<Http2Stream> stream)
+  {
+    if (!stream->_owner)
+      return;
+    stream->_owner = nullptr;
+    _streams.erase(stream->_id);
+    // its children take its place in the tree
+    for (auto& [id, s] : _streams)
+      if (s->_parent == stream->_id)
+        s->_parent = stream->_parent;
+    stream->_data.popFront();
+    HttpContextPtr ctx = std::move(stream->_ctx);
+    if (!ctx)
+      return;
+    if (stream->_endSent)
+      ctx->_timing.lastFlush = LoopMetrics::nowNs();
+    if (_streamCloseCallback)
+      _streamCloseCallback(ctx);
+    ctx->closeCallback();
+    ctx->setCloseCallback(nullptr);
+    ctx->setWriteCompleteCallback(nullptr);
+  }
+
+  /**
+   * endSent() - @stream has sent all of its response
+   */
+  void endSent(const std::shared_ptr<Http2Stream>& stream)
+  {
+    stream->_endSent = true;
+    // an answer before the end of the request: the rest of it is not needed
+    if (!stream->_remoteClosed)
+      writeRstStream(stream->_id, NO_ERROR);
+    closeStream(stream);
+  }
+
+  void sendHeaders(const std::shared_ptr<Http2Stream>& stream)
+  {
+    std::string block;
+    _encoder.encode(stream->_responseHeaders, block);
+    stream->_responseHeaders.clear();
+    stream->_headersReady = false;
+    stream->_headersSent = true;
+    bool end = stream->_ended && stream->_data.empty();
+    uint8_t flags = end ? FLAG_END_STREAM : 0;
+    uint8_t type = HEADERS;
+    size_t sent = 0;
+    do {
+      size_t n = std::min<size_t>(block.size() - sent, _peerMaxFrameSize);
+      if (sent + n == block.size())
+        flags |= FLAG_END_HEADERS;
+      writeFrame(type, flags, stream->_id, block.data() + sent, n);
+      sent += n;
+      type = CONTINUATION;
+      flags = 0;
+    } while (sent < block.size());
+    if (end)
+      endSent(stream);
+  }
+
+  /**
+   * readyToSend() - whether @stream has a DATA frame it may send now
+   */
+  bool readyToSend(const Http2Stream* stream) const
+  {
+    if (!stream->_headersSent || stream->_endSent)
+      return false;
+    if (stream->_data.empty())
+      return stream->_ended;
+    return stream->_sendWindow > 0 && _sendWindow > 0;
+  }
+
+  /**
+   * nextStream() - the ready stream furthest behind, among those whose ancestors wait
+   */
+  std::shared_ptr<Http2Stream> nextStream() const
+  {
+    std::shared_ptr<Http2Stream> next;
+    for (auto& [id, stream] : _streams) {
+      if (!readyToSend(stream.get()) || (next && stream->_pass >= next->_pass))
+        continue;
+      bool blocked = false;
+      const Http2Stream* s = stream.get();
+      for (size_t depth = 0; s && s->_parent && depth <= _streams.size(); depth++) {
+        s = findStream(s->_parent);
+        if (s && readyToSend(s)) {
+          blocked = true;
+          break;
+        }
+      }
+      if (!blocked)
+        next = stream;
+    }
+    return next;
+  }
+
+  void sendData()
+  {
+    // after an upgrade, the body waits for the preface: clients only buffer so much of what
+    // comes along with the 101 response
+    if (!_prefaceReceived)
+      return;
+    while (_conn->writeBufferSize() + _out.size() < kMaxBuffered) {
+      std::shared_ptr<Http2Stream> stream = nextStream();
+      if (!stream)
+        break;
+      size_t n = stream->_data.size();
+      if (n) {
+        int64_t window = std::min(stream->_sendWindow, _sendWindow);
+        n = std::min<size_t>({n, _peerMaxFrameSize, static_cast<size_t>(window)});
+      }
+      bool end = stream->_ended && n == stream->_data.size();
+      writeFrameHeader(n, DATA, end ? FLAG_END_STREAM : 0, stream->_id);
+      _out.append(stream->_data.data(), n);
+      stream->_data.popFront(n);
+      stream->_sendWindow -= n;
+      _sendWindow -= n;
+      _virtualTime = stream->_pass;
+      stream->_pass += kStride / stream->_weight;
+      if (end) {
+        endSent(stream);
+      } else if (stream->_data.empty() && stream->_drainPending) {
+        // a handler writing as its stream drains refills it right away, so the streams stay
+        // backlogged and the weights and dependencies decide
+        stream->_drainPending = false;
+        stream->_ctx->writeCompleteCallback();
+      }
+    }
+  }
+
+  void schedulePump()
+  {
+    if (_pumping) {
+      _pumpAgain = true;
+      return;
+    }
+    if (_pumpQueued || _closed)
+      return;
+    _pumpQueued = true;
+    _conn->getLoop()->queueInLoop([weakSelf = weak_from_this()] {
+      if (auto self = weakSelf.lock()) {
+        self->_pumpQueued = false;
+        self->pump();
+      }
+    });
+  }
+
+  /**
+   * pump() - frame what the streams have and write it
+   */
+  void pump()
+  {
+    if (_pumping) {
+      _pumpAgain = true;
+      return;
+    }
+    if (_closed)
+      return;
+    auto self = shared_from_this();
+    _pumping = true;
+    std::vector<std::shared_ptr<Http2Stream>> streams;
+    do {
+      _pumpAgain = false;
+      streams.clear();
+      for (auto& [id, stream] : _streams)
+        streams.push_back(stream);
+      for (auto& stream : streams)
+        if (stream->_headersReady && stream->_owner)
+          sendHeaders(stream);
+      sendData();
+      flush();
+    } while (_pumpAgain && !_closed);
+    _pumping = false;
+    if (_goingAway && _streams.empty() && !_failed) {
+      _failed = true;
+      _conn->shutdown();
+    }
+  }
+};
+
+inline Http2Stream::Http2Stream(Http2Connection* owner, uint32_t id, int64_t sendWindow,
+                                int32_t recvWindow)
+  : _owner(owner)
+  , _id(id)
+  , _data(4096)
+  , _sendWindow(sendWindow)
+  , _recvWindow(recvWindow)
+  , _parent(0)
+  , _weight(Http2Connection::kDefaultWeight)
+  , _pass(0)
+  , _headersReady(false)
+  , _headersSent(false)
+  , _ended(false)
+  , _endSent(false)
+  , _remoteClosed(false)
+  , _drainPending(false)
+  , _bodyRefused(false)
+{
+  _response.setHeaderCallback([this](const HttpParser<HttpResponse>&) { onResponseHeaders(); });
+  _response.setBodyCallback([this](const char* data, size_t len) { onResponseBody(data, len); });
+  _response.setMessageCallback([this](const HttpParser<HttpResponse>&) { onResponseComplete(); });
+}
+
+inline int Http2Stream::write(const char* data, size_t len)
+{
+  if (!_owner)
+    return -1;
+  // what follows the response is dropped, as a closing connection would
+  if (_ended)
+    return len;
+  llhttp_errno_t err = _response.advance(data, len);
+  if (err != HPE_OK && _owner) {
+    alog_warn("Http2Stream", "stream %u: bad response: %s", _id, llhttp_errno_name(err));
+    forceClose();
+    return -1;
+  }
+  return len;
+}
+
+inline void Http2Stream::shutdown()
+{
+  if (!_owner)
+    return;
+  // the end of a response delimited by the end of the connection
+  if (!_ended)
+    _response.finish();
+  if (!_ended)
+    forceClose();
+}
+
+inline void Http2Stream::forceClose()
+{
+  if (_owner)
+    _owner->resetStream(_owner->_streams.at(_id), Http2Connection::INTERNAL_ERROR);
+}
+
+inline void Http2Stream::onResponseHeaders()
+{
+  uint16_t status = _response.getMessage()->status_code;
+  // interim responses have no place in the response we build
+  if (status < 200)
+    return;
+  _responseHeaders.emplace_back(":status", std::to_string(status));
+  for (const auto& [key, value] : _response.getHeaders()) {
+    std::string name(key);
+    for (char& c : name)
+      c = tolower(static_cast<unsigned char>(c));
+    if (name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+        name == "transfer-encoding" || name == "upgrade")
+      continue;
+    _responseHeaders.emplace_back(std::move(name), value);
+  }
+  _headersReady = true;
+  _owner->schedulePump();
+}
+
+inline void Http2Stream::onResponseBody(const char* data, size_t len)
+{
+  if (_data.empty())
+    _pass = std::max(_pass, _owner->_virtualTime);
+  _data.append(data, len);
+  _drainPending = true;
+  _owner->schedulePump();
+}
+
+inline void Http2Stream::onResponseComplete()
+{
+  if (_response.getMessage()->status_code < 200)
+    return;
+  _ended = true;
+  _owner->schedulePump();
+}
+
+#endif
@@ -32,6 +32,10 @@ public:
   {
     _client.start();
   }
+  void enableReconnect()
+  {
+    _client.enableReconnect();
+  }
   void stopConnect()
   {
     _client.stopConnect();
@@ -0,0 +1,588 @@
+#ifndef __HTTPCLIENTPOOL_HPP__
+#define __HTTPCLIENTPOOL_HPP__
+
+#include <stdlib.h>
+#include <coroutine>
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "CountDownLatch.hpp"
+#include "EventLoop.hpp"
+#include "TcpClient.hpp"
+#include "HttpParser.hpp"
+
+/**
+ * class HttpClientPool - HTTP requests issued from the loops, over pooled keep-alive connections
+ *
+ * Every loop has a pool of its own (see addLoops()): a request made in a loop is sent and
+ * answered on connections of that loop, and its callback runs there, with no locking.
+ *
+ * Per host, up to maxConnections are kept alive. A request goes to an idle connection, or is
+ * pipelined behind the requests in flight on a connection up to the pipeline depth, or opens
+ * a new connection, or waits for one. Only idempotent requests are pipelined, and nothing is
+ * pipelined behind a request that is not. An idempotent request lost to a closing connection,
+ * e.g. an idle one the server closed as it was reused, is retried once.
+ *
+ * Only http:// URLs are supported. A host name is resolved once, blocking.
+ */
+class HttpClientPool : noncopyable
+{
+public:
+  enum Error
+  {
+    OK = 0,
+    BAD_URL,
+    CONNECT_FAILED,
+    TIMEOUT,
+    CLOSED,
+    BAD_RESPONSE,
+  };
+
+  typedef std::shared_ptr<HttpResponse> HttpResponsePtr;
+  typedef std::function<void(Error, const HttpResponsePtr&)> ResponseCallback;
+  typedef std::vector<std::pair<std::string, std::string>> Headers;
+
+  HttpClientPool()
+    : _maxConnections(8)
+    , _pipelineDepth(1)
+    , _connectTimeout(Time(0).offsetBy(2.0))
+    , _requestTimeout(Time(0).offsetBy(10.0))
+    , _idleTimeout(Time(0).offsetBy(60.0))
+  {}
+
+  /**
+   * ~HttpClientPool() - fail the requests left and close the connections, in every loop
+   *
+   * Waits for the loops, so they must still be running.
+   */
+  ~HttpClientPool()
+  {
+    CountDownLatch latch(_shards.size());
+    for (auto& shard : _shards)
+      shard->_loop->runInLoop([&latch, shard = shard.get()] {
+        shard->shutdown();
+        latch.countDown();
+      });
+    latch.wait();
+  }
+
+  /**
+   * setMaxConnections() - connections kept to each host by each loop
+   */
+  void setMaxConnections(size_t perHost)
+  {
+    _maxConnections = perHost;
+  }
+
+  /**
+   * setPipelineDepth() - requests in flight on a connection at once, 1 not to pipeline
+   */
+  void setPipelineDepth(size_t depth)
+  {
+    _pipelineDepth = depth;
+  }
+
+  /**
+   * setTimeouts() - in seconds
+   * @connect: to set up a connection
+   * @request: from the request being made to its response, waiting for a connection included
+   * @idle: a connection with nothing in flight is closed after
+   */
+  void setTimeouts(double connect, double request, double idle)
+  {
+    _connectTimeout = Time(0).offsetBy(connect);
+    _requestTimeout = Time(0).offsetBy(request);
+    _idleTimeout = Time(0).offsetBy(idle);
+  }
+
+  /**
+   * addLoops() - create a pool for each of @loops, before any request is made
+   */
+  void addLoops(const std::vector<EventLoop*>& loops)
+  {
+    for (EventLoop* loop : loops) {
+      _shards.emplace_back(new LoopPool(this, loop));
+      _shardOfLoop[loop] = _shards.back().get();
+    }
+  }
+
+  /**
+   * request() - send a request to @url, @cb gets the response
+   *
+   * Only to be called in one of the loops, where @cb runs then. @cb may be called before
+   * request() returns, e.g. on a bad URL. Host and Content-Length are added to @headers.
+   */
+  void request(llhttp_method_t method, const std::string& url, const Headers& headers,
+               std::string body, ResponseCallback cb)
+  {
+    auto it = _shardOfLoop.find(EventLoop::current());
+    assert(it != _shardOfLoop.end());
+    it->second->request(method, url, headers, std::move(body), std::move(cb));
+  }
+
+  /**
+   * fetch() - awaitable request(), see CoTask
+   *
+   * Resumes with the error and the response, which is null unless the error is OK. The task
+   * is resumed from the queue of the loop rather than from within the pool, so it may go on to
+   * destroy the pool.
+   */
+  auto fetch(llhttp_method_t method, const std::string& url, const Headers& headers = {},
+             std::string body = {})
+  {
+    struct Awaiter
+    {
+      HttpClientPool* pool;
+      llhttp_method_t method;
+      const std::string& url;
+      const Headers& headers;
+      std::string body;
+      Error error;
+      HttpResponsePtr response;
+
+      bool await_ready() const noexcept
+      {
+        return false;
+      }
+      void await_suspend(std::coroutine_handle<> h)
+      {
+        pool->request(method, url, headers, std::move(body),
+                      [this, h](Error e, const HttpResponsePtr& r) {
+                        error = e;
+                        response = r;
+                        EventLoop::current()->queueInLoop([h] { h.resume(); });
+                      });
+      }
+      std::pair<Error, HttpResponsePtr> await_resume()
+      {
+        return {error, std::move(response)};
+      }
+    };
+    return Awaiter{this, method, url, headers, std::move(body), OK, nullptr};
+  }
+
+  static const char* errorString(Error error)
+  {
+    switch (error) {
+      case OK: return "ok";
+      case BAD_URL: return "bad url";
+      case CONNECT_FAILED: return "connect failed";
+      case TIMEOUT: return "timeout";
+      case CLOSED: return "connection closed";
+      case BAD_RESPONSE: return "bad response";
+    }
+    return "unknown";
+  }
+
+private:
+  struct Pending
+  {
+    std::string data;   // the serialized request
+    bool idempotent;
+    bool head;
+    bool retried;
+    Time deadline = Time(0);
+    ResponseCallback cb;
+  };
+  typedef std::unique_ptr<Pending> PendingPtr;
+
+  class LoopPool;
+  struct Host;
+
+  /**
+   * struct Conn - a pooled connection, owned by its host
+   *
+   * Torn down in two steps: the connection is closed, and the Conn is freed from the queue of
+   * the loop, not to destroy the TcpClient from within one of its callbacks.
+   */
+  struct Conn
+  {
+    LoopPool* pool;   // nullptr once the pool is shut down
+    Host* host;
+    std::shared_ptr<TcpClient> client;
+    TcpConnectionPtr conn;   // null while connecting
+    HttpParser<HttpResponse> parser;
+    std::deque<PendingPtr> inflight;
+    bool closing = false;
+    Time lastUsed = Time(0);
+    TimingWheel::Entry timeoutEntry;
+  };
+  typedef std::shared_ptr<Conn> ConnPtr;
+
+  struct Host
+  {
+    std::string hostHeader;
+    InetAddress addr;
+    std::list<ConnPtr> conns;
+    size_t connecting = 0;
+    std::deque<PendingPtr> waiting;
+    TimingWheel::Entry timeoutEntry;   // of the oldest waiting request
+  };
+
+  class LoopPool : noncopyable
+  {
+  public:
+    LoopPool(HttpClientPool* owner, EventLoop* loop)
+      : _owner(owner)
+      , _loop(loop)
+      , _shutdown(false)
+    {}
+
+    void request(llhttp_method_t method, const std::string& url, const Headers& headers,
+                 std::string body, ResponseCallback cb)
+    {
+      std::string host, path;
+      uint16_t port;
+      if (_shutdown) {
+        cb(CLOSED, nullptr);
+        return;
+      }
+      if (!parseUrl(url, host, port, path)) {
+        cb(BAD_URL, nullptr);
+        return;
+      }
+      Host* h = getHost(host, port);
+      if (!h) {
+        cb(BAD_URL, nullptr);
+        return;
+      }
+
+      PendingPtr p(new Pending);
+      p->data.reserve(128 + path.size() + body.size());
+      p->data.append(llhttp_method_name(method)).append(" ").append(path);
+      p->data.append(" HTTP/1.1\r\nHost: ").append(h->hostHeader).append("\r\n");
+      for (const auto& [name, value] : headers)
+        p->data.append(name).append(": ").append(value).append("\r\n");
+      if (!body.empty() || method == HTTP_POST || method == HTTP_PUT)
+        p->data.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
+      p->data.append("\r\n").append(body);
+      HttpRequest req;
+      req.method = method;
+      p->idempotent = req.isIdempotent();
+      p->head = method == HTTP_HEAD;
+      p->retried = false;
+      p->deadline = _loop->now() + _owner->_requestTimeout;
+      p->cb = std::move(cb);
+      h->waiting.push_back(std::move(p));
+      dispatch(h);
+    }
+
+    void shutdown()
+    {
+      _shutdown = true;
+      for (auto& [key, h] : _hosts) {
+        h->timeoutEntry.cancel();
+        failAll(h->waiting, CLOSED);
+        for (ConnPtr& c : h->conns) {
+          c->pool = nullptr;
+          c->timeoutEntry.cancel();
+          failAll(c->inflight, CLOSED);
+          if (c->conn)
+            c->client->forceClose();
+          else
+            c->client->stopConnect();
+          // after the close queued by forceClose()
+          _loop->queueInLoop([c] {});
+        }
+      }
+      _hosts.clear();
+    }
+
+  private:
+    friend class HttpClientPool;
+
+    HttpClientPool* _owner;
+    EventLoop* _loop;
+    bool _shutdown;
+    std::unordered_map<std::string, std::unique_ptr<Host>> _hosts;   // by host:port
+
+    static bool parseUrl(const std::string& url, std::string& host, uint16_t& port,
+                         std::string& path)
+    {
+      static const char kScheme[] = "http://";
+      if (url.compare(0, sizeof(kScheme) - 1, kScheme) != 0)
+        return false;
+      size_t start = sizeof(kScheme) - 1;
+      size_t slash = url.find('/', start);
+      std::string authority = url.substr(start, slash - start);
+      path = slash == std::string::npos ? "/" : url.substr(slash);
+      port = 80;
+      size_t colon = authority.rfind(':');
+      if (!authority.empty() && authority[0] == '[') {
+        // [v6]:port
+        size_t close = authority.find(']');
+        if (close == std::string::npos)
+          return false;
+        host = authority.substr(1, close - 1);
+        colon = authority.size() > close + 1 && authority[close + 1] == ':' ? close + 1
+                                                                           : std::string::npos;
+      } else {
+        host = authority.substr(0, colon);
+      }
+      if (colon != std::string::npos) {
+        char* end;
+        long p = strtol(authority.c_str() + colon + 1, &end, 10);
+        if (*end || p <= 0 || p > 65535)
+          return false;
+        port = static_cast<uint16_t>(p);
+      }
+      return !host.empty();
+    }
+
+    Host* getHost(const std::string& host, uint16_t port)
+    {
+      std::string key = host + ":" + std::to_string(port);
+      auto it = _hosts.find(key);
+      if (it != _hosts.end())
+        return it->second.get();
+      std::unique_ptr<Host> h(new Host);
+      if (!h->addr.parseHost(host.c_str(), port))
+        return nullptr;
+      h->hostHeader = port == 80 ? host : key;
+      Host* raw = h.get();
+      h->timeoutEntry.setCallback([this, raw] { expireWaiting(raw); });
+      _hosts.emplace(key, std::move(h));
+      return raw;
+    }
+
+    /**
+     * dispatch() - send the waiting requests of @h, or open connections for them
+     */
+    void dispatch(Host* h)
+    {
+      while (!h->waiting.empty()) {
+        Conn* c = pick(h, *h->waiting.front());
+        if (!c)
+          break;
+        PendingPtr p = std::move(h->waiting.front());
+        h->waiting.pop_front();
+        send(c, std::move(p));
+      }
+      if (h->waiting.size() > h->connecting && h->conns.size() < _owner->_maxConnections)
+        connect(h);
+      if (h->waiting.empty())
+        h->timeoutEntry.cancel();
+      else
+        _loop->timingWheel().schedule(&h->timeoutEntry, h->waiting.front()->deadline);
+    }
+
+    // the connection that takes @p with the fewest requests in flight, if any
+    Conn* pick(Host* h, const Pending& p)
+    {
+      Conn* best = nullptr;
+      for (ConnPtr& c : h->conns) {
+        if (!c->conn || c->closing)
+          continue;
+        size_t n = c->inflight.size();
+        bool takes = n == 0 || (n < _owner->_pipelineDepth && p.idempotent &&
+                                c->inflight.back()->idempotent);
+        if (takes && (!best || n < best->inflight.size()))
+          best = c.get();
+      }
+      return best;
+    }
+
+    void send(Conn* c, PendingPtr p)
+    {
+      c->conn->write(p->data);
+      c->inflight.push_back(std::move(p));
+      c->lastUsed = _loop->now();
+      reschedule(c);
+    }
+
+    void connect(Host* h)
+    {
+      ConnPtr c = std::make_shared<Conn>();
+      c->pool = this;
+      c->host = h;
+      c->client = std::make_shared<TcpClient>(_loop, h->addr);
+      c->lastUsed = _loop->now();
+      Conn* raw = c.get();
+      // the client may call back after the Conn is released, e.g. with a close it queued
+      std::weak_ptr<Conn> weak = c;
+      c->client->setMaxConnectRetries(0);
+      c->client->setConnectCallback([weak](const TcpConnectionPtr& conn) {
+        if (ConnPtr c = weak.lock(); c && c->pool)
+          c->pool->onConnected(c.get(), conn);
+      });
+      c->client->setConnectFailedCallback([weak] {
+        if (ConnPtr c = weak.lock(); c && c->pool)
+          c->pool->onConnectFailed(c.get());
+      });
+      c->client->setMessageCallback([weak](const TcpConnectionPtr&, StreamBuffer* buf) {
+        if (ConnPtr c = weak.lock(); c && c->pool)
+          c->pool->onMessage(c.get(), buf);
+      });
+      c->client->setCloseCallback([weak](const TcpConnectionPtr&) {
+        if (ConnPtr c = weak.lock(); c && c->pool)
+          c->pool->onClose(c.get());
+      });
+      c->parser.setBeginCallback([raw](const HttpParser<HttpResponse>&) {
+        if (!raw->inflight.empty())
+          raw->parser.setSkipBody(raw->inflight.front()->head);
+      });
+      c->parser.setMessageCallback(
+        [raw](const HttpParser<HttpResponse>&) { raw->pool->onResponse(raw); });
+      c->timeoutEntry.setCallback([raw] { raw->pool->onTimeout(raw); });
+      h->conns.push_back(c);
+      h->connecting++;
+      reschedule(raw);
+      c->client->start();
+    }
+
+    void onConnected(Conn* c, const TcpConnectionPtr& conn)
+    {
+      c->host->connecting--;
+      c->conn = conn;
+      c->lastUsed = _loop->now();
+      reschedule(c);
+      dispatch(c->host);
+    }
+
+    void onConnectFailed(Conn* c)
+    {
+      Host* h = c->host;
+      h->connecting--;
+      // nothing else would serve them soon
+      if (h->conns.size() == 1)
+        failAll(h->waiting, CONNECT_FAILED);
+      release(c);
+      dispatch(h);
+    }
+
+    void onMessage(Conn* c, StreamBuffer* buf)
+    {
+      llhttp_errno_t err = c->parser.advance(buf->data(), buf->size());
+      buf->popFront();
+      if (err != HPE_OK) {
+        failAll(c->inflight, BAD_RESPONSE);
+        c->closing = true;
+      }
+      if (c->closing)
+        c->conn->forceClose();
+    }
+
+    void onResponse(Conn* c)
+    {
+      if (c->inflight.empty()) {
+        // not asked for
+        c->closing = true;
+        return;
+      }
+      PendingPtr p = std::move(c->inflight.front());
+      c->inflight.pop_front();
+      if (!c->parser.shouldKeepAlive())
+        c->closing = true;
+      c->lastUsed = _loop->now();
+      reschedule(c);
+      p->cb(OK, c->parser.getMessage());
+      dispatch(c->host);
+    }
+
+    void onClose(Conn* c)
+    {
+      Host* h = c->host;
+      // a response delimited by the close completes now
+      c->parser.finish();
+      // retry the idempotent requests lost, in order ahead of those waiting
+      while (!c->inflight.empty()) {
+        PendingPtr p = std::move(c->inflight.back());
+        c->inflight.pop_back();
+        if (p->idempotent && !p->retried) {
+          p->retried = true;
+          h->waiting.push_front(std::move(p));
+        } else {
+          p->cb(CLOSED, nullptr);
+        }
+      }
+      release(c);
+      dispatch(h);
+    }
+
+    void onTimeout(Conn* c)
+    {
+      if (!c->conn) {
+        c->client->stopConnect();
+        onConnectFailed(c);
+        return;
+      }
+      // a response late in a pipeline holds up those behind it, the connection is lost
+      if (!c->inflight.empty())
+        failAll(c->inflight, TIMEOUT);
+      c->closing = true;
+      c->conn->forceClose();
+    }
+
+    void expireWaiting(Host* h)
+    {
+      Time now = _loop->now();
+      std::deque<PendingPtr> expired;
+      for (auto it = h->waiting.begin(); it != h->waiting.end();) {
+        if ((*it)->deadline <= now) {
+          expired.push_back(std::move(*it));
+          it = h->waiting.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      failAll(expired, TIMEOUT);
+      dispatch(h);
+    }
+
+    // the deadline of @c: connecting, the earliest request in flight, or idle
+    void reschedule(Conn* c)
+    {
+      Time deadline(0);
+      if (!c->conn) {
+        deadline = c->lastUsed + _owner->_connectTimeout;
+      } else if (!c->inflight.empty()) {
+        deadline = c->inflight.front()->deadline;
+        for (const PendingPtr& p : c->inflight)
+          deadline = std::min(deadline, p->deadline);
+      } else {
+        deadline = c->lastUsed + _owner->_idleTimeout;
+      }
+      _loop->timingWheel().schedule(&c->timeoutEntry, deadline);
+    }
+
+    /**
+     * release() - drop @c from its host, it is freed once its callbacks are done
+     */
+    void release(Conn* c)
+    {
+      c->pool = nullptr;
+      c->timeoutEntry.cancel();
+      auto& conns = c->host->conns;
+      for (auto it = conns.begin(); it != conns.end(); ++it) {
+        if (it->get() == c) {
+          _loop->queueInLoop([conn = std::move(*it)] {});
+          conns.erase(it);
+          break;
+        }
+      }
+    }
+
+    static void failAll(std::deque<PendingPtr>& pendings, Error error)
+    {
+      // the callbacks may make new requests
+      std::deque<PendingPtr> failed;
+      failed.swap(pendings);
+      for (PendingPtr& p : failed)
+        p->cb(error, nullptr);
+    }
+  };
+
+  size_t _maxConnections;
+  size_t _pipelineDepth;
+  Time _connectTimeout;
+  Time _requestTimeout;
+  Time _idleTimeout;
+  std::vector<std::unique_ptr<LoopPool>> _shards;
+  std::unordered_map<EventLoop*, LoopPool*> _shardOfLoop;   // read only once set up
+};
+
+#endif
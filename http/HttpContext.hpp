@@ -1,6 +1,11 @@
 #ifndef __HTTPCONTEXT_HPP__
 #define __HTTPCONTEXT_HPP__
 
+#include <ctype.h>
+#include <string.h>
+#include <coroutine>
+#include <utility>
+#include <type_traits>
 #include <unordered_map>
 #include "TcpConnection.hpp"
 #include "HttpDefinition.hpp"
@@ -8,6 +13,38 @@
 
 template<typename T>
 class HttpContext;
+class Http2Connection;
+
+/**
+ * class HttpStreamSink - where a context writes instead of its connection
+ *
+ * The handlers still write HTTP/1.1, e.g. an HTTP/2 stream translates it into its frames, so
+ * they don't care what the client speaks.
+ */
+class HttpStreamSink
+{
+public:
+  virtual ~HttpStreamSink() {}
+
+  virtual int write(const char* data, size_t len) = 0;
+  virtual void shutdown() = 0;
+  virtual void forceClose() = 0;
+  virtual size_t bufferedBytes() const = 0;
+  virtual bool closed() const = 0;
+};
+
+/**
+ * class HttpUpgrade - a protocol taking over the connection of a context, e.g. after a 101
+ */
+class HttpUpgrade
+{
+public:
+  virtual ~HttpUpgrade() {}
+
+  virtual void onData(const char* data, size_t len) = 0;
+  virtual void onWriteComplete() = 0;
+  virtual void onClose() = 0;
+};
 
 /**
  * class HttpContext: An wrapper over HttpConnection
@@ -19,6 +56,7 @@ class HttpContext
 {
   friend class HttpServer;
   friend class HttpClient;
+  friend class Http2Connection;
 
 public:
   typedef class HttpParser<T> HttpParser;
@@ -27,10 +65,38 @@ public:
   typedef typename std::function<void(HttpContextPtr)> HttpCallback;
   typedef typename std::function<void()> HttpCtxCallback;
 
+  /**
+   * struct Timing - monotonic timestamps (LoopMetrics::nowNs()) of the current request
+   *
+   * A phase that did not happen is 0. accept and established are only set for the first
+   * request of a connection.
+   */
+  struct Timing
+  {
+    uint64_t accept = 0;
+    uint64_t established = 0;
+    uint64_t firstByte = 0;
+    uint64_t headersComplete = 0;
+    uint64_t messageComplete = 0;
+    uint64_t handlerReturn = 0;
+    uint64_t firstWrite = 0;
+    uint64_t lastFlush = 0;
+  };
+
 private:
   HttpContext(TcpConnectionPtr conn)
     : _conn(conn)
-  {}
+    , _statusRecorded(false)
+    , _readTime(0)
+    , _captureId(0)
+    , _upgradePending(false)
+    , _stage(STAGE_HEADERS)
+    , _stageStart(0)
+    , _lastRead(0)
+  {
+    _timing.accept = conn->acceptTime();
+    _timing.established = conn->establishedTime();
+  }
 
 public:
   template<typename... U>
@@ -62,21 +128,29 @@ public:
     return parser.getMessage();
   }
 
+  const Timing& getTiming() const
+  {
+    return _timing;
+  }
+
   void startRequest(llhttp_method_t method, const std::string& url)
   {
-    _conn->write(llhttp_method_name(method));
-    _conn->write(" ");
-    _conn->write(url);
-    _conn->write(" HTTP/1.1\r\n");
+    write(llhttp_method_name(method));
+    write(" ");
+    write(url);
+    write(" HTTP/1.1\r\n");
   }
 
   void startResponse(int code, const std::string& message)
   {
-    _conn->write("HTTP/1.1 ");
-    _conn->write(std::to_string(code));
-    _conn->write(" ");
-    _conn->write(message);
-    _conn->write("\r\n");
+    recordStatus(code);
+    markFirstWrite();
+    write("HTTP/1.1 ");
+    write(std::to_string(code));
+    write(" ");
+    write(message);
+    write("\r\n");
+    sendHeader("Date", getLoop()->clock().httpDate());
   }
 
   void startResponse(int code)
@@ -86,35 +160,66 @@ public:
 
   void sendHeader(const std::string& key, const std::string& value)
   {
-    _conn->write(key);
-    _conn->write(": ", 2);
-    _conn->write(value);
-    _conn->write("\r\n", 2);
+    write(key);
+    write(": ", 2);
+    write(value);
+    write("\r\n", 2);
   }
 
   int endHeaders()
   {
-    return _conn->write("\r\n", 2);
+    return write("\r\n", 2);
   }
 
   int send(const std::string& contents)
   {
-    return _conn->write(contents);
+    return send(contents.data(), contents.size());
   }
 
   int send(const char* contents, size_t len)
   {
-    return _conn->write(contents, len);
+    if (!_statusRecorded)
+      sniffStatus(contents, len);
+    markFirstWrite();
+    return write(contents, len);
   }
 
+  /**
+   * shutdown() - end the response, and the connection unless it belongs to a stream
+   */
   void shutdown()
   {
-    _conn->shutdown();
+    if (_sink)
+      _sink->shutdown();
+    else
+      _conn->shutdown();
   }
 
+  /**
+   * forceClose() - drop the connection, or reset the stream
+   */
   void forceClose()
   {
-    _conn->forceClose();
+    if (_sink)
+      _sink->forceClose();
+    else
+      _conn->forceClose();
+  }
+
+  /**
+   * connected() - whether what is sent may still reach the peer
+   */
+  bool connected() const
+  {
+    return _sink ? !_sink->closed() : _conn->connected();
+  }
+
+  /**
+   * bufferedBytes() - what was sent but is not written to the socket yet
+   */
+  size_t bufferedBytes() const
+  {
+    return _sink ? _sink->bufferedBytes() : _conn->writeBufferSize();
   }
 
   void sendError(int code, const std::string& message)
@@ -137,6 +242,30 @@ public:
     sendError(code, HttpDefinition::getMessage(code));
   }
 
+  /**
+   * upgrade() - hand the connection over to @protocol, once the 101 answering an upgrade
+   *             request is sent
+   *
+   * From then on what the client sends goes to @protocol rather than to the parser, what it
+   * sent after the request included. The server no longer times the connection out, nor calls
+   * the write complete callback of the context. Not for HTTP/2 streams.
+   */
+  void upgrade(std::shared_ptr<HttpUpgrade> protocol)
+  {
+    assert(!_sink);
+    _upgrade = std::move(protocol);
+    _timeoutEntry.cancel();
+    if (_upgradePending) {
+      _upgradePending = false;
+      if (_upgradeInput.size() >= kMaxUpgradeInput)
+        _conn->resumeRead();
+      std::string pending;
+      pending.swap(_upgradeInput);
+      if (!pending.empty())
+        _upgrade->onData(pending.data(), pending.size());
+    }
+  }
+
   std::any& getUserData()
   {
     return _userData;
@@ -166,13 +295,182 @@ public:
     _closeCallback = std::move(cb);
   }
 
+  /**
+   * drained() - awaitable resuming once what was sent so far is flushed, see CoTask
+   *
+   * Resumes with false if the connection closed first. The write complete callback is not
+   * called while a task waits.
+   */
+  auto drained()
+  {
+    struct Awaiter
+    {
+      HttpContext* ctx;
+
+      bool await_ready()
+      {
+        return !ctx->connected() || ctx->bufferedBytes() == 0;
+      }
+      void await_suspend(std::coroutine_handle<> h)
+      {
+        ctx->_drainWaiter = h;
+      }
+      bool await_resume()
+      {
+        return ctx->connected();
+      }
+    };
+    return Awaiter{this};
+  }
+
 private:
   TcpConnectionPtr _conn;
+  std::shared_ptr<HttpStreamSink> _sink;      // of a stream, null for a whole connection
+  std::shared_ptr<Http2Connection> _http2;   // of a connection that switched to HTTP/2
+  std::shared_ptr<HttpUpgrade> _upgrade;      // of a connection taken over by upgrade()
   std::any _userData;
   HttpParser parser;
   HttpCtxCallback _writeCompleteCallback;
   HttpCtxCallback _closeCallback;
+  std::coroutine_handle<> _drainWaiter;   // task in drained()
+  bool _statusRecorded;
+  Timing _timing;
+  uint64_t _readTime;   // when the data being parsed was read
+  uint64_t _captureId;  // 0 if the connection is not captured
+  // the parser stopped at an upgrade request, what follows waits for the handler to decide,
+  // reading pauses once kMaxUpgradeInput bytes wait
+  static constexpr size_t kMaxUpgradeInput = 64 * 1024;
+  bool _upgradePending;
+  std::string _upgradeInput;
+
+  /**
+   * enum Stage - where a server connection is, to pick the timeout that applies
+   */
+  enum Stage
+  {
+    STAGE_HEADERS,      // waiting for the headers of a request
+    STAGE_BODY,         // reading the body
+    STAGE_RESPONDING,   // the handler has the request
+    STAGE_IDLE,         // the response is flushed, waiting for the next request
+    STAGE_CLOSING,      // timed out, waiting for the peer to close
+  };
+  Stage _stage;
+  Time _stageStart;
+  Time _lastRead;
+  TimingWheel::Entry _timeoutEntry;
+
+  /**
+   * beginRequest() - a new request arrives, its response status is yet to be counted
+   */
+  void beginRequest()
+  {
+    _statusRecorded = false;
+  }
+
+  void markFirstWrite()
+  {
+    if constexpr (std::is_same_v<T, HttpRequest>) {
+      if (!_timing.firstWrite)
+        _timing.firstWrite = LoopMetrics::nowNs();
+    }
+  }
+
+  /**
+   * beginTiming() - the first byte of a new request is parsed
+   */
+  void beginTiming(uint64_t slowThreshold)
+  {
+    if (_timing.firstByte) {
+      finishTiming(slowThreshold);
+      _timing = Timing();
+    }
+    _timing.firstByte = _readTime;
+  }
+
+  /**
+   * finishTiming() - account the phases of the current request
+   *
+   * Called when the next request begins or the connection closes, so the last flush is known.
+   * Requests slower than @slowThreshold ns (0 disables) are logged with all their phases.
+   */
+  void finishTiming(uint64_t slowThreshold)
+  {
+    if constexpr (std::is_same_v<T, HttpRequest>) {
+      const Timing& t = _timing;
+      if (!t.firstByte)
+        return;
+      uint64_t phases[LoopMetrics::kPhases] = {};
+      auto span = [&](int phase, uint64_t from, uint64_t to) {
+        if (from && to >= from) {
+          phases[phase] = to - from;
+          getLoop()->metrics().requestPhases[phase].record(to - from);
+        }
+      };
+      uint64_t last = t.lastFlush > t.firstWrite ? t.lastFlush : t.firstWrite;
+      span(LoopMetrics::PHASE_HANDOFF, t.accept, t.established);
+      span(LoopMetrics::PHASE_HEADERS, t.firstByte, t.headersComplete);
+      span(LoopMetrics::PHASE_BODY, t.headersComplete, t.messageComplete);
+      span(LoopMetrics::PHASE_HANDLER, t.messageComplete, t.handlerReturn);
+      span(LoopMetrics::PHASE_FIRST_WRITE, t.messageComplete, t.firstWrite);
+      span(LoopMetrics::PHASE_FLUSH, t.firstWrite, last);
+      span(LoopMetrics::PHASE_TOTAL, t.firstByte, last);
 
+      if (slowThreshold && phases[LoopMetrics::PHASE_TOTAL] >= slowThreshold) {
+        auto ms = [&](int phase) { return phases[phase] / 1e6; };
+        std::shared_ptr<T> req = getMessage();
+        alog_warn("SlowRequest",
+                  "%s %s %s total=%.3fms handoff=%.3fms headers=%.3fms body=%.3fms "
+                  "handler=%.3fms first_write=%.3fms flush=%.3fms",
+                  _conn->getPeerAddr().toIpPort().c_str(),
+                  req ? llhttp_method_name(req->method) : "-",
+                  req ? req->path.c_str() : "-",
+                  ms(LoopMetrics::PHASE_TOTAL),
+                  ms(LoopMetrics::PHASE_HANDOFF),
+                  ms(LoopMetrics::PHASE_HEADERS),
+                  ms(LoopMetrics::PHASE_BODY),
+                  ms(LoopMetrics::PHASE_HANDLER),
+                  ms(LoopMetrics::PHASE_FIRST_WRITE),
+                  ms(LoopMetrics::PHASE_FLUSH));
+      }
+    }
+  }
+
+  void recordStatus(int code)
+  {
+    if constexpr (std::is_same_v<T, HttpRequest>) {
+      if (!_statusRecorded) {
+        _statusRecorded = true;
+        getLoop()->metrics().recordStatus(code);
+      }
+    }
+  }
+
+  /**
+   * sniffStatus() - count the status of a response written as raw bytes
+   */
+  void sniffStatus(const char* data, size_t len)
+  {
+    if constexpr (std::is_same_v<T, HttpRequest>) {
+      // "HTTP/1.1 200"
+      if (len >= 12 && strncmp(data, "HTTP/", 5) == 0 && isdigit(data[9]) &&
+          isdigit(data[10]) && isdigit(data[11]))
+        recordStatus((data[9] - '0') * 100 + (data[10] - '0') * 10 + (data[11] - '0'));
+    }
+  }
+
+  int write(const char* data, size_t len)
+  {
+    return _sink ? _sink->write(data, len) : _conn->write(data, len);
+  }
+  int write(const std::string& data)
+  {
+    return write(data.data(), data.size());
+  }
+
+  void setBeginCallback(const ParseCallback& cb)
+  {
+    parser.setBeginCallback(cb);
+  }
   void setHeaderCallback(const ParseCallback& cb)
   {
     parser.setHeaderCallback(cb);
@@ -185,11 +483,18 @@ private:
   {
     if (_closeCallback)
       _closeCallback();
+    if (_drainWaiter)
+      std::exchange(_drainWaiter, nullptr).resume();
   }
   void writeCompleteCallback()
   {
-    if (_writeCompleteCallback)
+    // the completion of an earlier write may be queued while more is buffered
+    if (_drainWaiter) {
+      if (bufferedBytes() == 0)
+        std::exchange(_drainWaiter, nullptr).resume();
+    } else if (_writeCompleteCallback) {
       _writeCompleteCallback();
+    }
   }
   llhttp_errno_t advance(const char* data, size_t len)
   {
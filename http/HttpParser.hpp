@@ -1,13 +1,16 @@
 #ifndef __HTTPPARSER_HPP__
 #define __HTTPPARSER_HPP__
 
+#include <strings.h>
 #include <string>
 #include <sstream>
 #include <unordered_map>
 #include <functional>
+#include <type_traits>
 #include "llhttp.h"
 #include "Utils.hpp"
 #include "TcpConnection.hpp"
+#include "RequestScanner.hpp"
 
 template<typename T>
 class HttpParser;
@@ -20,6 +23,35 @@ struct HttpRequest
   std::unordered_map<std::string, std::string> headers;
   std::string body;
 
+  /**
+   * isIdempotent() - whether the request can be safely sent more than once (RFC 7231 4.2.2)
+   */
+  bool isIdempotent() const
+  {
+    switch (method) {
+      case HTTP_GET:
+      case HTTP_HEAD:
+      case HTTP_PUT:
+      case HTTP_DELETE:
+      case HTTP_OPTIONS:
+      case HTTP_TRACE:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /**
+   * findHeader() - the value of the header @name, whatever its case, null if absent
+   */
+  const std::string* findHeader(const char* name) const
+  {
+    for (const auto& [key, value] : headers)
+      if (strcasecmp(key.c_str(), name) == 0)
+        return &value;
+    return nullptr;
+  }
+
   std::string serialize() const
   {
     std::stringstream ss;
@@ -42,6 +74,17 @@ struct HttpResponse
   std::unordered_map<std::string, std::string> headers;
   std::string body;
 
+  /**
+   * findHeader() - the value of the header @name, whatever its case, null if absent
+   */
+  const std::string* findHeader(const char* name) const
+  {
+    for (const auto& [key, value] : headers)
+      if (strcasecmp(key.c_str(), name) == 0)
+        return &value;
+    return nullptr;
+  }
+
   std::string serialize() const
   {
     std::stringstream ss;
@@ -61,12 +104,22 @@ class HttpParser : noncopyable
 {
 public:
   typedef std::function<void(const HttpParser&)> ParseCallback;
+  typedef std::function<void(const char*, size_t)> BodyCallback;
 
   HttpParser();
   ~HttpParser() {}
 
   llhttp_errno_t advance(const char* data, size_t len)
   {
+    if constexpr (std::is_same_v<T, HttpRequest>) {
+      if (_fastPath) {
+        size_t scanned = scanAhead(data, len);
+        if (scanned == len)
+          return HPE_OK;
+        data += scanned;
+        len -= scanned;
+      }
+    }
     return llhttp_execute(&_parser, data, len);
   }
   llhttp_errno_t advance(const std::string& data)
@@ -77,6 +130,14 @@ public:
   {
     llhttp_resume(&_parser);
   }
+
+  /**
+   * resumeAfterUpgrade() - parse HTTP again after an upgrade request that was turned down
+   */
+  void resumeAfterUpgrade()
+  {
+    llhttp_resume_after_upgrade(&_parser);
+  }
   llhttp_errno_t finish()
   {
     return llhttp_finish(&_parser);
@@ -87,6 +148,50 @@ public:
     return _data;
   }
 
+  /**
+   * setMessage() - stand for a message that was not parsed, e.g. one from an HTTP/2 stream
+   */
+  void setMessage(std::shared_ptr<T> message)
+  {
+    _data = std::move(message);
+  }
+
+  /**
+   * errorPos() - where advance() stopped on an error or a pause, e.g. after an upgrade
+   */
+  const char* errorPos() const
+  {
+    return llhttp_get_error_pos(&_parser);
+  }
+
+  /**
+   * shouldKeepAlive() - whether the connection may carry another message after this one
+   */
+  bool shouldKeepAlive() const
+  {
+    return llhttp_should_keep_alive(&_parser);
+  }
+
+  /**
+   * setSkipBody() - the next response has no body whatever its headers say, e.g. to a HEAD
+   */
+  void setSkipBody(bool on)
+  {
+    _skipBody = on;
+  }
+
+  /**
+   * setFastPath() - parse the plain requests at the start of what advance() is given with
+   *                 RequestScanner, in one pass, the rest with llhttp
+   *
+   * The begin, header and message callbacks are called one after the other for such a request,
+   * its message already complete. Only between two messages, and not with a body callback.
+   */
+  void setFastPath(bool on)
+  {
+    _fastPath = on;
+  }
+
   void reset()
   {
     std::shared_ptr<T> new_data = std::make_shared<T>();
@@ -122,6 +227,11 @@ public:
     return _data->body;
   }
 
+  void setBeginCallback(ParseCallback cb)
+  {
+    _beginCallback = std::move(cb);
+  }
+
   void setHeaderCallback(ParseCallback cb)
   {
     _headerCallback = std::move(cb);
@@ -132,20 +242,62 @@ public:
     _messageCallback = std::move(cb);
   }
 
+  /**
+   * setBodyCallback() - hand the body over as it is parsed, rather than in the message
+   */
+  void setBodyCallback(BodyCallback cb)
+  {
+    _bodyCallback = std::move(cb);
+  }
+
 private:
   llhttp_t _parser;
   llhttp_settings_t _settings;
+  bool _skipBody = false;
+  bool _fastPath = false;
+  bool _inMessage = false;   // llhttp is amid a message
+  bool _lastMessage = false;   // llhttp takes no more, e.g. after "Connection: close"
   std::shared_ptr<T> _data;
   std::string _currentBuffer;
   std::string _currentBuffer1;
 
+  ParseCallback _beginCallback;
   ParseCallback _headerCallback;
   ParseCallback _messageCallback;
+  BodyCallback _bodyCallback;
+
+  /**
+   * scanAhead() - take the complete plain requests at the start of @data, see setFastPath(),
+   *               returns the bytes they took
+   */
+  size_t scanAhead(const char* data, size_t len)
+  {
+    size_t scanned = 0;
+    while (scanned < len && !_inMessage && !_lastMessage && !_bodyCallback &&
+           llhttp_get_errno(&_parser) == HPE_OK) {
+      auto message = std::make_shared<T>();
+      size_t n = RequestScanner::scan(data + scanned, len - scanned, *message);
+      if (!n)
+        break;
+      scanned += n;
+      _data.swap(message);
+      if (_beginCallback)
+        _beginCallback(*this);
+      if (_headerCallback)
+        _headerCallback(*this);
+      if (_messageCallback)
+        _messageCallback(*this);
+    }
+    return scanned;
+  }
 
   static int on_message_begin(llhttp_t* parser)
   {
     HttpParser* that = container_of(parser, &HttpParser::_parser);
+    that->_inMessage = true;
     that->reset();
+    if (that->_beginCallback)
+      that->_beginCallback(*that);
     return 0;
   }
 
@@ -204,7 +356,8 @@ private:
     HttpParser* that = container_of(parser, &HttpParser::_parser);
     that->_data->headers[that->_currentBuffer].swap(that->_currentBuffer1);
     that->_currentBuffer.clear();
-    // Now _currentBuffer and _currentBuffer1 are all clear.
+    // a repeated header swaps the earlier value out, the last one wins
+    that->_currentBuffer1.clear();
     return 0;
   }
 
@@ -215,7 +368,8 @@ private:
     that->_data->minor = llhttp_get_http_minor(&that->_parser);
     if (that->_headerCallback)
       that->_headerCallback(*that);
-    return 0;
+    // 1 tells llhttp there is no body to expect
+    return that->_skipBody ? 1 : 0;
   }
 
   static int on_chunk_header(llhttp_t* parser)
@@ -233,13 +387,18 @@ private:
   static int on_body(llhttp_t* parser, const char* at, size_t length)
   {
     HttpParser* that = container_of(parser, &HttpParser::_parser);
-    that->_currentBuffer.append(at, length);
+    if (that->_bodyCallback)
+      that->_bodyCallback(at, length);
+    else
+      that->_currentBuffer.append(at, length);
     return 0;
   }
 
   static int on_message_complete(llhttp_t* parser)
   {
     HttpParser* that = container_of(parser, &HttpParser::_parser);
+    that->_inMessage = false;
+    that->_lastMessage = !llhttp_should_keep_alive(parser);
     that->_data->body.swap(that->_currentBuffer);
     if (that->_messageCallback)
       that->_messageCallback(*that);
@@ -265,6 +424,7 @@ HttpParser<HttpRequest>::HttpParser()
   _settings.on_message_complete = HttpParser::on_message_complete;
 
   llhttp_init(&_parser, HTTP_REQUEST, &_settings);
+  reset();
 }
 
 template<>
@@ -285,6 +445,7 @@ HttpParser<HttpResponse>::HttpParser()
   _settings.on_message_complete = HttpParser::on_message_complete;
 
   llhttp_init(&_parser, HTTP_RESPONSE, &_settings);
+  reset();
 }
 
 #endif
@@ -5,7 +5,6 @@
 #include <string>
 #include <functional>
 #include <unordered_map>
-#include <zlog.h>
 #include <pcre.h>
 #include "HttpParser.hpp"
 #include "TcpConnection.hpp"
@@ -100,7 +99,6 @@ private:
 public:
   HttpRouter(HttpServer* server)
     : _server(server)
-    , _zc(zlog_get_category("HttpRouter"))
   {}
   ~HttpRouter() {}
 
@@ -117,13 +115,17 @@ public:
   void handleRequest(HttpContextPtr ctx)
   {
     const auto& path = ctx->getMessage()->path;
+    LoopMetrics& metrics = ctx->getLoop()->metrics();
+    uint64_t start = LoopMetrics::nowNs();
     for (auto& route : _routes) {
       int len = route->match(path);
       if (len) {
+        metrics.routerMatch.record(LoopMetrics::nowNs() - start);
         route->handleRequest(len, ctx, _server);
         return;
       }
     }
+    metrics.routerMatch.record(LoopMetrics::nowNs() - start);
     ctx->sendError(404);
   }
 
@@ -131,7 +133,6 @@ private:
   typedef std::unique_ptr<Route> RoutePtr;
   std::vector<RoutePtr> _routes;
   HttpServer* _server;
-  zlog_category_t* _zc;
 };
 
 #endif
@@ -1,10 +1,14 @@
 #ifndef __HTTPSERVER_HPP__
 #define __HTTPSERVER_HPP__
 
+#include <strings.h>
 #include <zlog.h>
 #include "TcpConnection.hpp"
 #include "TcpServer.hpp"
 #include "HttpContext.hpp"
+#include "Http2Connection.hpp"
+#include "TrafficCapture.hpp"
+#include "RateLimiter.hpp"
 
 class HttpServer
 {
@@ -12,11 +16,24 @@ class HttpServer
   typedef typename HttpContext::HttpParser HttpParser;
   typedef typename HttpContext::HttpCallback HttpCallback;
   typedef typename HttpContext::HttpContextPtr HttpContextPtr;
+  typedef typename HttpContext::Stage Stage;
 
 public:
   HttpServer(EventLoop* loop, const InetAddress& listenAddr, bool reusePort, int threadNum,
              const ThreadInitCallback& init = nullptr)
     : _server(loop, listenAddr, reusePort, threadNum, init)
+    , _slowRequestThreshold(0)
+    , _capture(nullptr)
+    , _rateLimiter(nullptr)
+    , _headerReadTimeout(0)
+    , _bodyReadTimeout(0)
+    , _keepAliveTimeout(0)
+    , _writeStallTimeout(0)
+    , _shedResponse(prebuiltResponse(HttpStatus::SERVICE_UNAVAILABLE, false))
+    , _rateLimitResponse(prebuiltResponse(HttpStatus::TOO_MANY_REQUESTS, false))
+    , _http2(true)
+    , _http2MaxRequestBody(Http2Connection::kDefaultMaxRequestBody)
+    , _fastParse(false)
     , _zc(zlog_get_category("HttpServer"))
   {
     _server.setConnectCallback([&](const TcpConnectionPtr& conn) { initConnection(conn); });
@@ -32,8 +49,20 @@ public:
   {
     return _server.getBaseLoop();
   }
+
+  /**
+   * getIoLoops() - the loops serving the connections, e.g. for Broadcast::addLoops()
+   */
+  const std::vector<EventLoop*>& getIoLoops() const
+  {
+    return _server.getIoLoops();
+  }
+
   void start()
   {
+    // ALPN is how a TLS client learns it may speak HTTP/2
+    if (_tls && _http2)
+      _tls->setAlpnProtocols({"h2", "http/1.1"});
     _server.start();
   }
 
@@ -57,12 +86,168 @@ public:
     _closeCallback = std::move(cb);
   }
 
+  /**
+   * setSlowRequestThreshold() - log requests taking longer than @seconds, 0 to disable
+   *
+   * A request lasts from its first byte to the last byte of its response flushed to the
+   * socket, see HttpContext::Timing for the phases logged.
+   */
+  void setSlowRequestThreshold(double seconds)
+  {
+    _slowRequestThreshold = static_cast<uint64_t>(seconds * 1e9);
+  }
+
+  /**
+   * setTrafficCapture() - record the incoming bytes of new connections into @capture
+   *
+   * @capture must outlive the server.
+   */
+  void setTrafficCapture(TrafficCapture* capture)
+  {
+    _capture = capture;
+  }
+
+  /**
+   * setTimeouts() - close connections that are stuck, in seconds, 0 disables a timeout
+   * @headerRead: from the connection or the first byte of a request to the end of its headers
+   * @bodyRead: between two reads of a request body
+   * @keepAlive: from the last write of a response to the next request
+   * @writeStall: a response not draining because the peer doesn't read
+   *
+   * A connection timed out reading a request gets a 408, an idle one is shut down. Either is
+   * then given kCloseLinger seconds to close its end. A stalled connection is dropped at once.
+   * The deadlines live in the TimingWheel of the loop, so they are up to a tick late.
+   */
+  void setTimeouts(double headerRead, double bodyRead, double keepAlive, double writeStall)
+  {
+    _headerReadTimeout = Time(0).offsetBy(headerRead);
+    _bodyReadTimeout = Time(0).offsetBy(bodyRead);
+    _keepAliveTimeout = Time(0).offsetBy(keepAlive);
+    _writeStallTimeout = Time(0).offsetBy(writeStall);
+  }
+
+  static constexpr double kCloseLinger = 2.0;
+
+  /**
+   * setConnectionLimits() - cap the connections served at once, see TcpServer
+   * @reject: answer the connections over the limits with a prebuilt 503 and close them,
+   *          rather than leaving them in the listen backlog
+   */
+  void setConnectionLimits(size_t total, size_t perLoop, bool reject = false)
+  {
+    _server.setConnectionLimits(total, perLoop);
+    _server.setOverloadResponse(
+      reject ? prebuiltResponse(HttpStatus::SERVICE_UNAVAILABLE, true) : std::string());
+  }
+
+  /**
+   * setCpuAffinity() - pin the io loops to @cpus, see TcpServer
+   */
+  void setCpuAffinity(const std::vector<int>& cpus)
+  {
+    _server.setCpuAffinity(cpus);
+  }
+
+  /**
+   * setListenerPerLoop() - accept in every io loop on its own socket, see TcpServer
+   */
+  void setListenerPerLoop(bool on)
+  {
+    _server.setListenerPerLoop(on);
+  }
+
+  /**
+   * setTls() - serve HTTPS with @ctx, see TcpServer
+   *
+   * The header read timeout covers the handshake.
+   */
+  void setTls(std::shared_ptr<TlsContext> ctx)
+  {
+    _tls = ctx;
+    _server.setTls(std::move(ctx));
+  }
+
+  /**
+   * setHttp2() - speak HTTP/2 to the clients asking for it, the default
+   *
+   * Over TLS it is offered by ALPN. In clear text a client either starts with the HTTP/2
+   * preface (prior knowledge) or upgrades an HTTP/1.1 request with "Upgrade: h2c". Each stream
+   * goes to the request callback with a context of its own, whose close callback is called
+   * once the stream ends. The connection keeps the connect, close and write complete
+   * callbacks of the server.
+   * @maxRequestBody: a stream buffers its request body up to this, a larger one is answered
+   *                  with 413
+   */
+  void setHttp2(bool on, size_t maxRequestBody = Http2Connection::kDefaultMaxRequestBody)
+  {
+    _http2 = on;
+    _http2MaxRequestBody = maxRequestBody;
+  }
+
+  /**
+   * setFastParse() - parse the plain HTTP/1.1 requests in one pass, see RequestScanner
+   *
+   * Requests of another kind, or split over reads, still go through llhttp.
+   */
+  void setFastParse(bool on)
+  {
+    _fastParse = on;
+  }
+
+  /**
+   * setLoadShedding() - answer new requests with 503 while their loop is overloaded
+   * @target: loop lag in seconds tolerated, 0 to disable
+   * @interval: how long the lag must stay above @target, see EventLoop::setShedTarget()
+   *
+   * Requests are shed before they reach the request callback, unless their path starts with a
+   * priority path.
+   */
+  void setLoadShedding(double target, double interval)
+  {
+    for (EventLoop* loop : _server.getIoLoops())
+      loop->setShedTarget(target, interval);
+  }
+
+  /**
+   * setRateLimiter() - answer the requests of clients over their rate with 429
+   *
+   * Checked after load shedding, before the request callback. Priority paths are not limited.
+   * @limiter must outlive the server.
+   */
+  void setRateLimiter(RateLimiter* limiter)
+  {
+    _rateLimiter = limiter;
+    _rateLimiter->addLoops(_server.getIoLoops());
+  }
+
+  /**
+   * addPriorityPath() - never shed or rate limit requests under @prefix, e.g. health checks
+   */
+  void addPriorityPath(const std::string& prefix)
+  {
+    _priorityPaths.push_back(prefix);
+  }
+
 private:
   TcpServer _server;
   HttpCallback _connectCallback;
   HttpCallback _writeCompleteCallback;
   HttpCallback _requestCallback;
   HttpCallback _closeCallback;
+  uint64_t _slowRequestThreshold;   // ns
+  TrafficCapture* _capture;
+  RateLimiter* _rateLimiter;
+  Time _headerReadTimeout;
+  Time _bodyReadTimeout;
+  Time _keepAliveTimeout;
+  Time _writeStallTimeout;
+  std::vector<std::string> _priorityPaths;
+  const std::string _shedResponse;
+  const std::string _rateLimitResponse;
+  std::shared_ptr<TlsContext> _tls;
+  bool _http2;
+  size_t _http2MaxRequestBody;
+  bool _fastParse;
 
   zlog_category_t* _zc;
 
@@ -70,8 +255,28 @@ private:
   {
     HttpContextPtr ctx = HttpContext::create(conn);
     conn->setUserData(ctx);
-    // ctx->setHeaderCallback([&, ctx](const HttpParser& parser) { _requestCallback(ctx); });
-    ctx->setMessageCallback([&, ctx](const HttpParser& parser) { _requestCallback(ctx); });
+    ctx->parser.setFastPath(_fastParse);
+    if (_capture)
+      ctx->_captureId = _capture->open();
+    // raw pointer: the parser belongs to the context
+    HttpContext* rawCtx = ctx.get();
+    ctx->setBeginCallback([this, rawCtx](const HttpParser& parser) {
+      rawCtx->beginTiming(_slowRequestThreshold);
+      setStage(rawCtx, HttpContext::STAGE_HEADERS);
+    });
+    ctx->setHeaderCallback([this, rawCtx](const HttpParser& parser) {
+      rawCtx->_timing.headersComplete = LoopMetrics::nowNs();
+      setStage(rawCtx, HttpContext::STAGE_BODY);
+    });
+    ctx->setMessageCallback([&, ctx](const HttpParser& parser) {
+      ctx->_timing.messageComplete = LoopMetrics::nowNs();
+      if (_http2 && upgradeToHttp2(ctx))
+        return;
+      setStage(ctx.get(), HttpContext::STAGE_RESPONDING);
+      handleRequest(ctx);
+    });
+    ctx->_timeoutEntry.setCallback([this, rawCtx] { handleTimeout(rawCtx); });
+    setStage(rawCtx, HttpContext::STAGE_HEADERS);
     if (_connectCallback)
       _connectCallback(ctx);
   }
@@ -81,6 +286,20 @@ private:
     HttpContextPtr ctx = std::any_cast<HttpContextPtr>(conn->getUserData());
     // context close callback (per-context)
     ctx->closeCallback();
+    if (ctx->_http2) {
+      ctx->_http2->onClose();
+      // it holds the connection
+      ctx->_http2.reset();
+    }
+    if (ctx->_upgrade) {
+      ctx->_upgrade->onClose();
+      ctx->_upgrade.reset();
+    }
+    ctx->_timeoutEntry.cancel();
+    ctx->finishTiming(_slowRequestThreshold);
+    if (ctx->_captureId)
+      _capture->close(ctx->_captureId);
+    ctx->setBeginCallback(nullptr);
     ctx->setHeaderCallback(nullptr);
     ctx->setMessageCallback(nullptr);
     ctx->setWriteCompleteCallback(nullptr);
@@ -94,17 +313,311 @@ private:
   void handleMessage(const TcpConnectionPtr& conn, StreamBuffer* buffer)
   {
     HttpContextPtr ctx = std::any_cast<HttpContextPtr>(conn->getUserData());
-    ctx->advance(buffer->data(), buffer->size());
+    bool preface = false;
+    // a client with prior knowledge starts with the HTTP/2 preface rather than a request
+    if (_http2 && !ctx->_http2 && !ctx->_timing.firstByte &&
+        Http2Connection::isPreface(buffer->data(), buffer->size())) {
+      if (buffer->size() < Http2Connection::kPrefaceSize)
+        return;
+      preface = true;
+    }
+    ctx->_readTime = LoopMetrics::nowNs();
+    ctx->_lastRead = conn->getLoop()->now();
+    if (ctx->_captureId && !_capture->data(ctx->_captureId, buffer->data(), buffer->size()))
+      ctx->_captureId = 0;
+    if (preface)
+      createHttp2(ctx)->start();
+    if (ctx->_http2) {
+      ctx->_http2->feed(buffer->data(), buffer->size(), ctx->_readTime);
+    } else if (ctx->_upgrade) {
+      ctx->_upgrade->onData(buffer->data(), buffer->size());
+    } else if (ctx->_upgradePending) {
+      holdUpgradeInput(ctx.get(), buffer->data(), buffer->size());
+    } else {
+      parseRequests(ctx, buffer->data(), buffer->size());
+    }
     buffer->popFront();
+    if (ctx->_http2)
+      updateHttp2Stage(ctx.get());
+  }
+
+  /**
+   * parseRequests() - hand @len bytes of @data to the parser of @ctx, what follows an upgrade
+   *                   request to the new protocol
+   */
+  void parseRequests(const HttpContextPtr& ctx, const char* data, size_t len)
+  {
+    if (ctx->advance(data, len) != HPE_PAUSED_UPGRADE)
+      return;
+    // the client goes on in the new protocol right after the request asking for it
+    const char* rest = ctx->parser.errorPos();
+    size_t restLen = data + len - rest;
+    if (ctx->_http2) {
+      ctx->_http2->feed(rest, restLen, ctx->_readTime);
+    } else if (ctx->_upgrade) {
+      ctx->_upgrade->onData(rest, restLen);
+    } else {
+      ctx->_upgradePending = true;
+      holdUpgradeInput(ctx.get(), rest, restLen);
+    }
+  }
+
+  /**
+   * holdUpgradeInput() - keep what follows an upgrade request until its handler calls
+   *                      HttpContext::upgrade(), or answers without upgrading, see
+   *                      resumeHeldInput()
+   */
+  void holdUpgradeInput(HttpContext* ctx, const char* data, size_t len)
+  {
+    ctx->_upgradeInput.append(data, len);
+    if (ctx->_upgradeInput.size() >= HttpContext::kMaxUpgradeInput)
+      ctx->_conn->pauseRead();
+  }
+
+  /**
+   * resumeHeldInput() - back to HTTP/1.1 once the response to an upgrade request is flushed
+   *                     without an upgrade, parsing what the client sent meanwhile
+   */
+  void resumeHeldInput(const HttpContextPtr& ctx)
+  {
+    ctx->_upgradePending = false;
+    ctx->parser.resumeAfterUpgrade();
+    if (ctx->_upgradeInput.size() >= HttpContext::kMaxUpgradeInput)
+      ctx->_conn->resumeRead();
+    std::string pending;
+    pending.swap(ctx->_upgradeInput);
+    if (pending.empty())
+      return;
+    parseRequests(ctx, pending.data(), pending.size());
+    if (ctx->_http2)
+      updateHttp2Stage(ctx.get());
   }
 
   void writeCompleteCallback(const TcpConnectionPtr& conn)
   {
     HttpContextPtr ctx = std::any_cast<HttpContextPtr>(conn->getUserData());
-    ctx->writeCompleteCallback();
+    if (ctx->_http2) {
+      ctx->_http2->onWriteComplete();
+    } else if (ctx->_upgrade) {
+      ctx->_upgrade->onWriteComplete();
+    } else {
+      ctx->_timing.lastFlush = LoopMetrics::nowNs();
+      bool responded = ctx->_stage == HttpContext::STAGE_RESPONDING;
+      if (responded)
+        setStage(ctx.get(), HttpContext::STAGE_IDLE);
+      ctx->writeCompleteCallback();
+      // the handler may still upgrade from its write complete callback
+      if (responded && ctx->_upgradePending && !ctx->_upgrade && conn->connected())
+        resumeHeldInput(ctx);
+    }
     if (_writeCompleteCallback)
       _writeCompleteCallback(ctx);
   }
+
+  /**
+   * handleRequest() - a request is complete, on a connection or an HTTP/2 stream
+   */
+  void handleRequest(const HttpContextPtr& ctx)
+  {
+    ctx->beginRequest();
+    if (admit(ctx))
+      _requestCallback(ctx);
+    ctx->_timing.handlerReturn = LoopMetrics::nowNs();
+  }
+
+  /**
+   * createHttp2() - switch the connection of @ctx to HTTP/2
+   */
+  std::shared_ptr<Http2Connection> createHttp2(const HttpContextPtr& ctx)
+  {
+    auto http2 = std::make_shared<Http2Connection>(ctx->_conn);
+    http2->setMaxRequestBody(_http2MaxRequestBody);
+    // raw pointer: the context owns the engine
+    HttpContext* rawCtx = ctx.get();
+    http2->setRequestCallback([this](const HttpContextPtr& stream) { handleRequest(stream); });
+    http2->setStreamCloseCallback([this, rawCtx](const HttpContextPtr& stream) {
+      stream->finishTiming(_slowRequestThreshold);
+      updateHttp2Stage(rawCtx);
+    });
+    ctx->_http2 = http2;
+    // the requests are timed by their streams
+    ctx->_timing = typename HttpContext::Timing();
+    setStage(rawCtx, HttpContext::STAGE_IDLE);
+    return http2;
+  }
+
+  /**
+   * upgradeToHttp2() - switch to HTTP/2 if the request asks for it, see setHttp2()
+   */
+  bool upgradeToHttp2(const HttpContextPtr& ctx)
+  {
+    std::shared_ptr<HttpRequest> req = ctx->getMessage();
+    const std::string* connection = req->findHeader("Connection");
+    const std::string* upgrade = req->findHeader("Upgrade");
+    const std::string* settings = req->findHeader("HTTP2-Settings");
+    // over TLS, ALPN is the only way
+    if (ctx->_conn->tls() || !connection || !upgrade || !settings ||
+        strcasecmp(upgrade->c_str(), "h2c") != 0 || !strcasestr(connection->c_str(), "upgrade"))
+      return false;
+    typename HttpContext::Timing timing = ctx->_timing;
+    std::string settingsValue = *settings;
+    ctx->_conn->write("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\n"
+                      "Upgrade: h2c\r\n\r\n");
+    if (!createHttp2(ctx)->upgrade(settingsValue, req, timing))
+      ctx->_conn->forceClose();
+    return true;
+  }
+
+  void updateHttp2Stage(HttpContext* ctx)
+  {
+    Stage stage =
+      ctx->_http2->activeStreams() ? HttpContext::STAGE_RESPONDING : HttpContext::STAGE_IDLE;
+    if (ctx->_stage != stage)
+      setStage(ctx, stage);
+  }
+
+  /**
+   * prebuiltResponse() - a complete response with the status message as its body
+   */
+  static std::string prebuiltResponse(int code, bool close)
+  {
+    std::string message = HttpDefinition::getMessage(code);
+    return "HTTP/1.1 " + std::to_string(code) + " " + message +
+           "\r\nContent-Type: text/plain\r\nContent-Length: " + std::to_string(message.size()) +
+           "\r\nRetry-After: 1\r\n" + (close ? "Connection: close\r\n" : "") + "\r\n" + message;
+  }
+
+  /**
+   * admit() - pass a request on to the request callback, or answer it here
+   */
+  bool admit(const HttpContextPtr& ctx)
+  {
+    bool shed = ctx->getLoop()->overloaded();
+    if (!shed && !_rateLimiter)
+      return true;
+    if (isPriority(ctx))
+      return true;
+    LoopMetrics& metrics = ctx->getLoop()->metrics();
+    if (shed) {
+      metrics.requestsShed.add();
+      ctx->send(_shedResponse);
+      return false;
+    }
+    if (!_rateLimiter->allow(ctx->getConn(), *ctx->getMessage())) {
+      metrics.requestsRateLimited.add();
+      ctx->send(_rateLimitResponse);
+      return false;
+    }
+    return true;
+  }
+
+  bool isPriority(const HttpContextPtr& ctx) const
+  {
+    const std::string& path = ctx->getMessage()->path;
+    for (const auto& prefix : _priorityPaths)
+      if (path.compare(0, prefix.size(), prefix) == 0)
+        return true;
+    return false;
+  }
+
+  void setStage(HttpContext* ctx, Stage stage)
+  {
+    // nothing brings a connection back once it is timed out, an upgraded one times itself
+    if (ctx->_stage == HttpContext::STAGE_CLOSING || ctx->_upgrade)
+      return;
+    ctx->_stage = stage;
+    ctx->_stageStart = ctx->getLoop()->now();
+    Time deadline = timeoutDeadline(ctx, stage);
+    if (deadline)
+      ctx->getLoop()->timingWheel().schedule(&ctx->_timeoutEntry, deadline);
+    else
+      ctx->_timeoutEntry.cancel();
+  }
+
+  /**
+   * timeoutDeadline() - when the connection times out, 0 for never
+   * @stage: set to the stage that is timed, an idle connection with output pending is
+   *         responding again
+   *
+   * Reads and writes don't touch the wheel, they only move the deadline computed here.
+   */
+  Time timeoutDeadline(HttpContext* ctx, Stage& stage)
+  {
+    const TcpConnectionPtr& conn = ctx->_conn;
+    stage = ctx->_stage;
+    if (stage == HttpContext::STAGE_IDLE && conn->writeBufferSize())
+      stage = HttpContext::STAGE_RESPONDING;
+    Time lastWrite = std::max(ctx->_stageStart, conn->lastWriteTime());
+    switch (stage) {
+      case HttpContext::STAGE_HEADERS:
+        if (_headerReadTimeout)
+          return ctx->_stageStart + _headerReadTimeout;
+        break;
+      case HttpContext::STAGE_BODY:
+        if (_bodyReadTimeout)
+          return std::max(ctx->_stageStart, ctx->_lastRead) + _bodyReadTimeout;
+        break;
+      case HttpContext::STAGE_RESPONDING:
+        // the handler may take its time, only output waiting in the buffer can stall
+        if (_writeStallTimeout)
+          return (conn->writeBufferSize() ? lastWrite : conn->getLoop()->now()) +
+                 _writeStallTimeout;
+        break;
+      case HttpContext::STAGE_IDLE:
+        if (_keepAliveTimeout)
+          return lastWrite + _keepAliveTimeout;
+        break;
+      case HttpContext::STAGE_CLOSING:
+        return ctx->_stageStart.offsetBy(kCloseLinger);
+    }
+    return 0;
+  }
+
+  void handleTimeout(HttpContext* ctx)
+  {
+    Stage stage;
+    Time deadline = timeoutDeadline(ctx, stage);
+    if (!deadline)
+      return;
+    EventLoop* loop = ctx->getLoop();
+    if (loop->now() < deadline) {
+      loop->timingWheel().schedule(&ctx->_timeoutEntry, deadline);
+      return;
+    }
+
+    TcpConnectionPtr conn = ctx->_conn;
+    LoopMetrics& metrics = loop->metrics();
+    switch (stage) {
+      case HttpContext::STAGE_HEADERS:
+      case HttpContext::STAGE_BODY:
+        metrics
+          .timeouts[stage == HttpContext::STAGE_HEADERS ? LoopMetrics::TIMEOUT_HEADER_READ
+                                                        : LoopMetrics::TIMEOUT_BODY_READ]
+          .add();
+        // a response to an earlier request may still be on its way
+        if (conn->tls() && !conn->tls()->established())
+          conn->forceClose();
+        else if (conn->writeBufferSize())
+          ctx->shutdown();
+        else
+          ctx->sendError(HttpStatus::REQUEST_TIMEOUT);
+        break;
+      case HttpContext::STAGE_IDLE:
+        metrics.timeouts[LoopMetrics::TIMEOUT_KEEPALIVE].add();
+        if (ctx->_http2)
+          ctx->_http2->goAway();
+        ctx->shutdown();
+        break;
+      case HttpContext::STAGE_RESPONDING:
+        metrics.timeouts[LoopMetrics::TIMEOUT_WRITE_STALL].add();
+        conn->forceClose();
+        return;
+      case HttpContext::STAGE_CLOSING:
+        conn->forceClose();
+        return;
+    }
+    setStage(ctx, HttpContext::STAGE_CLOSING);
+  }
 };
 
 
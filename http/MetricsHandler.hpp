@@ -0,0 +1,32 @@
+#ifndef __METRICSHANDLER_HPP__
+#define __METRICSHANDLER_HPP__
+
+#include <string>
+#include "Metrics.hpp"
+#include "HttpServer.hpp"
+#include "HttpRouter.hpp"
+
+/**
+ * class MetricsHandler - expose the metrics of all loops in Prometheus text format
+ */
+class MetricsHandler
+{
+  typedef class HttpContext<HttpRequest> HttpContext;
+  typedef typename HttpContext::HttpContextPtr HttpContextPtr;
+
+public:
+  MetricsHandler() {}
+  ~MetricsHandler() {}
+
+  void operator()(int prefixLen, HttpContextPtr ctx, HttpServer* server)
+  {
+    std::string body = MetricsRegistry::instance().render();
+    ctx->startResponse(HttpStatus::OK);
+    ctx->sendHeader("Content-Type", "text/plain; version=0.0.4");
+    ctx->sendHeader("Content-Length", std::to_string(body.size()));
+    ctx->endHeaders();
+    ctx->send(body);
+  }
+};
+
+#endif
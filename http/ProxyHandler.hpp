@@ -6,9 +6,15 @@
 #include <sstream>
 #include <iostream>
 #include <memory>
+#include <atomic>
+#include <vector>
+#include <cmath>
 #include "HttpRouter.hpp"
 #include "HttpContext.hpp"
 #include "TcpClient.hpp"
+#include "WebSocket.hpp"
+#include "ChunkedWriter.hpp"
+#include "Compression.hpp"
 
 class ProxyHandler
 {
@@ -19,58 +25,897 @@ class ProxyHandler
 
 public:
   ProxyHandler(const std::string& host, uint16_t port)
-    : _host(host)
-    , _port(port)
+    : ProxyHandler(std::vector<std::pair<std::string, uint16_t>>{{host, port}})
+  {}
+
+  /**
+   * ProxyHandler() - proxy to a group of equivalent upstreams
+   *
+   * Requests are spread over the upstreams in round-robin order, and a retried request always
+   * goes to the next upstream.
+   */
+  ProxyHandler(const std::vector<std::pair<std::string, uint16_t>>& upstreams)
+    : _upstreams(std::make_shared<Upstreams>())
   {
-    if (port == 80 || port == 443)
-      _hostPort = host;
-    else
-      _hostPort = host + ":" + std::to_string(port);
+    assert(!upstreams.empty());
+    for (auto& [host, port] : upstreams) {
+      Upstream up{host, port, host};
+      if (port != 80 && port != 443)
+        up.hostPort = host + ":" + std::to_string(port);
+      _upstreams->list.push_back(std::move(up));
+    }
+    _upstreams->latency.reset(new LatencyTracker[upstreams.size()]);
+    _options.highWaterMark = kDefaultHighWaterMark;
+    _options.lowWaterMark = kDefaultLowWaterMark;
+    _options.connectTimeout = kDefaultConnectTimeout;
+    _options.firstByteTimeout = kDefaultFirstByteTimeout;
+    _options.idleReadTimeout = kDefaultIdleReadTimeout;
+    _options.totalTimeout = 0;
+    _options.maxRetries = kDefaultMaxRetries;
+    _options.hedgePercentile = 0;
+    _options.hedgeBudget = 0;
+    _options.hedgeMinDelay = kDefaultHedgeMinDelay;
+    _options.webSocket = false;
+    _options.compress = false;
   }
   ~ProxyHandler() {}
 
+  /**
+   * setWaterMarks() - bound the bytes buffered on either side of the proxy
+   *
+   * Once a peer's write buffer reaches @high, we stop reading from the other side until it
+   * drains to @low.
+   */
+  void setWaterMarks(size_t high, size_t low)
+  {
+    assert(low < high);
+    _options.highWaterMark = high;
+    _options.lowWaterMark = low;
+  }
+
+  /**
+   * setTimeouts() - limit how long a proxied request may wait on the upstream
+   *
+   * @connect: establishing the upstream connection
+   * @firstByte: from sending the request to the first byte of the response
+   * @idleRead: between two reads of the response
+   * @total: the whole request, retries included
+   *
+   * All in seconds, 0 means no limit.
+   */
+  void setTimeouts(double connect, double firstByte, double idleRead, double total)
+  {
+    _options.connectTimeout = connect;
+    _options.firstByteTimeout = firstByte;
+    _options.idleReadTimeout = idleRead;
+    _options.totalTimeout = total;
+  }
+
+  /**
+   * setMaxRetries() - retry idempotent requests on another upstream at most @n times
+   *
+   * A request is only retried if nothing has been sent to the client yet.
+   */
+  void setMaxRetries(int n)
+  {
+    _options.maxRetries = n;
+  }
+
+  /**
+   * setHedging() - send slow GET/HEAD requests to a second upstream as well
+   *
+   * If an upstream has not answered within the @percentile (e.g. 0.95) of its recent
+   * time-to-first-byte, the request is also sent to the next upstream, and the first answer
+   * wins. At most @budget (e.g. 0.05) hedged requests per request are sent overall, so
+   * hedging cannot double the load of an already slow group. Needs at least two upstreams.
+   */
+  void setHedging(double percentile, double budget, double minDelay = kDefaultHedgeMinDelay)
+  {
+    assert(percentile > 0 && percentile < 1);
+    _options.hedgePercentile = percentile;
+    _options.hedgeBudget = budget;
+    _options.hedgeMinDelay = minDelay;
+  }
+
+  /**
+   * setTls() - speak TLS with @ctx to the upstreams, checking their certificates against
+   *            their host names
+   */
+  void setTls(std::shared_ptr<TlsContext> ctx)
+  {
+    _options.tls = std::move(ctx);
+  }
+
+  /**
+   * setWebSocket() - pass WebSocket handshakes on, and once the upstream switches protocols,
+   *                  relay the frames both ways as they are
+   *
+   * An upgraded connection has no timeouts but the connect and first byte ones, its ends ping
+   * each other. An upstream refusing to upgrade keeps its connection open, the idle read
+   * timeout then ends the response.
+   */
+  void setWebSocket(bool on)
+  {
+    _options.webSocket = on;
+  }
+
+  /**
+   * setCompression() - gzip the responses @compression deems worth it, for clients accepting it
+   *
+   * A compressed response loses its Content-Length and goes out with chunked transfer
+   * encoding, a strong ETag becomes a weak one. Responses already encoded, to HEAD, or asking
+   * for no-transform are relayed as they are.
+   */
+  void setCompression(bool on, const Compression& compression = Compression())
+  {
+    _options.compress = on;
+    _options.compression = compression;
+  }
+
   void operator()(int prefixLen, HttpContextPtr ctx, HttpServer* server)
   {
-    InetAddress _upAddr;
-    if (!_upAddr.parseHost(_host.c_str(), _port)) {
-      ctx->send(
-        "HTTP/1.1 502 Bad Gateway\r\nContent-Type: text/plain\r\nContent-Length: 0\r\n\r\n");
-      return;
-    }
     HttpRequestPtr msg = ctx->getMessage();
     std::string upPath = msg->path.substr(prefixLen);
     if (upPath.empty())
       upPath.assign("/");
     msg->path = upPath;
-    msg->headers.insert_or_assign("Host", _hostPort);
     msg->headers.insert_or_assign("X-Forwarded-For", ctx->getConn()->getPeerAddr().toIpPort());
-    TcpClientPtr client = std::make_shared<TcpClient>(ctx->getLoop(), _upAddr);
-    client->setConnectCallback([msg](auto upConn) { upConn->write(msg->serialize()); });
-    client->setMessageCallback([ctx](const TcpConnectionPtr& upConn, StreamBuffer* buf) {
-      ctx->send(buf->data(), buf->size());
-      buf->popFront();
-    });
-    client->setCloseCallback([ctx](auto upConn) { ctx->forceClose(); });
-    ctx->setUserData(client);
-    ctx->setCloseCallback([ctx] {
-      TcpClientPtr upClient = std::any_cast<TcpClientPtr>(ctx->getUserData());
-      upClient->stopConnect();
-      upClient->setConnectCallback(nullptr);
-      upClient->setMessageCallback(nullptr);
-      upClient->setWriteCompleteCallback(nullptr);
-      upClient->setCloseCallback([upClient](auto upConn) {
-        // Hack: Hold a reference of itself until closeCallback() to avoid nullptr
-        upClient->setCloseCallback(nullptr);
-      });
-      upClient->forceClose();
+    // we rely on the upstream closing the connection to finish the response, unless it
+    // switches to WebSocket
+    bool tunnel = _options.webSocket && msg->major == 1 && WebSocketHandler::isUpgrade(*msg);
+    msg->headers.insert_or_assign("Connection", tunnel ? "Upgrade" : "close");
+    bool gzip = _options.compress && !tunnel && msg->method != HTTP_HEAD &&
+                Compression::acceptsGzip(*msg);
+
+    auto session = std::make_shared<Session>(ctx, _upstreams, _options, tunnel, gzip);
+    ctx->setUserData(session);
+    ctx->setCloseCallback([weakSession = std::weak_ptr<Session>(session)] {
+      if (auto session = weakSession.lock())
+        session->abort();
     });
-    client->start();
+    session->start();
   }
 
 private:
-  std::string _host;
-  uint16_t _port;
-  std::string _hostPort;
+  static constexpr size_t kDefaultHighWaterMark = 1024 * 1024;
+  static constexpr size_t kDefaultLowWaterMark = 256 * 1024;
+  static constexpr double kDefaultConnectTimeout = 3.0;
+  static constexpr double kDefaultFirstByteTimeout = 30.0;
+  static constexpr double kDefaultIdleReadTimeout = 30.0;
+  static constexpr int kDefaultMaxRetries = 1;
+
+  static constexpr double kDefaultHedgeMinDelay = 0.005;
+  static constexpr size_t kStatusLineSize = 12;   // "HTTP/1.1 101"
+  static constexpr int64_t kHedgeBudgetBurst = 10;
+
+  /**
+   * class LatencyTracker - recent time-to-first-byte distribution of one upstream
+   *
+   * Samples go into log-scaled buckets, 4 per power of two starting from 1ms. The counts are
+   * halved every kDecaySamples samples, so that the distribution follows recent behaviour.
+   * It is shared by all loops, but only needs to be roughly right, so relaxed atomics will do.
+   */
+  class LatencyTracker : noncopyable
+  {
+  public:
+    LatencyTracker()
+      : _samples(0)
+    {
+      for (auto& b : _buckets)
+        b.store(0, std::memory_order_relaxed);
+    }
+
+    void record(double seconds)
+    {
+      double ms = seconds * 1000;
+      int index = ms <= 1 ? 0 : std::min<int>(kBuckets - 1, 1 + std::log2(ms) * 4);
+      _buckets[index].fetch_add(1, std::memory_order_relaxed);
+      if (_samples.fetch_add(1, std::memory_order_relaxed) + 1 == kDecaySamples) {
+        for (auto& b : _buckets)
+          b.store(b.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        _samples.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    /**
+     * percentile() - the @p-th (0 < @p < 1) percentile in seconds, -1 if we know too little
+     */
+    double percentile(double p) const
+    {
+      uint32_t counts[kBuckets];
+      uint64_t total = 0;
+      for (int i = 0; i < kBuckets; i++)
+        total += counts[i] = _buckets[i].load(std::memory_order_relaxed);
+      if (total < kMinSamples)
+        return -1;
+      uint64_t rank = static_cast<uint64_t>(p * total);
+      uint64_t seen = 0;
+      int i = 0;
+      for (; i < kBuckets - 1; i++) {
+        seen += counts[i];
+        if (seen > rank)
+          break;
+      }
+      // upper bound of bucket i
+      return std::exp2(i / 4.0) / 1000;
+    }
+
+  private:
+    static constexpr int kBuckets = 64;
+    static constexpr uint32_t kDecaySamples = 1024;
+    static constexpr uint64_t kMinSamples = 32;
+
+    std::atomic<uint32_t> _buckets[kBuckets];
+    std::atomic<uint32_t> _samples;
+  };
+
+  struct Upstream
+  {
+    std::string host;
+    uint16_t port;
+    std::string hostPort;
+  };
+
+  /**
+   * struct Upstreams - the upstream group, shared by all copies of the handler
+   */
+  struct Upstreams
+  {
+    std::vector<Upstream> list;
+    std::unique_ptr<LatencyTracker[]> latency;
+    std::atomic<unsigned> next{0};
+    // in thousandths of a hedged request
+    std::atomic<int64_t> hedgeTokens{0};
+
+    void depositHedgeBudget(double ratio)
+    {
+      int64_t amount = static_cast<int64_t>(ratio * 1000);
+      int64_t cur = hedgeTokens.load(std::memory_order_relaxed);
+      int64_t next;
+      do {
+        next = std::min(cur + amount, kHedgeBudgetBurst * 1000);
+      } while (!hedgeTokens.compare_exchange_weak(cur, next, std::memory_order_relaxed));
+    }
+
+    bool withdrawHedgeBudget()
+    {
+      int64_t cur = hedgeTokens.load(std::memory_order_relaxed);
+      while (cur >= 1000) {
+        if (hedgeTokens.compare_exchange_weak(cur, cur - 1000, std::memory_order_relaxed))
+          return true;
+      }
+      return false;
+    }
+  };
+
+  struct Options
+  {
+    size_t highWaterMark;
+    size_t lowWaterMark;
+    double connectTimeout;
+    double firstByteTimeout;
+    double idleReadTimeout;
+    double totalTimeout;
+    int maxRetries;
+    double hedgePercentile;
+    double hedgeBudget;
+    double hedgeMinDelay;
+    std::shared_ptr<TlsContext> tls;
+    bool webSocket;
+    bool compress;
+    Compression compression;
+  };
+
+  /**
+   * class Session - the state of one proxied request
+   *
+   * Owned by the client context (as its user data, and as the protocol of an upgraded
+   * connection), everything else holds weak references.
+   */
+  class Session : noncopyable, public HttpUpgrade, public std::enable_shared_from_this<Session>
+  {
+  public:
+    Session(HttpContextPtr ctx, std::shared_ptr<Upstreams> upstreams, const Options& options,
+            bool tunnel, bool gzip)
+      : _ctx(ctx)
+      , _loop(ctx->getLoop())
+      , _upstreams(std::move(upstreams))
+      , _options(options)
+      , _idempotent(ctx->getMessage()->isIdempotent())
+      , _stream(ctx->getMessage()->major == 2)
+      , _tunnel(tunnel)
+      , _upgraded(false)
+      , _gzip(gzip)
+      , _upstreamDone(false)
+      , _first(_upstreams->next.fetch_add(1, std::memory_order_relaxed))
+      , _launched(0)
+      , _retries(0)
+      , _responded(false)
+      , _done(false)
+      , _lastRead(0)
+      , _totalTimer(0)
+      , _hedgeTimer(0)
+      , _idleTimer(0)
+    {
+      llhttp_method_t method = ctx->getMessage()->method;
+      _hedgeable = _options.hedgePercentile > 0 && _upstreams->list.size() > 1 &&
+                   (method == HTTP_GET || method == HTTP_HEAD);
+      if (_gzip) {
+        _parser = std::make_unique<HttpParser<HttpResponse>>();
+        _parser->setHeaderCallback(
+          [this](const HttpParser<HttpResponse>& parser) { onUpstreamHeaders(parser); });
+        _parser->setBodyCallback([this](const char* data, size_t len) {
+          if (_encoder)
+            _encoder->compress(data, len, _gzipped, Z_NO_FLUSH);
+        });
+        _parser->setMessageCallback(
+          [this](const HttpParser<HttpResponse>&) { _upstreamDone = true; });
+      }
+    }
+    ~Session() {}
+
+    void start()
+    {
+      if (_stream) {
+        // the connection is not ours, watch what waits in the stream instead
+        _ctx->setWriteCompleteCallback([weakSelf = weak_from_this()] {
+          if (auto self = weakSelf.lock())
+            if (TcpConnectionPtr upConn = self->upstreamConn())
+              upConn->resumeRead();
+        });
+      } else {
+        watchDownstream();
+      }
+      if (_options.totalTimeout > 0)
+        _totalTimer = _loop->runAfter(_options.totalTimeout, [weakSelf = weak_from_this()] {
+          if (auto self = weakSelf.lock()) {
+            self->_totalTimer = 0;
+            self->timeout();
+          }
+        });
+      if (_hedgeable)
+        _upstreams->depositHedgeBudget(_options.hedgeBudget);
+      attempt();
+    }
+
+    /**
+     * abort() - the client has gone away
+     */
+    void abort()
+    {
+      finish();
+      // break the reference cycle between us and the context
+      _ctx->setUserData(std::any());
+    }
+
+    /**
+     * onData() - the client's frames, once the upstream has switched protocols
+     */
+    void onData(const char* data, size_t len) override
+    {
+      if (TcpConnectionPtr upConn = upstreamConn())
+        upConn->write(data, len);
+    }
+
+    void onWriteComplete() override {}
+
+    void onClose() override
+    {
+      abort();
+    }
+
+  private:
+    /**
+     * watchDownstream() - slow client: stop reading the upstream response until the client
+     *                     catches up
+     */
+    void watchDownstream()
+    {
+      const TcpConnectionPtr& downConn = _ctx->getConn();
+      downConn->setHighWaterMarkCallback(
+        [weakSelf = weak_from_this()](const TcpConnectionPtr&) {
+          if (auto self = weakSelf.lock())
+            if (TcpConnectionPtr upConn = self->upstreamConn())
+              upConn->pauseRead();
+        },
+        _options.highWaterMark);
+      downConn->setLowWaterMarkCallback(
+        [weakSelf = weak_from_this()](const TcpConnectionPtr&) {
+          if (auto self = weakSelf.lock())
+            if (TcpConnectionPtr upConn = self->upstreamConn())
+              upConn->resumeRead();
+        },
+        _options.lowWaterMark);
+    }
+
+    /**
+     * struct Attempt - one request sent to one upstream
+     *
+     * Before the response starts there may be two of them (the original and its hedge),
+     * afterwards only the one which is answering.
+     */
+    struct Attempt
+    {
+      TcpClientPtr client;
+      size_t upstream;
+      Time start;
+      TimerId connectTimer;
+      TimerId firstByteTimer;
+    };
+
+    HttpContextPtr _ctx;
+    EventLoop* _loop;
+    std::shared_ptr<Upstreams> _upstreams;
+    Options _options;
+    bool _idempotent;
+    bool _stream;   // an HTTP/2 stream, sharing its connection with others
+    bool _tunnel;   // a WebSocket handshake, relayed as is once the upstream accepts it
+    bool _upgraded;
+    std::string _statusLine;   // the start of it, until we know whether it is a 101
+    // the client accepts gzip, and the response was not found unworthy of it yet
+    bool _gzip;
+    bool _upstreamDone;   // the parser has seen the whole response
+    std::unique_ptr<HttpParser<HttpResponse>> _parser;
+    std::string _head;   // the response as it came, until its head tells whether to compress
+    std::shared_ptr<ChunkedWriter> _writer;   // of the compressed response, null until then
+    std::unique_ptr<GzipEncoder> _encoder;
+    std::string _gzipped;   // compressed body waiting for the writer
+    bool _hedgeable;
+    unsigned _first;
+    unsigned _launched;
+    int _retries;
+    std::vector<Attempt> _attempts;
+    bool _responded;
+    bool _done;
+    Time _lastRead;
+
+    TimerId _totalTimer;
+    TimerId _hedgeTimer;
+    TimerId _idleTimer;
+
+    TcpConnectionPtr upstreamConn()
+    {
+      if (!_responded || _attempts.empty())
+        return nullptr;
+      return _attempts.front().client->connection();
+    }
+
+    Attempt* findAttempt(TcpClient* client)
+    {
+      for (auto& a : _attempts)
+        if (a.client.get() == client)
+          return &a;
+      return nullptr;
+    }
+
+    void attempt()
+    {
+      const auto& list = _upstreams->list;
+      size_t index = (_first + _launched++) % list.size();
+      const Upstream& up = list[index];
+
+      InetAddress upAddr;
+      if (!upAddr.parseHost(up.host.c_str(), up.port)) {
+        if (_attempts.empty())
+          retryOrGiveUp(true, HttpStatus::BAD_GATEWAY);
+        return;
+      }
+      HttpRequestPtr msg = _ctx->getMessage();
+      msg->headers.insert_or_assign("Host", up.hostPort);
+      // the upstream speaks HTTP/1.1, whatever the client does
+      if (_stream) {
+        msg->major = 1;
+        msg->minor = 1;
+      }
+      std::string request = msg->serialize();
+
+      std::weak_ptr<Session> weakSelf(shared_from_this());
+      TcpClientPtr upClient = std::make_shared<TcpClient>(_loop, upAddr);
+      // callbacks of a released client may still be on their way, so they check that the
+      // client still belongs to one of our attempts
+      TcpClient* client = upClient.get();
+      // failing over to the next upstream is better than backing off on this one
+      upClient->setMaxConnectRetries(0);
+      if (_options.tls)
+        upClient->setTls(_options.tls, up.host);
+      upClient->setConnectFailedCallback([weakSelf, client] {
+        if (auto self = weakSelf.lock(); self && self->findAttempt(client))
+          self->attemptFailed(client, true, HttpStatus::BAD_GATEWAY);
+      });
+      upClient->setConnectCallback([weakSelf, client, request](const TcpConnectionPtr& upConn) {
+        if (auto self = weakSelf.lock(); self && self->findAttempt(client))
+          self->onConnected(client, upConn, request);
+      });
+      upClient->setMessageCallback(
+        [weakSelf, client](const TcpConnectionPtr&, StreamBuffer* buf) {
+          if (auto self = weakSelf.lock(); self && self->findAttempt(client))
+            self->onResponse(client, buf);
+          else
+            buf->popFront();
+        });
+      upClient->setCloseCallback([weakSelf, client](const TcpConnectionPtr&) {
+        if (auto self = weakSelf.lock(); self && self->findAttempt(client))
+          self->onUpstreamClose(client);
+      });
+
+      Attempt a{upClient, index, Time::now(), 0, 0};
+      if (_options.connectTimeout > 0)
+        a.connectTimer = _loop->runAfter(_options.connectTimeout, [weakSelf, client] {
+          if (auto self = weakSelf.lock()) {
+            if (Attempt* a = self->findAttempt(client)) {
+              a->connectTimer = 0;
+              self->attemptFailed(client, true, HttpStatus::GATEWAY_TIMEOUT);
+            }
+          }
+        });
+      _attempts.push_back(std::move(a));
+
+      if (_hedgeable && _launched == 1) {
+        double delay = _upstreams->latency[index].percentile(_options.hedgePercentile);
+        // without enough samples we don't know what is slow
+        if (delay >= 0)
+          _hedgeTimer = _loop->runAfter(std::max(delay, _options.hedgeMinDelay), [weakSelf] {
+            if (auto self = weakSelf.lock()) {
+              self->_hedgeTimer = 0;
+              self->hedge();
+            }
+          });
+      }
+      upClient->start();
+    }
+
+    /**
+     * hedge() - the first upstream is slower than usual, ask another one as well
+     */
+    void hedge()
+    {
+      if (_done || _responded || _attempts.size() != 1)
+        return;
+      if (!_upstreams->withdrawHedgeBudget())
+        return;
+      attempt();
+    }
+
+    void onConnected(TcpClient* client, const TcpConnectionPtr& upConn, const std::string& request)
+    {
+      Attempt* a = findAttempt(client);
+      cancelTimer(a->connectTimer);
+      // slow upstream: stop reading the request from the client until upstream catches up,
+      // unless other streams share the client connection
+      if (!_stream) {
+        std::weak_ptr<TcpConnection> weakDown(_ctx->getConn());
+        upConn->setHighWaterMarkCallback(
+          [weakDown](auto) {
+            if (auto downConn = weakDown.lock())
+              downConn->pauseRead();
+          },
+          _options.highWaterMark);
+        upConn->setLowWaterMarkCallback(
+          [weakDown](auto) {
+            if (auto downConn = weakDown.lock())
+              downConn->resumeRead();
+          },
+          _options.lowWaterMark);
+      }
+      upConn->write(request);
+      if (_options.firstByteTimeout > 0)
+        a->firstByteTimer =
+          _loop->runAfter(_options.firstByteTimeout, [weakSelf = weak_from_this(), client] {
+            if (auto self = weakSelf.lock()) {
+              if (Attempt* a = self->findAttempt(client)) {
+                a->firstByteTimer = 0;
+                // the upstream may have acted on the request, only retry if it is idempotent
+                self->attemptFailed(client, self->_idempotent, HttpStatus::GATEWAY_TIMEOUT);
+              }
+            }
+          });
+    }
+
+    void onResponse(TcpClient* client, StreamBuffer* buf)
+    {
+      if (!_responded) {
+        // the first one to answer wins
+        _responded = true;
+        cancelTimer(_hedgeTimer);
+        for (size_t i = 0; i < _attempts.size();) {
+          if (_attempts[i].client.get() != client) {
+            releaseAttempt(_attempts[i]);
+            _attempts.erase(_attempts.begin() + i);
+          } else {
+            ++i;
+          }
+        }
+        Attempt& a = _attempts.front();
+        cancelTimer(a.firstByteTimer);
+        Time latency = Time::now() - a.start;
+        _upstreams->latency[a.upstream].record(latency / 1000000.0);
+        _loop->metrics().upstreamLatency.record(latency * 1000);
+        if (_options.idleReadTimeout > 0)
+          armIdleTimer(_options.idleReadTimeout);
+      }
+      bool switching = false;
+      if (_tunnel && !_upgraded && _statusLine.size() < kStatusLineSize) {
+        _statusLine.append(buf->data(),
+                           std::min(kStatusLineSize - _statusLine.size(), buf->size()));
+        switching = _statusLine == "HTTP/1.1 101";
+      }
+      _lastRead = _loop->now();
+      if (_gzip)
+        gzipResponse(buf->data(), buf->size());
+      else
+        _ctx->send(buf->data(), buf->size());
+      buf->popFront();
+      if (switching) {
+        // the WebSocket lasts as long as its ends want
+        _upgraded = true;
+        cancelTimer(_totalTimer);
+        cancelTimer(_idleTimer);
+        _ctx->upgrade(shared_from_this());
+      }
+      // resumed by the write complete callback once the stream is drained
+      if (_stream && _ctx->bufferedBytes() >= _options.highWaterMark)
+        _attempts.front().client->connection()->pauseRead();
+    }
+
+    void onUpstreamClose(TcpClient* client)
+    {
+      if (!_responded) {
+        // closed without a response, e.g. the upstream is restarting
+        attemptFailed(client, _idempotent, HttpStatus::BAD_GATEWAY);
+        return;
+      }
+      finish();
+      if (_gzip && !_writer) {
+        _ctx->send(_head);
+      } else if (_gzip && !_writer->finished()) {
+        // a body delimited by the close is complete now, any other is cut short
+        if (_parser->finish() == HPE_OK && _upstreamDone)
+          flushGzip();
+        else
+          _writer.reset();
+      }
+      // flush what we have got to the client, then close
+      _ctx->getConn()->resumeRead();
+      _ctx->shutdown();
+    }
+
+    /**
+     * gzipResponse() - parse @len bytes of the response, compressing its body if worth it
+     *
+     * The response is held until its head tells, one not worth compressing then goes out as it
+     * came. Otherwise its head is sent again without its framing, and the body compressed
+     * through a ChunkedWriter, flushed at the end of each read so that a slow upstream is not
+     * held back by zlib.
+     */
+    void gzipResponse(const char* data, size_t len)
+    {
+      if (_writer && _writer->finished())
+        return;
+      if (!_writer)
+        _head.append(data, len);
+      llhttp_errno_t err = _parser->advance(data, len);
+      if (!_writer) {
+        // not worth it, or not HTTP as we know it
+        if (!_gzip || err != HPE_OK) {
+          _gzip = false;
+          _ctx->send(_head);
+          _head.clear();
+          _parser.reset();
+        }
+        return;
+      }
+      if (err != HPE_OK) {
+        // the upstream broke the framing of the body, cut the response short
+        _gzip = false;
+        _writer.reset();
+        return;
+      }
+      flushGzip();
+    }
+
+    /**
+     * onUpstreamHeaders() - the head of the response is in, compress its body or not
+     */
+    void onUpstreamHeaders(const HttpParser<HttpResponse>& parser)
+    {
+      std::shared_ptr<HttpResponse> res = parser.getMessage();
+      const std::string* type = res->findHeader("Content-Type");
+      const std::string* length = res->findHeader("Content-Length");
+      const std::string* cacheControl = res->findHeader("Cache-Control");
+      int code = res->status_code;
+      size_t headEnd = _head.find("\r\n\r\n");
+      if (code < 200 || code == 204 || code == 206 || code == 304 || !type ||
+          res->findHeader("Content-Encoding") ||
+          (cacheControl && strcasestr(cacheControl->c_str(), "no-transform")) ||
+          !_options.compression.compressible(*type, length ? atoll(length->c_str()) : -1) ||
+          headEnd == std::string::npos) {
+        _gzip = false;
+        return;
+      }
+      // the headers from the head as it came, the map of the parser keeps one of each name
+      ChunkedWriter::Headers headers;
+      bool vary = false;
+      for (size_t pos = _head.find("\r\n") + 2; pos < headEnd + 2;) {
+        size_t eol = _head.find("\r\n", pos);
+        std::string line = _head.substr(pos, eol - pos);
+        pos = eol + 2;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+          continue;
+        std::string name = line.substr(0, colon);
+        size_t valueStart = std::min(line.find_first_not_of(" \t", colon + 1), line.size());
+        std::string value = line.substr(valueStart);
+        value.erase(value.find_last_not_of(" \t") + 1);
+        // the writer frames the body and dates the response, the trailers are not relayed
+        if (strcasecmp(name.c_str(), "Content-Length") == 0 ||
+            strcasecmp(name.c_str(), "Transfer-Encoding") == 0 ||
+            strcasecmp(name.c_str(), "Trailer") == 0 ||
+            strcasecmp(name.c_str(), "Connection") == 0 ||
+            strcasecmp(name.c_str(), "Keep-Alive") == 0 || strcasecmp(name.c_str(), "Date") == 0)
+          continue;
+        if (strcasecmp(name.c_str(), "ETag") == 0 && value.compare(0, 2, "W/") != 0) {
+          // the bytes differ from the upstream's, they are only semantically the same
+          value.insert(0, "W/");
+        } else if (strcasecmp(name.c_str(), "Vary") == 0) {
+          vary = true;
+          if (value != "*" && !strcasestr(value.c_str(), "Accept-Encoding"))
+            value.append(", Accept-Encoding");
+        }
+        headers.emplace_back(std::move(name), std::move(value));
+      }
+      headers.emplace_back("Content-Encoding", "gzip");
+      if (!vary)
+        headers.emplace_back("Vary", "Accept-Encoding");
+
+      _writer = std::make_shared<ChunkedWriter>(_ctx);
+      // flushGzip() sends a chunk per read
+      _writer->setFlushPolicy(ChunkedWriter::kDefaultFlushSize, 0);
+      _writer->start(code, headers);
+      _encoder = std::make_unique<GzipEncoder>(_options.compression.level());
+      _head.clear();
+    }
+
+    /**
+     * flushGzip() - send what was compressed so far, and end the response once the upstream's
+     *               is complete
+     */
+    void flushGzip()
+    {
+      if (!_encoder->compress(nullptr, 0, _gzipped, _upstreamDone ? Z_FINISH : Z_SYNC_FLUSH)) {
+        _gzip = false;
+        _writer.reset();
+        return;
+      }
+      _writer->write(_gzipped);
+      _gzipped.clear();
+      if (_upstreamDone) {
+        _loop->metrics().recordGzip(_encoder->bytesIn(), _encoder->bytesOut());
+        _encoder.reset();
+        _writer->finish();
+      } else {
+        _writer->flush();
+      }
+    }
+
+    /**
+     * armIdleTimer() - check for an idle upstream after @delay seconds
+     *
+     * Rather than re-arming the timer on every read, the timer compares the time of the last
+     * read when it fires and sleeps again for the remainder.
+     */
+    void armIdleTimer(double delay)
+    {
+      _idleTimer = _loop->runAfter(delay, [weakSelf = weak_from_this()] {
+        if (auto self = weakSelf.lock()) {
+          self->_idleTimer = 0;
+          double idle = (self->_loop->now() - self->_lastRead) / 1000000.0;
+          if (idle >= self->_options.idleReadTimeout)
+            self->timeout();
+          else
+            self->armIdleTimer(self->_options.idleReadTimeout - idle);
+        }
+      });
+    }
+
+    /**
+     * attemptFailed() - the attempt on @client failed
+     *
+     * If a hedged attempt is still running, leave it to that one.
+     */
+    void attemptFailed(TcpClient* client, bool retryable, int status)
+    {
+      if (_done)
+        return;
+      for (size_t i = 0; i < _attempts.size(); ++i) {
+        if (_attempts[i].client.get() == client) {
+          releaseAttempt(_attempts[i]);
+          _attempts.erase(_attempts.begin() + i);
+          break;
+        }
+      }
+      if (_responded) {
+        finish();
+        _ctx->forceClose();
+        return;
+      }
+      if (_attempts.empty())
+        retryOrGiveUp(retryable, status);
+    }
+
+    /**
+     * retryOrGiveUp() - retry on the next upstream if possible, otherwise reply @status
+     */
+    void retryOrGiveUp(bool retryable, int status)
+    {
+      if (retryable && _idempotent && _retries < _options.maxRetries) {
+        _retries++;
+        attempt();
+        return;
+      }
+      finish();
+      _ctx->getConn()->resumeRead();
+      _ctx->sendError(status);
+    }
+
+    /**
+     * timeout() - the request as a whole took too long
+     */
+    void timeout()
+    {
+      if (_done)
+        return;
+      finish();
+      if (_responded) {
+        _ctx->forceClose();
+      } else {
+        _ctx->getConn()->resumeRead();
+        _ctx->sendError(HttpStatus::GATEWAY_TIMEOUT);
+      }
+    }
+
+    void finish()
+    {
+      if (_done)
+        return;
+      _done = true;
+      cancelTimer(_totalTimer);
+      cancelTimer(_hedgeTimer);
+      cancelTimer(_idleTimer);
+      for (auto& a : _attempts)
+        releaseAttempt(a);
+      _attempts.clear();
+    }
+
+    void cancelTimer(TimerId& timer)
+    {
+      if (timer) {
+        _loop->cancel(timer);
+        timer = 0;
+      }
+    }
+
+    void releaseAttempt(Attempt& a)
+    {
+      cancelTimer(a.connectTimer);
+      cancelTimer(a.firstByteTimer);
+      TcpClientPtr upClient;
+      upClient.swap(a.client);
+      upClient->stopConnect();
+      if (upClient->connection()) {
+        upClient->setCloseCallback([upClient](auto upConn) {
+          // Hack: Hold a reference of itself until closeCallback() to avoid nullptr
+          upClient->setCloseCallback(nullptr);
+        });
+        upClient->forceClose();
+      } else {
+        // we may be called from one of its callbacks, destroy it later
+        _loop->queueInLoop([upClient] {});
+      }
+    }
+  };
+
+  std::shared_ptr<Upstreams> _upstreams;
+  Options _options;
 };
 
 #endif
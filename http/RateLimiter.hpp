@@ -0,0 +1,215 @@
+#ifndef __RATELIMITER_HPP__
+#define __RATELIMITER_HPP__
+
+#include <strings.h>
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "EventLoop.hpp"
+#include "Socket.hpp"
+#include "TcpConnection.hpp"
+#include "HttpParser.hpp"
+
+/**
+ * class RateLimiter - token buckets limiting the requests of each client
+ *
+ * Clients are keyed by their address, or by a request header (e.g. set by a load balancer in
+ * front of us). Every io loop has its own shard of buckets, so checking a request takes no lock.
+ *
+ * The connections of one client may be spread over several loops, so a shard refills a bucket
+ * with the share of the client's requests it saw in the last period. The shards publish their
+ * counts under a lock once a period; a client new to a shard gets the whole rate until then,
+ * and a shard never gets less than an equal share, so a client may briefly exceed its rate.
+ *
+ * Each shard keeps at most maxKeys buckets, the least recently used are evicted.
+ */
+class RateLimiter : noncopyable
+{
+public:
+  static constexpr double kRebalancePeriod = 1.0;
+
+  /**
+   * RateLimiter() - allow @rate requests per second with bursts of @burst per client
+   * @maxKeys: the buckets kept by each shard, at least 1
+   */
+  RateLimiter(double rate, double burst, size_t maxKeys)
+    : _rate(rate)
+    , _burst(burst)
+    , _maxKeys(std::max<size_t>(maxKeys, 1))
+  {}
+  ~RateLimiter() {}
+
+  /**
+   * setKeyHeader() - key the clients by the value of @name rather than their address
+   *
+   * Requests without the header are keyed by their address.
+   */
+  void setKeyHeader(const std::string& name)
+  {
+    _keyHeader = name;
+  }
+
+  /**
+   * addLoops() - create a shard for each of @loops, before any request is checked
+   *
+   * The limiter must outlive the loops.
+   */
+  void addLoops(const std::vector<EventLoop*>& loops)
+  {
+    for (EventLoop* loop : loops) {
+      _shards.emplace_back(new Shard(this, _shards.size()));
+      Shard* shard = _shards.back().get();
+      _shardOfLoop[loop] = shard;
+      loop->runEvery(kRebalancePeriod, [shard] { shard->rebalance(); });
+    }
+  }
+
+  /**
+   * allow() - take a token for the client of @req on connection @conn
+   *
+   * Only to be called in the loop of @conn.
+   */
+  bool allow(const TcpConnectionPtr& conn, const HttpRequest& req)
+  {
+    auto it = _shardOfLoop.find(conn->getLoop());
+    if (it == _shardOfLoop.end())
+      return true;
+    return it->second->allow(key(conn, req), conn->getLoop()->now());
+  }
+
+private:
+  struct Bucket
+  {
+    std::string key;
+    double tokens;
+    Time last;
+    double share;         // of the rate this shard refills with
+    uint64_t count;       // requests in the current period
+    uint64_t published;   // count of the last period, as published
+  };
+
+  class Shard : noncopyable
+  {
+  public:
+    Shard(RateLimiter* limiter, size_t index)
+      : _limiter(limiter)
+      , _index(index)
+    {}
+
+    bool allow(const std::string& key, Time now)
+    {
+      Bucket* b = touch(key, now);
+      b->count++;
+      double elapsed = (now - b->last) / 1e6;
+      b->last = now;
+      double burst = std::max(1.0, _limiter->_burst * b->share);
+      b->tokens = std::min(burst, b->tokens + elapsed * _limiter->_rate * b->share);
+      if (b->tokens < 1)
+        return false;
+      b->tokens -= 1;
+      return true;
+    }
+
+    /**
+     * rebalance() - publish the counts of the period, and take the shares of the next
+     */
+    void rebalance()
+    {
+      std::lock_guard lock(_limiter->_mutex);
+      for (const auto& key : _evicted)
+        _limiter->publish(key, _index, 0);
+      _evicted.clear();
+      for (Bucket& b : _lru) {
+        if (b.count || b.published)
+          _limiter->publish(b.key, _index, b.count);
+        b.published = b.count;
+        b.count = 0;
+      }
+      for (Bucket& b : _lru)
+        b.share = _limiter->share(b.key, _index);
+    }
+
+  private:
+    RateLimiter* _limiter;
+    size_t _index;
+    std::list<Bucket> _lru;   // most recently used first
+    std::unordered_map<std::string, std::list<Bucket>::iterator> _buckets;
+    std::vector<std::string> _evicted;
+
+    Bucket* touch(const std::string& key, Time now)
+    {
+      auto it = _buckets.find(key);
+      if (it != _buckets.end()) {
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return &*it->second;
+      }
+      if (_buckets.size() >= _limiter->_maxKeys) {
+        Bucket& victim = _lru.back();
+        if (victim.published)
+          _evicted.push_back(victim.key);
+        _buckets.erase(victim.key);
+        _lru.pop_back();
+      }
+      _lru.push_front(Bucket{key, _limiter->_burst, now, 1.0, 0, 0});
+      _buckets[key] = _lru.begin();
+      return &_lru.front();
+    }
+  };
+
+  double _rate;
+  double _burst;
+  size_t _maxKeys;
+  std::string _keyHeader;
+  std::vector<std::unique_ptr<Shard>> _shards;
+  std::unordered_map<EventLoop*, Shard*> _shardOfLoop;   // read only once set up
+
+  std::mutex _mutex;   // guards _counts
+  std::unordered_map<std::string, std::vector<uint64_t>> _counts;   // per key, per shard
+
+  void publish(const std::string& key, size_t shard, uint64_t count)
+  {
+    auto it = _counts.find(key);
+    if (it == _counts.end()) {
+      if (!count)
+        return;
+      it = _counts.emplace(key, std::vector<uint64_t>(_shards.size())).first;
+    }
+    it->second[shard] = count;
+    for (uint64_t c : it->second)
+      if (c)
+        return;
+    _counts.erase(it);
+  }
+
+  double share(const std::string& key, size_t shard) const
+  {
+    auto it = _counts.find(key);
+    if (it == _counts.end())
+      return 1.0;
+    uint64_t total = 0;
+    for (uint64_t c : it->second)
+      total += c;
+    return std::max(static_cast<double>(it->second[shard]) / total, 1.0 / _shards.size());
+  }
+
+  std::string key(const TcpConnectionPtr& conn, const HttpRequest& req) const
+  {
+    if (!_keyHeader.empty())
+      for (const auto& [name, value] : req.headers)
+        if (strcasecmp(name.c_str(), _keyHeader.c_str()) == 0)
+          return value;
+    // the raw address is short enough not to allocate
+    const struct sockaddr* sa = conn->getPeerAddr().getSockAddr();
+    if (sa->sa_family == AF_INET)
+      return std::string(
+        reinterpret_cast<const char*>(&reinterpret_cast<const sockaddr_in*>(sa)->sin_addr), 4);
+    return std::string(
+      reinterpret_cast<const char*>(&reinterpret_cast<const sockaddr_in6*>(sa)->sin6_addr), 16);
+  }
+};
+
+#endif
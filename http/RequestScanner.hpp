@@ -0,0 +1,226 @@
+#ifndef __REQUESTSCANNER_HPP__
+#define __REQUESTSCANNER_HPP__
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "llhttp.h"
+
+namespace scanner_detail {
+
+/**
+ * findOutside() - the first byte of [@p, @end) outside [@lo, @hi] or equal to @stop, @end if
+ *                 none
+ *
+ * Bytes compare unsigned. The widest vectors the build targets look at 32 or 16 bytes at a
+ * time, AVX2 with -mavx2, SSE2 on any x86-64 and NEON on arm64, the tail goes bytewise.
+ */
+inline const char* findOutside(const char* p, const char* end, uint8_t lo, uint8_t hi,
+                               uint8_t stop)
+{
+#if defined(__AVX2__)
+  __m256i lo256 = _mm256_set1_epi8(lo);
+  __m256i hi256 = _mm256_set1_epi8(hi);
+  __m256i stop256 = _mm256_set1_epi8(stop);
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    // lo <= v <= hi, as max(v, lo) == v and min(v, hi) == v
+    __m256i in = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, lo256), v),
+                                  _mm256_cmpeq_epi8(_mm256_min_epu8(v, hi256), v));
+    uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(in)) |
+                    static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, stop256)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i lo128 = _mm_set1_epi8(lo);
+  __m128i hi128 = _mm_set1_epi8(hi);
+  __m128i stop128 = _mm_set1_epi8(stop);
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i in = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, lo128), v),
+                               _mm_cmpeq_epi8(_mm_min_epu8(v, hi128), v));
+    uint32_t mask = (~_mm_movemask_epi8(in) & 0xffff) |
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(v, stop128));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#elif defined(__ARM_NEON)
+  uint8x16_t lo128 = vdupq_n_u8(lo);
+  uint8x16_t hi128 = vdupq_n_u8(hi);
+  uint8x16_t stop128 = vdupq_n_u8(stop);
+  for (; end - p >= 16; p += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+    uint8x16_t in = vandq_u8(vcgeq_u8(v, lo128), vcleq_u8(v, hi128));
+    // no movemask on NEON, the bytewise loop below finds the one within these 16
+    if (vmaxvq_u8(vorrq_u8(vmvnq_u8(in), vceqq_u8(v, stop128))))
+      break;
+  }
+#endif
+  for (; p < end; p++) {
+    uint8_t c = *p;
+    if (c < lo || c > hi || c == stop)
+      return p;
+  }
+  return end;
+}
+
+/**
+ * struct TokenTable - the bytes of a header name, tchar of RFC 9110 5.6.2
+ */
+struct TokenTable
+{
+  bool token[256];
+
+  constexpr TokenTable()
+    : token()
+  {
+    for (int c = '0'; c <= '9'; c++)
+      token[c] = true;
+    for (int c = 'a'; c <= 'z'; c++)
+      token[c] = token[c - 'a' + 'A'] = true;
+    for (const char* s = "!#$%&'*+-.^_`|~"; *s; s++)
+      token[static_cast<uint8_t>(*s)] = true;
+  }
+};
+
+inline constexpr TokenTable kTokens;
+
+}   // namespace scanner_detail
+
+/**
+ * class RequestScanner - a fast path for the plain requests making most of the traffic
+ *
+ * A request whose head and body are all there, on HTTP/1.1 with a common method, an
+ * origin-form target and no Transfer-Encoding, Upgrade or Connection other than keep-alive,
+ * is parsed in one pass: the vector search of findOutside() takes the target, each header
+ * name and each value in a few steps, the header map gets a string per name and value, no
+ * callback per piece. Anything else, including what llhttp would reject, is left to llhttp,
+ * see HttpParser::setFastPath().
+ */
+class RequestScanner
+{
+public:
+  /**
+   * scan() - parse the request at the start of @data into @req
+   *
+   * Returns the bytes it takes, head and body, 0 if it is incomplete or not plain enough,
+   * @req is then of no use.
+   */
+  template<typename Request>
+  static size_t scan(const char* data, size_t len, Request& req)
+  {
+    using scanner_detail::findOutside;
+    const char* p = data;
+    const char* end = data + len;
+    if (!scanMethod(p, end, req.method))
+      return 0;
+    // the target, printable ASCII only
+    const char* target = p;
+    p = findOutside(p, end, 0x21, 0x7e, 0);
+    if (p == target || *target != '/' || end - p < 11 || memcmp(p, " HTTP/1.1\r\n", 11) != 0)
+      return 0;
+    req.path.assign(target, p);
+    req.major = 1;
+    req.minor = 1;
+    p += 11;
+
+    size_t contentLength = 0;
+    bool hasLength = false;
+    for (;;) {
+      if (end - p < 2)
+        return 0;
+      if (*p == '\r') {
+        if (p[1] != '\n')
+          return 0;
+        p += 2;
+        break;
+      }
+      const char* name = p;
+      p = findOutside(p, end, 0x21, 0x7e, ':');
+      if (p == end || *p != ':' || p == name)
+        return 0;
+      for (const char* c = name; c < p; c++)
+        if (!scanner_detail::kTokens.token[static_cast<uint8_t>(*c)])
+          return 0;
+      size_t nameLen = p - name;
+      p++;
+      while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+      // the value ends at the first control byte that is not a tab, trailing blanks are kept
+      // as llhttp does
+      const char* value = p;
+      for (;;) {
+        p = findOutside(p, end, 0x20, 0xff, 0x7f);
+        if (p == end || *p != '\t')
+          break;
+        p++;
+      }
+      if (end - p < 2 || p[0] != '\r' || p[1] != '\n')
+        return 0;
+      size_t valueLen = p - value;
+      p += 2;
+      // what gives a request a framing or a protocol of its own
+      if (is(name, nameLen, "Content-Length")) {
+        if (hasLength || !valueLen || valueLen > 15)
+          return 0;
+        for (size_t i = 0; i < valueLen; i++) {
+          if (value[i] < '0' || value[i] > '9')
+            return 0;
+          contentLength = contentLength * 10 + (value[i] - '0');
+        }
+        hasLength = true;
+      } else if (is(name, nameLen, "Transfer-Encoding") || is(name, nameLen, "Upgrade")) {
+        return 0;
+      } else if (is(name, nameLen, "Connection") && !is(value, valueLen, "keep-alive")) {
+        return 0;
+      }
+      req.headers.insert_or_assign(std::string(name, nameLen), std::string(value, valueLen));
+    }
+    if (static_cast<size_t>(end - p) < contentLength)
+      return 0;
+    req.body.assign(p, contentLength);
+    return p + contentLength - data;
+  }
+
+private:
+  static bool is(const char* s, size_t len, const char* name)
+  {
+    return len == strlen(name) && strncasecmp(s, name, len) == 0;
+  }
+
+  static bool scanMethod(const char*& p, const char* end, llhttp_method_t& method)
+  {
+    static const struct
+    {
+      const char* text;
+      size_t len;
+      llhttp_method_t method;
+    } kMethods[] = {
+      {"GET ", 4, HTTP_GET},
+      {"POST ", 5, HTTP_POST},
+      {"HEAD ", 5, HTTP_HEAD},
+      {"PUT ", 4, HTTP_PUT},
+      {"DELETE ", 7, HTTP_DELETE},
+      {"OPTIONS ", 8, HTTP_OPTIONS},
+      {"PATCH ", 6, HTTP_PATCH},
+    };
+    for (const auto& m : kMethods) {
+      if (static_cast<size_t>(end - p) >= m.len && memcmp(p, m.text, m.len) == 0) {
+        p += m.len;
+        method = m.method;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+#endif
@@ -1,10 +1,16 @@
 #ifndef __STATICHANDLER_HPP__
 #define __STATICHANDLER_HPP__
 
+#include <strings.h>
+#include <sys/stat.h>
 #include <fstream>
+#include <memory>
 #include <string>
+#include "Coroutine.hpp"
 #include "HttpServer.hpp"
 #include "HttpRouter.hpp"
+#include "ChunkedWriter.hpp"
+#include "Compression.hpp"
 
 class StaticHandler
 {
@@ -15,9 +21,23 @@ public:
   StaticHandler(const std::string& rootPath, bool alias = false)
     : _rootPath(rootPath)
     , _alias(alias)
+    , _compress(false)
   {}
   ~StaticHandler() {}
 
+  /**
+   * setCompression() - gzip the files @compression deems worth it, for clients accepting it
+   *
+   * A sibling "file.gz" at least as new as the file is sent as it is. Otherwise files up to
+   * GzipCache::kMaxFileSize are compressed once into the cache of the loop, larger ones as
+   * they are sent, with chunked transfer encoding.
+   */
+  void setCompression(bool on, const Compression& compression = Compression())
+  {
+    _compress = on;
+    _compression = compression;
+  }
+
   void operator()(int prefixLen, HttpContextPtr ctx, HttpServer* server)
   {
     std::string path = ctx->getMessage()->path;
@@ -36,49 +56,193 @@ public:
     }
     if (filePath.back() == '/')
       filePath += "index.html";
-    std::shared_ptr<std::ifstream> ifs(new std::ifstream(filePath, std::ios::binary));
-    if (!ifs->good()) {
+    std::ifstream ifs(filePath, std::ios::binary);
+    struct stat st;
+    if (!ifs.good() || stat(filePath.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
       ctx->sendError(HttpStatus::NOT_FOUND);
       return;
     }
-    size_t fileSize = ifs->seekg(0, std::ios::end).tellg();
-    ifs->seekg(0, std::ios::beg);
+    size_t fileSize = st.st_size;
+    const char* type = mimeType(filePath);
+    bool compressible = _compress && _compression.compressible(type, fileSize);
+    if (compressible && Compression::acceptsGzip(*ctx->getMessage())) {
+      if (sendPrecompressed(ctx, filePath, st, type))
+        return;
+      if (fileSize <= GzipCache::kMaxFileSize)
+        sendCached(ctx, ifs, filePath, st, type);
+      else
+        sendGzip(ctx, std::move(ifs), type, _compression.level()).detach();
+      return;
+    }
     ctx->startResponse(HttpStatus::OK);
-    ctx->sendHeader("Content-Type", "text/html");
+    ctx->sendHeader("Content-Type", type);
+    if (compressible)
+      ctx->sendHeader("Vary", "Accept-Encoding");
     ctx->sendHeader("Content-Length", std::to_string(fileSize));
     ctx->endHeaders();
-    // char buf[1024];
-    // while (ifs->good()) {
-    //   ifs->read(buf, sizeof(buf));
-    //   int rv = ctx->send(buf, ifs->gcount());
-    //   if (rv < 0)
-    //     break;
-    // }
-    // ctx->shutdown();
-    ctx->setWriteCompleteCallback([ctx, ifs] { sendMore(ctx, ifs); });
+    sendFile(ctx, std::move(ifs)).detach();
   }
 
-  static void sendMore(HttpContextPtr ctx, std::shared_ptr<std::ifstream> ifs)
+  /**
+   * sendFile() - send the rest of @ifs a chunk at a time, as the previous one is flushed
+   */
+  static CoTask<> sendFile(HttpContextPtr ctx, std::ifstream ifs)
   {
     char buf[4096];
-    if (ifs->good()) {
-      ifs->read(buf, sizeof(buf));
-      size_t readCount = ifs->gcount();
-      if (readCount > 0) {
-        int rv = ctx->send(buf, readCount);
-        if (rv < 0)
-          goto err;
-      }
-      return;
+    for (;;) {
+      if (!co_await ctx->drained())
+        co_return;
+      if (!ifs.good())
+        break;
+      ifs.read(buf, sizeof(buf));
+      size_t readCount = ifs.gcount();
+      if (readCount > 0 && ctx->send(buf, readCount) < 0)
+        break;
     }
-  err:
-    ctx->setWriteCompleteCallback(NULL);
     ctx->shutdown();
   }
 
+  /**
+   * sendGzip() - send the rest of @ifs compressed at @level, as the previous chunk is flushed
+   */
+  static CoTask<> sendGzip(HttpContextPtr ctx, std::ifstream ifs, std::string type, int level)
+  {
+    auto writer = std::make_shared<ChunkedWriter>(ctx);
+    // a chunk goes out once there is enough of it, the loop below waits for it to be flushed
+    writer->setFlushPolicy(ChunkedWriter::kDefaultFlushSize, 0);
+    writer->start(HttpStatus::OK,
+                  {{"Content-Type", type},
+                   {"Content-Encoding", "gzip"},
+                   {"Vary", "Accept-Encoding"}});
+    GzipEncoder encoder(level);
+    std::string in(kGzipReadSize, '\0');
+    std::string out;
+    for (;;) {
+      if (!co_await ctx->drained())
+        co_return;
+      ifs.read(&in[0], in.size());
+      bool last = !ifs.good();
+      out.clear();
+      // a writer left unfinished cuts the response short
+      if (!encoder.compress(in.data(), ifs.gcount(), out, last ? Z_FINISH : Z_NO_FLUSH) ||
+          writer->write(out) < 0)
+        co_return;
+      if (last)
+        break;
+    }
+    ctx->getLoop()->metrics().recordGzip(encoder.bytesIn(), encoder.bytesOut());
+    writer->finish();
+    ctx->shutdown();
+  }
+
+  /**
+   * mimeType() - the media type of @path by its extension
+   */
+  static const char* mimeType(const std::string& path)
+  {
+    static const char* const kTypes[][2] = {
+      {"html", "text/html"},
+      {"htm", "text/html"},
+      {"css", "text/css"},
+      {"js", "application/javascript"},
+      {"mjs", "application/javascript"},
+      {"json", "application/json"},
+      {"xml", "application/xml"},
+      {"txt", "text/plain"},
+      {"csv", "text/csv"},
+      {"md", "text/markdown"},
+      {"svg", "image/svg+xml"},
+      {"wasm", "application/wasm"},
+      {"png", "image/png"},
+      {"jpg", "image/jpeg"},
+      {"jpeg", "image/jpeg"},
+      {"gif", "image/gif"},
+      {"webp", "image/webp"},
+      {"ico", "image/x-icon"},
+      {"woff", "font/woff"},
+      {"woff2", "font/woff2"},
+      {"pdf", "application/pdf"},
+      {"mp4", "video/mp4"},
+      {"gz", "application/gzip"},
+      {"zip", "application/zip"},
+    };
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || path.find('/', dot) != std::string::npos)
+      return "application/octet-stream";
+    for (const auto& [ext, type] : kTypes)
+      if (strcasecmp(path.c_str() + dot + 1, ext) == 0)
+        return type;
+    return "application/octet-stream";
+  }
+
 private:
+  static constexpr size_t kGzipReadSize = 16384;
+
   std::string _rootPath;
   bool _alias;
+  bool _compress;
+  Compression _compression;
+
+  static int64_t mtimeOf(const struct stat& st)
+  {
+    return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+
+  static void startGzipResponse(const HttpContextPtr& ctx, const char* type, size_t length)
+  {
+    ctx->startResponse(HttpStatus::OK);
+    ctx->sendHeader("Content-Type", type);
+    ctx->sendHeader("Content-Encoding", "gzip");
+    ctx->sendHeader("Vary", "Accept-Encoding");
+    ctx->sendHeader("Content-Length", std::to_string(length));
+    ctx->endHeaders();
+  }
+
+  /**
+   * sendPrecompressed() - send "@filePath.gz" instead, if there is one not older than the file
+   */
+  static bool sendPrecompressed(const HttpContextPtr& ctx, const std::string& filePath,
+                                const struct stat& st, const char* type)
+  {
+    std::string gzPath = filePath + ".gz";
+    struct stat gzSt;
+    if (stat(gzPath.c_str(), &gzSt) != 0 || !S_ISREG(gzSt.st_mode) || mtimeOf(gzSt) < mtimeOf(st))
+      return false;
+    std::ifstream ifs(gzPath, std::ios::binary);
+    if (!ifs.good())
+      return false;
+    startGzipResponse(ctx, type, gzSt.st_size);
+    ctx->getLoop()->metrics().recordGzip(st.st_size, gzSt.st_size);
+    sendFile(ctx, std::move(ifs)).detach();
+    return true;
+  }
+
+  /**
+   * sendCached() - send @ifs gzipped from the cache of the loop, compressing it on a miss
+   */
+  void sendCached(const HttpContextPtr& ctx, std::ifstream& ifs, const std::string& filePath,
+                  const struct stat& st, const char* type)
+  {
+    GzipCache& cache = GzipCache::local();
+    SharedBuffer gz = cache.find(filePath, mtimeOf(st), st.st_size);
+    if (!gz) {
+      std::string body(st.st_size, '\0');
+      ifs.read(&body[0], body.size());
+      auto out = std::make_shared<std::string>();
+      GzipEncoder encoder(_compression.level());
+      if (static_cast<size_t>(ifs.gcount()) != body.size() ||
+          !encoder.compress(body.data(), body.size(), *out, Z_FINISH)) {
+        ctx->sendError(HttpStatus::INTERNAL_SERVER_ERROR);
+        return;
+      }
+      gz = out;
+      cache.insert(filePath, mtimeOf(st), st.st_size, gz);
+    }
+    startGzipResponse(ctx, type, gz->size());
+    ctx->getLoop()->metrics().recordGzip(st.st_size, gz->size());
+    ctx->send(gz->data(), gz->size());
+    ctx->shutdown();
+  }
 };
 
 #endif
@@ -0,0 +1,1127 @@
+#ifndef __WEBSOCKET_HPP__
+#define __WEBSOCKET_HPP__
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <algorithm>
+#include <any>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "TcpConnection.hpp"
+#include "HttpContext.hpp"
+#include "HttpServer.hpp"
+
+namespace websocket_detail {
+
+/**
+ * unmask() - xor @len bytes of payload with the masking key @mask, in place
+ * @offset: of @data in the payload, the key repeats every 4 bytes from its start
+ *
+ * The widest vectors the build targets do the bulk, AVX2 with -mavx2, SSE2 on any x86-64 and
+ * NEON on arm64, then 8 and 1 bytes at a time.
+ */
+inline void unmask(char* data, size_t len, const uint8_t mask[4], uint64_t offset)
+{
+  // the key as it lines up with data[0]
+  uint8_t key[4];
+  for (int i = 0; i < 4; i++)
+    key[i] = mask[(offset + i) & 3];
+  uint32_t key32;
+  memcpy(&key32, key, 4);
+  size_t i = 0;
+#if defined(__AVX2__)
+  __m256i key256 = _mm256_set1_epi32(key32);
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i), _mm256_xor_si256(v, key256));
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i key128 = _mm_set1_epi32(key32);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_xor_si128(v, key128));
+  }
+#elif defined(__ARM_NEON)
+  uint8x16_t key128 = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+  for (; i + 16 <= len; i += 16) {
+    uint8_t* p = reinterpret_cast<uint8_t*>(data + i);
+    vst1q_u8(p, veorq_u8(vld1q_u8(p), key128));
+  }
+#endif
+  uint64_t key64 = static_cast<uint64_t>(key32) << 32 | key32;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, data + i, 8);
+    v ^= key64;
+    memcpy(data + i, &v, 8);
+  }
+  // i is a multiple of 4 here
+  for (; i < len; i++)
+    data[i] ^= key[i & 3];
+}
+
+/**
+ * validUtf8() - whether @len bytes are well-formed UTF-8, as text messages must be
+ */
+inline bool validUtf8(const char* s, size_t len)
+{
+  static constexpr uint32_t kMin[] = {0, 0x80, 0x800, 0x10000};
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(s);
+  const uint8_t* end = p + len;
+  while (p < end) {
+    // ASCII 8 bytes at a time
+    if (end - p >= 8) {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      if (!(v & 0x8080808080808080ULL)) {
+        p += 8;
+        continue;
+      }
+    }
+    uint8_t c = *p;
+    if (c < 0x80) {
+      p++;
+      continue;
+    }
+    size_t n;
+    uint32_t cp;
+    if ((c & 0xe0) == 0xc0) {
+      n = 1;
+      cp = c & 0x1f;
+    } else if ((c & 0xf0) == 0xe0) {
+      n = 2;
+      cp = c & 0x0f;
+    } else if ((c & 0xf8) == 0xf0) {
+      n = 3;
+      cp = c & 0x07;
+    } else {
+      return false;
+    }
+    if (static_cast<size_t>(end - p) <= n)
+      return false;
+    for (size_t i = 1; i <= n; i++) {
+      if ((p[i] & 0xc0) != 0x80)
+        return false;
+      cp = cp << 6 | (p[i] & 0x3f);
+    }
+    // overlong forms, surrogates and beyond U+10FFFF
+    if (cp < kMin[n] || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+      return false;
+    p += n + 1;
+  }
+  return true;
+}
+
+/**
+ * acceptKey() - the Sec-WebSocket-Accept answering the Sec-WebSocket-Key @key
+ */
+inline std::string acceptKey(const std::string& key)
+{
+  std::string s = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digestLen = 0;
+  EVP_Digest(s.data(), s.size(), digest, &digestLen, EVP_sha1(), nullptr);
+  unsigned char encoded[64];
+  int n = EVP_EncodeBlock(encoded, digest, digestLen);
+  return std::string(reinterpret_cast<char*>(encoded), n);
+}
+
+/**
+ * split() - the items of a @sep separated header value, trimmed, empty ones skipped
+ */
+inline std::vector<std::string> split(const std::string& s, char sep)
+{
+  std::vector<std::string> items;
+  size_t pos = 0;
+  while (pos <= s.size()) {
+    size_t end = std::min(s.find(sep, pos), s.size());
+    size_t b = s.find_first_not_of(" \t", pos);
+    size_t e = s.find_last_not_of(" \t", end - 1);
+    if (b < end && e != std::string::npos && e >= b)
+      items.push_back(s.substr(b, e - b + 1));
+    pos = end + 1;
+  }
+  return items;
+}
+
+}   // namespace websocket_detail
+
+/**
+ * class WebSocketDeflate - the permessage-deflate (RFC 7692) state of one connection
+ *
+ * The zlib streams are only set up on first use, most connections of a chat server never
+ * send or receive a message large enough to be compressed.
+ */
+class WebSocketDeflate : noncopyable
+{
+public:
+  WebSocketDeflate(int level, int windowBits, bool noContextTakeover)
+    : _level(level)
+    , _windowBits(windowBits)
+    , _noContextTakeover(noContextTakeover)
+    , _deflating(false)
+    , _inflating(false)
+  {}
+  ~WebSocketDeflate()
+  {
+    if (_deflating)
+      deflateEnd(&_deflate);
+    if (_inflating)
+      inflateEnd(&_inflate);
+  }
+
+  /**
+   * negotiate() - the extension to answer the offers of Sec-WebSocket-Extensions, "" for none
+   * @noContextTakeover: asked by us, set if the accepted offer asks for it too
+   * @windowBits: set to the window the accepted offer allows our compressor
+   *
+   * The first offer we can honour wins. zlib has no 256 byte window, so offers limiting ours
+   * to 8 bits are declined.
+   */
+  static std::string negotiate(const std::string& offers, bool& noContextTakeover,
+                               int& windowBits)
+  {
+    for (const std::string& offer : websocket_detail::split(offers, ',')) {
+      std::vector<std::string> params = websocket_detail::split(offer, ';');
+      if (params.empty() || strcasecmp(params[0].c_str(), "permessage-deflate") != 0)
+        continue;
+      bool ok = true, serverNoTakeover = noContextTakeover, clientNoTakeover = false;
+      int bits = 15;
+      unsigned seen = 0;
+      for (size_t i = 1; i < params.size() && ok; i++) {
+        size_t eq = params[i].find('=');
+        std::string name = params[i].substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : params[i].substr(eq + 1);
+        name.erase(name.find_last_not_of(" \t") + 1);
+        value.erase(0, value.find_first_not_of(" \t\""));
+        value.erase(value.find_last_not_of(" \t\"") + 1);
+        unsigned flag;
+        if (name == "server_no_context_takeover" && value.empty()) {
+          flag = 1;
+          serverNoTakeover = true;
+        } else if (name == "client_no_context_takeover" && value.empty()) {
+          flag = 2;
+          clientNoTakeover = true;
+        } else if (name == "server_max_window_bits") {
+          flag = 4;
+          bits = windowBitsOf(value);
+          ok = bits >= 9;
+        } else if (name == "client_max_window_bits") {
+          // our inflater takes any window, no need to limit theirs
+          flag = 8;
+          ok = value.empty() || windowBitsOf(value) >= 8;
+        } else {
+          flag = 0;
+          ok = false;
+        }
+        ok = ok && !(seen & flag);
+        seen |= flag;
+      }
+      if (!ok)
+        continue;
+      std::string response = "permessage-deflate";
+      if (serverNoTakeover)
+        response += "; server_no_context_takeover";
+      if (clientNoTakeover)
+        response += "; client_no_context_takeover";
+      if (seen & 4)
+        response += "; server_max_window_bits=" + std::to_string(bits);
+      noContextTakeover = serverNoTakeover;
+      windowBits = bits;
+      return response;
+    }
+    return std::string();
+  }
+
+  /**
+   * compress() - the payload of a compressed message holding @len bytes of @data
+   */
+  bool compress(const char* data, size_t len, std::string& out)
+  {
+    if (!_deflating) {
+      memset(&_deflate, 0, sizeof(_deflate));
+      if (deflateInit2(&_deflate, _level, Z_DEFLATED, -_windowBits, 8, Z_DEFAULT_STRATEGY) !=
+          Z_OK)
+        return false;
+      _deflating = true;
+    }
+    out.clear();
+    _deflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    _deflate.avail_in = len;
+    do {
+      size_t used = out.size();
+      out.resize(used + deflateBound(&_deflate, _deflate.avail_in) + 16);
+      _deflate.next_out = reinterpret_cast<Bytef*>(&out[used]);
+      _deflate.avail_out = out.size() - used;
+      int rc = deflate(&_deflate, Z_SYNC_FLUSH);
+      out.resize(out.size() - _deflate.avail_out);
+      if (rc != Z_OK && rc != Z_BUF_ERROR)
+        return false;
+    } while (_deflate.avail_out == 0);
+    // the empty block ending the flush is left for the receiver to add back
+    if (out.size() >= 4 && memcmp(out.data() + out.size() - 4, "\x00\x00\xff\xff", 4) == 0)
+      out.resize(out.size() - 4);
+    if (_noContextTakeover)
+      deflateReset(&_deflate);
+    return true;
+  }
+
+  /**
+   * decompress() - inflate the payload of a compressed message @in into @out
+   *
+   * Stops past @maxSize bytes, so a small bomb cannot take all the memory. False if @in is
+   * corrupt.
+   */
+  bool decompress(std::string& in, std::string& out, size_t maxSize)
+  {
+    if (!_inflating) {
+      memset(&_inflate, 0, sizeof(_inflate));
+      if (inflateInit2(&_inflate, -15) != Z_OK)
+        return false;
+      _inflating = true;
+    }
+    in.append("\x00\x00\xff\xff", 4);
+    out.clear();
+    _inflate.next_in = reinterpret_cast<Bytef*>(&in[0]);
+    _inflate.avail_in = in.size();
+    while (out.size() <= maxSize) {
+      size_t used = out.size();
+      out.resize(std::min(used + std::max<size_t>(in.size() * 4, 4096), maxSize + 1));
+      _inflate.next_out = reinterpret_cast<Bytef*>(&out[used]);
+      _inflate.avail_out = out.size() - used;
+      int rc = inflate(&_inflate, Z_SYNC_FLUSH);
+      out.resize(out.size() - _inflate.avail_out);
+      if (rc == Z_STREAM_END) {
+        // a final block, the next message starts a new stream
+        inflateReset(&_inflate);
+        break;
+      }
+      if (rc != Z_OK && rc != Z_BUF_ERROR)
+        return false;
+      if (_inflate.avail_in == 0 && _inflate.avail_out != 0)
+        break;
+    }
+    return true;
+  }
+
+private:
+  int _level;
+  int _windowBits;
+  bool _noContextTakeover;
+  bool _deflating;
+  bool _inflating;
+  z_stream _deflate;
+  z_stream _inflate;
+
+  static int windowBitsOf(const std::string& value)
+  {
+    if (value.empty() || value.size() > 2 || !isdigit(value[0]) || !isdigit(value.back()))
+      return -1;
+    int bits = atoi(value.c_str());
+    return bits >= 8 && bits <= 15 ? bits : -1;
+  }
+};
+
+/**
+ * class WebSocket - the server end of a WebSocket connection (RFC 6455)
+ *
+ * Created by WebSocketHandler once the handshake is answered, it takes over the connection.
+ * Client frames are unmasked as they are read, into the message they belong to, so a payload
+ * is only copied once. Fragmented messages are reassembled, pings answered and the closing
+ * handshake completed on the loop, the callbacks only see whole messages.
+ *
+ * Only used from its loop, like the connection.
+ */
+class WebSocket : noncopyable, public HttpUpgrade, public std::enable_shared_from_this<WebSocket>
+{
+public:
+  typedef std::shared_ptr<WebSocket> WebSocketPtr;
+  typedef std::function<void(const WebSocketPtr&, const std::string&, bool binary)>
+    MessageCallback;
+  typedef std::function<void(const WebSocketPtr&, uint16_t code, const std::string& reason)>
+    CloseCallback;
+  typedef std::function<void(const WebSocketPtr&)> WebSocketCallback;
+
+  enum Opcode
+  {
+    CONTINUATION = 0x0,
+    TEXT = 0x1,
+    BINARY = 0x2,
+    CLOSE = 0x8,
+    PING = 0x9,
+    PONG = 0xa,
+  };
+
+  enum CloseCode
+  {
+    NORMAL_CLOSURE = 1000,
+    GOING_AWAY = 1001,
+    PROTOCOL_ERROR = 1002,
+    UNSUPPORTED_DATA = 1003,
+    NO_STATUS_RECEIVED = 1005,   // never sent, a close frame without a code
+    ABNORMAL_CLOSURE = 1006,     // never sent, the connection closed without a close frame
+    INVALID_PAYLOAD = 1007,
+    POLICY_VIOLATION = 1008,
+    MESSAGE_TOO_BIG = 1009,
+    INTERNAL_ERROR = 1011,
+  };
+
+  struct Options
+  {
+    size_t maxMessageSize;     // reassembled and inflated
+    double pingInterval;       // seconds of silence before a ping, 0 for none
+    size_t maxBuffered;        // unsent bytes before the peer is dropped, 0 for no limit
+    size_t deflateThreshold;   // smaller messages are sent uncompressed
+  };
+
+  static constexpr double kCloseTimeout = 5.0;
+
+  WebSocket(const TcpConnectionPtr& conn, const Options& options,
+            std::unique_ptr<WebSocketDeflate> deflate, const std::string& protocol)
+    : _conn(conn)
+    , _loop(conn->getLoop())
+    , _options(options)
+    , _deflate(std::move(deflate))
+    , _protocol(protocol)
+    , _headerSize(0)
+    , _inPayload(false)
+    , _opcode(0)
+    , _fin(false)
+    , _payloadLeft(0)
+    , _maskOffset(0)
+    , _messageOpcode(0)
+    , _compressed(false)
+    , _closeSent(false)
+    , _closeReceived(false)
+    , _failed(false)
+    , _closed(false)
+    , _closeCode(ABNORMAL_CLOSURE)
+    , _lastRead(0)
+    , _pingSent(false)
+    , _pingTime(0)
+    , _closeStart(0)
+  {
+    _timer.setCallback([this] { onTimer(); });
+  }
+  ~WebSocket() {}
+
+  /**
+   * start() - the handshake is sent, start watching the peer
+   */
+  void start()
+  {
+    _loop->metrics().websocketConnections.add();
+    _lastRead = _loop->now();
+    schedule();
+  }
+
+  /**
+   * send() - send a message, compressed if permessage-deflate is on and it is large enough
+   *
+   * Text messages must be UTF-8, which is not checked. Returns -1 once the WebSocket is
+   * closing.
+   */
+  int send(const char* data, size_t len, bool binary = false)
+  {
+    if (_closeSent || _closed)
+      return -1;
+    _loop->metrics().websocketMessagesOut.add();
+    uint8_t opcode = binary ? BINARY : TEXT;
+    if (_deflate && len >= _options.deflateThreshold) {
+      std::string payload;
+      if (_deflate->compress(data, len, payload))
+        return sendFrame(opcode, true, payload.data(), payload.size());
+    }
+    return sendFrame(opcode, false, data, len);
+  }
+
+  int send(const std::string& message, bool binary = false)
+  {
+    return send(message.data(), message.size(), binary);
+  }
+
+  /**
+   * prepare() - frame a message once to be sent to many WebSockets, see sendPrepared()
+   *
+   * Frames from a server are not masked, so they are the same bytes for every peer. They are
+   * never compressed: with context takeover the compressed bytes depend on each peer.
+   */
+  static SharedBuffer prepare(const char* data, size_t len, bool binary = false)
+  {
+    auto frame = std::make_shared<std::string>();
+    frame->resize(kMaxHeaderSize);
+    frame->resize(frameHeader(&(*frame)[0], binary ? BINARY : TEXT, false, len));
+    frame->append(data, len);
+    return frame;
+  }
+
+  /**
+   * sendPrepared() - send a message framed by prepare(), without copying it
+   */
+  int sendPrepared(const SharedBuffer& frame)
+  {
+    if (_closeSent || _closed)
+      return -1;
+    _loop->metrics().websocketMessagesOut.add();
+    int rc = _conn->write(frame);
+    checkBuffered();
+    return rc;
+  }
+
+  void ping(const std::string& payload = std::string())
+  {
+    if (!_closeSent && !_closed)
+      sendFrame(PING, false, payload.data(), std::min<size_t>(payload.size(), 125));
+  }
+
+  /**
+   * close() - start the closing handshake, the close callback follows once the peer answers
+   */
+  void close(uint16_t code = NORMAL_CLOSURE, const std::string& reason = std::string())
+  {
+    if (!_closeSent && !_closed)
+      sendClose(code, reason);
+  }
+
+  bool isOpen() const
+  {
+    return !_closeSent && !_closeReceived && !_closed;
+  }
+
+  /**
+   * protocol() - the subprotocol chosen in the handshake, empty for none
+   */
+  const std::string& protocol() const
+  {
+    return _protocol;
+  }
+
+  bool compressed() const
+  {
+    return _deflate != nullptr;
+  }
+
+  /**
+   * bufferedBytes() - what was sent but is not written to the socket yet
+   */
+  size_t bufferedBytes() const
+  {
+    return _conn->writeBufferSize();
+  }
+
+  const TcpConnectionPtr& getConn() const
+  {
+    return _conn;
+  }
+
+  EventLoop* getLoop() const
+  {
+    return _loop;
+  }
+
+  std::any& getUserData()
+  {
+    return _userData;
+  }
+  void setUserData(const std::any& userData)
+  {
+    _userData = userData;
+  }
+
+  void setMessageCallback(MessageCallback cb)
+  {
+    _messageCallback = std::move(cb);
+  }
+
+  /**
+   * setCloseCallback() - called once the connection is gone, with the code and reason of the
+   *                      close frame received, ABNORMAL_CLOSURE if there was none
+   */
+  void setCloseCallback(CloseCallback cb)
+  {
+    _closeCallback = std::move(cb);
+  }
+
+  void setWriteCompleteCallback(WebSocketCallback cb)
+  {
+    _writeCompleteCallback = std::move(cb);
+  }
+
+  void onData(const char* data, size_t len) override
+  {
+    // a callback may drop the last reference to us
+    WebSocketPtr self = shared_from_this();
+    _lastRead = _loop->now();
+    _pingSent = false;
+    const char* end = data + len;
+    while (data < end && !_failed && !_closeReceived) {
+      if (!_inPayload) {
+        size_t need = headerSize();
+        while (_headerSize < need && data < end) {
+          size_t n = std::min<size_t>(need - _headerSize, end - data);
+          memcpy(_header + _headerSize, data, n);
+          _headerSize += n;
+          data += n;
+          need = headerSize();
+        }
+        if (_headerSize < need)
+          return;
+        _headerSize = 0;
+        beginFrame(need);
+        continue;
+      }
+      size_t n = std::min<uint64_t>(_payloadLeft, end - data);
+      std::string& payload = (_opcode & 0x8) ? _control : _message;
+      size_t used = payload.size();
+      payload.append(data, n);
+      websocket_detail::unmask(&payload[used], n, _mask, _maskOffset);
+      _maskOffset += n;
+      _payloadLeft -= n;
+      data += n;
+      if (!_payloadLeft)
+        endFrame();
+    }
+  }
+
+  void onWriteComplete() override
+  {
+    if (_writeCompleteCallback)
+      _writeCompleteCallback(shared_from_this());
+  }
+
+  void onClose() override
+  {
+    if (_closed)
+      return;
+    _closed = true;
+    _timer.cancel();
+    WebSocketPtr self = shared_from_this();
+    if (_closeCallback)
+      _closeCallback(self, _closeCode, _closeReason);
+    // they may hold references to us
+    _messageCallback = nullptr;
+    _closeCallback = nullptr;
+    _writeCompleteCallback = nullptr;
+    _userData.reset();
+  }
+
+private:
+  static constexpr size_t kMaxHeaderSize = 14;
+  static constexpr size_t kCoalesceSize = 4096;
+  static constexpr size_t kKeepCapacity = 64 * 1024;
+
+  TcpConnectionPtr _conn;
+  EventLoop* _loop;
+  Options _options;
+  std::unique_ptr<WebSocketDeflate> _deflate;   // null without permessage-deflate
+  std::string _protocol;
+  std::any _userData;
+  MessageCallback _messageCallback;
+  CloseCallback _closeCallback;
+  WebSocketCallback _writeCompleteCallback;
+
+  // the frame being read
+  uint8_t _header[kMaxHeaderSize];
+  size_t _headerSize;   // bytes of the header read so far
+  bool _inPayload;
+  uint8_t _opcode;
+  bool _fin;
+  uint8_t _mask[4];
+  uint64_t _payloadLeft;
+  uint64_t _maskOffset;
+  // the message being reassembled, a control frame may come between its fragments
+  uint8_t _messageOpcode;   // 0 if none
+  bool _compressed;
+  std::string _message;
+  std::string _control;
+
+  bool _closeSent;
+  bool _closeReceived;
+  bool _failed;   // no more input is read
+  bool _closed;   // the connection is gone
+  uint16_t _closeCode;
+  std::string _closeReason;
+
+  Time _lastRead;
+  bool _pingSent;   // and not answered by anything yet
+  Time _pingTime;
+  Time _closeStart;
+  TimingWheel::Entry _timer;
+
+  /**
+   * headerSize() - the size of the frame header, as far as the bytes read so far tell
+   */
+  size_t headerSize() const
+  {
+    if (_headerSize < 2)
+      return 2;
+    uint8_t len = _header[1] & 0x7f;
+    return 2 + (len == 126 ? 2 : len == 127 ? 8 : 0) + (_header[1] & 0x80 ? 4 : 0);
+  }
+
+  void beginFrame(size_t headerSize)
+  {
+    uint8_t b0 = _header[0], b1 = _header[1];
+    bool rsv1 = b0 & 0x40;
+    uint64_t len = b1 & 0x7f;
+    if (len == 126) {
+      len = _header[2] << 8 | _header[3];
+    } else if (len == 127) {
+      len = 0;
+      for (int i = 2; i < 10; i++)
+        len = len << 8 | _header[i];
+    }
+    _fin = b0 & 0x80;
+    _opcode = b0 & 0x0f;
+    // clients must mask, the other reserved bits belong to extensions we don't have
+    if ((b0 & 0x30) || !(b1 & 0x80)) {
+      fail(PROTOCOL_ERROR);
+      return;
+    }
+    memcpy(_mask, _header + headerSize - 4, 4);
+    if (_opcode & 0x8) {
+      if (_opcode > PONG || !_fin || len > 125 || rsv1) {
+        fail(PROTOCOL_ERROR);
+        return;
+      }
+    } else if (_opcode == CONTINUATION) {
+      if (!_messageOpcode || rsv1) {
+        fail(PROTOCOL_ERROR);
+        return;
+      }
+    } else {
+      if (_opcode > BINARY || _messageOpcode || (rsv1 && !_deflate)) {
+        fail(PROTOCOL_ERROR);
+        return;
+      }
+      _messageOpcode = _opcode;
+      _compressed = rsv1;
+    }
+    if (!(_opcode & 0x8)) {
+      if (len > _options.maxMessageSize - _message.size()) {
+        fail(MESSAGE_TOO_BIG);
+        return;
+      }
+      _message.reserve(_message.size() + len);
+    }
+    _payloadLeft = len;
+    _maskOffset = 0;
+    if (len)
+      _inPayload = true;
+    else
+      endFrame();
+  }
+
+  void endFrame()
+  {
+    _inPayload = false;
+    if (_opcode & 0x8) {
+      onControl();
+      _control.clear();
+      return;
+    }
+    if (!_fin)
+      return;
+    if (_compressed) {
+      std::string inflated;
+      if (!_deflate->decompress(_message, inflated, _options.maxMessageSize)) {
+        fail(INVALID_PAYLOAD);
+        return;
+      }
+      if (inflated.size() > _options.maxMessageSize) {
+        fail(MESSAGE_TOO_BIG);
+        return;
+      }
+      _message.swap(inflated);
+    }
+    bool binary = _messageOpcode == BINARY;
+    _messageOpcode = 0;
+    if (!binary && !websocket_detail::validUtf8(_message.data(), _message.size())) {
+      fail(INVALID_PAYLOAD);
+      return;
+    }
+    _loop->metrics().websocketMessagesIn.add();
+    if (_messageCallback)
+      _messageCallback(shared_from_this(), _message, binary);
+    _message.clear();
+    // don't pin the buffer of a large message
+    if (_message.capacity() > kKeepCapacity)
+      std::string().swap(_message);
+  }
+
+  void onControl()
+  {
+    switch (_opcode) {
+      case PING:
+        if (!_closeSent)
+          sendFrame(PONG, false, _control.data(), _control.size());
+        break;
+      case PONG:
+        // reading it was sign of life enough
+        break;
+      case CLOSE: {
+        _closeReceived = true;
+        uint16_t code = NO_STATUS_RECEIVED;
+        if (_control.size() == 1) {
+          fail(PROTOCOL_ERROR);
+          return;
+        }
+        if (_control.size() >= 2) {
+          code = static_cast<uint8_t>(_control[0]) << 8 | static_cast<uint8_t>(_control[1]);
+          if (!validCloseCode(code)) {
+            fail(PROTOCOL_ERROR);
+            return;
+          }
+          if (!websocket_detail::validUtf8(_control.data() + 2, _control.size() - 2)) {
+            fail(INVALID_PAYLOAD);
+            return;
+          }
+          _closeReason.assign(_control, 2);
+        }
+        _closeCode = code;
+        if (!_closeSent)
+          sendClose(code == NO_STATUS_RECEIVED ? 0 : code, std::string());
+        // the server closes the TCP connection first, RFC 6455 7.1.1
+        _conn->shutdown();
+        schedule();
+        break;
+      }
+    }
+  }
+
+  static bool validCloseCode(uint16_t code)
+  {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) ||
+           (code >= 3000 && code <= 4999);
+  }
+
+  /**
+   * fail() - give up on a peer breaking the protocol, RFC 6455 7.1.7
+   */
+  void fail(uint16_t code)
+  {
+    if (_failed)
+      return;
+    _failed = true;
+    if (!_closeReceived)
+      _closeCode = code;
+    if (!_closeSent)
+      sendClose(code, std::string());
+    _conn->shutdown();
+  }
+
+  /**
+   * sendClose() - send a close frame with @code, none if 0
+   */
+  void sendClose(uint16_t code, const std::string& reason)
+  {
+    char payload[125];
+    size_t len = 0;
+    if (code) {
+      payload[0] = static_cast<char>(code >> 8);
+      payload[1] = static_cast<char>(code);
+      len = 2 + std::min<size_t>(reason.size(), sizeof(payload) - 2);
+      memcpy(payload + 2, reason.data(), len - 2);
+    }
+    sendFrame(CLOSE, false, payload, len);
+    _closeSent = true;
+    _closeStart = _loop->now();
+    schedule();
+  }
+
+  /**
+   * frameHeader() - write the header of an unmasked frame to @frame, returns its size
+   */
+  static size_t frameHeader(char* frame, uint8_t opcode, bool compressed, size_t len)
+  {
+    frame[0] = static_cast<char>(0x80 | (compressed ? 0x40 : 0) | opcode);
+    if (len < 126) {
+      frame[1] = static_cast<char>(len);
+      return 2;
+    }
+    if (len <= 0xffff) {
+      frame[1] = 126;
+      frame[2] = static_cast<char>(len >> 8);
+      frame[3] = static_cast<char>(len);
+      return 4;
+    }
+    frame[1] = 127;
+    for (int i = 0; i < 8; i++)
+      frame[2 + i] = static_cast<char>(static_cast<uint64_t>(len) >> (56 - 8 * i));
+    return 10;
+  }
+
+  int sendFrame(uint8_t opcode, bool compressed, const char* data, size_t len)
+  {
+    char frame[kMaxHeaderSize + kCoalesceSize];
+    size_t n = frameHeader(frame, opcode, compressed, len);
+    int rc;
+    // a small frame goes out in one write
+    if (len <= kCoalesceSize) {
+      if (len)
+        memcpy(frame + n, data, len);
+      rc = _conn->write(frame, n + len);
+    } else {
+      _conn->write(frame, n);
+      rc = _conn->write(data, len);
+    }
+    checkBuffered();
+    return rc;
+  }
+
+  void checkBuffered()
+  {
+    // a peer that doesn't read would have us buffer without limit
+    if (_options.maxBuffered && _conn->writeBufferSize() > _options.maxBuffered)
+      _conn->forceClose();
+  }
+
+  /**
+   * deadline() - when the timer has something to do, 0 for never
+   *
+   * Reads only move the deadline later, the timer picks it up when it fires.
+   */
+  Time deadline() const
+  {
+    if (_closeSent || _closeReceived)
+      return _closeStart.offsetBy(kCloseTimeout);
+    if (_options.pingInterval <= 0)
+      return 0;
+    return (_pingSent ? _pingTime : _lastRead).offsetBy(_options.pingInterval);
+  }
+
+  void schedule()
+  {
+    if (_closed)
+      return;
+    if (Time d = deadline())
+      _loop->timingWheel().schedule(&_timer, d);
+  }
+
+  void onTimer()
+  {
+    WebSocketPtr self = shared_from_this();
+    Time d = deadline();
+    if (!d || _closed)
+      return;
+    if (_loop->now() < d) {
+      _loop->timingWheel().schedule(&_timer, d);
+      return;
+    }
+    // the closing handshake took too long, or the ping was not answered
+    if (_closeSent || _closeReceived || _pingSent) {
+      _conn->forceClose();
+      return;
+    }
+    _pingSent = true;
+    _pingTime = _loop->now();
+    sendFrame(PING, false, nullptr, 0);
+    schedule();
+  }
+};
+
+/**
+ * class WebSocketHandler - a route accepting WebSocket connections
+ *
+ *   WebSocketHandler echo;
+ *   echo.setMessageCallback([](const WebSocketPtr& ws, const std::string& msg, bool binary) {
+ *     ws->send(msg, binary);
+ *   });
+ *   router.addSimpleRoute("/echo", echo);
+ *
+ * A request that is not a valid handshake gets a 400, a 426 if it is for another version of
+ * the protocol.
+ */
+class WebSocketHandler
+{
+  typedef class HttpContext<HttpRequest> HttpContext;
+  typedef typename HttpContext::HttpContextPtr HttpContextPtr;
+  typedef WebSocket::WebSocketPtr WebSocketPtr;
+
+public:
+  typedef std::function<void(const WebSocketPtr&, const std::shared_ptr<HttpRequest>&)>
+    OpenCallback;
+
+  WebSocketHandler()
+    : _deflate(false)
+    , _deflateNoContextTakeover(false)
+    , _deflateLevel(Z_DEFAULT_COMPRESSION)
+  {
+    _options.maxMessageSize = kDefaultMaxMessageSize;
+    _options.pingInterval = kDefaultPingInterval;
+    _options.maxBuffered = kDefaultMaxBuffered;
+    _options.deflateThreshold = kDefaultDeflateThreshold;
+  }
+  ~WebSocketHandler() {}
+
+  /**
+   * setMaxMessageSize() - fail connections sending larger messages, with MESSAGE_TOO_BIG
+   */
+  void setMaxMessageSize(size_t size)
+  {
+    _options.maxMessageSize = size;
+  }
+
+  /**
+   * setPingInterval() - ping a peer silent for @seconds, drop it if it stays silent as long
+   *                     again, 0 to never ping
+   */
+  void setPingInterval(double seconds)
+  {
+    _options.pingInterval = seconds;
+  }
+
+  /**
+   * setMaxBuffered() - drop a peer once @bytes wait to be written to it, 0 for no limit
+   */
+  void setMaxBuffered(size_t bytes)
+  {
+    _options.maxBuffered = bytes;
+  }
+
+  /**
+   * setPerMessageDeflate() - accept permessage-deflate when a client offers it
+   * @noContextTakeover: compress every message on its own, saving the 256KB of compressor
+   *                     state each connection keeps between messages, at some ratio
+   * @threshold: messages below @threshold bytes are sent uncompressed
+   */
+  void setPerMessageDeflate(bool on, bool noContextTakeover = false,
+                            size_t threshold = kDefaultDeflateThreshold,
+                            int level = Z_DEFAULT_COMPRESSION)
+  {
+    _deflate = on;
+    _deflateNoContextTakeover = noContextTakeover;
+    _options.deflateThreshold = threshold;
+    _deflateLevel = level;
+  }
+
+  /**
+   * setProtocols() - the subprotocols we speak, the first one the client offers is chosen
+   */
+  void setProtocols(std::vector<std::string> protocols)
+  {
+    _protocols = std::move(protocols);
+  }
+
+  /**
+   * setOpenCallback() - a WebSocket is accepted, with the request of its handshake
+   *
+   * The place to set the callbacks of a particular WebSocket, it gets the ones of the
+   * handler first.
+   */
+  void setOpenCallback(OpenCallback cb)
+  {
+    _openCallback = std::move(cb);
+  }
+
+  void setMessageCallback(WebSocket::MessageCallback cb)
+  {
+    _messageCallback = std::move(cb);
+  }
+
+  void setCloseCallback(WebSocket::CloseCallback cb)
+  {
+    _closeCallback = std::move(cb);
+  }
+
+  /**
+   * isUpgrade() - whether @req asks to switch to WebSocket
+   */
+  static bool isUpgrade(const HttpRequest& req)
+  {
+    const std::string* upgrade = req.findHeader("Upgrade");
+    const std::string* connection = req.findHeader("Connection");
+    return upgrade && connection && strcasestr(upgrade->c_str(), "websocket") &&
+           strcasestr(connection->c_str(), "upgrade");
+  }
+
+  void operator()(int prefixLen, HttpContextPtr ctx, HttpServer* server)
+  {
+    std::shared_ptr<HttpRequest> req = ctx->getMessage();
+    const std::string* key = req->findHeader("Sec-WebSocket-Key");
+    const std::string* version = req->findHeader("Sec-WebSocket-Version");
+    // over HTTP/2 it would take an extended CONNECT, RFC 8441
+    if (req->method != HTTP_GET || req->major != 1 || req->minor < 1 || !isUpgrade(*req) ||
+        !key || key->size() != 24) {
+      ctx->sendError(HttpStatus::BAD_REQUEST);
+      return;
+    }
+    if (!version || *version != "13") {
+      ctx->send("HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\n"
+                "Content-Length: 0\r\nConnection: close\r\n\r\n");
+      ctx->shutdown();
+      return;
+    }
+
+    std::string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                           "Connection: Upgrade\r\nSec-WebSocket-Accept: " +
+                           websocket_detail::acceptKey(*key) + "\r\n";
+    std::string protocol = chooseProtocol(*req);
+    if (!protocol.empty())
+      response += "Sec-WebSocket-Protocol: " + protocol + "\r\n";
+    std::unique_ptr<WebSocketDeflate> deflate;
+    const std::string* extensions = req->findHeader("Sec-WebSocket-Extensions");
+    if (_deflate && extensions) {
+      bool noContextTakeover = _deflateNoContextTakeover;
+      int windowBits;
+      std::string accepted =
+        WebSocketDeflate::negotiate(*extensions, noContextTakeover, windowBits);
+      if (!accepted.empty()) {
+        response += "Sec-WebSocket-Extensions: " + accepted + "\r\n";
+        deflate.reset(new WebSocketDeflate(_deflateLevel, windowBits, noContextTakeover));
+      }
+    }
+    response += "\r\n";
+    ctx->send(response);
+
+    auto ws = std::make_shared<WebSocket>(ctx->getConn(), _options, std::move(deflate), protocol);
+    ws->setMessageCallback(_messageCallback);
+    ws->setCloseCallback(_closeCallback);
+    ws->start();
+    if (_openCallback)
+      _openCallback(ws, req);
+    // what the client sent after the handshake is read from now on
+    ctx->upgrade(ws);
+  }
+
+private:
+  static constexpr size_t kDefaultMaxMessageSize = 1024 * 1024;
+  static constexpr double kDefaultPingInterval = 30.0;
+  static constexpr size_t kDefaultMaxBuffered = 4 * 1024 * 1024;
+  static constexpr size_t kDefaultDeflateThreshold = 256;
+
+  WebSocket::Options _options;
+  bool _deflate;
+  bool _deflateNoContextTakeover;
+  int _deflateLevel;
+  std::vector<std::string> _protocols;
+  OpenCallback _openCallback;
+  WebSocket::MessageCallback _messageCallback;
+  WebSocket::CloseCallback _closeCallback;
+
+  std::string chooseProtocol(const HttpRequest& req) const
+  {
+    const std::string* offered = req.findHeader("Sec-WebSocket-Protocol");
+    if (!offered || _protocols.empty())
+      return std::string();
+    for (const std::string& p : websocket_detail::split(*offered, ','))
+      if (std::find(_protocols.begin(), _protocols.end(), p) != _protocols.end())
+        return p;
+    return std::string();
+  }
+};
+
+#endif
@@ -1,10 +1,15 @@
+#include <stdlib.h>
+#include <algorithm>
 #include <atomic>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <thread>
 #include <vector>
 #include <zlog.h>
 
+#include "Logger.hpp"
+#include "TrafficCapture.hpp"
 #include "ThreadPool.hpp"
 #include "EventLoop.hpp"
 #include "HttpServer.hpp"
@@ -12,6 +17,11 @@
 #include "HttpRouter.hpp"
 #include "StaticHandler.hpp"
 #include "ProxyHandler.hpp"
+#include "MetricsHandler.hpp"
+#include "WebSocket.hpp"
+#include "EventStream.hpp"
+#include "Broadcast.hpp"
+#include "ChunkedWriter.hpp"
 
 int main(int argc, char const* argv[])
 {
@@ -24,28 +34,136 @@ int main(int argc, char const* argv[])
     dzlog_fatal("init fail");
     return -1;
   }
+  if (!AsyncLogger::instance().start("rpx.log")) {
+    dzlog_fatal("async logger init fail");
+    return -1;
+  }
 
   InetAddress listenAddr;
   if (!listenAddr.parseHost("127.0.0.1", 8080)) {
     dzlog_fatal("parseHost fail");
     return -2;
   }
+  TrafficCapture capture;   // outlives the server
+  std::unique_ptr<RateLimiter> limiter;
+  Broadcast chat;   // outlives the loops
   EventLoop loop;
   HttpServer server(&loop, listenAddr, true, threadNum);
+  server.setSlowRequestThreshold(1.0);
+  server.setTimeouts(10.0, 30.0, 60.0, 60.0);
+  server.setConnectionLimits(10000, 0);
+  server.setLoadShedding(0.02, 0.5);
+  server.setFastParse(true);
+  server.addPriorityPath("/ping");
+  server.addPriorityPath("/metrics");
+  // RPX_CAPTURE=file [RPX_CAPTURE_SAMPLE=fraction] [RPX_CAPTURE_RATE=bytes/s], see rpx-replay
+  if (const char* path = getenv("RPX_CAPTURE")) {
+    const char* sample = getenv("RPX_CAPTURE_SAMPLE");
+    const char* rate = getenv("RPX_CAPTURE_RATE");
+    if (!capture.start(path, sample ? atof(sample) : 1, rate ? atol(rate) : 1 << 20)) {
+      dzlog_fatal("capture init fail");
+      return -1;
+    }
+    server.setTrafficCapture(&capture);
+  }
+  // RPX_RATE_LIMIT=requests/s [RPX_RATE_BURST=requests] per client address
+  if (const char* rate = getenv("RPX_RATE_LIMIT")) {
+    const char* burst = getenv("RPX_RATE_BURST");
+    limiter.reset(new RateLimiter(atof(rate), burst ? atof(burst) : atof(rate), 100000));
+    server.setRateLimiter(limiter.get());
+  }
+  // RPX_CPUS=list like 0-3,8 to pin the io loops, RPX_LISTENER_PER_LOOP=1 to accept in them
+  if (const char* list = getenv("RPX_CPUS")) {
+    std::vector<int> cpus;
+    if (!EventLoopThreadPool::parseCpuList(list, cpus)) {
+      dzlog_fatal("bad RPX_CPUS %s", list);
+      return -1;
+    }
+    server.setCpuAffinity(cpus);
+  }
+  if (const char* perLoop = getenv("RPX_LISTENER_PER_LOOP"))
+    server.setListenerPerLoop(atoi(perLoop) != 0);
+  // RPX_TLS_CERT=cert.pem RPX_TLS_KEY=key.pem [RPX_TLS_TICKET_KEY=80 byte file] for HTTPS,
+  // /self then proxies over TLS too, trusting the certificate
+  std::shared_ptr<TlsContext> upstreamTls;
+  if (const char* cert = getenv("RPX_TLS_CERT")) {
+    const char* key = getenv("RPX_TLS_KEY");
+    const char* ticketKey = getenv("RPX_TLS_TICKET_KEY");
+    auto tls = std::make_shared<TlsContext>(TlsContext::SERVER);
+    if (!tls->loadCertificate(cert, key ? key : cert) ||
+        (ticketKey && !tls->loadTicketKey(ticketKey))) {
+      dzlog_fatal("tls init fail");
+      return -1;
+    }
+    server.setTls(tls);
+    upstreamTls = std::make_shared<TlsContext>(TlsContext::CLIENT);
+    upstreamTls->loadVerifyLocations(cert);
+  }
   HttpRouter router(&server);
   router.addSimpleRoute(
     "/ping", [](int, HttpContext<HttpRequest>::HttpContextPtr ctx, HttpServer*) {
       ctx->send("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 4\r\nConnection: "
                 "close\r\n\r\npong");
+      ctx->shutdown();
     });
-  router.addSimpleRoute("/static", StaticHandler("."));
+  router.addSimpleRoute("/metrics", MetricsHandler());
+  // /chunked?n streams n lines (at most 100000) of unknown length, batched into chunks by the
+  // flush policy
+  router.addSimpleRoute(
+    "/chunked", [](int prefixLen, HttpContext<HttpRequest>::HttpContextPtr ctx, HttpServer*) {
+      static constexpr size_t kMaxLines = 100000;
+      const std::string& path = ctx->getMessage()->path;
+      size_t lines = 1000;
+      if (path.size() > static_cast<size_t>(prefixLen) + 1)
+        lines = std::min<size_t>(strtoul(path.c_str() + prefixLen + 1, nullptr, 10), kMaxLines);
+      auto writer = std::make_shared<ChunkedWriter>(ctx);
+      writer->start(200, {{"Content-Type", "text/plain"}, {"Trailer", "X-Lines"}});
+      for (size_t i = 0; i < lines; i++)
+        writer->write("line " + std::to_string(i) + "\n");
+      writer->finish({{"X-Lines", std::to_string(lines)}});
+    });
+  StaticHandler staticFiles(".");
+  staticFiles.setCompression(true);
+  router.addSimpleRoute("/static", staticFiles);
   router.addSimpleRoute("/baidu", ProxyHandler("www.baidu.com", 80));
-  router.addSimpleRoute("/self", ProxyHandler("127.0.0.1", 8080));
+  // /echo echoes WebSocket messages, /self/echo gets there through the proxy
+  WebSocketHandler echo;
+  echo.setPerMessageDeflate(true);
+  echo.setMessageCallback(
+    [](const WebSocket::WebSocketPtr& ws, const std::string& msg, bool binary) {
+      ws->send(msg, binary);
+    });
+  router.addSimpleRoute("/echo", echo);
+  // what a /chat WebSocket sends goes to every /chat WebSocket and /chat/events stream
+  chat.addLoops(server.getIoLoops());
+  WebSocketHandler chatSocket;
+  chatSocket.setOpenCallback(
+    [&chat](const WebSocket::WebSocketPtr& ws, const std::shared_ptr<HttpRequest>&) {
+      chat.subscribe(ws);
+    });
+  chatSocket.setMessageCallback(
+    [&chat](const WebSocket::WebSocketPtr&, const std::string& msg, bool binary) {
+      chat.publish(msg, binary);
+    });
+  EventStreamHandler chatEvents;
+  chatEvents.setOpenCallback(
+    [&chat](const EventStream::EventStreamPtr& es, const std::shared_ptr<HttpRequest>&) {
+      chat.subscribe(es);
+    });
+  router.addSimpleRoute("/chat/events", chatEvents);
+  router.addSimpleRoute("/chat", chatSocket);
+  ProxyHandler self("127.0.0.1", 8080);
+  if (upstreamTls)
+    self.setTls(upstreamTls);
+  self.setWebSocket(true);
+  self.setCompression(true);
+  router.addSimpleRoute("/self", self);
   router.addSimpleRoute("/other", ProxyHandler("127.0.0.1", 8081));
   server.setRequestCallback([&router](auto ctx) { router.handleRequest(ctx); });
   server.start();
 
   loop.loop();
+  AsyncLogger::instance().stop();
   zlog_fini();
   return 0;
 }